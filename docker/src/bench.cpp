@@ -0,0 +1,147 @@
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+#include "blobs.h"
+#include "metrics.h"
+#include "pull.h"
+#include "snapshot.h"
+#include "token.h"
+
+// Pulls a fixed set of images from a local registry, such as registry:2
+// filled with `crane copy`, and prints where the time went. Each image is
+// pulled cold, into an empty store over new connections, then warm, again
+// into the store and snapshots the cold pull left and over its connections.
+constexpr std::string_view BENCH_REGISTRY = "http://127.0.0.1:5000";
+constexpr std::array<std::string_view, 3> BENCH_IMAGES = {"alpine:3.20", "busybox:1.36", "nginx:1.27"};
+constexpr std::string_view BENCH_DIR = "bench";
+// Layers this large are fetched as SPLIT_PARTS ranges at once, as
+// my_containerd does.
+constexpr std::int64_t SPLIT_THRESHOLD = 64 * 1024 * 1024;
+constexpr std::size_t SPLIT_PARTS = 4;
+
+namespace {
+
+struct Run {
+    std::chrono::nanoseconds wall;
+    MetricsTotals metrics;
+};
+
+// Pulls image into directory and stacks its layers into a container root,
+// which is removed again afterwards.
+Run pull_once(CurlPool& pool, TokenCache& tokens, const std::filesystem::path& directory, std::string_view image,
+              std::string_view reference, PullOptions options)
+{
+    BlobStore store{directory / "blobs"};
+    options.snapshots = directory / "snapshots";
+    Snapshotter snapshotter{directory / "containers"};
+    snapshotter.remove("bench");
+
+    MetricsTotals before = Metrics::global().totals();
+    auto started = std::chrono::steady_clock::now();
+    PullResult result = pull_image(pool, tokens, store, image, reference, options);
+    for (const PulledBlob& blob : result.blobs) {
+        if (blob.error) {
+            std::rethrow_exception(blob.error);
+        }
+    }
+    std::vector<std::filesystem::path> lower;
+    for (const Descriptor& layer : result.manifest.layers) {
+        lower.push_back(options.snapshots / layer.digest.substr(layer.digest.find(':') + 1));
+    }
+    snapshotter.prepare("bench", lower);
+    Run run{std::chrono::steady_clock::now() - started, Metrics::global().totals() - before};
+
+    snapshotter.remove("bench");
+    return run;
+}
+
+void report(std::string_view image, std::string_view kind, const Run& run) {
+    auto ms = [] (auto duration) { return std::chrono::duration<double, std::milli>{duration}.count(); };
+    auto mib = [] (std::uint64_t bytes) { return static_cast<double>(bytes) / (1024 * 1024); };
+    const MetricsTotals& metrics = run.metrics;
+
+    std::cout << std::fixed << std::setprecision(1)
+              << image << " " << kind << ": " << ms(run.wall) << " ms, " << metrics.requests << " requests ("
+              << metrics.reused << " reused), " << mib(metrics.received) << " MiB\n"
+              << "  http: dns " << ms(metrics.dns) << " ms, connect " << ms(metrics.connect) << " ms, tls "
+              << ms(metrics.tls) << " ms, ttfb " << ms(metrics.ttfb) << " ms, total " << ms(metrics.total)
+              << " ms\n ";
+    for (std::size_t i = 0; i < STAGE_COUNT; i++) {
+        const StageTotals& stage = metrics.stages[i];
+        std::cout << " " << stage_name(static_cast<Stage>(i)) << " " << ms(stage.elapsed) << " ms";
+        if (stage.bytes > 0) {
+            std::cout << " / " << mib(stage.bytes) << " MiB";
+        }
+        std::cout << (i + 1 < STAGE_COUNT ? "," : "\n");
+    }
+    std::cout << std::flush;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string registry{BENCH_REGISTRY};
+    std::filesystem::path directory{BENCH_DIR};
+    std::size_t rounds = 1;
+    std::vector<std::string> images;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        bool valid = true;
+        if (arg.starts_with("--registry=")) {
+            registry = arg.substr(11);
+        } else if (arg.starts_with("--dir=")) {
+            directory = arg.substr(6);
+        } else if (arg.starts_with("--rounds=")) {
+            std::string_view text = arg.substr(9);
+            auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), rounds);
+            valid = error == std::errc{} && end == text.data() + text.size() && rounds > 0;
+        } else if (!arg.starts_with("-")) {
+            images.emplace_back(arg);
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            std::cerr << "usage: " << argv[0]
+                      << " [--registry=URL] [--dir=PATH] [--rounds=N] [image:tag...]" << std::endl;
+            return 2;
+        }
+    }
+    if (images.empty()) {
+        images.assign(BENCH_IMAGES.begin(), BENCH_IMAGES.end());
+    }
+
+    PullOptions options;
+    options.registry = registry;
+    options.split_threshold = SPLIT_THRESHOLD;
+    options.split_parts = SPLIT_PARTS;
+
+    try {
+        for (std::size_t round = 0; round < rounds; round++) {
+            for (const std::string& name : images) {
+                // The tag is after the last colon, unless that is part of a
+                // registry host before the last slash.
+                std::size_t colon = name.rfind(':');
+                bool tagged = colon != std::string::npos && name.find('/', colon) == std::string::npos;
+                std::string_view image = std::string_view{name}.substr(0, tagged ? colon : name.size());
+                std::string_view tag = tagged ? std::string_view{name}.substr(colon + 1) : "latest";
+
+                std::filesystem::remove_all(directory);
+                CurlPool pool;
+                TokenCache tokens{pool, {}, discover_auth(pool, registry)};
+                report(name, "cold", pull_once(pool, tokens, directory, image, tag, options));
+                report(name, "warm", pull_once(pool, tokens, directory, image, tag, options));
+                std::filesystem::remove_all(directory);
+            }
+        }
+        return 0;
+    } catch (const CurlErrorBase& error) {
+        std::cerr << error << std::endl;
+        return 1;
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,267 @@
+#include "blobs.h"
+
+#include "http.h"
+#include "posix.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+bool is_lower_alnum(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+}
+
+bool is_lower_hex(char c) {
+    return (c >= 'a' && c <= 'f') || (c >= '0' && c <= '9');
+}
+
+// What absorb() reads at a time.
+constexpr std::int64_t ABSORB_CHUNK = 1024 * 1024;
+
+} // namespace
+
+BlobStore::BlobStore(std::filesystem::path root)
+    : m_root{std::move(root)}
+{
+    std::filesystem::create_directories(m_root / "tmp");
+}
+
+std::filesystem::path BlobStore::path(std::string_view digest) const {
+    size_t colon = digest.find(':');
+    if (colon == std::string_view::npos || colon == 0 || colon + 1 == digest.size()) {
+        throw std::invalid_argument("malformed digest: " + std::string{digest});
+    }
+    std::string_view algorithm = digest.substr(0, colon);
+    std::string_view hex = digest.substr(colon + 1);
+    for (char c : algorithm) {
+        if (!is_lower_alnum(c)) {
+            throw std::invalid_argument("malformed digest: " + std::string{digest});
+        }
+    }
+    for (char c : hex) {
+        if (!is_lower_hex(c)) {
+            throw std::invalid_argument("malformed digest: " + std::string{digest});
+        }
+    }
+    return m_root / algorithm / hex;
+}
+
+bool BlobStore::contains(std::string_view digest) const {
+    return find(digest).has_value();
+}
+
+std::optional<std::filesystem::path> BlobStore::find(std::string_view digest) const {
+    std::filesystem::path blob = path(digest);
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(blob, error)) {
+        return std::nullopt;
+    }
+    return blob;
+}
+
+BlobStore::Writer BlobStore::begin(std::string_view digest, std::int64_t size) const {
+    std::filesystem::path target = path(digest);
+    DigestVerifier verifier{digest, size};
+    // Temporary files stay on the store's filesystem, so that commit() can
+    // rename them into place.
+    std::filesystem::path partial = m_root / "tmp" / target.filename();
+    partial += ".partial";
+    for (;;) {
+        int fd = open(partial.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw_errno("open " + partial.string());
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            int saved = errno;
+            close(fd);
+            if (saved != EWOULDBLOCK) {
+                errno = saved;
+                throw_errno("flock " + partial.string());
+            }
+            break;
+        }
+        // The holder of the lock before us may have committed the file, or
+        // discarded it, between our open and our lock.
+        struct stat opened;
+        struct stat named;
+        if (fstat(fd, &opened) != 0 || stat(partial.c_str(), &named) != 0 || opened.st_ino != named.st_ino ||
+            opened.st_dev != named.st_dev) {
+            close(fd);
+            continue;
+        }
+        std::int64_t partial_size = opened.st_size;
+        if (size >= 0 && partial_size > size) {
+            if (ftruncate(fd, 0) != 0) {
+                int saved = errno;
+                close(fd);
+                errno = saved;
+                throw_errno("ftruncate " + partial.string());
+            }
+            partial_size = 0;
+        }
+        return Writer{std::move(verifier), std::move(partial), std::move(target), fd, true, partial_size};
+    }
+
+    // Another writer has the partial file.
+    std::string temporary = (m_root / "tmp" / target.filename()).string() + ".XXXXXX";
+    int fd = mkostemp(temporary.data(), O_CLOEXEC);
+    if (fd < 0) {
+        throw_errno("mkostemp " + temporary);
+    }
+    // mkostemp creates the file private, but blobs are shared.
+    fchmod(fd, 0644);
+    return Writer{std::move(verifier), temporary, std::move(target), fd, false, 0};
+}
+
+BlobStore::Writer::Writer(DigestVerifier verifier, std::filesystem::path temporary, std::filesystem::path target,
+                          int fd, bool resumable, std::int64_t partial_size)
+    : m_verifier{std::move(verifier)},
+      m_temporary{std::move(temporary)},
+      m_target{std::move(target)},
+      m_fd{fd},
+      m_resumable{resumable},
+      m_partial_size{partial_size}
+{}
+
+BlobStore::Writer::Writer(Writer&& other) noexcept
+    : m_verifier{std::move(other.m_verifier)},
+      m_temporary{std::move(other.m_temporary)},
+      m_target{std::move(other.m_target)},
+      m_fd{other.m_fd},
+      m_resumable{other.m_resumable},
+      m_partial_size{other.m_partial_size}
+{
+    other.m_fd = -1;
+}
+
+BlobStore::Writer::~Writer() {
+    if (m_fd < 0) {
+        return;
+    }
+    // Keeps what the next writer can resume from. Bytes past it, written
+    // out of order, would leave a gap it cannot tell from content.
+    std::int64_t kept = std::max(offset(), m_partial_size);
+    if (!m_resumable || kept == 0 || ftruncate(m_fd, kept) != 0) {
+        discard();
+        return;
+    }
+    close(m_fd);
+    m_fd = -1;
+}
+
+void BlobStore::Writer::discard() {
+    if (m_fd >= 0) {
+        // Unlinked before the lock goes away with the descriptor, so that
+        // the next writer cannot pick up the file in between.
+        unlink(m_temporary.c_str());
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+void BlobStore::Writer::write(std::string_view chunk) {
+    write_at(offset(), chunk);
+    try {
+        m_verifier.update(chunk);
+    } catch (const DigestError&) {
+        restart();
+        throw;
+    }
+}
+
+void BlobStore::Writer::write_at(std::int64_t position, std::string_view chunk) {
+    while (!chunk.empty()) {
+        ssize_t written = pwrite(m_fd, chunk.data(), chunk.size(), position);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_errno("pwrite " + m_temporary.string());
+        }
+        chunk.remove_prefix(static_cast<size_t>(written));
+        position += written;
+    }
+}
+
+void BlobStore::Writer::absorb(std::int64_t end, const BodySink* sink) {
+    std::string buffer(static_cast<size_t>(std::min<std::int64_t>(std::max<std::int64_t>(end - offset(), 0),
+                                                                   ABSORB_CHUNK)), '\0');
+    while (offset() < end) {
+        size_t wanted = static_cast<size_t>(std::min<std::int64_t>(end - offset(), ABSORB_CHUNK));
+        ssize_t got = pread(m_fd, buffer.data(), wanted, offset());
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_errno("pread " + m_temporary.string());
+        }
+        if (got == 0) {
+            throw DigestError(digest() + ": only " + std::to_string(offset()) + " bytes on disk");
+        }
+        std::string_view chunk{buffer.data(), static_cast<size_t>(got)};
+        m_verifier.update(chunk);
+        if (sink != nullptr) {
+            (*sink)(chunk);
+        }
+    }
+}
+
+void BlobStore::Writer::restart() {
+    m_verifier.reset();
+    m_partial_size = 0;
+    if (ftruncate(m_fd, 0) != 0) {
+        throw_errno("ftruncate " + m_temporary.string());
+    }
+}
+
+std::filesystem::path BlobStore::Writer::commit() {
+    if (m_fd < 0) {
+        throw std::logic_error("blob " + digest() + " already committed");
+    }
+    try {
+        m_verifier.verify();
+    } catch (...) {
+        discard();
+        throw;
+    }
+    // Drops anything written past the blob out of order. Without the fsync,
+    // a crash after the rename could leave a truncated blob under a digest
+    // it does not match.
+    if (ftruncate(m_fd, offset()) != 0) {
+        throw_errno("ftruncate " + m_temporary.string());
+    }
+    if (fsync(m_fd) != 0) {
+        throw_errno("fsync " + m_temporary.string());
+    }
+
+    // Renamed while still locked, so that no other writer resumes a file
+    // that is already in the store.
+    std::filesystem::path directory = m_target.parent_path();
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (rename(m_temporary.c_str(), m_target.c_str()) != 0) {
+        int saved = errno;
+        discard();
+        errno = saved;
+        throw_errno("rename " + m_temporary.string());
+    }
+    close(m_fd);
+    m_fd = -1;
+
+    // Makes the rename itself durable. A blob that is lost here is simply
+    // fetched again, so failing is not an error.
+    int directory_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd >= 0) {
+        fsync(directory_fd);
+        close(directory_fd);
+    }
+    return m_target;
+}
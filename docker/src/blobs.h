@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+
+#include "digest.h"
+#include "http.h"
+
+// Content-addressed blobs on disk, laid out like the blobs directory of an
+// OCI image layout: root/<algorithm>/<hex>. Blobs are keyed by digest only,
+// so a layer shared by several images is stored once.
+//
+// A blob appears under its digest by rename, complete or not at all, so
+// readers never need a lock and several processes may share one store.
+class BlobStore {
+public:
+    // A blob being written to a temporary file and hashed on the way.
+    // commit() moves it into the store once it matches its digest.
+    //
+    // The temporary file is named after the digest, so that a writer left
+    // unfinished by a dropped connection or an interrupted pull keeps what
+    // it got, and the next writer of the same blob resumes from there. A
+    // lock keeps two writers from sharing the file; the second gets a
+    // private one, which is discarded when it is dropped uncommitted.
+    class Writer {
+    public:
+        ~Writer();
+
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+        Writer(Writer&& other) noexcept;
+        Writer& operator=(Writer&&) = delete;
+
+        const std::string& digest() const { return m_verifier.digest(); }
+
+        // How much an earlier writer left behind. It is not hashed, and so
+        // not counted in offset(), until absorb() reads it back.
+        std::int64_t partial_size() const { return m_partial_size; }
+
+        // Everything before offset() has been written and hashed, so it is
+        // where write() goes on and where a download resumes.
+        std::int64_t offset() const { return m_verifier.received(); }
+
+        // Usable as a BodySink. Throws DigestError, and starts the blob
+        // over, once it outgrows its expected size.
+        void write(std::string_view chunk);
+
+        // Writes a chunk at position, past offset(), without hashing it.
+        // Meant for ranges fetched out of order, which absorb() takes in
+        // once the gap before them is filled.
+        void write_at(std::int64_t position, std::string_view chunk);
+
+        // Reads back and hashes what is on disk between offset() and end,
+        // passing it to sink on the way when one is given. Used to take in
+        // a partial blob or ranges written with write_at().
+        void absorb(std::int64_t end, const BodySink* sink = nullptr);
+
+        // Throws away everything written so far, such as when a server
+        // ignored a range and resuming is impossible.
+        void restart();
+
+        // Verifies the blob, flushes it to disk and makes it visible under
+        // its digest. Throws DigestError, discarding the blob, when it does
+        // not match. Racing writers of the same digest are harmless, since
+        // the content is the same.
+        std::filesystem::path commit();
+
+    private:
+        friend class BlobStore;
+
+        Writer(DigestVerifier verifier, std::filesystem::path temporary, std::filesystem::path target, int fd,
+               bool resumable, std::int64_t partial_size);
+
+        void discard();
+
+        DigestVerifier m_verifier;
+        std::filesystem::path m_temporary;
+        std::filesystem::path m_target;
+        int m_fd;
+        bool m_resumable;
+        std::int64_t m_partial_size;
+    };
+
+    explicit BlobStore(std::filesystem::path root);
+
+    // Where the blob lives, or would. Throws std::invalid_argument unless
+    // digest looks like "sha256:<hex>", with a lower-case algorithm and hex
+    // part, which also keeps it from naming a path outside the store.
+    std::filesystem::path path(std::string_view digest) const;
+
+    bool contains(std::string_view digest) const;
+    std::optional<std::filesystem::path> find(std::string_view digest) const;
+
+    // size is the length the blob must have, or -1 when unknown. Picks up
+    // the partial file of an earlier writer of the blob, if any.
+    Writer begin(std::string_view digest, std::int64_t size = -1) const;
+
+    const std::filesystem::path& root() const { return m_root; }
+
+private:
+    std::filesystem::path m_root;
+};
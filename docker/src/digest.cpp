@@ -0,0 +1,70 @@
+#include "digest.h"
+
+#include <array>
+
+#include "metrics.h"
+
+DigestVerifier::DigestVerifier(std::string_view digest, std::int64_t size)
+    : m_digest{digest},
+      m_size{size},
+      m_received{0},
+      m_context{nullptr}
+{
+    const EVP_MD* algorithm = nullptr;
+    if (digest.starts_with("sha256:")) {
+        algorithm = EVP_sha256();
+    } else if (digest.starts_with("sha512:")) {
+        algorithm = EVP_sha512();
+    } else {
+        throw std::invalid_argument("unsupported digest: " + m_digest);
+    }
+
+    m_context = EVP_MD_CTX_new();
+    if (m_context == nullptr || EVP_DigestInit_ex(m_context, algorithm, nullptr) != 1) {
+        EVP_MD_CTX_free(m_context);
+        throw std::runtime_error("EVP_DigestInit_ex failed");
+    }
+}
+
+void DigestVerifier::reset() {
+    if (EVP_DigestInit_ex(m_context, EVP_MD_CTX_get0_md(m_context), nullptr) != 1) {
+        throw std::runtime_error("EVP_DigestInit_ex failed");
+    }
+    m_received = 0;
+}
+
+void DigestVerifier::update(std::string_view chunk) {
+    m_received += static_cast<std::int64_t>(chunk.size());
+    if (m_size >= 0 && m_received > m_size) {
+        throw DigestError(m_digest + ": more than the expected " + std::to_string(m_size) + " bytes");
+    }
+    StageTimer timer{Stage::verify};
+    if (EVP_DigestUpdate(m_context, chunk.data(), chunk.size()) != 1) {
+        throw std::runtime_error("EVP_DigestUpdate failed");
+    }
+    timer.stop(chunk.size());
+}
+
+void DigestVerifier::verify() {
+    if (m_size >= 0 && m_received != m_size) {
+        throw DigestError(m_digest + ": got " + std::to_string(m_received) + " of " + std::to_string(m_size) +
+                          " bytes");
+    }
+
+    std::array<unsigned char, EVP_MAX_MD_SIZE> hash;
+    unsigned int length = 0;
+    if (EVP_DigestFinal_ex(m_context, hash.data(), &length) != 1) {
+        throw std::runtime_error("EVP_DigestFinal_ex failed");
+    }
+
+    static constexpr char HEX[] = "0123456789abcdef";
+    std::string actual = m_digest.substr(0, m_digest.find(':') + 1);
+    for (unsigned int i = 0; i < length; i++) {
+        actual += HEX[hash[i] >> 4];
+        actual += HEX[hash[i] & 0xf];
+    }
+    if (actual != m_digest) {
+        throw DigestError("digest mismatch: expected " + m_digest + ", got " + actual);
+    }
+    Metrics::global().add(Stage::verify, {}, 0, 1);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+#include <openssl/evp.h>
+
+#include "pch.h"
+
+class DigestError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Hashes content as it streams past and checks it against a digest such as
+// "sha256:<hex>" at the end, so that verifying a blob costs no second read.
+// OpenSSL picks SHA-NI or the ARMv8 SHA extensions when the CPU has them.
+class DigestVerifier {
+public:
+    // size is the length the content must have, or -1 when unknown. Throws
+    // std::invalid_argument for an algorithm other than sha256 or sha512.
+    explicit DigestVerifier(std::string_view digest, std::int64_t size = -1);
+    ~DigestVerifier() { EVP_MD_CTX_free(m_context); }
+
+    DigestVerifier(const DigestVerifier&) = delete;
+    DigestVerifier& operator=(const DigestVerifier&) = delete;
+
+    DigestVerifier(DigestVerifier&& other) noexcept
+        : m_digest{std::move(other.m_digest)},
+          m_size{other.m_size},
+          m_received{other.m_received},
+          m_context{other.m_context}
+    {
+        other.m_context = nullptr;
+    }
+    DigestVerifier& operator=(DigestVerifier&&) = delete;
+
+    // Throws DigestError as soon as the content runs past the expected size,
+    // which fails a transfer long before its end.
+    void update(std::string_view chunk);
+
+    // Throws DigestError unless everything passed to update() matches the
+    // digest and size. The verifier cannot be updated afterwards.
+    void verify();
+
+    // Forgets everything hashed so far.
+    void reset();
+
+    const std::string& digest() const { return m_digest; }
+    std::int64_t received() const { return m_received; }
+
+private:
+    std::string m_digest;
+    std::int64_t m_size;
+    std::int64_t m_received;
+    EVP_MD_CTX* m_context;
+};
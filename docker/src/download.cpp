@@ -0,0 +1,230 @@
+#include "download.h"
+
+#include <deque>
+#include <utility>
+
+#include "metrics.h"
+
+namespace {
+
+std::string host_of(const std::string& url) {
+    std::string host;
+    CURLU* handle = curl_url();
+    if (handle == nullptr) {
+        throw CurlErrorBase("curl_url failed");
+    }
+    char* part = nullptr;
+    if (curl_url_set(handle, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK &&
+        curl_url_get(handle, CURLUPART_HOST, &part, 0) == CURLUE_OK)
+    {
+        host = part;
+        curl_free(part);
+    }
+    curl_url_cleanup(handle);
+    // A URL curl cannot parse fails in its transfer, which is reported
+    // with the other results.
+    return host;
+}
+
+} // namespace
+
+Downloader::Downloader(CurlPool& pool, DownloadOptions options)
+    : m_pool{pool},
+      m_options{options},
+      m_multi{nullptr}
+{
+    CurlInit::ensure();
+
+    m_multi = curl_multi_init();
+    if (m_multi == nullptr) {
+        throw CurlErrorBase("curl_multi_init failed");
+    }
+
+    auto setopt = [this] (CURLMoption option, auto value, const char* name) {
+        CURLMcode result = curl_multi_setopt(m_multi, option, value);
+        if (result != CURLM_OK) {
+            curl_multi_cleanup(m_multi);
+            throw CurlMultiError(std::string{"curl_multi_setopt ("} + name + ") failed", result);
+        }
+    };
+    setopt(CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX, "CURLMOPT_PIPELINING");
+    setopt(CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(m_options.max_per_host), "CURLMOPT_MAX_HOST_CONNECTIONS");
+    setopt(CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(m_options.max_total), "CURLMOPT_MAX_TOTAL_CONNECTIONS");
+}
+
+Downloader::~Downloader() {
+    // Only left over when run() threw.
+    for (const auto& job : m_jobs) {
+        if (job->lease) {
+            curl_multi_remove_handle(m_multi, (*job->lease)->native());
+        }
+        if (job->wake) {
+            std::lock_guard lock{job->wake->mutex};
+            job->wake->multi = nullptr;
+        }
+    }
+    m_jobs.clear();
+    curl_multi_cleanup(m_multi);
+}
+
+std::size_t Downloader::add(Download download) {
+    auto job = std::make_unique<Job>();
+    job->index = m_jobs.size();
+    job->host = host_of(download.url);
+    job->download = std::move(download);
+    m_jobs.push_back(std::move(job));
+    return m_jobs.back()->index;
+}
+
+void Downloader::start(Job& job) {
+    job.lease.emplace(m_pool.acquire());
+    Curl& curl = **job.lease;
+    const BodySink* sink = job.download.sink ? &job.download.sink : nullptr;
+    if (job.download.ready) {
+        job.wake = std::make_shared<Wake>();
+        job.wake->multi = m_multi;
+        job.ready = [&job] (std::string_view chunk) {
+            return job.download.ready(chunk, [wake = job.wake] {
+                std::lock_guard lock{wake->mutex};
+                if (wake->multi != nullptr) {
+                    wake->woken = true;
+                    curl_multi_wakeup(wake->multi);
+                }
+            });
+        };
+    }
+    curl.begin(job.transfer, job.download.url, job.download.headers, sink, job.download.range,
+               job.ready ? &job.ready : nullptr);
+
+    curl.setopt(CURLOPT_PRIVATE, static_cast<void*>(&job), "CURLOPT_PRIVATE");
+    curl.setopt(CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS, "CURLOPT_HTTP_VERSION");
+    // Waiting for a connection that can multiplex beats opening another one
+    // to the same host.
+    curl.setopt(CURLOPT_PIPEWAIT, 1L, "CURLOPT_PIPEWAIT");
+    if (job.download.progress) {
+        curl.setopt(CURLOPT_XFERINFOFUNCTION, &Downloader::progress, "CURLOPT_XFERINFOFUNCTION");
+        curl.setopt(CURLOPT_XFERINFODATA, static_cast<void*>(&job), "CURLOPT_XFERINFODATA");
+        curl.setopt(CURLOPT_NOPROGRESS, 0L, "CURLOPT_NOPROGRESS");
+    }
+
+    CURLMcode result = curl_multi_add_handle(m_multi, curl.native());
+    if (result != CURLM_OK) {
+        throw CurlMultiError("curl_multi_add_handle failed", result);
+    }
+}
+
+void Downloader::complete(Job& job, CURLcode result, DownloadResult& out) {
+    if (job.wake) {
+        std::lock_guard lock{job.wake->mutex};
+        job.wake->multi = nullptr;
+    }
+    try {
+        out.response = (*job.lease)->finish(job.transfer, result);
+        const RequestTimings& timings = out.response.timings;
+        Metrics::global().add(Stage::download, timings.total, static_cast<std::uint64_t>(timings.received), 1);
+    } catch (...) {
+        out.error = std::current_exception();
+    }
+    // The progress callback aborts the transfer, so its failure is the one
+    // worth reporting.
+    if (job.error) {
+        out.error = job.error;
+    }
+    job.lease.reset();
+}
+
+std::vector<DownloadResult> Downloader::run() {
+    std::vector<DownloadResult> results(m_jobs.size());
+    std::deque<Job*> queued;
+    for (const auto& job : m_jobs) {
+        queued.push_back(job.get());
+    }
+    std::unordered_map<std::string, std::size_t> per_host;
+    std::size_t active = 0;
+
+    auto start_queued = [&] {
+        for (auto it = queued.begin(); it != queued.end() && active < m_options.max_total;) {
+            Job& job = **it;
+            std::size_t& running = per_host[job.host];
+            if (running >= m_options.max_per_host) {
+                ++it;
+                continue;
+            }
+            it = queued.erase(it);
+            try {
+                start(job);
+            } catch (...) {
+                results[job.index].error = std::current_exception();
+                // Returning the handle resets it, dropping its pointers
+                // into the job.
+                job.lease.reset();
+                continue;
+            }
+            running++;
+            active++;
+        }
+    };
+
+    start_queued();
+    while (active > 0) {
+        int running_handles = 0;
+        CURLMcode code = curl_multi_perform(m_multi, &running_handles);
+        if (code != CURLM_OK) {
+            throw CurlMultiError("curl_multi_perform failed", code);
+        }
+
+        int remaining = 0;
+        while (CURLMsg* message = curl_multi_info_read(m_multi, &remaining)) {
+            if (message->msg != CURLMSG_DONE) {
+                continue;
+            }
+            CURL* handle = message->easy_handle;
+            CURLcode result = message->data.result;
+            Job* job = nullptr;
+            curl_easy_getinfo(handle, CURLINFO_PRIVATE, &job);
+            curl_multi_remove_handle(m_multi, handle);
+
+            complete(*job, result, results[job->index]);
+            per_host[job->host]--;
+            active--;
+        }
+
+        // Resuming may pass a chunk to the sink straight away, which pauses
+        // the transfer again when the sink is still not ready.
+        for (const auto& job : m_jobs) {
+            if (!job->wake || !job->lease) {
+                continue;
+            }
+            bool woken = false;
+            {
+                std::lock_guard lock{job->wake->mutex};
+                woken = std::exchange(job->wake->woken, false);
+            }
+            if (woken) {
+                curl_easy_pause((*job->lease)->native(), CURLPAUSE_CONT);
+            }
+        }
+
+        start_queued();
+        if (active > 0) {
+            code = curl_multi_poll(m_multi, nullptr, 0, 1000, nullptr);
+            if (code != CURLM_OK) {
+                throw CurlMultiError("curl_multi_poll failed", code);
+            }
+        }
+    }
+
+    m_jobs.clear();
+    return results;
+}
+
+int Downloader::progress(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t, curl_off_t) {
+    auto* job = static_cast<Job*>(clientp);
+    try {
+        job->download.progress(dlnow, dltotal);
+    } catch (...) {
+        job->error = std::current_exception();
+        return 1;
+    }
+    return 0;
+}
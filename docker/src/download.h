@@ -0,0 +1,95 @@
+#pragma once
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "http.h"
+
+struct DownloadOptions {
+    // Transfers running at once against one host, as named in the URL
+    // before any redirect. Over HTTP/2 they share a single connection.
+    std::size_t max_per_host = 6;
+    // Transfers running at once overall.
+    std::size_t max_total = 32;
+};
+
+// Called with the bytes received so far and the expected total, which is
+// 0 until the server has sent a Content-Length.
+using ProgressFn = std::function<void(curl_off_t received, curl_off_t total)>;
+
+struct Download {
+    std::string url;
+    HeaderMap headers;
+    // Where the body of a 2xx response goes, as with Curl::get. Left empty,
+    // the body is buffered in the result.
+    BodySink sink;
+    ProgressFn progress = {};
+    // Fetches only part of the resource, as with Curl::get.
+    std::optional<ByteRange> range = {};
+    // Whether sink can take chunk without blocking. When it cannot, the
+    // transfer is paused, so that the others keep going, until wake is
+    // called, from any thread. Left empty, the sink is always called.
+    std::function<bool(std::string_view chunk, std::function<void()> wake)> ready = {};
+};
+
+struct DownloadResult {
+    HttpResponse response;
+    // Set instead when the transfer failed or its sink or progress callback
+    // threw.
+    std::exception_ptr error;
+};
+
+// Runs many GETs side by side on one curl multi handle, with easy handles
+// leased from a CurlPool. Downloads that would exceed a concurrency limit
+// wait in a queue, in the order they were added.
+class Downloader {
+public:
+    explicit Downloader(CurlPool& pool, DownloadOptions options = {});
+    ~Downloader();
+
+    Downloader(const Downloader&) = delete;
+    Downloader& operator=(const Downloader&) = delete;
+
+    // Queues a download and returns its index in the results of run().
+    std::size_t add(Download download);
+
+    // Runs every queued download to completion and clears the queue. One
+    // download failing does not stop the others.
+    std::vector<DownloadResult> run();
+
+private:
+    // What wakes the multi handle for a paused transfer. multi is cleared
+    // once the transfer is done.
+    struct Wake {
+        std::mutex mutex;
+        CURLM* multi;
+        bool woken = false;
+    };
+
+    struct Job {
+        std::size_t index;
+        Download download;
+        std::string host;
+        std::optional<CurlPool::Lease> lease;
+        Curl::Transfer transfer;
+        ReadyFn ready;
+        // Shared with the wake functions handed to Download::ready, which
+        // may outlive the job.
+        std::shared_ptr<Wake> wake;
+        std::exception_ptr error;
+    };
+
+    void start(Job& job);
+    void complete(Job& job, CURLcode result, DownloadResult& out);
+
+    static int progress(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+
+    CurlPool& m_pool;
+    DownloadOptions m_options;
+    CURLM* m_multi;
+    // Jobs are pointed at by their handles, so they must not move.
+    std::vector<std::unique_ptr<Job>> m_jobs;
+};
@@ -0,0 +1,204 @@
+#include "estargz.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <limits>
+
+#include "digest.h"
+#include "gzip.h"
+#include "json.h"
+
+namespace {
+
+constexpr std::string_view TOC_NAME = "stargz.index.json";
+constexpr std::string_view PREFETCH_LANDMARK = ".prefetch.landmark";
+constexpr std::string_view NO_PREFETCH_LANDMARK = ".no.prefetch.landmark";
+// Far beyond the TOC of any real layer, but keeps a hostile one bounded.
+constexpr std::size_t MAX_TOC_SIZE = 256 * 1024 * 1024;
+
+std::string normalize(std::string_view name) {
+    while (name.starts_with("./")) {
+        name.remove_prefix(2);
+    }
+    while (name.starts_with('/')) {
+        name.remove_prefix(1);
+    }
+    while (name.ends_with('/')) {
+        name.remove_suffix(1);
+    }
+    return std::string{name == "." ? "" : name};
+}
+
+// A whole number that fits, as a hostile TOC may give any double.
+std::int64_t integer(const JsonValue& entry, std::string_view key) {
+    const JsonValue* value = entry.find(key);
+    if (value == nullptr) {
+        return 0;
+    }
+    double number = value->as_number();
+    // 2^63 itself is the first double that does not fit.
+    if (!(number >= -0x1p63 && number < 0x1p63)) {
+        throw EstargzError("eStargz TOC field " + std::string{key} + " out of range");
+    }
+    return static_cast<std::int64_t>(number);
+}
+
+std::string string(const JsonValue& entry, std::string_view key) {
+    const JsonValue* value = entry.find(key);
+    return value != nullptr ? value->as_string() : std::string{};
+}
+
+// Only the RFC 3339 times eStargz writers produce, in UTC, are understood;
+// anything else reads as the epoch.
+std::int64_t parse_time(const std::string& text) {
+    std::tm time{};
+    if (std::sscanf(text.c_str(), "%d-%d-%dT%d:%d:%d", &time.tm_year, &time.tm_mon, &time.tm_mday, &time.tm_hour,
+                    &time.tm_min, &time.tm_sec) != 6) {
+        return 0;
+    }
+    time.tm_year -= 1900;
+    time.tm_mon -= 1;
+    return timegm(&time);
+}
+
+} // namespace
+
+std::int64_t parse_estargz_footer(std::string_view footer) {
+    // A gzip header with FEXTRA set, holding one 22-byte subfield "SG" of
+    // the TOC offset in hex and "STARGZ", then an empty deflate stream.
+    constexpr std::string_view MAGIC{"\x1f\x8b\x08\x04", 4};
+    if (footer.size() != ESTARGZ_FOOTER_SIZE || !footer.starts_with(MAGIC) || footer[10] != 26 || footer[11] != 0 ||
+        footer.substr(12, 4) != std::string_view{"SG\x16\x00", 4} || footer.substr(32, 6) != "STARGZ")
+    {
+        throw EstargzError("not an eStargz layer");
+    }
+    std::int64_t offset = 0;
+    for (char c : footer.substr(16, 16)) {
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (digit < 0) {
+            throw EstargzError("malformed eStargz footer");
+        }
+        if (offset > std::numeric_limits<std::int64_t>::max() / 16) {
+            throw EstargzError("eStargz TOC offset out of range");
+        }
+        offset = offset * 16 + digit;
+    }
+    return offset;
+}
+
+Toc parse_estargz_toc(std::string_view compressed, std::int64_t toc_offset, std::string_view digest) {
+    std::string tar = gunzip(compressed, MAX_TOC_SIZE);
+    if (tar.size() < 512 || std::string_view{tar.data()}.substr(0, 100) != TOC_NAME) {
+        throw EstargzError("eStargz TOC is not " + std::string{TOC_NAME});
+    }
+    std::size_t size = std::strtoull(std::string{tar.data() + 124, 12}.c_str(), nullptr, 8);
+    if (size > tar.size() - 512) {
+        throw EstargzError("eStargz TOC truncated");
+    }
+    std::string_view json{tar.data() + 512, size};
+    if (!digest.empty()) {
+        DigestVerifier verifier{digest, static_cast<std::int64_t>(size)};
+        verifier.update(json);
+        verifier.verify();
+    }
+
+    Toc toc;
+    // Every member starts at some entry's offset, or at the TOC, so each
+    // ends where the next offset up begins.
+    std::vector<std::int64_t> offsets{toc_offset};
+    JsonValue root = parse_json(json);
+    for (const JsonValue& value : root["entries"].as_array()) {
+        std::string type = string(value, "type");
+        std::string name = normalize(string(value, "name"));
+        std::int64_t offset = integer(value, "offset");
+        if (offset > 0) {
+            offsets.push_back(offset);
+        }
+
+        if (name == PREFETCH_LANDMARK) {
+            toc.prefetch = toc.entries.size();
+            continue;
+        }
+        if (name == NO_PREFETCH_LANDMARK) {
+            continue;
+        }
+
+        if (type == "chunk") {
+            if (toc.entries.empty() || toc.entries.back().name != name || toc.entries.back().type != "reg") {
+                throw EstargzError("eStargz chunk of " + name + " without its file");
+            }
+        } else {
+            TocEntry& entry = toc.entries.emplace_back();
+            entry.name = std::move(name);
+            entry.type = std::move(type);
+            entry.link_name = string(value, "linkName");
+            if (entry.type == "hardlink") {
+                entry.link_name = normalize(entry.link_name);
+            }
+            entry.mode = static_cast<std::uint32_t>(integer(value, "mode"));
+            entry.uid = static_cast<std::uint32_t>(integer(value, "uid"));
+            entry.gid = static_cast<std::uint32_t>(integer(value, "gid"));
+            entry.mtime = parse_time(string(value, "modtime"));
+            entry.size = integer(value, "size");
+            if (entry.size < 0) {
+                throw EstargzError("eStargz entry " + entry.name + " has a negative size");
+            }
+            entry.dev_major = static_cast<std::uint32_t>(integer(value, "devMajor"));
+            entry.dev_minor = static_cast<std::uint32_t>(integer(value, "devMinor"));
+            if (entry.type != "reg" || entry.size == 0) {
+                continue;
+            }
+        }
+
+        TocEntry& file = toc.entries.back();
+        TocChunk& chunk = file.chunks.emplace_back();
+        chunk.offset = integer(value, "chunkOffset");
+        chunk.size = integer(value, "chunkSize");
+        if (chunk.size == 0 && chunk.offset >= 0) {
+            chunk.size = file.size - chunk.offset;
+        }
+        chunk.begin = offset;
+        chunk.digest = string(value, "chunkDigest");
+        if (chunk.digest.empty() && chunk.offset == 0 && chunk.size == file.size) {
+            chunk.digest = string(value, "digest");
+        }
+        // The member must start past the first tar header, and the chunk lie
+        // within the file, which is checked without overflowing.
+        if (chunk.digest.empty() || chunk.begin <= 0 || chunk.offset < 0 || chunk.size <= 0 ||
+            chunk.size > file.size - chunk.offset) {
+            throw EstargzError("eStargz chunk of " + file.name + " is malformed");
+        }
+    }
+
+    std::ranges::sort(offsets);
+    for (TocEntry& entry : toc.entries) {
+        for (TocChunk& chunk : entry.chunks) {
+            auto next = std::ranges::upper_bound(offsets, chunk.begin);
+            if (next == offsets.end()) {
+                throw EstargzError("eStargz chunk of " + entry.name + " lies past the TOC");
+            }
+            chunk.end = *next;
+        }
+    }
+    return toc;
+}
+
+std::string gunzip(std::string_view compressed, std::size_t limit) {
+    std::string output;
+    try {
+        GzipInflater inflater;
+        inflater.input(compressed);
+        while (output.size() < limit && inflater.more()) {
+            std::size_t used = output.size();
+            output.resize(std::min(limit, std::max<std::size_t>(used * 2, 64 * 1024)));
+            output.resize(used + inflater.inflate(output.data() + used, output.size() - used));
+        }
+        if (output.size() < limit && !inflater.ended()) {
+            throw EstargzError("gzip data truncated");
+        }
+    } catch (const GzipError& error) {
+        throw EstargzError(error.what());
+    }
+    return output;
+}
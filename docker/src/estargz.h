@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include "pch.h"
+
+class EstargzError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// An eStargz layer is still a gzipped tar any puller can unpack, but every
+// file, or every chunk of a large file, starts a gzip member of its own,
+// and a table of contents (TOC) near the end says where. Any file can then
+// be read with a range request, without the rest of the layer.
+
+// The layer annotation holding the digest of the TOC JSON.
+constexpr std::string_view TOC_DIGEST_ANNOTATION = "containerd.io/snapshot/stargz/toc.digest";
+
+// The footer is an empty gzip member whose extra field points at the TOC.
+constexpr std::size_t ESTARGZ_FOOTER_SIZE = 51;
+
+struct TocChunk {
+    // Where in the file the chunk goes, and how long it is.
+    std::int64_t offset = 0;
+    std::int64_t size = 0;
+    // The gzip member holding the chunk runs from begin up to end in the
+    // layer, where the next member starts.
+    std::int64_t begin = 0;
+    std::int64_t end = 0;
+    std::string digest;
+};
+
+struct TocEntry {
+    // Without a leading "./" or "/", or a trailing "/".
+    std::string name;
+    // "dir", "reg", "symlink", "hardlink", "char", "block" or "fifo".
+    std::string type;
+    // The target of a symlink, or the name of the entry a hardlink shares.
+    std::string link_name;
+    std::uint32_t mode = 0;
+    std::uint32_t uid = 0;
+    std::uint32_t gid = 0;
+    std::int64_t mtime = 0;
+    std::int64_t size = 0;
+    std::uint32_t dev_major = 0;
+    std::uint32_t dev_minor = 0;
+    // In file order. Empty except for non-empty regular files.
+    std::vector<TocChunk> chunks;
+};
+
+struct Toc {
+    // In layer order, without the landmark files.
+    std::vector<TocEntry> entries;
+    // The first prefetch entries are the files the image builder found a
+    // container to need at startup, and placed first in the layer.
+    std::size_t prefetch = 0;
+};
+
+// Returns where the TOC starts, given the last ESTARGZ_FOOTER_SIZE bytes of
+// a layer. Throws EstargzError when the layer is not eStargz.
+std::int64_t parse_estargz_footer(std::string_view footer);
+
+// Parses the TOC from its gzip member, which starts at toc_offset and runs
+// up to the footer. digest, unless empty, is what the TOC JSON must hash
+// to; without it, the TOC and the chunk digests it lists are only as
+// trustworthy as the connection.
+Toc parse_estargz_toc(std::string_view compressed, std::int64_t toc_offset, std::string_view digest);
+
+// Decompresses gzip members back to back, stopping after limit bytes.
+// Throws EstargzError on corrupt data.
+std::string gunzip(std::string_view compressed, std::size_t limit);
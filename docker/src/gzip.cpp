@@ -0,0 +1,37 @@
+#include "gzip.h"
+
+#include <string>
+
+GzipInflater::GzipInflater() {
+    // 16 selects the gzip wrapper rather than zlib's.
+    if (inflateInit2(&m_stream, 16 + MAX_WBITS) != Z_OK) {
+        throw std::runtime_error("inflateInit2 failed");
+    }
+}
+
+GzipInflater::~GzipInflater() {
+    inflateEnd(&m_stream);
+}
+
+void GzipInflater::input(std::string_view data) {
+    m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    m_stream.avail_in = static_cast<uInt>(data.size());
+}
+
+std::size_t GzipInflater::inflate(char* out, std::size_t size) {
+    if (m_ended && m_stream.avail_in > 0) {
+        // Another gzip member follows.
+        inflateReset(&m_stream);
+        m_ended = false;
+    }
+    m_stream.next_out = reinterpret_cast<Bytef*>(out);
+    m_stream.avail_out = static_cast<uInt>(size);
+    int result = ::inflate(&m_stream, Z_NO_FLUSH);
+    if (result == Z_STREAM_END) {
+        m_ended = true;
+    } else if (result != Z_OK && result != Z_BUF_ERROR) {
+        throw GzipError(std::string{"inflate failed: "} + (m_stream.msg != nullptr ? m_stream.msg : zError(result)));
+    }
+    m_full = m_stream.avail_out == 0 && !m_ended;
+    return size - m_stream.avail_out;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <string_view>
+
+#include <zlib.h>
+
+#include "pch.h"
+
+class GzipError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Inflates gzip members back to back, as a layer holds one or, when it is
+// eStargz, one per file, from input given a piece at a time.
+class GzipInflater {
+public:
+    GzipInflater();
+    ~GzipInflater();
+
+    GzipInflater(const GzipInflater&) = delete;
+    GzipInflater& operator=(const GzipInflater&) = delete;
+
+    // The next piece of input, which must outlive the calls that use it.
+    void input(std::string_view data);
+
+    // Inflates up to size bytes into out, and returns how many it wrote.
+    // Throws GzipError on corrupt data.
+    std::size_t inflate(char* out, std::size_t size);
+
+    // Whether inflate() has more to give before the next input: some is
+    // left, or zlib holds output back since out filled up.
+    bool more() const { return m_stream.avail_in > 0 || m_full; }
+
+    // Whether the input so far ends with a complete member.
+    bool ended() const { return m_ended; }
+
+private:
+    z_stream m_stream{};
+    bool m_ended = false;
+    bool m_full = false;
+};
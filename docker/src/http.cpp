@@ -1,74 +1,345 @@
 #include "http.h"
 
-CurlInit Curl::m_init;
-std::once_flag Curl::m_once_init;
+#include <algorithm>
+#include <cctype>
+#include <chrono>
 
-Curl::Curl()
-    : m_handle(nullptr)
-{
-    CURLcode result = curl_global_init(CURL_GLOBAL_NOTHING);
+#include "posix.h"
+
+CurlInit::CurlInit() {
+    CURLcode result = curl_global_init(CURL_GLOBAL_DEFAULT);
     if (result != CURLE_OK) {
-        throw new CurlError("curl_global_init failed", result);
+        throw CurlError("curl_global_init failed", result);
     }
+}
+
+void CurlInit::ensure() {
+    // A function-local static is initialised once even with concurrent
+    // callers, and torn down at exit after every static Curl user.
+    static CurlInit init;
+}
+
+CurlShare::CurlShare() {
+    CurlInit::ensure();
 
-    CURL* handle = curl_easy_init();
-    if (handle == nullptr) {
-        throw new CurlErrorBase("curl_easy_init failed");
+    m_share = curl_share_init();
+    if (m_share == nullptr) {
+        throw CurlErrorBase("curl_share_init failed");
     }
+
+    auto setopt = [this] (CURLSHoption option, auto value, const char* name) {
+        CURLSHcode result = curl_share_setopt(m_share, option, value);
+        if (result != CURLSHE_OK) {
+            curl_share_cleanup(m_share);
+            throw CurlShareError(std::string{"curl_share_setopt ("} + name + ") failed", result);
+        }
+    };
+    setopt(CURLSHOPT_LOCKFUNC, &CurlShare::lock, "CURLSHOPT_LOCKFUNC");
+    setopt(CURLSHOPT_UNLOCKFUNC, &CurlShare::unlock, "CURLSHOPT_UNLOCKFUNC");
+    setopt(CURLSHOPT_USERDATA, static_cast<void*>(this), "CURLSHOPT_USERDATA");
+    setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS, "CURL_LOCK_DATA_DNS");
+    setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION, "CURL_LOCK_DATA_SSL_SESSION");
+    setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT, "CURL_LOCK_DATA_CONNECT");
 }
 
-std::string Curl::get(const std::string& url, const HeaderMap& headers) {
-    // CURLcode curl_easy_setopt(CURL *handle, CURLOPT_HTTPGET, long useget);
+void CurlShare::lock(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+    static_cast<CurlShare*>(userptr)->m_locks[data].lock();
+}
 
-    CURLcode result = curl_easy_setopt(m_handle, CURLOPT_URL, url.c_str());
-    if (result != CURLE_OK) {
-        throw new CurlError("curl_easy_setopt (CURLOPT_URL) failed", result);
-    }
-
-    std::string response;
-    response.reserve(1024 * 1024);
-    result = curl_easy_setopt(m_handle, CURLOPT_WRITEFUNCTION, [&response] (
-        char* ptr,
-        size_t _size,
-        size_t nmemb,
-        void* _userdata
-    ) -> size_t {
-        // Documentation states this function may be called with 0 bytes if the transferred file is empty.
-        if (nmemb != 0) {
-            response.append(ptr, nmemb);
+void CurlShare::unlock(CURL*, curl_lock_data data, void* userptr) {
+    static_cast<CurlShare*>(userptr)->m_locks[data].unlock();
+}
+
+Curl::Curl(CurlShare* share)
+    : m_handle(nullptr),
+      m_share(share)
+{
+    CurlInit::ensure();
+
+    m_handle = curl_easy_init();
+    if (m_handle == nullptr) {
+        throw CurlErrorBase("curl_easy_init failed");
+    }
+    reset();
+}
+
+void Curl::reset() {
+    curl_easy_reset(m_handle);
+
+    if (m_share != nullptr) {
+        setopt(CURLOPT_SHARE, m_share->native(), "CURLOPT_SHARE");
+    }
+    // Registries redirect blob downloads to a CDN.
+    setopt(CURLOPT_FOLLOWLOCATION, 1L, "CURLOPT_FOLLOWLOCATION");
+    setopt(CURLOPT_TCP_KEEPALIVE, 1L, "CURLOPT_TCP_KEEPALIVE");
+    // Handles are used from worker threads, where signals cannot be used to
+    // time out name resolution.
+    setopt(CURLOPT_NOSIGNAL, 1L, "CURLOPT_NOSIGNAL");
+}
+
+size_t Curl::write_body(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    auto* transfer = static_cast<Transfer*>(userdata);
+    size_t length = size * nmemb;
+
+    // The first chunk belongs to the final response of any redirect chain,
+    // whose status decides where the body goes.
+    if (!transfer->m_started) {
+        transfer->m_started = true;
+        long status = 0;
+        curl_easy_getinfo(transfer->m_curl->m_handle, CURLINFO_RESPONSE_CODE, &status);
+        bool success = transfer->m_ranged ? status == 206 : status / 100 == 2;
+        transfer->m_streaming = transfer->m_sink != nullptr && success;
+
+        curl_off_t content_length = -1;
+        curl_easy_getinfo(transfer->m_curl->m_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+        if (!transfer->m_streaming && content_length > 0) {
+            curl_off_t limit = transfer->m_sink != nullptr ? MAX_ERROR_BODY : 64 * 1024 * 1024;
+            transfer->m_target->body.reserve(static_cast<size_t>(std::min(content_length, limit)));
+        }
+    }
+
+    if (transfer->m_streaming) {
+        try {
+            if (transfer->m_ready != nullptr && !(*transfer->m_ready)(std::string_view{ptr, length})) {
+                return CURL_WRITEFUNC_PAUSE;
+            }
+            (*transfer->m_sink)(std::string_view{ptr, length});
+        } catch (...) {
+            transfer->m_error = std::current_exception();
+            // Any count other than length aborts the transfer.
+            return length == 0 ? 1 : 0;
         }
+        return length;
+    }
+
+    std::string& body = transfer->m_target->body;
+    if (transfer->m_sink != nullptr) {
+        // The rest of an error body is not worth downloading, which matters
+        // when a server ignores a range and sends a whole layer instead.
+        if (body.size() + length > MAX_ERROR_BODY) {
+            body.append(ptr, MAX_ERROR_BODY - body.size());
+            transfer->m_truncated = true;
+            return length == 0 ? 1 : 0;
+        }
+    }
+    body.append(ptr, length);
+    return length;
+}
+
+size_t Curl::write_header(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    auto* transfer = static_cast<Transfer*>(userdata);
+    HeaderMap& headers = transfer->m_target->headers;
+    HeaderMap& spare = transfer->m_curl->m_spare_headers;
+    std::string_view line{ptr, size * nmemb};
+
+    // Each response of a redirect chain starts with its status line. The
+    // headers of the one before go back to the spare nodes rather than
+    // being freed.
+    if (line.starts_with("HTTP/")) {
+        spare.merge(headers);
+        headers.clear();
+        return size * nmemb;
+    }
+
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos) {
+        return size * nmemb;
+    }
+    std::string& name = transfer->m_curl->m_header_name;
+    name.assign(line.substr(0, colon));
+    std::ranges::transform(name, name.begin(), [] (unsigned char c) { return std::tolower(c); });
+    std::string_view value = line.substr(colon + 1);
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == '\r' || value.back() == '\n' || value.back() == ' ')) {
+        value.remove_suffix(1);
+    }
+
+    if (auto existing = headers.find(name); existing != headers.end()) {
+        existing->second.assign(value);
+        return size * nmemb;
+    }
+    // A node that held the same header before, or failing that any spare
+    // node, whose strings keep their capacity.
+    HeaderMap::node_type node = spare.extract(name);
+    if (node.empty() && !spare.empty()) {
+        node = spare.extract(spare.begin());
+        node.key().assign(name);
+    }
+    if (node.empty()) {
+        headers.emplace(name, value);
+        return size * nmemb;
+    }
+    node.mapped().assign(value);
+    headers.insert(std::move(node));
+    return size * nmemb;
+}
+
+HttpResponse Curl::get(const std::string& url, const HeaderMap& headers) {
+    return perform(url, headers, nullptr, std::nullopt);
+}
+
+HttpResponse Curl::get(const std::string& url, const HeaderMap& headers, const BodySink& sink,
+                       std::optional<ByteRange> range) {
+    return perform(url, headers, &sink, range);
+}
+
+HttpResponse Curl::perform(const std::string& url, const HeaderMap& headers, const BodySink* sink,
+                           std::optional<ByteRange> range) {
+    Transfer transfer;
+    begin(transfer, url, headers, sink, range);
+    return finish(transfer, curl_easy_perform(m_handle));
+}
+
+void Curl::perform(const HttpRequest& request, HttpResponse& response) {
+    Transfer transfer;
+    transfer.m_target = &response;
+    response.status = 0;
+    response.body.clear();
+    start(transfer, nullptr);
+
+    setopt(CURLOPT_URL, request.url().c_str(), "CURLOPT_URL");
+    setopt(CURLOPT_HTTPHEADER, request.headers(), "CURLOPT_HTTPHEADER");
+    if (request.method() == HttpRequest::Method::head) {
+        setopt(CURLOPT_NOBODY, 1L, "CURLOPT_NOBODY");
+    }
+    complete(transfer, curl_easy_perform(m_handle));
+}
+
+void Curl::begin(Transfer& transfer, const std::string& url, const HeaderMap& headers, const BodySink* sink,
+                 std::optional<ByteRange> range, const ReadyFn* ready) {
+    start(transfer, sink);
+    transfer.m_ready = ready;
+    transfer.m_ranged = range.has_value();
+
+    setopt(CURLOPT_URL, url.c_str(), "CURLOPT_URL");
 
-        return nmemb;
-    });
-    
-    // CURLcode curl_easy_setopt(CURL *handle, CURLOPT_HTTPHEADER,
-                          // struct curl_slist *headers);
-    CurlStringList headers;
     for (const auto& [key, value] : headers) {
-        std::ostringstream header;
-        header << key << ": " << value;
-        headers.append(header);
+        transfer.m_headers.append(key + ": " + value);
     }
-    result = curl_easy_setopt(m_hanlde, CURLOPT_HTTPHEADER, headers.native());
-    if (result != CURLE_OK) {
-        throw new CurlError("curl_easy_setopt (CURLOPT_HTTPHEADER) failed");
+    setopt(CURLOPT_HTTPHEADER, transfer.m_headers.native(), "CURLOPT_HTTPHEADER");
+
+    if (range) {
+        std::string spec = std::to_string(range->first) + "-";
+        if (range->last >= 0) {
+            spec += std::to_string(range->last);
+        }
+        setopt(CURLOPT_RANGE, spec.c_str(), "CURLOPT_RANGE");
     }
+}
+
+void Curl::start(Transfer& transfer, const BodySink* sink) {
+    transfer.m_curl = this;
+    transfer.m_sink = sink;
+    // Headers left over from a reused response are spare nodes until the
+    // new ones come in.
+    m_spare_headers.merge(transfer.m_target->headers);
+    transfer.m_target->headers.clear();
 
-    // success = curl_easy_perform(handle);
+    // Also undoes the CURLOPT_NOBODY of a HEAD before.
+    setopt(CURLOPT_HTTPGET, 1L, "CURLOPT_HTTPGET");
+    setopt(CURLOPT_WRITEFUNCTION, &Curl::write_body, "CURLOPT_WRITEFUNCTION");
+    setopt(CURLOPT_WRITEDATA, static_cast<void*>(&transfer), "CURLOPT_WRITEDATA");
+    setopt(CURLOPT_HEADERFUNCTION, &Curl::write_header, "CURLOPT_HEADERFUNCTION");
+    setopt(CURLOPT_HEADERDATA, static_cast<void*>(&transfer), "CURLOPT_HEADERDATA");
 }
 
-std::ostream& operator>>(std::ostream& os, const CurlErrorBase& error) {
-    os << "CURL: " << error.message();
+HttpResponse Curl::finish(Transfer& transfer, CURLcode result) {
+    complete(transfer, result);
+    return std::move(transfer.m_response);
 }
 
-std::ostream& operator>>(std::ostream& os, const CurlError& error) {
-    os << "CURL:" << error.message() << ", error code = " << error.code();
+void Curl::complete(Transfer& transfer, CURLcode result) {
+    // The transfer owns the header list and is about to go away, so the
+    // handle must not keep pointers into it.
+    curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, nullptr);
+    curl_easy_setopt(m_handle, CURLOPT_WRITEDATA, nullptr);
+    curl_easy_setopt(m_handle, CURLOPT_HEADERDATA, nullptr);
+    curl_easy_setopt(m_handle, CURLOPT_RANGE, nullptr);
+    if (transfer.m_error) {
+        std::rethrow_exception(transfer.m_error);
+    }
+    if (result != CURLE_OK && !(result == CURLE_WRITE_ERROR && transfer.m_truncated)) {
+        char* url = nullptr;
+        curl_easy_getinfo(m_handle, CURLINFO_EFFECTIVE_URL, &url);
+        throw CurlError("curl_easy_perform (" + std::string{url != nullptr ? url : ""} + ") failed", result);
+    }
+    HttpResponse& response = *transfer.m_target;
+    curl_easy_getinfo(m_handle, CURLINFO_RESPONSE_CODE, &response.status);
+
+    auto time = [this] (CURLINFO info) {
+        curl_off_t microseconds = 0;
+        curl_easy_getinfo(m_handle, info, &microseconds);
+        return std::chrono::microseconds{microseconds};
+    };
+    // libcurl counts each phase from the start of the request.
+    std::chrono::microseconds resolved = time(CURLINFO_NAMELOOKUP_TIME_T);
+    std::chrono::microseconds connected = time(CURLINFO_CONNECT_TIME_T);
+    std::chrono::microseconds handshaken = time(CURLINFO_APPCONNECT_TIME_T);
+    RequestTimings& timings = response.timings;
+    timings.dns = resolved;
+    timings.connect = std::max(connected - resolved, std::chrono::microseconds{});
+    timings.tls = handshaken > connected ? handshaken - connected : std::chrono::microseconds{};
+    timings.ttfb = time(CURLINFO_STARTTRANSFER_TIME_T);
+    timings.total = time(CURLINFO_TOTAL_TIME_T);
+    curl_off_t received = 0;
+    curl_easy_getinfo(m_handle, CURLINFO_SIZE_DOWNLOAD_T, &received);
+    timings.received = received;
+    long connects = 0;
+    curl_easy_getinfo(m_handle, CURLINFO_NUM_CONNECTS, &connects);
+    timings.reused = connects == 0;
+
+    char* url = nullptr;
+    curl_easy_getinfo(m_handle, CURLINFO_EFFECTIVE_URL, &url);
+    Metrics::global().record(timings, response.status, url != nullptr ? url : "");
+}
+
+void FdSink::operator()(std::string_view chunk) const {
+    write_all(m_fd, chunk);
+}
+
+CurlPool::Lease CurlPool::acquire() {
+    {
+        std::lock_guard lock{m_mutex};
+        if (!m_idle.empty()) {
+            Curl curl = std::move(m_idle.back());
+            m_idle.pop_back();
+            return Lease{*this, std::move(curl)};
+        }
+    }
+    return Lease{*this, Curl{&m_share}};
+}
+
+void CurlPool::release(Curl&& curl) {
+    if (curl.native() == nullptr) {
+        return;
+    }
+    curl.reset();
+
+    std::lock_guard lock{m_mutex};
+    if (m_idle.size() < m_max_idle) {
+        m_idle.push_back(std::move(curl));
+    }
+}
+
+std::ostream& operator<<(std::ostream& os, const CurlErrorBase& error) {
+    return os << "CURL: " << error.message();
+}
+
+HttpRequest::HttpRequest(std::string url, const HeaderMap& headers, Method method)
+    : m_url{std::move(url)},
+      m_method{method}
+{
+    for (const auto& [key, value] : headers) {
+        m_headers.append(key + ": " + value);
+    }
 }
 
 void CurlStringList::append(const std::string& value) {
     curl_slist* new_list = curl_slist_append(m_slist, value.c_str());
     if (new_list == nullptr) {
-        throw new CurErrorBase("curl_slist_append failed");
+        throw CurlErrorBase("curl_slist_append failed");
     }
     m_slist = new_list;
-}
\ No newline at end of file
+}
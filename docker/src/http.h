@@ -1,62 +1,42 @@
 #pragma once
 
+#include <array>
+#include <exception>
+#include <functional>
 #include <optional>
+#include <string_view>
+#include <vector>
 
 #include <curl/curl.h>
 
+#include "metrics.h"
 #include "pch.h"
 
 using HeaderMap = std::unordered_map<std::string, std::string>;
 
+// Initialises libcurl for the whole process. Every Curl and CurlShare calls
+// ensure() before touching libcurl, so curl_global_init runs exactly once.
 class CurlInit {
 public:
     CurlInit();
     ~CurlInit() { curl_global_cleanup(); }
 
-    CurlInit(const Curl&) = delete;
-    CurlInit& operator=(const Curl&) = delete;
-    Curl(Curl&&) = delete;
-    Curl& operator=(Curl&&) = delete;
-};
-
-class Curl {
-public:
-    CurlHandle(CURL* handle);
-    ~Curl() { release(); }
-
-    Curl(const Curl&) = delete;
-    Curl& operator=(const Curl&) = delete;
-
-    Curl(Curl&& other) {
-        m_handle = other.m_handle;
-        other.m_handle = nullptr;
-    }
-    Curl& operator=(Curl&& other) {
-        if (&other != this) {
-            release();
-            m_handle = other.m_handle;
-            other.m_handle = nullptr;
-        }
-        return *this;
-    }
+    CurlInit(const CurlInit&) = delete;
+    CurlInit& operator=(const CurlInit&) = delete;
+    CurlInit(CurlInit&&) = delete;
+    CurlInit& operator=(CurlInit&&) = delete;
 
-    std::string get(const std::string& url, const HeaderMap& headers);
-
-private:
-    void release() { curl_global_cleanup(); }
-
-    static CurlInit m_init;
-    static std::once_flag m_once_init;
-    CURL* m_handle;
+    static void ensure();
 };
 
-class CurlErrorBase {
+class CurlErrorBase : public std::exception {
 public:
     explicit CurlErrorBase(const std::string& message)
         : m_message{message}
     {}
 
     const std::string& message() const { return m_message; }
+    const char* what() const noexcept override { return m_message.c_str(); }
 
 protected:
     std::string m_message;
@@ -65,7 +45,7 @@ protected:
 class CurlError : public CurlErrorBase {
 public:
     CurlError(const std::string& message, CURLcode code)
-        : CurlErrorBase{message},
+        : CurlErrorBase{message + ": " + curl_easy_strerror(code)},
           m_code{code}
     {}
 
@@ -75,6 +55,56 @@ private:
     CURLcode m_code;
 };
 
+class CurlMultiError : public CurlErrorBase {
+public:
+    CurlMultiError(const std::string& message, CURLMcode code)
+        : CurlErrorBase{message + ": " + curl_multi_strerror(code)},
+          m_code{code}
+    {}
+
+    CURLMcode code() const { return m_code; }
+
+private:
+    CURLMcode m_code;
+};
+
+class CurlShareError : public CurlErrorBase {
+public:
+    CurlShareError(const std::string& message, CURLSHcode code)
+        : CurlErrorBase{message + ": " + curl_share_strerror(code)},
+          m_code{code}
+    {}
+
+    CURLSHcode code() const { return m_code; }
+
+private:
+    CURLSHcode m_code;
+};
+
+// A CURLSH sharing the DNS cache, TLS sessions and live connections between
+// every handle attached to it, so that a request to a host another handle
+// has already talked to skips the lookup and the TCP and TLS handshakes.
+// libcurl keeps a pointer to it, so it can be neither copied nor moved.
+class CurlShare {
+public:
+    CurlShare();
+    ~CurlShare() { curl_share_cleanup(m_share); }
+
+    CurlShare(const CurlShare&) = delete;
+    CurlShare& operator=(const CurlShare&) = delete;
+    CurlShare(CurlShare&&) = delete;
+    CurlShare& operator=(CurlShare&&) = delete;
+
+    CURLSH* native() const { return m_share; }
+
+private:
+    static void lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr);
+    static void unlock(CURL* handle, curl_lock_data data, void* userptr);
+
+    CURLSH* m_share;
+    std::array<std::mutex, CURL_LOCK_DATA_LAST> m_locks;
+};
+
 class CurlStringList {
 public:
     CurlStringList() : m_slist{nullptr} {};
@@ -106,4 +136,259 @@ private:
     }
 
     curl_slist* m_slist;
-};
\ No newline at end of file
+};
+
+struct HttpHead {
+    long status = 0;
+    // Names are lower-cased. Only the headers of the last response are kept
+    // when redirects are followed.
+    HeaderMap headers;
+    RequestTimings timings;
+};
+
+struct HttpResponse : HttpHead {
+    std::string body;
+};
+
+// A request whose URL and header list are built once, for one that is made
+// over and over, such as a HEAD checking whether a tag has moved. Only
+// read by Curl::perform(), so one request may be performed by several
+// handles at once.
+class HttpRequest {
+public:
+    enum class Method { get, head };
+
+    HttpRequest(std::string url, const HeaderMap& headers = {}, Method method = Method::get);
+
+    const std::string& url() const { return m_url; }
+    Method method() const { return m_method; }
+    curl_slist* headers() const { return m_headers.native(); }
+
+private:
+    std::string m_url;
+    CurlStringList m_headers;
+    Method m_method;
+};
+
+// The bytes first to last of a resource, both included. A last of -1 means
+// through to the end.
+struct ByteRange {
+    curl_off_t first = 0;
+    curl_off_t last = -1;
+};
+
+// Receives a response body a chunk at a time, straight from libcurl's
+// receive buffer, which is only valid for the duration of the call. An
+// exception thrown by the sink aborts the transfer and is rethrown by get().
+using BodySink = std::function<void(std::string_view chunk)>;
+
+// Asked before each chunk of a streamed body reaches the sink whether the
+// sink can take it now. Returning false pauses the transfer without the
+// chunk, which libcurl passes again once the transfer is resumed with
+// curl_easy_pause(). For transfers on a multi handle, where a sink that
+// blocks would hold up every other transfer.
+using ReadyFn = std::function<bool(std::string_view chunk)>;
+
+// Writes a body to a file descriptor, which it does not own.
+class FdSink {
+public:
+    explicit FdSink(int fd) : m_fd{fd} {}
+
+    void operator()(std::string_view chunk) const;
+
+private:
+    int m_fd;
+};
+
+class Curl {
+public:
+    explicit Curl(CurlShare* share = nullptr);
+    ~Curl() { release(); }
+
+    Curl(const Curl&) = delete;
+    Curl& operator=(const Curl&) = delete;
+
+    Curl(Curl&& other)
+        : m_spare_headers{std::move(other.m_spare_headers)},
+          m_header_name{std::move(other.m_header_name)}
+    {
+        m_handle = other.m_handle;
+        m_share = other.m_share;
+        other.m_handle = nullptr;
+    }
+    Curl& operator=(Curl&& other) {
+        if (&other != this) {
+            release();
+            m_handle = other.m_handle;
+            m_share = other.m_share;
+            m_spare_headers = std::move(other.m_spare_headers);
+            m_header_name = std::move(other.m_header_name);
+            other.m_handle = nullptr;
+        }
+        return *this;
+    }
+
+    HttpResponse get(const std::string& url, const HeaderMap& headers = {});
+
+    // Streams the body of a 2xx response to sink, in constant memory. The
+    // body of any other response is returned in HttpResponse::body, cut
+    // short after MAX_ERROR_BODY bytes, for error reporting. With a range, only a 206
+    // counts, so that a server ignoring the range and sending the whole
+    // resource with a 200 never reaches the sink.
+    HttpResponse get(const std::string& url, const HeaderMap& headers, const BodySink& sink,
+                     std::optional<ByteRange> range = std::nullopt);
+
+    // Performs a prepared request into response, whose buffers are reused:
+    // the body is cleared and reserved from Content-Length without giving
+    // back its capacity, and headers seen in the last response keep their
+    // nodes. Done again with the same response, a request allocates next
+    // to nothing outside libcurl.
+    void perform(const HttpRequest& request, HttpResponse& response);
+
+    static constexpr size_t MAX_ERROR_BODY = 64 * 1024;
+
+    // The state of one request. The handle's callbacks point at it from
+    // begin() until finish(), so it must not move in between.
+    class Transfer {
+    public:
+        Transfer() = default;
+
+        Transfer(const Transfer&) = delete;
+        Transfer& operator=(const Transfer&) = delete;
+
+    private:
+        friend class Curl;
+
+        Curl* m_curl = nullptr;
+        const BodySink* m_sink = nullptr;
+        const ReadyFn* m_ready = nullptr;
+        CurlStringList m_headers;
+        HttpResponse m_response;
+        // m_response, or the caller's for a prepared request.
+        HttpResponse* m_target = &m_response;
+        bool m_ranged = false;
+        bool m_streaming = false;
+        bool m_started = false;
+        bool m_truncated = false;
+        std::exception_ptr m_error;
+    };
+
+    // Sets the handle up for a GET that someone else performs, such as a
+    // curl multi handle. sink may be null to buffer the body, and otherwise
+    // must outlive the transfer, as must ready when it is not null.
+    void begin(Transfer& transfer, const std::string& url, const HeaderMap& headers, const BodySink* sink,
+               std::optional<ByteRange> range = std::nullopt, const ReadyFn* ready = nullptr);
+
+    // Completes a transfer begun with begin(), given the result libcurl
+    // reported for it, and throws like get().
+    HttpResponse finish(Transfer& transfer, CURLcode result);
+
+    CURL* native() const { return m_handle; }
+
+    // Clears the options of the last request while keeping the handle's
+    // connections and caches.
+    void reset();
+
+private:
+    // Downloader sets options of its own on the handles it runs.
+    friend class Downloader;
+
+    void release() {
+        curl_easy_cleanup(m_handle);
+        m_handle = nullptr;
+    }
+
+    // curl_easy_setopt(), throwing CurlError that names the option.
+    template <typename T>
+    void setopt(CURLoption option, T value, const char* name) {
+        CURLcode result = curl_easy_setopt(m_handle, option, value);
+        if (result != CURLE_OK) {
+            throw CurlError(std::string{"curl_easy_setopt ("} + name + ") failed", result);
+        }
+    }
+
+    HttpResponse perform(const std::string& url, const HeaderMap& headers, const BodySink* sink,
+                         std::optional<ByteRange> range);
+    void start(Transfer& transfer, const BodySink* sink);
+    void complete(Transfer& transfer, CURLcode result);
+
+    static size_t write_body(char* ptr, size_t size, size_t nmemb, void* userdata);
+    static size_t write_header(char* ptr, size_t size, size_t nmemb, void* userdata);
+
+    CURL* m_handle;
+    CurlShare* m_share;
+    // Header nodes of earlier responses, taken back for the headers of the
+    // next one, and the buffer names are lower-cased in.
+    HeaderMap m_spare_headers;
+    std::string m_header_name;
+};
+
+// Keeps warm easy handles attached to one CurlShare. acquire() hands out an
+// idle handle, or a new one when none is idle, and the lease puts it back
+// when it goes out of scope. Safe to use from several threads.
+class CurlPool {
+public:
+    class Lease {
+    public:
+        Lease(CurlPool& pool, Curl&& curl)
+            : m_pool{&pool},
+              m_curl{std::move(curl)}
+        {}
+        ~Lease() {
+            if (m_pool != nullptr) {
+                m_pool->release(std::move(m_curl));
+            }
+        }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        Lease(Lease&& other)
+            : m_pool{other.m_pool},
+              m_curl{std::move(other.m_curl)}
+        {
+            other.m_pool = nullptr;
+        }
+        Lease& operator=(Lease&&) = delete;
+
+        Curl& operator*() { return m_curl; }
+        Curl* operator->() { return &m_curl; }
+
+    private:
+        CurlPool* m_pool;
+        Curl m_curl;
+    };
+
+    explicit CurlPool(std::size_t max_idle = 8)
+        : m_max_idle{max_idle}
+    {}
+
+    CurlPool(const CurlPool&) = delete;
+    CurlPool& operator=(const CurlPool&) = delete;
+
+    Lease acquire();
+
+    HttpResponse get(const std::string& url, const HeaderMap& headers = {}) {
+        return acquire()->get(url, headers);
+    }
+    HttpResponse get(const std::string& url, const HeaderMap& headers, const BodySink& sink,
+                     std::optional<ByteRange> range = std::nullopt) {
+        return acquire()->get(url, headers, sink, range);
+    }
+
+    void perform(const HttpRequest& request, HttpResponse& response) {
+        acquire()->perform(request, response);
+    }
+
+    CurlShare& share() { return m_share; }
+
+private:
+    void release(Curl&& curl);
+
+    CurlShare m_share;
+    std::mutex m_mutex;
+    std::vector<Curl> m_idle;
+    std::size_t m_max_idle;
+};
+
+std::ostream& operator<<(std::ostream& os, const CurlErrorBase& error);
@@ -0,0 +1,297 @@
+#include "json.h"
+
+#include <charconv>
+
+namespace {
+
+// Deep enough for any manifest, shallow enough that hostile input cannot
+// overflow the stack.
+constexpr int MAX_DEPTH = 64;
+
+class JsonParser {
+public:
+    explicit JsonParser(std::string_view text) : m_text{text}, m_pos{0} {}
+
+    JsonValue parse_document() {
+        JsonValue value = parse_value(0);
+        skip_space();
+        if (m_pos != m_text.size()) {
+            fail("trailing characters");
+        }
+        return value;
+    }
+
+private:
+    [[noreturn]] void fail(const char* what) const {
+        throw JsonError("JSON parse error at offset " + std::to_string(m_pos) + ": " + what);
+    }
+
+    void skip_space() {
+        while (m_pos < m_text.size()) {
+            char c = m_text[m_pos];
+            if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+                break;
+            }
+            m_pos++;
+        }
+    }
+
+    char peek() {
+        skip_space();
+        if (m_pos == m_text.size()) {
+            fail("unexpected end of input");
+        }
+        return m_text[m_pos];
+    }
+
+    void expect(std::string_view literal) {
+        if (m_text.substr(m_pos, literal.size()) != literal) {
+            fail("invalid literal");
+        }
+        m_pos += literal.size();
+    }
+
+    JsonValue parse_value(int depth) {
+        if (depth > MAX_DEPTH) {
+            fail("nesting too deep");
+        }
+        switch (peek()) {
+        case '{':
+            return parse_object(depth);
+        case '[':
+            return parse_array(depth);
+        case '"':
+            return JsonValue{parse_string()};
+        case 't':
+            expect("true");
+            return JsonValue{true};
+        case 'f':
+            expect("false");
+            return JsonValue{false};
+        case 'n':
+            expect("null");
+            return JsonValue{};
+        default:
+            return parse_number();
+        }
+    }
+
+    JsonValue parse_object(int depth) {
+        JsonValue::Object members;
+        m_pos++;
+        if (peek() == '}') {
+            m_pos++;
+            return JsonValue{std::move(members)};
+        }
+        for (;;) {
+            if (peek() != '"') {
+                fail("expected a member name");
+            }
+            std::string key = parse_string();
+            if (peek() != ':') {
+                fail("expected ':'");
+            }
+            m_pos++;
+            members.emplace_back(std::move(key), parse_value(depth + 1));
+
+            char c = peek();
+            m_pos++;
+            if (c == '}') {
+                return JsonValue{std::move(members)};
+            }
+            if (c != ',') {
+                fail("expected ',' or '}'");
+            }
+        }
+    }
+
+    JsonValue parse_array(int depth) {
+        JsonValue::Array elements;
+        m_pos++;
+        if (peek() == ']') {
+            m_pos++;
+            return JsonValue{std::move(elements)};
+        }
+        for (;;) {
+            elements.push_back(parse_value(depth + 1));
+
+            char c = peek();
+            m_pos++;
+            if (c == ']') {
+                return JsonValue{std::move(elements)};
+            }
+            if (c != ',') {
+                fail("expected ',' or ']'");
+            }
+        }
+    }
+
+    bool is_digit(size_t pos) const {
+        return pos < m_text.size() && m_text[pos] >= '0' && m_text[pos] <= '9';
+    }
+
+    JsonValue parse_number() {
+        // from_chars also takes "inf", "nan", "01" and "1.", which JSON does
+        // not, so the grammar is checked first and from_chars only converts.
+        size_t pos = m_pos;
+        if (pos < m_text.size() && m_text[pos] == '-') {
+            pos++;
+        }
+        if (!is_digit(pos)) {
+            fail(pos == m_pos ? "unexpected character" : "invalid number");
+        }
+        if (m_text[pos] == '0') {
+            pos++;
+            if (is_digit(pos)) {
+                fail("leading zero in number");
+            }
+        }
+        while (is_digit(pos)) {
+            pos++;
+        }
+        if (pos < m_text.size() && m_text[pos] == '.') {
+            pos++;
+            if (!is_digit(pos)) {
+                fail("invalid number");
+            }
+            while (is_digit(pos)) {
+                pos++;
+            }
+        }
+        if (pos < m_text.size() && (m_text[pos] == 'e' || m_text[pos] == 'E')) {
+            pos++;
+            if (pos < m_text.size() && (m_text[pos] == '+' || m_text[pos] == '-')) {
+                pos++;
+            }
+            if (!is_digit(pos)) {
+                fail("invalid number");
+            }
+            while (is_digit(pos)) {
+                pos++;
+            }
+        }
+
+        double value = 0;
+        auto [ptr, error] = std::from_chars(m_text.data() + m_pos, m_text.data() + pos, value);
+        if (error != std::errc{} || ptr != m_text.data() + pos) {
+            fail("invalid number");
+        }
+        m_pos = pos;
+        return JsonValue{value};
+    }
+
+    unsigned parse_hex4() {
+        if (m_text.size() - m_pos < 4) {
+            fail("truncated \\u escape");
+        }
+        unsigned value = 0;
+        auto [ptr, error] = std::from_chars(m_text.data() + m_pos, m_text.data() + m_pos + 4, value, 16);
+        if (error != std::errc{} || ptr != m_text.data() + m_pos + 4) {
+            fail("invalid \\u escape");
+        }
+        m_pos += 4;
+        return value;
+    }
+
+    static void append_utf8(std::string& out, unsigned code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        } else if (code < 0x800) {
+            out += static_cast<char>(0xc0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        } else if (code < 0x10000) {
+            out += static_cast<char>(0xe0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        } else {
+            out += static_cast<char>(0xf0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (code & 0x3f));
+        }
+    }
+
+    std::string parse_string() {
+        std::string out;
+        m_pos++;
+        for (;;) {
+            size_t run = m_pos;
+            while (run < m_text.size() && m_text[run] != '"' && m_text[run] != '\\' &&
+                   static_cast<unsigned char>(m_text[run]) >= 0x20) {
+                run++;
+            }
+            if (run == m_text.size()) {
+                fail("unterminated string");
+            }
+            out.append(m_text.substr(m_pos, run - m_pos));
+            if (static_cast<unsigned char>(m_text[run]) < 0x20) {
+                m_pos = run;
+                fail("control character in string");
+            }
+            m_pos = run + 1;
+            if (m_text[run] == '"') {
+                return out;
+            }
+
+            if (m_pos == m_text.size()) {
+                fail("unterminated string");
+            }
+            char c = m_text[m_pos++];
+            switch (c) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned code = parse_hex4();
+                if (code >= 0xd800 && code < 0xdc00) {
+                    expect("\\u");
+                    unsigned low = parse_hex4();
+                    if (low < 0xdc00 || low >= 0xe000) {
+                        fail("invalid surrogate pair");
+                    }
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                } else if (code >= 0xdc00 && code < 0xe000) {
+                    fail("invalid surrogate pair");
+                }
+                append_utf8(out, code);
+                break;
+            }
+            default:
+                fail("invalid escape");
+            }
+        }
+    }
+
+    std::string_view m_text;
+    size_t m_pos;
+};
+
+} // namespace
+
+const JsonValue* JsonValue::find(std::string_view key) const {
+    const Object* object = std::get_if<Object>(&m_value);
+    if (object == nullptr) {
+        return nullptr;
+    }
+    for (const auto& [name, value] : *object) {
+        if (name == key) {
+            return &value;
+        }
+    }
+    return nullptr;
+}
+
+const JsonValue& JsonValue::operator[](std::string_view key) const {
+    static const JsonValue null;
+    const JsonValue* value = find(key);
+    return value != nullptr ? *value : null;
+}
+
+JsonValue parse_json(std::string_view text) {
+    return JsonParser{text}.parse_document();
+}
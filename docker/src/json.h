@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "pch.h"
+
+class JsonError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// A parsed JSON document. Registry responses are small and read once, so
+// objects keep their members in document order and look keys up linearly.
+class JsonValue {
+public:
+    using Array = std::vector<JsonValue>;
+    using Object = std::vector<std::pair<std::string, JsonValue>>;
+
+    JsonValue() = default;
+    explicit JsonValue(bool value) : m_value{value} {}
+    explicit JsonValue(double value) : m_value{value} {}
+    explicit JsonValue(std::string value) : m_value{std::move(value)} {}
+    explicit JsonValue(Array value) : m_value{std::move(value)} {}
+    explicit JsonValue(Object value) : m_value{std::move(value)} {}
+
+    bool is_null() const { return std::holds_alternative<std::nullptr_t>(m_value); }
+    bool is_bool() const { return std::holds_alternative<bool>(m_value); }
+    bool is_number() const { return std::holds_alternative<double>(m_value); }
+    bool is_string() const { return std::holds_alternative<std::string>(m_value); }
+    bool is_array() const { return std::holds_alternative<Array>(m_value); }
+    bool is_object() const { return std::holds_alternative<Object>(m_value); }
+
+    // Each throws JsonError when the value has another type.
+    bool as_bool() const { return get<bool>("a boolean"); }
+    double as_number() const { return get<double>("a number"); }
+    const std::string& as_string() const { return get<std::string>("a string"); }
+    const Array& as_array() const { return get<Array>("an array"); }
+    const Object& as_object() const { return get<Object>("an object"); }
+
+    // Returns nullptr when this is not an object or has no such member.
+    const JsonValue* find(std::string_view key) const;
+
+    // Returns the member, or a null value when it is missing.
+    const JsonValue& operator[](std::string_view key) const;
+
+private:
+    template <typename T>
+    const T& get(const char* expected) const {
+        if (const T* value = std::get_if<T>(&m_value)) {
+            return *value;
+        }
+        throw JsonError(std::string{"JSON value is not "} + expected);
+    }
+
+    std::variant<std::nullptr_t, bool, double, std::string, Array, Object> m_value;
+};
+
+// Throws JsonError on malformed input or trailing garbage.
+JsonValue parse_json(std::string_view text);
@@ -0,0 +1,202 @@
+#include "layer.h"
+
+#include <stdexcept>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "gzip.h"
+#include "metrics.h"
+#include "tar.h"
+
+Compression layer_compression(std::string_view media_type) {
+    // OCI types end in "+gzip" or "+zstd", Docker's in ".tar.gzip", and
+    // either ends in "tar" when uncompressed.
+    if (media_type.ends_with("+gzip") || media_type.ends_with(".tar.gzip")) {
+        return Compression::gzip;
+    }
+    if (media_type.ends_with("+zstd")) {
+        return Compression::zstd;
+    }
+    if (media_type.ends_with(".tar")) {
+        return Compression::none;
+    }
+    throw std::invalid_argument("not a layer media type: " + std::string{media_type});
+}
+
+LayerUnpacker::LayerUnpacker(std::filesystem::path directory, Compression compression, Whiteouts whiteouts)
+    : m_compressed{QUEUE_DEPTH},
+      m_archive{QUEUE_DEPTH}
+{
+    m_pending.reserve(CHUNK_SIZE);
+    m_decompressor = std::jthread{[this, compression] { decompress(compression); }};
+    m_extractor = std::jthread{[this, directory = std::move(directory), whiteouts] {
+        extract(directory, whiteouts);
+    }};
+}
+
+LayerUnpacker::~LayerUnpacker() {
+    if (!m_finished) {
+        cancel();
+    }
+}
+
+void LayerUnpacker::write(std::string_view chunk) {
+    m_pending.append(chunk);
+    if (m_pending.size() < CHUNK_SIZE) {
+        return;
+    }
+    if (!m_compressed.push(std::move(m_pending))) {
+        rethrow();
+    }
+    m_pending = std::string{};
+    m_pending.reserve(CHUNK_SIZE);
+}
+
+bool LayerUnpacker::writable(std::string_view chunk, std::function<void()> wake) {
+    // Only a full block is queued, and this is the one thread pushing.
+    if (m_pending.size() + chunk.size() < CHUNK_SIZE) {
+        return true;
+    }
+    return m_compressed.ready(std::move(wake));
+}
+
+void LayerUnpacker::finish() {
+    if (m_finished) {
+        return;
+    }
+    if (!m_pending.empty() && !m_compressed.push(std::move(m_pending))) {
+        rethrow();
+    }
+    m_compressed.close();
+    m_decompressor.join();
+    m_extractor.join();
+    m_finished = true;
+
+    std::lock_guard lock{m_error_mutex};
+    if (m_error) {
+        std::rethrow_exception(m_error);
+    }
+}
+
+void LayerUnpacker::cancel() {
+    m_compressed.cancel();
+    m_archive.cancel();
+}
+
+void LayerUnpacker::fail(std::exception_ptr error) {
+    {
+        std::lock_guard lock{m_error_mutex};
+        if (!m_error) {
+            m_error = error;
+        }
+    }
+    cancel();
+}
+
+void LayerUnpacker::rethrow() {
+    std::lock_guard lock{m_error_mutex};
+    if (m_error) {
+        std::rethrow_exception(m_error);
+    }
+    throw std::runtime_error("layer unpack cancelled");
+}
+
+void LayerUnpacker::decompress(Compression compression) {
+    try {
+        switch (compression) {
+        case Compression::none:
+            while (std::optional<std::string> chunk = m_compressed.pop()) {
+                if (!m_archive.push(std::move(*chunk))) {
+                    return;
+                }
+            }
+            Metrics::global().add(Stage::decompress, {}, 0, 1);
+            break;
+
+        case Compression::gzip: {
+            GzipInflater inflater;
+            while (std::optional<std::string> chunk = m_compressed.pop()) {
+                inflater.input(*chunk);
+                while (inflater.more()) {
+                    std::string block(CHUNK_SIZE, '\0');
+                    // Only time in zlib counts, not waiting on the queues.
+                    StageTimer timer{Stage::decompress};
+                    block.resize(inflater.inflate(block.data(), block.size()));
+                    timer.stop(block.size());
+                    if (!block.empty() && !m_archive.push(std::move(block))) {
+                        return;
+                    }
+                }
+            }
+            if (!inflater.ended()) {
+                throw std::runtime_error("gzip stream truncated");
+            }
+            Metrics::global().add(Stage::decompress, {}, 0, 1);
+            break;
+        }
+
+        case Compression::zstd: {
+#ifdef HAVE_ZSTD
+            ZSTD_DCtx* context = ZSTD_createDCtx();
+            if (context == nullptr) {
+                throw std::runtime_error("ZSTD_createDCtx failed");
+            }
+            struct Guard {
+                ZSTD_DCtx* context;
+                ~Guard() { ZSTD_freeDCtx(context); }
+            } guard{context};
+
+            // 0 once a frame is complete. Further frames just continue.
+            size_t hint = 0;
+            while (std::optional<std::string> chunk = m_compressed.pop()) {
+                ZSTD_inBuffer input{chunk->data(), chunk->size(), 0};
+                bool full = false;
+                while (input.pos < input.size || full) {
+                    std::string block(CHUNK_SIZE, '\0');
+                    ZSTD_outBuffer output{block.data(), block.size(), 0};
+                    StageTimer timer{Stage::decompress};
+                    hint = ZSTD_decompressStream(context, &output, &input);
+                    timer.stop(output.pos);
+                    if (ZSTD_isError(hint)) {
+                        throw std::runtime_error(std::string{"ZSTD_decompressStream failed: "} +
+                                                 ZSTD_getErrorName(hint));
+                    }
+                    full = output.pos == output.size;
+                    block.resize(output.pos);
+                    if (!block.empty() && !m_archive.push(std::move(block))) {
+                        return;
+                    }
+                }
+            }
+            if (hint != 0) {
+                throw std::runtime_error("zstd stream truncated");
+            }
+            Metrics::global().add(Stage::decompress, {}, 0, 1);
+            break;
+#else
+            throw std::runtime_error("zstd layers need a build with libzstd");
+#endif
+        }
+        }
+        m_archive.close();
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
+
+void LayerUnpacker::extract(std::filesystem::path directory, Whiteouts whiteouts) {
+    try {
+        TarExtractor extractor{directory, whiteouts};
+        while (std::optional<std::string> block = m_archive.pop()) {
+            StageTimer timer{Stage::extract};
+            extractor.feed(*block);
+            timer.stop(block->size());
+        }
+        extractor.finish();
+        Metrics::global().add(Stage::extract, {}, 0, 1);
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <string_view>
+#include <thread>
+
+#include "queue.h"
+#include "tar.h"
+
+enum class Compression {
+    none,
+    gzip,
+    zstd,
+};
+
+// Throws std::invalid_argument for a media type that is not a layer.
+Compression layer_compression(std::string_view media_type);
+
+// Unpacks a layer into a directory while it is still downloading. Whatever
+// feeds write(), usually a download sink, runs the first stage. A second
+// thread decompresses and a third untars, with bounded queues in between,
+// so that a slow disk slows the download instead of piling up memory.
+//
+// Chunks are gathered into CHUNK_SIZE blocks before they are queued, and at
+// most QUEUE_DEPTH blocks wait between two stages.
+class LayerUnpacker {
+public:
+    static constexpr std::size_t CHUNK_SIZE = 128 * 1024;
+    static constexpr std::size_t QUEUE_DEPTH = 32;
+
+    // directory must exist.
+    LayerUnpacker(std::filesystem::path directory, Compression compression, Whiteouts whiteouts = Whiteouts::keep);
+    // Cancels an unpack that was not finished.
+    ~LayerUnpacker();
+
+    LayerUnpacker(const LayerUnpacker&) = delete;
+    LayerUnpacker& operator=(const LayerUnpacker&) = delete;
+
+    // Usable as a BodySink. Blocks while the later stages are behind, and
+    // rethrows their error once they have failed.
+    void write(std::string_view chunk);
+
+    // Whether write() would take chunk without blocking. When it would
+    // block, wake is called from another thread once it no longer does, so
+    // that a sink on a curl multi handle can pause its transfer instead of
+    // holding up the others.
+    bool writable(std::string_view chunk, std::function<void()> wake);
+
+    // Waits for the layer to be unpacked, and rethrows the first error of
+    // any stage.
+    void finish();
+
+    // Stops every stage without waiting for the queued data.
+    void cancel();
+
+private:
+    void decompress(Compression compression);
+    void extract(std::filesystem::path directory, Whiteouts whiteouts);
+    void fail(std::exception_ptr error);
+    void rethrow();
+
+    std::string m_pending;
+    BoundedQueue<std::string> m_compressed;
+    BoundedQueue<std::string> m_archive;
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error;
+    bool m_finished = false;
+    // Last, so that they stop before the queues they use go away.
+    std::jthread m_decompressor;
+    std::jthread m_extractor;
+};
@@ -0,0 +1,729 @@
+#include "lazy.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <system_error>
+
+#include <fcntl.h>
+#include <linux/fuse.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "posix.h"
+#include "tar.h"
+
+namespace {
+
+// The footer, and usually the whole TOC, come with one request for the end
+// of the layer.
+constexpr curl_off_t TAIL_SIZE = 512 * 1024;
+
+// Nothing in a layer ever changes, so the kernel may cache names and
+// attributes for as long as it likes.
+constexpr std::uint64_t CACHE_SECONDS = 3600;
+
+constexpr std::uint32_t MAX_READ = 128 * 1024;
+// A request carries at most MAX_READ bytes of data after its header.
+constexpr std::size_t REQUEST_BUFFER = MAX_READ + 4096;
+
+std::string parent_of(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? std::string{} : path.substr(0, slash);
+}
+
+std::string name_of(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+constexpr std::string_view WHITEOUT_PREFIX = ".wh.";
+constexpr std::string_view OPAQUE_WHITEOUT = ".wh..wh..opq";
+
+// What every whiteout reads as, a 0/0 character device.
+const TocEntry& whiteout_entry() {
+    static const TocEntry entry = [] {
+        TocEntry whiteout;
+        whiteout.type = "char";
+        return whiteout;
+    }();
+    return entry;
+}
+
+std::uint32_t file_type(const TocEntry* entry) {
+    if (entry == nullptr || entry->type == "dir") {
+        return S_IFDIR;
+    }
+    if (entry->type == "reg") {
+        return S_IFREG;
+    }
+    if (entry->type == "symlink") {
+        return S_IFLNK;
+    }
+    if (entry->type == "char") {
+        return S_IFCHR;
+    }
+    if (entry->type == "block") {
+        return S_IFBLK;
+    }
+    if (entry->type == "fifo") {
+        return S_IFIFO;
+    }
+    return S_IFREG;
+}
+
+} // namespace
+
+LazyLayer::LazyLayer(CurlPool& pool, TokenCache& tokens, const BlobStore& chunks, std::string url, std::string scope,
+                     const Descriptor& layer)
+    : m_pool{pool},
+      m_tokens{tokens},
+      m_chunks{chunks},
+      m_url{std::move(url)},
+      m_scope{std::move(scope)},
+      m_digest{layer.digest}
+{
+    curl_off_t size = layer.size;
+    if (size < static_cast<curl_off_t>(ESTARGZ_FOOTER_SIZE)) {
+        throw EstargzError(m_digest + ": not an eStargz layer");
+    }
+    curl_off_t tail_start = std::max<curl_off_t>(0, size - TAIL_SIZE);
+    std::string tail = fetch(tail_start, size - 1);
+    curl_off_t footer_start = size - static_cast<curl_off_t>(ESTARGZ_FOOTER_SIZE);
+    std::int64_t toc_offset = parse_estargz_footer(std::string_view{tail}.substr(footer_start - tail_start));
+    if (toc_offset <= 0 || toc_offset >= footer_start) {
+        throw EstargzError(m_digest + ": eStargz TOC offset out of range");
+    }
+    if (toc_offset < tail_start) {
+        tail = fetch(toc_offset, size - 1);
+        tail_start = toc_offset;
+    }
+
+    auto annotation = layer.annotations.find(std::string{TOC_DIGEST_ANNOTATION});
+    std::string_view toc_digest = annotation != layer.annotations.end() ? annotation->second : std::string_view{};
+    std::string_view compressed = std::string_view{tail}.substr(toc_offset - tail_start, footer_start - toc_offset);
+    m_toc = parse_estargz_toc(compressed, toc_offset, toc_digest);
+}
+
+std::string LazyLayer::fetch(curl_off_t first, curl_off_t last) {
+    std::string body;
+    body.reserve(static_cast<size_t>(last - first + 1));
+    HeaderMap headers{{"Authorization", "Bearer " + m_tokens.get(m_scope)}};
+    HttpResponse response = m_pool.get(m_url, headers, [&body] (std::string_view chunk) { body.append(chunk); },
+                                       ByteRange{first, last});
+    if (response.status != 206) {
+        throw RegistryError(m_digest + ": range request failed: HTTP " + std::to_string(response.status));
+    }
+    if (static_cast<curl_off_t>(body.size()) != last - first + 1) {
+        throw RegistryError(m_digest + ": range request answered with " + std::to_string(body.size()) + " bytes");
+    }
+    return body;
+}
+
+void LazyLayer::store(const TocChunk& chunk, std::string_view compressed) {
+    std::string content = gunzip(compressed, static_cast<size_t>(chunk.size));
+    if (static_cast<std::int64_t>(content.size()) != chunk.size) {
+        throw EstargzError(m_digest + ": chunk " + chunk.digest + " is short");
+    }
+    BlobStore::Writer writer = m_chunks.begin(chunk.digest, chunk.size);
+    writer.write(content);
+    writer.commit();
+}
+
+std::filesystem::path LazyLayer::chunk(const TocChunk& chunk) {
+    if (std::optional<std::filesystem::path> path = m_chunks.find(chunk.digest)) {
+        return *path;
+    }
+
+    std::unique_lock lock{m_mutex};
+    std::shared_future<void> pending;
+    auto found = m_pending.find(chunk.digest);
+    if (found != m_pending.end()) {
+        pending = found->second;
+        lock.unlock();
+    } else {
+        std::promise<void> promise;
+        pending = promise.get_future().share();
+        m_pending.emplace(chunk.digest, pending);
+        lock.unlock();
+        try {
+            store(chunk, fetch(chunk.begin, chunk.end - 1));
+            promise.set_value();
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+        lock.lock();
+        m_pending.erase(chunk.digest);
+        lock.unlock();
+    }
+    pending.get();
+    return m_chunks.path(chunk.digest);
+}
+
+void LazyLayer::prefetch(std::vector<const TocChunk*> chunks, std::int64_t max_request, std::stop_token stop) {
+    std::ranges::sort(chunks, {}, &TocChunk::begin);
+    auto duplicates = std::ranges::unique(chunks, {}, &TocChunk::begin);
+    chunks.erase(duplicates.begin(), duplicates.end());
+
+    // Each run of chunks is registered as pending, as chunk() does for one,
+    // so that a read of one of them waits for the run rather than fetching
+    // it again. Chunks pending elsewhere are left to that fetch, and those
+    // stored meanwhile, by reads, are not fetched again.
+    for (std::size_t first = 0; first < chunks.size() && !stop.stop_requested();) {
+        std::vector<std::promise<void>> promises;
+        std::unique_lock lock{m_mutex};
+        auto available = [this] (const TocChunk* chunk) {
+            return !m_pending.contains(chunk->digest) && !m_chunks.contains(chunk->digest);
+        };
+        while (first < chunks.size() && !available(chunks[first])) {
+            first++;
+        }
+        if (first == chunks.size()) {
+            break;
+        }
+        std::size_t last = first;
+        while (last + 1 < chunks.size() && chunks[last + 1]->begin == chunks[last]->end &&
+               chunks[last + 1]->end - chunks[first]->begin <= max_request && available(chunks[last + 1])) {
+            last++;
+        }
+        for (std::size_t i = first; i <= last; i++) {
+            m_pending.emplace(chunks[i]->digest, promises.emplace_back().get_future().share());
+        }
+        lock.unlock();
+
+        std::size_t stored = 0;
+        std::exception_ptr error;
+        try {
+            curl_off_t begin = chunks[first]->begin;
+            std::string data = fetch(begin, chunks[last]->end - 1);
+            for (; stored < promises.size(); stored++) {
+                const TocChunk& chunk = *chunks[first + stored];
+                store(chunk, std::string_view{data}.substr(chunk.begin - begin, chunk.end - chunk.begin));
+                promises[stored].set_value();
+            }
+        } catch (...) {
+            error = std::current_exception();
+            for (std::size_t i = stored; i < promises.size(); i++) {
+                promises[i].set_exception(error);
+            }
+        }
+        lock.lock();
+        for (std::size_t i = first; i <= last; i++) {
+            m_pending.erase(chunks[i]->digest);
+        }
+        lock.unlock();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        first = last + 1;
+    }
+}
+
+LazyMount::LazyMount(LazyLayer& layer, std::filesystem::path mountpoint, LazyMountOptions options)
+    : m_layer{layer},
+      m_mountpoint{std::move(mountpoint)},
+      m_options{std::move(options)}
+{
+    build_tree();
+
+    m_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_stop_fd < 0) {
+        throw_errno("eventfd");
+    }
+    m_fd = open("/dev/fuse", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (m_fd < 0) {
+        int saved = errno;
+        close(m_stop_fd);
+        errno = saved;
+        throw_errno("open /dev/fuse");
+    }
+    // Others may use the mount, as containers usually run as another user,
+    // with the kernel checking permissions against the TOC's modes.
+    std::string data = "fd=" + std::to_string(m_fd) + ",rootmode=40000,user_id=" + std::to_string(getuid()) +
+        ",group_id=" + std::to_string(getgid()) + ",allow_other,default_permissions,max_read=" +
+        std::to_string(MAX_READ);
+    if (mount(m_layer.digest().c_str(), m_mountpoint.c_str(), "fuse.estargz", MS_RDONLY | MS_NOSUID | MS_NODEV,
+              data.c_str()) != 0) {
+        int saved = errno;
+        close(m_fd);
+        close(m_stop_fd);
+        errno = saved;
+        throw_errno("mount " + m_mountpoint.string());
+    }
+
+    // Once mounted, a failure, such as to start a thread, takes down what
+    // has been started so far, as the destructor would.
+    try {
+        m_mounted = std::chrono::steady_clock::now();
+        if (!m_options.traces.empty()) {
+            std::error_code error;
+            const std::string& digest = m_layer.digest();
+            m_tracing = !std::filesystem::exists(m_options.traces / digest.substr(digest.find(':') + 1), error);
+        }
+
+        m_prefetcher = std::jthread{[this] (std::stop_token stop) { run_prefetch(stop); }};
+        for (std::size_t i = 0; i < std::max<std::size_t>(m_options.threads, 1); i++) {
+            m_workers.emplace_back([this] (std::stop_token stop) { serve(stop); });
+        }
+    } catch (...) {
+        unmount();
+        throw;
+    }
+}
+
+LazyMount::~LazyMount() {
+    unmount();
+    save_trace();
+}
+
+void LazyMount::unmount() {
+    // Detached, the mount goes away once nothing uses it anymore. Closing
+    // the device then fails whatever is still asked of it.
+    umount2(m_mountpoint.c_str(), MNT_DETACH);
+    std::uint64_t one = 1;
+    if (::write(m_stop_fd, &one, sizeof(one)) < 0) {
+        // The workers also stop once the kernel drops the connection.
+    }
+    m_workers.clear();
+    m_prefetcher = std::jthread{};
+    close(m_fd);
+    close(m_stop_fd);
+}
+
+std::uint64_t LazyMount::make_directory(const std::string& path) {
+    auto found = m_by_path.find(path);
+    if (found != m_by_path.end()) {
+        return found->second;
+    }
+    make_directory(parent_of(path));
+    m_nodes.emplace_back().path = path;
+    m_by_path.emplace(path, m_nodes.size() - 1);
+    return m_nodes.size() - 1;
+}
+
+void LazyMount::build_tree() {
+    m_nodes.resize(FUSE_ROOT_ID + 1);
+    m_by_path.emplace("", FUSE_ROOT_ID);
+
+    // A later entry for the same path replaces an earlier one, as when
+    // extracting the tar.
+    const Toc& toc = m_layer.toc();
+    for (const TocEntry& entry : toc.entries) {
+        if (entry.type == "hardlink") {
+            continue;
+        }
+        if (entry.name.empty()) {
+            m_nodes[FUSE_ROOT_ID].entry = &entry;
+            continue;
+        }
+        std::string parent = parent_of(entry.name);
+        make_directory(parent);
+        if (entry.type == "dir") {
+            m_nodes[make_directory(entry.name)].entry = &entry;
+            continue;
+        }
+        std::string name = name_of(entry.name);
+        if (name == OPAQUE_WHITEOUT) {
+            m_nodes[make_directory(parent)].opaque = true;
+            continue;
+        }
+        Node& node = m_nodes.emplace_back();
+        node.entry = &entry;
+        node.path = entry.name;
+        if (name.starts_with(WHITEOUT_PREFIX) && name.size() > WHITEOUT_PREFIX.size()) {
+            node.entry = &whiteout_entry();
+            node.path = (parent.empty() ? "" : parent + '/') + name.substr(WHITEOUT_PREFIX.size());
+        }
+        m_by_path.insert_or_assign(node.path, m_nodes.size() - 1);
+    }
+    for (const TocEntry& entry : toc.entries) {
+        if (entry.type != "hardlink") {
+            continue;
+        }
+        auto target = m_by_path.find(entry.link_name);
+        if (target == m_by_path.end() || file_type(m_nodes[target->second].entry) == S_IFDIR) {
+            continue;
+        }
+        make_directory(parent_of(entry.name));
+        m_by_path.insert_or_assign(entry.name, target->second);
+        m_nodes[target->second].links++;
+    }
+
+    for (const auto& [path, node] : m_by_path) {
+        if (!path.empty()) {
+            m_nodes[m_by_path.at(parent_of(path))].children.emplace_back(name_of(path), node);
+        }
+    }
+    for (Node& node : m_nodes) {
+        std::ranges::sort(node.children);
+    }
+}
+
+void LazyMount::serve(std::stop_token stop) {
+    std::vector<char> buffer(REQUEST_BUFFER);
+    pollfd fds[2] = {{m_fd, POLLIN, 0}, {m_stop_fd, POLLIN, 0}};
+    while (!stop.stop_requested()) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (fds[1].revents != 0) {
+            return;
+        }
+        // Workers wake together, and all but one find nothing to read.
+        ssize_t length = ::read(m_fd, buffer.data(), buffer.size());
+        if (length < 0) {
+            // ENOENT is a request the kernel withdrew, ENODEV an unmount.
+            if (errno == EAGAIN || errno == EINTR || errno == ENOENT) {
+                continue;
+            }
+            return;
+        }
+        if (static_cast<size_t>(length) >= sizeof(fuse_in_header)) {
+            handle(buffer.data(), static_cast<size_t>(length));
+        }
+    }
+}
+
+void LazyMount::reply(std::uint64_t unique, int error, const void* data, std::size_t size) {
+    fuse_out_header header{};
+    header.len = static_cast<uint32_t>(sizeof(header) + size);
+    header.error = -error;
+    header.unique = unique;
+    iovec parts[2] = {{&header, sizeof(header)}, {const_cast<void*>(data), size}};
+    // Fails with ENOENT when the request was interrupted meanwhile, which
+    // leaves nothing to do.
+    if (writev(m_fd, parts, size > 0 ? 2 : 1) < 0) {
+        return;
+    }
+}
+
+void LazyMount::handle(const char* request, std::size_t length) {
+    fuse_in_header header;
+    std::memcpy(&header, request, sizeof(header));
+    const char* body = request + sizeof(header);
+    std::size_t body_length = length - sizeof(header);
+    // Copies the request's arguments, which may be shorter than the struct
+    // on older kernels.
+    auto arguments = [&] <typename T> (T& out) {
+        out = T{};
+        std::memcpy(&out, body, std::min(sizeof(T), body_length));
+    };
+
+    if (header.opcode == FUSE_FORGET || header.opcode == FUSE_BATCH_FORGET || header.opcode == FUSE_INTERRUPT) {
+        return;
+    }
+    if (header.opcode == FUSE_INIT) {
+        fuse_init_in in;
+        arguments(in);
+        if (in.major != FUSE_KERNEL_VERSION) {
+            reply(header.unique, EPROTO);
+            return;
+        }
+        fuse_init_out out{};
+        out.major = FUSE_KERNEL_VERSION;
+        out.minor = FUSE_KERNEL_MINOR_VERSION;
+        out.max_readahead = in.max_readahead;
+        out.flags = in.flags & (FUSE_ASYNC_READ | FUSE_PARALLEL_DIROPS | FUSE_CACHE_SYMLINKS | FUSE_MAX_PAGES);
+        out.max_background = 16;
+        out.congestion_threshold = 12;
+        out.max_write = MAX_READ;
+        out.time_gran = 1;
+        out.max_pages = static_cast<uint16_t>(MAX_READ / 4096);
+        reply(header.unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    if (header.nodeid < FUSE_ROOT_ID || header.nodeid >= m_nodes.size()) {
+        reply(header.unique, ENOENT);
+        return;
+    }
+    const Node& node = m_nodes[header.nodeid];
+
+    auto attributes = [this] (std::uint64_t id) {
+        const Node& node = m_nodes[id];
+        const TocEntry* entry = node.entry;
+        std::uint32_t type = file_type(entry);
+        fuse_attr attr{};
+        attr.ino = id;
+        attr.mode = type | (entry != nullptr ? entry->mode & 07777 : 0755);
+        attr.nlink = type == S_IFDIR ? 2 : node.links;
+        if (entry != nullptr) {
+            attr.size = type == S_IFREG ? entry->size : type == S_IFLNK ? entry->link_name.size() : 0;
+            attr.mtime = attr.ctime = attr.atime = static_cast<std::uint64_t>(entry->mtime);
+            attr.uid = entry->uid;
+            attr.gid = entry->gid;
+            attr.rdev = static_cast<std::uint32_t>(makedev(entry->dev_major, entry->dev_minor));
+        }
+        attr.blocks = (attr.size + 511) / 512;
+        attr.blksize = 4096;
+        return attr;
+    };
+
+    switch (header.opcode) {
+    case FUSE_LOOKUP: {
+        std::string_view name{body, strnlen(body, body_length)};
+        auto child = std::ranges::lower_bound(node.children, name, {},
+                                              [] (const auto& child) { return std::string_view{child.first}; });
+        if (child == node.children.end() || child->first != name) {
+            reply(header.unique, ENOENT);
+            return;
+        }
+        fuse_entry_out out{};
+        out.nodeid = child->second;
+        out.entry_valid = CACHE_SECONDS;
+        out.attr_valid = CACHE_SECONDS;
+        out.attr = attributes(child->second);
+        reply(header.unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    case FUSE_GETATTR: {
+        fuse_attr_out out{};
+        out.attr_valid = CACHE_SECONDS;
+        out.attr = attributes(header.nodeid);
+        reply(header.unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    case FUSE_READLINK:
+        if (file_type(node.entry) != S_IFLNK) {
+            reply(header.unique, EINVAL);
+            return;
+        }
+        reply(header.unique, 0, node.entry->link_name.data(), node.entry->link_name.size());
+        return;
+
+    case FUSE_OPEN: {
+        fuse_open_in in;
+        arguments(in);
+        if ((in.flags & O_ACCMODE) != O_RDONLY) {
+            reply(header.unique, EROFS);
+            return;
+        }
+        if (file_type(node.entry) != S_IFREG) {
+            reply(header.unique, EISDIR);
+            return;
+        }
+        record(header.nodeid);
+        fuse_open_out out{};
+        out.fh = header.nodeid;
+        out.open_flags = FOPEN_KEEP_CACHE;
+        reply(header.unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    case FUSE_READ: {
+        fuse_read_in in;
+        arguments(in);
+        try {
+            std::string data = read(node, in.offset, std::min(in.size, MAX_READ));
+            reply(header.unique, 0, data.data(), data.size());
+        } catch (const std::exception&) {
+            reply(header.unique, EIO);
+        }
+        return;
+    }
+
+    case FUSE_OPENDIR: {
+        if (file_type(node.entry) != S_IFDIR) {
+            reply(header.unique, ENOTDIR);
+            return;
+        }
+        fuse_open_out out{};
+        out.open_flags = FOPEN_KEEP_CACHE;
+        reply(header.unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    case FUSE_READDIR: {
+        fuse_read_in in;
+        arguments(in);
+        // Offsets count entries, starting with "." and "..".
+        std::string out;
+        for (std::uint64_t i = in.offset; i < node.children.size() + 2; i++) {
+            std::string_view name = i == 0 ? "." : i == 1 ? ".." : std::string_view{node.children[i - 2].first};
+            std::uint64_t id = i == 0 ? header.nodeid : i == 1 ? m_by_path.at(parent_of(node.path))
+                                                               : node.children[i - 2].second;
+            fuse_dirent dirent{};
+            dirent.ino = id;
+            dirent.off = i + 1;
+            dirent.namelen = static_cast<uint32_t>(name.size());
+            dirent.type = file_type(m_nodes[id].entry) >> 12;
+            std::size_t size = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + name.size());
+            if (out.size() + size > in.size) {
+                break;
+            }
+            std::size_t start = out.size();
+            out.resize(start + size, '\0');
+            std::memcpy(out.data() + start, &dirent, FUSE_NAME_OFFSET);
+            std::memcpy(out.data() + start + FUSE_NAME_OFFSET, name.data(), name.size());
+        }
+        reply(header.unique, 0, out.data(), out.size());
+        return;
+    }
+
+    case FUSE_GETXATTR: {
+        // Only the opaque mark of overlayfs is there to read.
+        fuse_getxattr_in in;
+        arguments(in);
+        std::string_view name;
+        if (body_length > sizeof(in)) {
+            name = std::string_view{body + sizeof(in), strnlen(body + sizeof(in), body_length - sizeof(in))};
+        }
+        if (!node.opaque || (name != OVERLAY_OPAQUE_XATTR && name != USER_OVERLAY_OPAQUE_XATTR)) {
+            reply(header.unique, ENODATA);
+        } else if (in.size == 0) {
+            fuse_getxattr_out out{};
+            out.size = 1;
+            reply(header.unique, 0, &out, sizeof(out));
+        } else {
+            reply(header.unique, 0, "y", 1);
+        }
+        return;
+    }
+
+    case FUSE_STATFS: {
+        fuse_statfs_out out{};
+        out.st.files = m_nodes.size() - 1;
+        out.st.bsize = 4096;
+        out.st.frsize = 4096;
+        out.st.namelen = 255;
+        reply(header.unique, 0, &out, sizeof(out));
+        return;
+    }
+
+    case FUSE_RELEASE:
+    case FUSE_RELEASEDIR:
+    case FUSE_FLUSH:
+    case FUSE_ACCESS:
+    case FUSE_DESTROY:
+        reply(header.unique, 0);
+        return;
+
+    default:
+        // The kernel stops asking once told, as for listing extended
+        // attributes.
+        reply(header.unique, ENOSYS);
+        return;
+    }
+}
+
+std::string LazyMount::read(const Node& node, std::uint64_t offset, std::uint32_t size) {
+    const TocEntry& entry = *node.entry;
+    auto begin = static_cast<std::int64_t>(offset);
+    std::int64_t end = std::min<std::int64_t>(entry.size, begin + size);
+    std::string data;
+    if (begin >= end) {
+        return data;
+    }
+    data.reserve(static_cast<size_t>(end - begin));
+
+    auto chunk = std::ranges::upper_bound(entry.chunks, begin, {}, &TocChunk::offset);
+    if (chunk != entry.chunks.begin()) {
+        --chunk;
+    }
+    for (; chunk != entry.chunks.end() && chunk->offset < end; ++chunk) {
+        std::filesystem::path path = m_layer.chunk(*chunk);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw_errno("open " + path.string());
+        }
+        std::int64_t position = std::max(begin, chunk->offset);
+        std::int64_t stop = std::min(end, chunk->offset + chunk->size);
+        while (position < stop) {
+            std::size_t start = data.size();
+            data.resize(start + static_cast<size_t>(stop - position));
+            ssize_t got = pread(fd, data.data() + start, static_cast<size_t>(stop - position),
+                                position - chunk->offset);
+            if (got <= 0) {
+                int saved = errno;
+                close(fd);
+                errno = got == 0 ? EIO : saved;
+                throw_errno("pread " + path.string());
+            }
+            data.resize(start + static_cast<size_t>(got));
+            position += got;
+        }
+        close(fd);
+    }
+    return data;
+}
+
+void LazyMount::record(std::uint64_t node) {
+    if (!m_tracing) {
+        return;
+    }
+    std::lock_guard lock{m_trace_mutex};
+    if (std::chrono::steady_clock::now() - m_mounted > m_options.trace_window) {
+        return;
+    }
+    if (m_traced.insert(node).second) {
+        m_trace.push_back(m_nodes[node].path);
+    }
+}
+
+void LazyMount::save_trace() {
+    std::lock_guard lock{m_trace_mutex};
+    if (!m_tracing || m_trace.empty()) {
+        return;
+    }
+    const std::string& digest = m_layer.digest();
+    std::filesystem::path path = m_options.traces / digest.substr(digest.find(':') + 1);
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    std::error_code error;
+    std::filesystem::create_directories(m_options.traces, error);
+    {
+        std::ofstream file{temporary, std::ios::trunc};
+        for (const std::string& file_path : m_trace) {
+            file << file_path << '\n';
+        }
+        if (!file) {
+            return;
+        }
+    }
+    std::filesystem::rename(temporary, path, error);
+}
+
+void LazyMount::run_prefetch(std::stop_token stop) {
+    const Toc& toc = m_layer.toc();
+    std::vector<const TocChunk*> chunks;
+    auto add = [&chunks] (const TocEntry& entry) {
+        for (const TocChunk& chunk : entry.chunks) {
+            chunks.push_back(&chunk);
+        }
+    };
+
+    const std::string& digest = m_layer.digest();
+    std::ifstream trace;
+    if (!m_options.traces.empty()) {
+        trace.open(m_options.traces / digest.substr(digest.find(':') + 1));
+    }
+    if (trace) {
+        for (std::string path; std::getline(trace, path);) {
+            auto node = m_by_path.find(path);
+            if (node != m_by_path.end() && m_nodes[node->second].entry != nullptr) {
+                add(*m_nodes[node->second].entry);
+            }
+        }
+    } else {
+        for (std::size_t i = 0; i < toc.prefetch; i++) {
+            add(toc.entries[i]);
+        }
+    }
+
+    try {
+        m_layer.prefetch(std::move(chunks), m_options.prefetch_request, stop);
+    } catch (const std::exception&) {
+        // Reads fetch whatever is still missing themselves.
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "blobs.h"
+#include "estargz.h"
+#include "http.h"
+#include "registry.h"
+#include "token.h"
+
+// An eStargz layer read from the registry as needed. Opening it fetches
+// only its footer and TOC. File content comes a chunk at a time with range
+// requests, is checked against the chunk's digest and kept in a chunk
+// store, which layers share since chunks are keyed by digest.
+class LazyLayer {
+public:
+    // url is the layer's blob URL, and scope the token scope that may pull
+    // it. Throws EstargzError when the layer is not eStargz.
+    LazyLayer(CurlPool& pool, TokenCache& tokens, const BlobStore& chunks, std::string url, std::string scope,
+              const Descriptor& layer);
+
+    LazyLayer(const LazyLayer&) = delete;
+    LazyLayer& operator=(const LazyLayer&) = delete;
+
+    const std::string& digest() const { return m_digest; }
+    const Toc& toc() const { return m_toc; }
+
+    // Returns where the chunk is stored, fetching it first when it is not.
+    // Safe to call from several threads, which share a single fetch when
+    // they ask for the same chunk at once.
+    std::filesystem::path chunk(const TocChunk& chunk);
+
+    // Fetches the chunks not yet stored. Chunks next to each other in the
+    // layer are fetched together, in requests of up to max_request bytes.
+    void prefetch(std::vector<const TocChunk*> chunks, std::int64_t max_request, std::stop_token stop = {});
+
+private:
+    std::string fetch(curl_off_t first, curl_off_t last);
+    void store(const TocChunk& chunk, std::string_view compressed);
+
+    CurlPool& m_pool;
+    TokenCache& m_tokens;
+    const BlobStore& m_chunks;
+    std::string m_url;
+    std::string m_scope;
+    std::string m_digest;
+    Toc m_toc;
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::shared_future<void>> m_pending;
+};
+
+struct LazyMountOptions {
+    // Where startup traces are kept, in a file per layer named after its
+    // digest. Left empty, the landmark files of the layer are prefetched
+    // instead, and nothing is traced.
+    std::filesystem::path traces;
+    // Files opened this soon after mounting make up the startup trace of a
+    // layer that has none yet.
+    std::chrono::seconds trace_window{30};
+    std::int64_t prefetch_request = 8 * 1024 * 1024;
+    // Threads answering the kernel, each of which may wait on a fetch.
+    std::size_t threads = 4;
+};
+
+// Serves a LazyLayer read-only at a mount point through FUSE, speaking the
+// kernel protocol on /dev/fuse directly. Mounting takes CAP_SYS_ADMIN. The
+// files of the layer's startup trace, or failing that those the builder
+// placed before its prefetch landmark, are fetched in the background right
+// away; anything else is fetched when first read. Whiteouts appear as
+// overlayfs reads them, as with Whiteouts::overlay, so the mount can be a
+// lower layer of a Snapshotter.
+class LazyMount {
+public:
+    // mountpoint must be an existing directory. Throws std::system_error
+    // when mounting fails.
+    LazyMount(LazyLayer& layer, std::filesystem::path mountpoint, LazyMountOptions options = {});
+    // Unmounts, and saves the startup trace recorded meanwhile.
+    ~LazyMount();
+
+    LazyMount(const LazyMount&) = delete;
+    LazyMount& operator=(const LazyMount&) = delete;
+
+private:
+    // One inode per entry, plus directories the TOC only implies. Hard
+    // links share the inode of their target.
+    struct Node {
+        const TocEntry* entry = nullptr;
+        std::string path;
+        std::uint32_t links = 1;
+        // Set on a directory that hides those below it when stacked.
+        bool opaque = false;
+        // Sorted by name.
+        std::vector<std::pair<std::string, std::uint64_t>> children;
+    };
+
+    void build_tree();
+    // Stops the threads and takes the mount down.
+    void unmount();
+    std::uint64_t make_directory(const std::string& path);
+    void serve(std::stop_token stop);
+    void handle(const char* request, std::size_t length);
+    void reply(std::uint64_t unique, int error, const void* data = nullptr, std::size_t size = 0);
+    std::string read(const Node& node, std::uint64_t offset, std::uint32_t size);
+    void record(std::uint64_t node);
+    void save_trace();
+    void run_prefetch(std::stop_token stop);
+
+    LazyLayer& m_layer;
+    std::filesystem::path m_mountpoint;
+    LazyMountOptions m_options;
+    // Indexed by inode number, which starts at FUSE_ROOT_ID.
+    std::vector<Node> m_nodes;
+    std::unordered_map<std::string, std::uint64_t> m_by_path;
+    int m_fd = -1;
+    int m_stop_fd = -1;
+    bool m_tracing = false;
+    std::chrono::steady_clock::time_point m_mounted;
+    std::mutex m_trace_mutex;
+    std::unordered_set<std::uint64_t> m_traced;
+    std::vector<std::string> m_trace;
+    // Last, so that they stop before the members they use go away.
+    std::jthread m_prefetcher;
+    std::vector<std::jthread> m_workers;
+};
@@ -1,12 +1,235 @@
+#include <charconv>
+#include <chrono>
+#include <csignal>
 #include <iostream>
+#include <memory>
+#include <optional>
 
+#include <sys/wait.h>
+
+#include "blobs.h"
 #include "http.h"
+#include "lazy.h"
+#include "metrics.h"
+#include "pull.h"
+#include "sandbox.h"
+#include "snapshot.h"
+#include "token.h"
 
-constexpr char* IMAGE_NAME = "nginx";
+constexpr std::string_view IMAGE_NAME = "nginx";
+constexpr std::string_view IMAGE_TAG = "latest";
+constexpr std::string_view BLOB_DIR = "blobs";
+constexpr std::string_view SNAPSHOT_DIR = "snapshots";
+constexpr std::string_view TOKEN_CACHE = ".tokens";
+// Containers get their root filesystems here, stacked from the layers.
+constexpr std::string_view CONTAINER_DIR = "containers";
+// With --lazy, eStargz layers are mounted here instead of pulled, with the
+// chunks read so far and the startup traces kept alongside.
+constexpr std::string_view LAZY_DIR = "lazy";
+constexpr std::string_view CHUNK_DIR = "chunks";
+constexpr std::string_view TRACE_DIR = "traces";
+// With a command to run, each job gets a container of its own, started in
+// one of WARM_SANDBOXES sandboxes kept ready under CGROUP_DIR.
+constexpr std::string_view CGROUP_DIR = "/sys/fs/cgroup/my_containerd";
+constexpr std::string_view SANDBOX_DIR = "sandboxes";
+constexpr std::size_t WARM_SANDBOXES = 4;
+// Layers this large are fetched as SPLIT_PARTS ranges at once.
+constexpr std::int64_t SPLIT_THRESHOLD = 64 * 1024 * 1024;
+constexpr std::size_t SPLIT_PARTS = 4;
 
 int main(int argc, char** argv) {
-    Curl curl;
-    std::string token = curl.get("https://auth.docker.io/token?service=registry.docker.io&scope=repository:library/nginx:pull");
+    bool lazy = false;
+    std::size_t warm = WARM_SANDBOXES;
+    std::size_t jobs = 1;
+    std::filesystem::path metrics_file;
+    std::vector<std::string> command;
+    auto count = [] (std::string_view text, std::size_t& out) {
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), out);
+        return error == std::errc{} && end == text.data() + text.size();
+    };
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        bool valid = true;
+        if (arg == "--lazy") {
+            lazy = true;
+        } else if (arg.starts_with("--pool=")) {
+            valid = count(arg.substr(7), warm);
+        } else if (arg.starts_with("--jobs=")) {
+            valid = count(arg.substr(7), jobs);
+        } else if (arg.starts_with("--metrics=")) {
+            metrics_file = arg.substr(10);
+        } else if (arg == "--log-requests") {
+            Metrics::global().log_requests(&std::clog);
+        } else if (arg == "--") {
+            command.assign(argv + i + 1, argv + argc);
+            break;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            std::cerr << "usage: " << argv[0] << " [--lazy] [--pool=N] [--jobs=N] [--metrics=FILE] [--log-requests]"
+                      << " [-- command...]" << std::endl;
+            return 2;
+        }
+    }
+    // Blocked before any thread starts, so that every thread inherits the
+    // mask and only sigwait() below sees them.
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    if (lazy) {
+        pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+    }
+
+    // Written however the run ends, so that a failed pull still shows where
+    // its time went.
+    struct MetricsWriter {
+        const std::filesystem::path& path;
+        ~MetricsWriter() {
+            if (path.empty()) {
+                return;
+            }
+            try {
+                Metrics::global().write_prometheus(path);
+            } catch (const std::exception& error) {
+                std::cerr << error.what() << std::endl;
+            }
+        }
+    } metrics_writer{metrics_file};
+
+    CurlPool pool;
+
+    try {
+        TokenCache tokens{pool, TOKEN_CACHE, discover_auth(pool, REGISTRY_URL)};
+        BlobStore store{BLOB_DIR};
+        // Made first, so that the sandboxes get ready while the image pulls.
+        std::optional<SandboxPool> sandboxes;
+        if (!command.empty()) {
+            sandboxes.emplace(SandboxOptions{.cgroup = CGROUP_DIR, .state = SANDBOX_DIR, .size = warm});
+        }
+
+        auto last_report = std::chrono::steady_clock::now();
+        PullOptions options;
+        options.snapshots = SNAPSHOT_DIR;
+        options.split_threshold = SPLIT_THRESHOLD;
+        options.split_parts = SPLIT_PARTS;
+        options.progress = [&] (curl_off_t received, curl_off_t expected) {
+            auto time = std::chrono::steady_clock::now();
+            if (time - last_report < std::chrono::milliseconds{500}) {
+                return;
+            }
+            last_report = time;
+            std::cerr << "  " << received / 1024 << " / " << expected / 1024 << " KiB" << std::endl;
+        };
+
+        Manifest manifest = resolve_manifest(pool, tokens, IMAGE_NAME, IMAGE_TAG, options);
+
+        // Mounts go before the layers they serve.
+        BlobStore chunks{CHUNK_DIR};
+        std::vector<std::unique_ptr<LazyLayer>> layers;
+        std::vector<std::unique_ptr<LazyMount>> mounts;
+        if (lazy) {
+            std::string repository = repository_name(IMAGE_NAME);
+            for (const Descriptor& layer : manifest.layers) {
+                std::cout << layer.digest << ": ";
+                try {
+                    auto lazy_layer = std::make_unique<LazyLayer>(pool, tokens, chunks,
+                                                                  blob_url(repository, layer.digest),
+                                                                  pull_scope(repository), layer);
+                    std::filesystem::path mountpoint = std::filesystem::path{LAZY_DIR} /
+                        layer.digest.substr(layer.digest.find(':') + 1);
+                    std::filesystem::create_directories(mountpoint);
+                    mounts.push_back(std::make_unique<LazyMount>(*lazy_layer, mountpoint,
+                                                                 LazyMountOptions{.traces = TRACE_DIR}));
+                    layers.push_back(std::move(lazy_layer));
+                    options.skip.insert(layer.digest);
+                    std::cout << "mounted at " << mountpoint.string() << std::endl;
+                } catch (const EstargzError& error) {
+                    std::cout << error.what() << ", pulling it instead" << std::endl;
+                } catch (const std::system_error& error) {
+                    std::cout << error.what() << ", pulling it instead" << std::endl;
+                }
+            }
+        }
+
+        PullResult result = pull_manifest(pool, tokens, store, IMAGE_NAME, std::move(manifest), options);
+
+        int failed = 0;
+        for (const PulledBlob& blob : result.blobs) {
+            std::cout << blob.digest << ": ";
+            try {
+                if (blob.error) {
+                    std::rethrow_exception(blob.error);
+                }
+                if (blob.fetched) {
+                    std::cout << blob.received << " bytes" << std::endl;
+                } else {
+                    std::cout << "already stored" << std::endl;
+                }
+            } catch (const CurlErrorBase& error) {
+                std::cout << error << std::endl;
+                failed++;
+            } catch (const std::exception& error) {
+                std::cout << error.what() << std::endl;
+                failed++;
+            }
+        }
+
+        if (failed > 0) {
+            return 1;
+        }
+
+        // Lazily mounted layers take the place of their snapshots.
+        std::vector<std::filesystem::path> lower;
+        for (const Descriptor& layer : result.manifest.layers) {
+            std::string_view directory = options.skip.contains(layer.digest) ? LAZY_DIR : SNAPSHOT_DIR;
+            lower.push_back(std::filesystem::path{directory} / layer.digest.substr(layer.digest.find(':') + 1));
+        }
+        Snapshotter snapshotter{CONTAINER_DIR};
+        if (command.empty()) {
+            snapshotter.remove(IMAGE_NAME);
+            std::filesystem::path rootfs = snapshotter.prepare(IMAGE_NAME, lower);
+            std::cout << "root filesystem at " << rootfs.string()
+                      << (snapshotter.method() == SnapshotMethod::overlay ? " (overlay)" : " (copy)") << std::endl;
+
+            if (!mounts.empty()) {
+                std::cout << "serving " << mounts.size() << " lazy layers until interrupted" << std::endl;
+                int signal = 0;
+                sigwait(&stop_signals, &signal);
+                // Its lower layers are about to go away.
+                snapshotter.remove(IMAGE_NAME);
+            }
+            return 0;
+        }
 
-    return 0;
-}
\ No newline at end of file
+        for (std::size_t job = 0; job < jobs; job++) {
+            std::string id = std::string{IMAGE_NAME} + "-" + std::to_string(job);
+            snapshotter.remove(id);
+            ContainerSpec spec;
+            spec.rootfs = snapshotter.prepare(id, lower);
+            spec.args = command;
+            spec.env = {"PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin"};
+            spec.hostname = id;
+            auto started = std::chrono::steady_clock::now();
+            Container container = sandboxes->start(spec);
+            auto start_time = std::chrono::steady_clock::now() - started;
+            int status = container.wait();
+            std::cout << id << ": started in "
+                      << std::chrono::duration_cast<std::chrono::microseconds>(start_time).count() << " us, ";
+            if (WIFEXITED(status)) {
+                std::cout << "exited with " << WEXITSTATUS(status) << std::endl;
+            } else {
+                std::cout << "killed by signal " << WTERMSIG(status) << std::endl;
+            }
+            snapshotter.remove(id);
+        }
+        return 0;
+    } catch (const CurlErrorBase& error) {
+        std::cerr << error << std::endl;
+        return 1;
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+}
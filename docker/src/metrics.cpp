@@ -0,0 +1,173 @@
+#include "metrics.h"
+
+#include <cerrno>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <system_error>
+
+namespace {
+
+constexpr std::array<Stage, STAGE_COUNT> STAGES = {
+    Stage::download, Stage::verify, Stage::decompress, Stage::extract, Stage::snapshot,
+};
+
+template <typename Rep, typename Period>
+double seconds(std::chrono::duration<Rep, Period> duration) {
+    return std::chrono::duration<double>{duration}.count();
+}
+
+// Byte counts go out whole, which a double would round past 2^53 or, at
+// the stream's default precision, well before.
+template <typename T>
+void counter(std::ostream& out, std::string_view name, std::string_view help, T value) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " counter\n"
+        << name << " " << value << "\n";
+}
+
+} // namespace
+
+std::string_view stage_name(Stage stage) {
+    switch (stage) {
+    case Stage::download:
+        return "download";
+    case Stage::verify:
+        return "verify";
+    case Stage::decompress:
+        return "decompress";
+    case Stage::extract:
+        return "extract";
+    case Stage::snapshot:
+        return "snapshot";
+    }
+    return "unknown";
+}
+
+MetricsTotals MetricsTotals::operator-(const MetricsTotals& earlier) const {
+    MetricsTotals difference;
+    difference.requests = requests - earlier.requests;
+    difference.reused = reused - earlier.reused;
+    difference.received = received - earlier.received;
+    difference.dns = dns - earlier.dns;
+    difference.connect = connect - earlier.connect;
+    difference.tls = tls - earlier.tls;
+    difference.ttfb = ttfb - earlier.ttfb;
+    difference.total = total - earlier.total;
+    for (std::size_t i = 0; i < STAGE_COUNT; i++) {
+        difference.stages[i].elapsed = stages[i].elapsed - earlier.stages[i].elapsed;
+        difference.stages[i].bytes = stages[i].bytes - earlier.stages[i].bytes;
+        difference.stages[i].items = stages[i].items - earlier.stages[i].items;
+    }
+    return difference;
+}
+
+Metrics& Metrics::global() {
+    static Metrics metrics;
+    return metrics;
+}
+
+void Metrics::record(const RequestTimings& timings, long status, std::string_view url) {
+    auto add = [] (Counter& counter, std::uint64_t value) { counter.fetch_add(value, std::memory_order_relaxed); };
+    add(m_requests, 1);
+    add(m_reused, timings.reused ? 1 : 0);
+    add(m_received, static_cast<std::uint64_t>(timings.received));
+    add(m_dns, static_cast<std::uint64_t>(timings.dns.count()));
+    add(m_connect, static_cast<std::uint64_t>(timings.connect.count()));
+    add(m_tls, static_cast<std::uint64_t>(timings.tls.count()));
+    add(m_ttfb, static_cast<std::uint64_t>(timings.ttfb.count()));
+    add(m_total, static_cast<std::uint64_t>(timings.total.count()));
+
+    std::ostream* log = m_log.load();
+    if (log == nullptr) {
+        return;
+    }
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(6) << "request url=\"" << url << "\" status=" << status
+         << " dns=" << seconds(timings.dns) << " connect=" << seconds(timings.connect)
+         << " tls=" << seconds(timings.tls) << " ttfb=" << seconds(timings.ttfb)
+         << " total=" << seconds(timings.total) << " bytes=" << timings.received
+         << " reused=" << (timings.reused ? "true" : "false") << "\n";
+    std::lock_guard lock{m_log_mutex};
+    *log << line.str() << std::flush;
+}
+
+void Metrics::add(Stage stage, std::chrono::nanoseconds elapsed, std::uint64_t bytes, std::uint64_t items) {
+    StageCounters& counters = m_stages[static_cast<std::size_t>(stage)];
+    counters.nanoseconds.fetch_add(static_cast<std::uint64_t>(elapsed.count()), std::memory_order_relaxed);
+    counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    counters.items.fetch_add(items, std::memory_order_relaxed);
+}
+
+MetricsTotals Metrics::totals() const {
+    auto get = [] (const Counter& counter) { return counter.load(std::memory_order_relaxed); };
+    MetricsTotals totals;
+    totals.requests = get(m_requests);
+    totals.reused = get(m_reused);
+    totals.received = get(m_received);
+    totals.dns = std::chrono::microseconds{get(m_dns)};
+    totals.connect = std::chrono::microseconds{get(m_connect)};
+    totals.tls = std::chrono::microseconds{get(m_tls)};
+    totals.ttfb = std::chrono::microseconds{get(m_ttfb)};
+    totals.total = std::chrono::microseconds{get(m_total)};
+    for (std::size_t i = 0; i < STAGE_COUNT; i++) {
+        totals.stages[i].elapsed = std::chrono::nanoseconds{get(m_stages[i].nanoseconds)};
+        totals.stages[i].bytes = get(m_stages[i].bytes);
+        totals.stages[i].items = get(m_stages[i].items);
+    }
+    return totals;
+}
+
+void Metrics::write_prometheus(std::ostream& out) const {
+    MetricsTotals now = totals();
+    // Microseconds of a long run still show.
+    out.precision(12);
+    counter(out, "my_containerd_http_requests_total", "HTTP requests completed.", now.requests);
+    counter(out, "my_containerd_http_reused_connections_total", "HTTP requests sent on a connection already open.",
+            now.reused);
+    counter(out, "my_containerd_http_received_bytes_total", "Response body bytes received.", now.received);
+    counter(out, "my_containerd_http_dns_seconds_total", "Time spent resolving host names.", seconds(now.dns));
+    counter(out, "my_containerd_http_connect_seconds_total", "Time spent in TCP handshakes.", seconds(now.connect));
+    counter(out, "my_containerd_http_tls_seconds_total", "Time spent in TLS handshakes.", seconds(now.tls));
+    counter(out, "my_containerd_http_ttfb_seconds_total", "Time from the start of requests to their first byte.",
+            seconds(now.ttfb));
+    counter(out, "my_containerd_http_request_seconds_total", "Time from the start of requests to their end.",
+            seconds(now.total));
+
+    auto stages = [&] (std::string_view name, std::string_view help, auto value) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " counter\n";
+        for (Stage stage : STAGES) {
+            out << name << "{stage=\"" << stage_name(stage) << "\"} "
+                << value(now.stages[static_cast<std::size_t>(stage)]) << "\n";
+        }
+    };
+    stages("my_containerd_stage_seconds_total", "Time spent in each stage of a pull.",
+           [] (const StageTotals& totals) { return seconds(totals.elapsed); });
+    stages("my_containerd_stage_bytes_total", "Bytes that went through each stage of a pull.",
+           [] (const StageTotals& totals) { return totals.bytes; });
+    stages("my_containerd_stage_items_total", "Blobs, layers or snapshots that made it through each stage.",
+           [] (const StageTotals& totals) { return totals.items; });
+}
+
+void Metrics::write_prometheus(const std::filesystem::path& path) const {
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream out{temporary};
+        write_prometheus(out);
+        out.close();
+        if (!out) {
+            throw std::system_error(errno, std::generic_category(), "write " + temporary.string());
+        }
+    }
+    std::filesystem::rename(temporary, path);
+}
+
+void StageTimer::stop(std::uint64_t bytes, std::uint64_t items) {
+    if (m_stopped) {
+        return;
+    }
+    m_stopped = true;
+    Metrics::global().add(m_stage, std::chrono::steady_clock::now() - m_started, bytes, items);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+#include <string_view>
+
+#include "pch.h"
+
+// What libcurl measured of one request, from CURLINFO_*. Each phase is its
+// own share of the request rather than the time since it started, so dns,
+// connect and tls are 0 on a reused connection, and tls on plain HTTP.
+struct RequestTimings {
+    std::chrono::microseconds dns{};
+    std::chrono::microseconds connect{};
+    std::chrono::microseconds tls{};
+    // From the start of the request to its first response byte.
+    std::chrono::microseconds ttfb{};
+    std::chrono::microseconds total{};
+    // Of the body, as it came over the wire.
+    std::int64_t received = 0;
+    bool reused = false;
+};
+
+// The steps a layer goes through on its way to a container.
+enum class Stage {
+    download,
+    verify,
+    decompress,
+    extract,
+    snapshot,
+};
+
+constexpr std::size_t STAGE_COUNT = 5;
+
+std::string_view stage_name(Stage stage);
+
+struct StageTotals {
+    std::chrono::nanoseconds elapsed{};
+    std::uint64_t bytes = 0;
+    // Blobs, layers or snapshots that made it through the stage.
+    std::uint64_t items = 0;
+};
+
+struct MetricsTotals {
+    std::uint64_t requests = 0;
+    std::uint64_t reused = 0;
+    std::uint64_t received = 0;
+    std::chrono::microseconds dns{};
+    std::chrono::microseconds connect{};
+    std::chrono::microseconds tls{};
+    std::chrono::microseconds ttfb{};
+    std::chrono::microseconds total{};
+    std::array<StageTotals, STAGE_COUNT> stages{};
+
+    // What was counted between two snapshots.
+    MetricsTotals operator-(const MetricsTotals& earlier) const;
+};
+
+// Counters of every request Curl makes and every stage of a pull, kept for
+// the whole process. Updates are a few relaxed atomic adds, so they are
+// safe and cheap from any thread.
+class Metrics {
+public:
+    static Metrics& global();
+
+    // Called by Curl once a request has completed.
+    void record(const RequestTimings& timings, long status, std::string_view url);
+    void add(Stage stage, std::chrono::nanoseconds elapsed, std::uint64_t bytes, std::uint64_t items = 0);
+
+    MetricsTotals totals() const;
+
+    // Writes a line per request, in logfmt, to log, or to nowhere when it
+    // is null. log must outlive its use.
+    void log_requests(std::ostream* log) { m_log.store(log); }
+
+    // In the Prometheus text format.
+    void write_prometheus(std::ostream& out) const;
+    // Replaces path as a whole, so that a scraper reading it, such as
+    // node_exporter's textfile collector, never sees half of it. Throws
+    // std::system_error.
+    void write_prometheus(const std::filesystem::path& path) const;
+
+private:
+    using Counter = std::atomic<std::uint64_t>;
+
+    struct StageCounters {
+        Counter nanoseconds{0};
+        Counter bytes{0};
+        Counter items{0};
+    };
+
+    Counter m_requests{0};
+    Counter m_reused{0};
+    Counter m_received{0};
+    Counter m_dns{0};
+    Counter m_connect{0};
+    Counter m_tls{0};
+    Counter m_ttfb{0};
+    Counter m_total{0};
+    std::array<StageCounters, STAGE_COUNT> m_stages;
+    std::atomic<std::ostream*> m_log{nullptr};
+    std::mutex m_log_mutex;
+};
+
+// Times one stretch of work in a stage, from construction to stop(), and
+// adds it to Metrics::global(). Stopped on destruction when stop() was not
+// called, with no bytes.
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage)
+        : m_stage{stage},
+          m_started{std::chrono::steady_clock::now()}
+    {}
+    ~StageTimer() { stop(0); }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    void stop(std::uint64_t bytes, std::uint64_t items = 0);
+
+private:
+    Stage m_stage;
+    std::chrono::steady_clock::time_point m_started;
+    bool m_stopped = false;
+};
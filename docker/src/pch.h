@@ -2,5 +2,5 @@
 
 #include <string>
 #include <iostream>
-#include <unordered>
+#include <unordered_map>
 #include <mutex>
\ No newline at end of file
@@ -0,0 +1,21 @@
+#include "posix.h"
+
+#include <cerrno>
+#include <system_error>
+
+void throw_errno(const std::string& what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+void write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_errno("write");
+        }
+        data.remove_prefix(static_cast<std::size_t>(written));
+    }
+}
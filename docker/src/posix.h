@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include <unistd.h>
+
+#include "pch.h"
+
+// Throws std::system_error for errno, which the failed call just set.
+[[noreturn]] void throw_errno(const std::string& what);
+
+// Owns a file descriptor, closing it when destroyed. A negative one, as a
+// failed open returns, is not closed.
+class Fd {
+public:
+    explicit Fd(int fd) : m_fd{fd} {}
+    ~Fd() {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    Fd(const Fd&) = delete;
+    Fd& operator=(const Fd&) = delete;
+
+    int get() const { return m_fd; }
+
+private:
+    int m_fd;
+};
+
+// Writes all of data, however many calls it takes. Throws std::system_error.
+void write_all(int fd, std::string_view data);
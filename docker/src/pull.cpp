@@ -0,0 +1,476 @@
+#include "pull.h"
+
+#include <algorithm>
+#include <charconv>
+#include <ctime>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <unordered_set>
+
+#include "layer.h"
+
+namespace {
+
+// Looked up for every ManifestCheck, which would otherwise build the key
+// each time.
+const std::string DIGEST_HEADER = "docker-content-digest";
+
+// A failure worth another request: the network or the registry may come
+// back, while a blob that does not match or unpack never will.
+bool is_transient(const std::exception_ptr& error) {
+    try {
+        std::rethrow_exception(error);
+    } catch (const CurlError&) {
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+bool is_transient(long status) {
+    // 401 once the registry no longer takes the token, which is dropped
+    // from the cache before the next attempt.
+    return status == 401 || status == 408 || status == 429 || status >= 500;
+}
+
+// How long a 429 or 503 asks clients to wait, in seconds or as an HTTP
+// date.
+std::optional<std::chrono::milliseconds> retry_after(const HttpHead& response) {
+    auto header = response.headers.find("retry-after");
+    if (header == response.headers.end()) {
+        return std::nullopt;
+    }
+    const std::string& value = header->second;
+    long long seconds = 0;
+    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), seconds);
+    if (error == std::errc{} && end == value.data() + value.size()) {
+        return std::chrono::seconds{std::max(seconds, 0LL)};
+    }
+    time_t date = curl_getdate(value.c_str(), nullptr);
+    if (date < 0) {
+        return std::nullopt;
+    }
+    return std::chrono::seconds{std::max<long long>(date - std::time(nullptr), 0)};
+}
+
+// The wait before attempt + 1: what the registry asked for, or else
+// options.retry_delay doubled with every attempt, and never more than
+// options.max_retry_delay.
+std::chrono::milliseconds retry_delay(const PullOptions& options, int attempt,
+                                      std::optional<std::chrono::milliseconds> asked) {
+    if (asked) {
+        return std::min(*asked, options.max_retry_delay);
+    }
+    std::chrono::milliseconds delay = options.retry_delay;
+    for (int i = 0; i < attempt && delay < options.max_retry_delay; i++) {
+        delay *= 2;
+    }
+    return std::min(delay, options.max_retry_delay);
+}
+
+// Retries what failed for the network or a transient status, as the blobs
+// of a pull are.
+HttpResponse get_manifest(CurlPool& pool, TokenCache& tokens, const std::string& scope, const std::string& url,
+                          const PullOptions& options) {
+    for (int attempt = 0; ; attempt++) {
+        bool last = attempt + 1 >= options.attempts;
+        std::string token = tokens.get(scope);
+        HeaderMap headers{
+            {"Authorization", "Bearer " + token},
+            {"Accept", std::string{MANIFEST_ACCEPT}},
+        };
+        std::optional<std::chrono::milliseconds> asked;
+        try {
+            HttpResponse response = pool.get(url, headers);
+            if (response.status == 200) {
+                return response;
+            }
+            if (last || !is_transient(response.status)) {
+                throw RegistryError("manifest request failed: HTTP " + std::to_string(response.status));
+            }
+            if (response.status == 401) {
+                tokens.invalidate(scope, token);
+            }
+            asked = retry_after(response);
+        } catch (const CurlError&) {
+            if (last) {
+                throw;
+            }
+        }
+        std::this_thread::sleep_for(retry_delay(options, attempt, asked));
+    }
+}
+
+Manifest fetch_manifest(CurlPool& pool, TokenCache& tokens, const std::string& scope, const std::string& url,
+                        const PullOptions& options) {
+    return parse_manifest(get_manifest(pool, tokens, scope, url, options).body);
+}
+
+std::filesystem::path snapshot_path(const std::filesystem::path& snapshots, std::string_view digest) {
+    return snapshots / digest.substr(digest.find(':') + 1);
+}
+
+// Layers unpack next to their snapshot and are renamed into place once
+// complete, so that a snapshot that exists is always whole.
+std::unique_ptr<LayerUnpacker> start_unpack(const std::filesystem::path& snapshots, const Descriptor& layer) {
+    std::filesystem::path partial = snapshot_path(snapshots, layer.digest);
+    partial += ".partial";
+    std::filesystem::remove_all(partial);
+    std::filesystem::create_directories(partial);
+    return std::make_unique<LayerUnpacker>(partial, layer_compression(layer.media_type), Whiteouts::overlay);
+}
+
+void finish_unpack(const std::filesystem::path& snapshots, LayerUnpacker& unpacker, std::string_view digest) {
+    std::filesystem::path snapshot = snapshot_path(snapshots, digest);
+    std::filesystem::path partial = snapshot;
+    partial += ".partial";
+    unpacker.finish();
+    std::filesystem::rename(partial, snapshot);
+}
+
+// One range of a split blob, with the bytes from position through last
+// still to come.
+struct Range {
+    curl_off_t position;
+    curl_off_t last;
+};
+
+struct Request {
+    std::size_t index;
+    std::size_t range;
+    bool ranged;
+};
+
+struct Fetch {
+    const Descriptor* blob;
+    PulledBlob* result;
+    BlobStore::Writer writer;
+    // Null unless the layer is to be unpacked.
+    std::unique_ptr<LayerUnpacker> unpacker;
+    // Empty unless the blob is fetched split. The first range streams
+    // through the writer like a whole blob would, and its position is the
+    // writer's offset. The others are written out of order and absorbed
+    // once all of them are in.
+    std::vector<Range> ranges = {};
+    // Set once the registry answered a range with the whole blob.
+    bool no_ranges = false;
+    // What went out this round.
+    std::vector<Request> requests = {};
+    bool done = false;
+    std::exception_ptr error = nullptr;
+};
+
+void sink_to_unpacker(Fetch& fetch, std::string_view chunk) {
+    if (fetch.unpacker) {
+        fetch.unpacker->write(chunk);
+    }
+}
+
+// What has been fetched so far is of no use anymore. When the blob cannot
+// even start over, it is done, with the reason as its error.
+void start_over(Fetch& fetch, const std::filesystem::path& snapshots) {
+    try {
+        fetch.writer.restart();
+        fetch.ranges.clear();
+        if (fetch.unpacker) {
+            // Stopped before start_unpack() clears its directory.
+            fetch.unpacker.reset();
+            fetch.unpacker = start_unpack(snapshots, *fetch.blob);
+        }
+    } catch (...) {
+        fetch.error = std::current_exception();
+        fetch.done = true;
+    }
+}
+
+void complete(Fetch& fetch, const std::filesystem::path& snapshots) {
+    fetch.done = true;
+    try {
+        if (!fetch.ranges.empty()) {
+            BodySink sink = [&fetch] (std::string_view chunk) { sink_to_unpacker(fetch, chunk); };
+            fetch.writer.absorb(fetch.blob->size, &sink);
+        }
+        fetch.writer.commit();
+        if (fetch.unpacker) {
+            finish_unpack(snapshots, *fetch.unpacker, fetch.blob->digest);
+        }
+    } catch (...) {
+        fetch.error = std::current_exception();
+    }
+}
+
+} // namespace
+
+Manifest resolve_manifest(CurlPool& pool, TokenCache& tokens, std::string_view image, std::string_view reference,
+                          const PullOptions& options)
+{
+    std::string repository = repository_name(image);
+    std::string scope = pull_scope(repository);
+    Manifest manifest = fetch_manifest(pool, tokens, scope, manifest_url(repository, reference, options.registry),
+                                       options);
+    if (manifest.is_index()) {
+        const Descriptor* platform = manifest.find_platform(options.os, options.architecture);
+        if (platform == nullptr) {
+            throw RegistryError("no " + options.os + "/" + options.architecture + " manifest");
+        }
+        manifest = fetch_manifest(pool, tokens, scope, manifest_url(repository, platform->digest, options.registry),
+                                  options);
+    }
+    return manifest;
+}
+
+ManifestCheck::ManifestCheck(CurlPool& pool, TokenCache& tokens, std::string_view image, std::string_view reference,
+                             const PullOptions& options)
+    : m_pool{pool},
+      m_tokens{tokens},
+      m_scope{pull_scope(repository_name(image))},
+      m_url{manifest_url(repository_name(image), reference, options.registry)}
+{}
+
+const std::string& ManifestCheck::digest() {
+    if (m_tokens.get(m_scope, m_token, m_token_generation) || !m_request) {
+        HeaderMap headers{
+            {"Authorization", "Bearer " + m_token},
+            {"Accept", std::string{MANIFEST_ACCEPT}},
+        };
+        m_request.emplace(m_url, headers, HttpRequest::Method::head);
+    }
+
+    m_pool.perform(*m_request, m_response);
+    if (m_response.status != 200) {
+        throw RegistryError("manifest request failed: HTTP " + std::to_string(m_response.status));
+    }
+    auto digest = m_response.headers.find(DIGEST_HEADER);
+    if (digest == m_response.headers.end()) {
+        throw RegistryError("manifest response has no Docker-Content-Digest");
+    }
+    return digest->second;
+}
+
+PullResult pull_image(CurlPool& pool, TokenCache& tokens, const BlobStore& store, std::string_view image,
+                      std::string_view reference, const PullOptions& options)
+{
+    return pull_manifest(pool, tokens, store, image, resolve_manifest(pool, tokens, image, reference, options),
+                         options);
+}
+
+PullResult pull_manifest(CurlPool& pool, TokenCache& tokens, const BlobStore& store, std::string_view image,
+                         Manifest resolved, const PullOptions& options)
+{
+    std::string repository = repository_name(image);
+    std::string scope = pull_scope(repository);
+
+    PullResult result;
+    result.manifest = std::move(resolved);
+    const Manifest& manifest = result.manifest;
+
+    std::vector<const Descriptor*> blobs;
+    std::unordered_set<std::string> seen;
+    auto add_blob = [&] (const Descriptor& blob) {
+        if (!options.skip.contains(blob.digest) && seen.insert(blob.digest).second) {
+            blobs.push_back(&blob);
+        }
+    };
+    add_blob(manifest.config);
+    for (const Descriptor& layer : manifest.layers) {
+        add_blob(layer);
+    }
+    result.blobs.reserve(blobs.size());
+
+    // Blobs already in the store, from this image or any other sharing
+    // them, are not fetched again. Layers are unpacked while they download,
+    // or from the store when only their snapshot is missing. Sinks point at
+    // fetches, which therefore must not move.
+    std::vector<Fetch> fetches;
+    fetches.reserve(blobs.size());
+    std::vector<const Descriptor*> stored;
+    curl_off_t expected = 0;
+    for (const Descriptor* blob : blobs) {
+        PulledBlob& pulled = result.blobs.emplace_back();
+        pulled.digest = blob->digest;
+        bool unpack = !options.snapshots.empty() && blob != &manifest.config &&
+            !std::filesystem::exists(snapshot_path(options.snapshots, blob->digest));
+        if (store.contains(blob->digest)) {
+            if (unpack) {
+                stored.push_back(blob);
+            }
+            continue;
+        }
+        // A blob that cannot be stored or unpacked fails alone, like one
+        // that cannot be fetched.
+        try {
+            fetches.push_back({blob, &pulled, store.begin(blob->digest, blob->size),
+                               unpack ? start_unpack(options.snapshots, *blob) : nullptr});
+        } catch (...) {
+            pulled.error = std::current_exception();
+            continue;
+        }
+        pulled.fetched = true;
+        Fetch& fetch = fetches.back();
+
+        // What an interrupted pull left behind is hashed and unpacked
+        // again, which costs a read from disk instead of the network.
+        if (fetch.writer.partial_size() > 0) {
+            try {
+                BodySink sink = [&fetch] (std::string_view chunk) { sink_to_unpacker(fetch, chunk); };
+                fetch.writer.absorb(fetch.writer.partial_size(), &sink);
+            } catch (const std::exception&) {
+                start_over(fetch, options.snapshots);
+            }
+        }
+        expected += blob->size - fetch.writer.offset();
+    }
+
+    curl_off_t received = 0;
+    std::string token;
+    // Set by the failures of a round, for the wait before the next.
+    bool unauthorized = false;
+    std::optional<std::chrono::milliseconds> asked;
+    for (int attempt = 0; attempt < options.attempts; attempt++) {
+        if (std::ranges::all_of(fetches, &Fetch::done)) {
+            break;
+        }
+        if (attempt > 0) {
+            if (unauthorized) {
+                tokens.invalidate(scope, token);
+            }
+            std::this_thread::sleep_for(retry_delay(options, attempt - 1, asked));
+            unauthorized = false;
+            asked.reset();
+        }
+        Downloader downloader{pool, options.download};
+        token = tokens.get(scope);
+        HeaderMap blob_headers{{"Authorization", "Bearer " + token}};
+        for (Fetch& fetch : fetches) {
+            if (fetch.done) {
+                continue;
+            }
+            std::int64_t size = fetch.blob->size;
+            if (fetch.ranges.empty() && fetch.writer.offset() == 0 && !fetch.no_ranges &&
+                options.split_threshold > 0 && options.split_parts > 1 && size >= options.split_threshold)
+            {
+                auto parts = static_cast<std::int64_t>(options.split_parts);
+                curl_off_t length = (size + parts - 1) / parts;
+                for (curl_off_t first = 0; first < size; first += length) {
+                    fetch.ranges.push_back({first, std::min(size, first + length) - 1});
+                }
+            }
+
+            auto add = [&] (std::size_t range, std::optional<ByteRange> bytes) {
+                std::size_t index = downloader.add({
+                    .url = blob_url(repository, fetch.blob->digest, options.registry),
+                    .headers = blob_headers,
+                    .sink = [&, range] (std::string_view chunk) {
+                        auto length = static_cast<curl_off_t>(chunk.size());
+                        if (range == 0) {
+                            if (!fetch.ranges.empty() && fetch.writer.offset() + length > fetch.ranges[0].last + 1) {
+                                throw RegistryError(fetch.blob->digest + ": range answered with too many bytes");
+                            }
+                            fetch.writer.write(chunk);
+                            sink_to_unpacker(fetch, chunk);
+                        } else {
+                            Range& bytes = fetch.ranges[range];
+                            if (bytes.position + length > bytes.last + 1) {
+                                throw RegistryError(fetch.blob->digest + ": range answered with too many bytes");
+                            }
+                            fetch.writer.write_at(bytes.position, chunk);
+                            bytes.position += length;
+                        }
+                        fetch.result->received += length;
+                        received += length;
+                        if (options.progress) {
+                            options.progress(received, expected);
+                        }
+                    },
+                    .range = bytes,
+                    // Only the first range feeds the unpacker, which must not
+                    // block the other transfers while it is behind.
+                    .ready = [&, range] (std::string_view chunk, std::function<void()> wake) {
+                        return range != 0 || !fetch.unpacker || fetch.unpacker->writable(chunk, std::move(wake));
+                    },
+                });
+                fetch.requests.push_back({index, range, bytes.has_value()});
+            };
+
+            if (fetch.ranges.empty()) {
+                if (fetch.writer.offset() < size) {
+                    curl_off_t offset = fetch.writer.offset();
+                    add(0, offset > 0 ? std::optional<ByteRange>{ByteRange{offset}} : std::nullopt);
+                }
+            } else {
+                for (std::size_t i = 0; i < fetch.ranges.size(); i++) {
+                    curl_off_t position = i == 0 ? fetch.writer.offset() : fetch.ranges[i].position;
+                    if (position <= fetch.ranges[i].last) {
+                        add(i, ByteRange{position, fetch.ranges[i].last});
+                    }
+                }
+            }
+        }
+
+        std::vector<DownloadResult> results = downloader.run();
+
+        for (Fetch& fetch : fetches) {
+            if (fetch.done) {
+                continue;
+            }
+            bool failed = false;
+            bool retry = true;
+            for (const Request& request : fetch.requests) {
+                const DownloadResult& download = results[request.index];
+                if (download.error) {
+                    fetch.error = download.error;
+                    failed = true;
+                    retry = retry && is_transient(download.error);
+                    continue;
+                }
+                long status = download.response.status;
+                if (request.ranged && status == 200) {
+                    // Resuming and splitting are out, so the blob starts
+                    // over in one piece.
+                    fetch.no_ranges = true;
+                    fetch.error = std::make_exception_ptr(RegistryError("registry ignores ranges"));
+                    failed = true;
+                    start_over(fetch, options.snapshots);
+                    break;
+                }
+                if (status != (request.ranged ? 206 : 200)) {
+                    fetch.error = std::make_exception_ptr(RegistryError("HTTP " + std::to_string(status)));
+                    failed = true;
+                    retry = retry && is_transient(status);
+                    unauthorized = unauthorized || status == 401;
+                    if (std::optional<std::chrono::milliseconds> wait = retry_after(download.response)) {
+                        asked = std::max(asked.value_or(*wait), *wait);
+                    }
+                }
+            }
+            fetch.requests.clear();
+            if (!failed) {
+                fetch.error = nullptr;
+                complete(fetch, options.snapshots);
+            } else if (!retry) {
+                fetch.done = true;
+            }
+        }
+    }
+
+    for (Fetch& fetch : fetches) {
+        fetch.result->error = fetch.error;
+    }
+
+    for (const Descriptor* layer : stored) {
+        PulledBlob& pulled = *std::ranges::find(result.blobs, layer->digest, &PulledBlob::digest);
+        try {
+            std::unique_ptr<LayerUnpacker> unpacker = start_unpack(options.snapshots, *layer);
+            std::ifstream blob{*store.find(layer->digest), std::ios::binary};
+            std::string chunk(LayerUnpacker::CHUNK_SIZE, '\0');
+            while (blob.read(chunk.data(), static_cast<std::streamsize>(chunk.size())) || blob.gcount() > 0) {
+                unpacker->write(std::string_view{chunk.data(), static_cast<size_t>(blob.gcount())});
+            }
+            finish_unpack(options.snapshots, *unpacker, layer->digest);
+        } catch (...) {
+            pulled.error = std::current_exception();
+        }
+    }
+    return result;
+}
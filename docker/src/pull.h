@@ -0,0 +1,105 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "blobs.h"
+#include "download.h"
+#include "registry.h"
+#include "token.h"
+
+struct PullOptions {
+    std::string registry = std::string{REGISTRY_URL};
+    std::string os = "linux";
+    std::string architecture = "amd64";
+    DownloadOptions download;
+    // Where layers are unpacked, into a directory per layer named after the
+    // hex of its digest, with whiteouts as overlayfs reads them so that a
+    // Snapshotter can stack them. Left empty, layers are only stored.
+    std::filesystem::path snapshots;
+    // Blobs of at least this size are fetched as split_parts ranges side by
+    // side, so that one large layer is not held to the bandwidth a single
+    // connection gets over a high-latency link. 0 fetches every blob in one
+    // request.
+    std::int64_t split_threshold = 0;
+    std::size_t split_parts = 4;
+    // How often a manifest or blob is requested before the pull gives up
+    // on it. Each retry of a blob resumes where the last one stopped.
+    int attempts = 3;
+    // The wait before the first retry, doubled before each one after. A
+    // Retry-After from the registry takes its place. Neither is ever
+    // longer than max_retry_delay.
+    std::chrono::milliseconds retry_delay{500};
+    std::chrono::milliseconds max_retry_delay{30000};
+    // Called with the bytes fetched so far, out of what was missing from
+    // the store when the pull started.
+    ProgressFn progress;
+    // Digests of layers to leave out, such as those mounted lazily.
+    std::unordered_set<std::string> skip;
+};
+
+struct PulledBlob {
+    std::string digest;
+    // Whether it came over the network, or was already in the store.
+    bool fetched = false;
+    // What it took over the network, which a resumed blob keeps below its
+    // size.
+    std::int64_t received = 0;
+    // Set when the blob could not be fetched, stored or unpacked.
+    std::exception_ptr error;
+};
+
+struct PullResult {
+    Manifest manifest;
+    // The config first, then the layers, each digest once.
+    std::vector<PulledBlob> blobs;
+};
+
+// Fetches the manifest of an image, such as "nginx" at reference "latest",
+// picking the one for the platform in options out of an index. Throws
+// RegistryError when there is none.
+Manifest resolve_manifest(CurlPool& pool, TokenCache& tokens, std::string_view image, std::string_view reference,
+                          const PullOptions& options = {});
+
+// Asks the registry which manifest a reference of an image points at, with
+// a HEAD that is built once and performed into the same response each
+// time, so that watching a tag for a push costs neither the registry a
+// manifest body nor the caller a heap allocation per check, until the
+// token is renewed.
+class ManifestCheck {
+public:
+    ManifestCheck(CurlPool& pool, TokenCache& tokens, std::string_view image, std::string_view reference,
+                  const PullOptions& options = {});
+
+    // Returns the digest of the manifest, which stays valid until the next
+    // call. Throws RegistryError when the registry does not say.
+    const std::string& digest();
+
+private:
+    CurlPool& m_pool;
+    TokenCache& m_tokens;
+    std::string m_scope;
+    std::string m_url;
+    // The request is built again only when the token is renewed.
+    std::string m_token;
+    std::uint64_t m_token_generation = 0;
+    std::optional<HttpRequest> m_request;
+    HttpResponse m_response;
+};
+
+// Pulls the blobs of an image manifest into store, and unpacks its layers
+// while they download when options.snapshots is set. Blobs already in the
+// store are not fetched again. A blob that fails is reported in the result
+// without stopping the others.
+PullResult pull_manifest(CurlPool& pool, TokenCache& tokens, const BlobStore& store, std::string_view image,
+                         Manifest manifest, const PullOptions& options = {});
+
+// resolve_manifest() and pull_manifest() in one.
+PullResult pull_image(CurlPool& pool, TokenCache& tokens, const BlobStore& store, std::string_view image,
+                      std::string_view reference, const PullOptions& options = {});
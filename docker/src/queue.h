@@ -0,0 +1,103 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <utility>
+
+#include "pch.h"
+
+// A blocking FIFO of at most capacity items, connecting the stages of a
+// pipeline so that a slow stage holds the faster ones back instead of
+// letting them buffer without bound.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(std::size_t capacity) : m_capacity{capacity} {}
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // Blocks while the queue is full. Returns false, dropping item, once the
+    // queue has been closed or cancelled.
+    bool push(T item) {
+        std::unique_lock lock{m_mutex};
+        m_not_full.wait(lock, [this] { return m_items.size() < m_capacity || m_closed; });
+        if (m_closed) {
+            return false;
+        }
+        m_items.push_back(std::move(item));
+        m_not_empty.notify_one();
+        return true;
+    }
+
+    // Blocks while the queue is empty. Returns nullopt once it is closed and
+    // drained, or cancelled.
+    std::optional<T> pop() {
+        std::unique_lock lock{m_mutex};
+        m_not_empty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+        if (m_items.empty() || m_cancelled) {
+            return std::nullopt;
+        }
+        T item = std::move(m_items.front());
+        m_items.pop_front();
+        m_not_full.notify_one();
+        std::function<void()> notify = std::exchange(m_on_space, {});
+        lock.unlock();
+        if (notify) {
+            notify();
+        }
+        return item;
+    }
+
+    // Whether push() would return without blocking. When it would block,
+    // notify is called once, from the thread that makes room or closes the
+    // queue, so that a producer that must not block can come back then.
+    bool ready(std::function<void()> notify) {
+        std::lock_guard lock{m_mutex};
+        if (m_items.size() < m_capacity || m_closed) {
+            return true;
+        }
+        m_on_space = std::move(notify);
+        return false;
+    }
+
+    // No more items will be pushed. Those queued are still popped.
+    void close() {
+        std::unique_lock lock{m_mutex};
+        m_closed = true;
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+        std::function<void()> notify = std::exchange(m_on_space, {});
+        lock.unlock();
+        if (notify) {
+            notify();
+        }
+    }
+
+    // Stops both ends at once, dropping anything queued.
+    void cancel() {
+        std::unique_lock lock{m_mutex};
+        m_closed = true;
+        m_cancelled = true;
+        m_items.clear();
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+        std::function<void()> notify = std::exchange(m_on_space, {});
+        lock.unlock();
+        if (notify) {
+            notify();
+        }
+    }
+
+private:
+    std::size_t m_capacity;
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+    std::deque<T> m_items;
+    std::function<void()> m_on_space;
+    bool m_closed = false;
+    bool m_cancelled = false;
+};
@@ -0,0 +1,83 @@
+#include "registry.h"
+
+#include "json.h"
+
+namespace {
+
+Descriptor parse_descriptor(const JsonValue& value) {
+    Descriptor descriptor;
+    descriptor.media_type = value["mediaType"].as_string();
+    descriptor.digest = value["digest"].as_string();
+    descriptor.size = static_cast<std::int64_t>(value["size"].as_number());
+
+    const JsonValue& platform = value["platform"];
+    if (platform.is_object()) {
+        descriptor.platform.os = platform["os"].as_string();
+        descriptor.platform.architecture = platform["architecture"].as_string();
+        if (const JsonValue* variant = platform.find("variant")) {
+            descriptor.platform.variant = variant->as_string();
+        }
+    }
+
+    const JsonValue& annotations = value["annotations"];
+    if (annotations.is_object()) {
+        for (const auto& [key, annotation] : annotations.as_object()) {
+            descriptor.annotations.insert_or_assign(key, annotation.as_string());
+        }
+    }
+    return descriptor;
+}
+
+} // namespace
+
+const Descriptor* Manifest::find_platform(std::string_view os, std::string_view architecture) const {
+    for (const Descriptor& descriptor : manifests) {
+        if (descriptor.platform.os == os && descriptor.platform.architecture == architecture) {
+            return &descriptor;
+        }
+    }
+    return nullptr;
+}
+
+Manifest parse_manifest(std::string_view json) {
+    JsonValue document = parse_json(json);
+    Manifest manifest;
+    if (const JsonValue* media_type = document.find("mediaType")) {
+        manifest.media_type = media_type->as_string();
+    }
+
+    if (const JsonValue* manifests = document.find("manifests")) {
+        for (const JsonValue& entry : manifests->as_array()) {
+            manifest.manifests.push_back(parse_descriptor(entry));
+        }
+        if (manifest.manifests.empty()) {
+            throw JsonError("image index lists no manifests");
+        }
+        return manifest;
+    }
+
+    manifest.config = parse_descriptor(document["config"]);
+    for (const JsonValue& entry : document["layers"].as_array()) {
+        manifest.layers.push_back(parse_descriptor(entry));
+    }
+    return manifest;
+}
+
+std::string repository_name(std::string_view image) {
+    if (image.find('/') != std::string_view::npos) {
+        return std::string{image};
+    }
+    return "library/" + std::string{image};
+}
+
+std::string pull_scope(std::string_view repository) {
+    return "repository:" + std::string{repository} + ":pull";
+}
+
+std::string manifest_url(std::string_view repository, std::string_view reference, std::string_view registry) {
+    return std::string{registry} + "/v2/" + std::string{repository} + "/manifests/" + std::string{reference};
+}
+
+std::string blob_url(std::string_view repository, std::string_view digest, std::string_view registry) {
+    return std::string{registry} + "/v2/" + std::string{repository} + "/blobs/" + std::string{digest};
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include "pch.h"
+
+constexpr std::string_view REGISTRY_URL = "https://registry-1.docker.io";
+constexpr std::string_view AUTH_URL = "https://auth.docker.io/token";
+constexpr std::string_view AUTH_SERVICE = "registry.docker.io";
+
+// Sent with manifest requests, so that the registry answers with a
+// multi-platform index when the image has one.
+constexpr std::string_view MANIFEST_ACCEPT =
+    "application/vnd.oci.image.index.v1+json, "
+    "application/vnd.docker.distribution.manifest.list.v2+json, "
+    "application/vnd.oci.image.manifest.v1+json, "
+    "application/vnd.docker.distribution.manifest.v2+json";
+
+class RegistryError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct Platform {
+    std::string os;
+    std::string architecture;
+    std::string variant;
+};
+
+struct Descriptor {
+    std::string media_type;
+    std::string digest;
+    std::int64_t size = 0;
+    // Only set for the entries of an index.
+    Platform platform;
+    std::unordered_map<std::string, std::string> annotations;
+};
+
+// Either an image manifest, with a config and layers, or an index, with one
+// manifest per platform.
+struct Manifest {
+    std::string media_type;
+    Descriptor config;
+    std::vector<Descriptor> layers;
+    std::vector<Descriptor> manifests;
+
+    bool is_index() const { return !manifests.empty(); }
+
+    // Returns the index entry matching os and architecture, or nullptr.
+    const Descriptor* find_platform(std::string_view os, std::string_view architecture) const;
+};
+
+// Throws JsonError when the document is not a manifest.
+Manifest parse_manifest(std::string_view json);
+
+// Docker Hub keeps official images under library/.
+std::string repository_name(std::string_view image);
+
+// The token scope for pulling from repository.
+std::string pull_scope(std::string_view repository);
+
+std::string manifest_url(std::string_view repository, std::string_view reference,
+                         std::string_view registry = REGISTRY_URL);
+std::string blob_url(std::string_view repository, std::string_view digest, std::string_view registry = REGISTRY_URL);
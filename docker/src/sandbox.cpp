@@ -0,0 +1,477 @@
+#include "sandbox.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <linux/sched.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "posix.h"
+
+namespace {
+
+// What a start message may hold: the hostname, working directory, args
+// and environment of a container, each string ending in '\0'.
+constexpr std::size_t MAX_MESSAGE = 64 * 1024;
+constexpr std::size_t MAX_STRINGS = 1024;
+
+// Where a sandbox mounts the root filesystem of its container, in the
+// tmpfs it waits in.
+constexpr const char* ROOTFS = "rootfs";
+
+// A cgroup whose processes were just killed may stay busy for a moment.
+constexpr int RMDIR_ATTEMPTS = 100;
+
+void write_file(const std::filesystem::path& path, const std::string& value) {
+    std::ofstream file{path};
+    file << value << std::flush;
+    if (!file) {
+        throw std::system_error(errno, std::generic_category(), "write " + path.string());
+    }
+}
+
+// The names in a space-separated list such as cgroup.controllers.
+bool lists(const std::filesystem::path& path, std::string_view name) {
+    std::ifstream file{path};
+    std::string word;
+    while (file >> word) {
+        if (word == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The <sys/pidfd.h> of glibc 2.36 does not declare it extern "C".
+int send_signal(int pidfd, int signal) {
+    return static_cast<int>(syscall(SYS_pidfd_send_signal, pidfd, signal, nullptr, 0));
+}
+
+void remove_cgroup(const std::filesystem::path& cgroup) {
+    for (int i = 0; i < RMDIR_ATTEMPTS; i++) {
+        if (rmdir(cgroup.c_str()) == 0 || errno != EBUSY) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+}
+
+// Everything from here to execve() runs in the child of clone3(), which
+// is a copy of a process that may have other threads. Locks they held stay
+// held, so it only makes system calls and never allocates.
+
+void report(int socket, int error) {
+    while (send(socket, &error, sizeof(error), MSG_NOSIGNAL) < 0 && errno == EINTR) {
+    }
+}
+
+[[noreturn]] void fail(int socket) {
+    report(socket, errno != 0 ? errno : EINVAL);
+    _exit(127);
+}
+
+// A new network namespace has only a loopback interface, and it is down.
+bool bring_up_loopback() {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    ifreq request{};
+    std::strcpy(request.ifr_name, "lo");
+    bool up = ioctl(fd, SIOCGIFFLAGS, &request) == 0;
+    request.ifr_flags |= IFF_UP;
+    up = up && ioctl(fd, SIOCSIFFLAGS, &request) == 0;
+    close(fd);
+    return up;
+}
+
+// Waits for a start message and the root filesystem as a detached mount,
+// then becomes the container's init. Returns only through _exit().
+[[noreturn]] void run_sandbox(int socket, const char* mountpoint, bool new_network) {
+    // Only the socket and standard streams are kept, so that neither the
+    // sockets of other sandboxes nor anything else of the parent leaks
+    // into the container.
+    if (socket != 3) {
+        if (dup3(socket, 3, O_CLOEXEC) < 0) {
+            fail(socket);
+        }
+        socket = 3;
+    }
+    close_range(4, ~0U, 0);
+
+    // Nothing mounted from here on shows outside the sandbox. The copy of
+    // the parent's mounts is swapped for an empty tmpfs right away, as
+    // detaching it takes longer the more mounts there are. pivot_root()
+    // and unmounting "." swap the old root for the new one.
+    if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0 ||
+        mount("tmpfs", mountpoint, "tmpfs", MS_NOSUID | MS_NODEV | MS_NOEXEC, "size=4k,mode=700") != 0 ||
+        chdir(mountpoint) != 0 || mkdir(ROOTFS, 0700) != 0 || syscall(SYS_pivot_root, ".", ".") != 0 ||
+        umount2(".", MNT_DETACH) != 0 || chdir("/") != 0 || (new_network && !bring_up_loopback())) {
+        fail(socket);
+    }
+    report(socket, 0);
+
+    static char message[MAX_MESSAGE];
+    static char* strings[MAX_STRINGS + 2];
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec part{message, sizeof(message) - 1};
+    msghdr header{};
+    header.msg_iov = &part;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    ssize_t length;
+    while ((length = recvmsg(socket, &header, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (length <= 0) {
+        // The pool is gone, or is done with this sandbox.
+        _exit(0);
+    }
+    cmsghdr* rights = CMSG_FIRSTHDR(&header);
+    if (rights == nullptr || rights->cmsg_type != SCM_RIGHTS) {
+        errno = EINVAL;
+        fail(socket);
+    }
+    int rootfs;
+    std::memcpy(&rootfs, CMSG_DATA(rights), sizeof(rootfs));
+
+    // hostname, cwd, the number of args, the args, then the environment.
+    message[length] = '\0';
+    std::size_t count = 0;
+    for (char* string = message; string < message + length && count < MAX_STRINGS;
+         string += std::strlen(string) + 1) {
+        strings[count++] = string;
+    }
+    std::size_t argc = 0;
+    for (const char* digit = count > 2 ? strings[2] : ""; *digit >= '0' && *digit <= '9'; digit++) {
+        argc = argc * 10 + static_cast<std::size_t>(*digit - '0');
+    }
+    if (count < 3 || argc == 0 || argc > count - 3) {
+        errno = EINVAL;
+        fail(socket);
+    }
+    // The args move down over the count, leaving room for the null
+    // pointer that ends them.
+    char** argv = strings + 2;
+    for (std::size_t i = 0; i < argc; i++) {
+        argv[i] = argv[i + 1];
+    }
+    argv[argc] = nullptr;
+    char** envp = argv + argc + 1;
+    strings[count] = nullptr;
+    strings[count + 1] = nullptr;
+
+    if (move_mount(rootfs, "", AT_FDCWD, ROOTFS, MOVE_MOUNT_F_EMPTY_PATH) != 0 || chdir(ROOTFS) != 0 ||
+        syscall(SYS_pivot_root, ".", ".") != 0 || umount2(".", MNT_DETACH) != 0 || chdir("/") != 0) {
+        fail(socket);
+    }
+    close(rootfs);
+    if (mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, nullptr) != 0 && errno != ENOENT) {
+        fail(socket);
+    }
+    if ((strings[0][0] != '\0' && sethostname(strings[0], std::strlen(strings[0])) != 0) || chdir(strings[1]) != 0) {
+        fail(socket);
+    }
+
+    // The pool's signal mask does not carry over to the container. A
+    // sandbox outliving the pool needs no death signal, as it exits once
+    // its socket closes.
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, nullptr);
+    // The socket closes on success, which is what start() waits for.
+    execve(argv[0], argv, envp);
+    fail(socket);
+}
+
+} // namespace
+
+struct Sandbox {
+    pid_t pid = -1;
+    int pidfd = -1;
+    int socket = -1;
+    std::filesystem::path cgroup;
+    std::filesystem::path mountpoint;
+    bool exited = false;
+    int status = 0;
+
+    Sandbox() = default;
+    Sandbox(const Sandbox&) = delete;
+    Sandbox& operator=(const Sandbox&) = delete;
+
+    ~Sandbox() {
+        if (pidfd >= 0) {
+            if (!exited) {
+                // Killing init kills the rest of its PID namespace.
+                send_signal(pidfd, SIGKILL);
+                siginfo_t info{};
+                while (waitid(P_PIDFD, static_cast<id_t>(pidfd), &info, WEXITED) != 0 && errno == EINTR) {
+                }
+            }
+            close(pidfd);
+        }
+        if (socket >= 0) {
+            close(socket);
+        }
+        if (!cgroup.empty()) {
+            remove_cgroup(cgroup);
+        }
+        if (!mountpoint.empty()) {
+            rmdir(mountpoint.c_str());
+        }
+    }
+
+    int wait() {
+        if (exited) {
+            return status;
+        }
+        siginfo_t info{};
+        while (waitid(P_PIDFD, static_cast<id_t>(pidfd), &info, WEXITED) != 0) {
+            if (errno != EINTR) {
+                throw_errno("waitid");
+            }
+        }
+        exited = true;
+        if (info.si_code == CLD_EXITED) {
+            status = (info.si_status & 0xff) << 8;
+        } else {
+            status = (info.si_status & 0x7f) | (info.si_code == CLD_DUMPED ? 0x80 : 0);
+        }
+        return status;
+    }
+};
+
+Container::Container(std::unique_ptr<Sandbox> sandbox) : m_sandbox{std::move(sandbox)} {}
+Container::Container(Container&&) noexcept = default;
+Container& Container::operator=(Container&&) noexcept = default;
+Container::~Container() = default;
+
+pid_t Container::pid() const {
+    return m_sandbox->pid;
+}
+
+int Container::wait() {
+    return m_sandbox->wait();
+}
+
+void Container::kill(int signal) {
+    if (!m_sandbox->exited && send_signal(m_sandbox->pidfd, signal) != 0 && errno != ESRCH) {
+        throw_errno("kill " + std::to_string(m_sandbox->pid));
+    }
+}
+
+SandboxPool::SandboxPool(SandboxOptions options)
+    : m_options{std::move(options)}
+{
+    std::filesystem::create_directories(m_options.cgroup);
+    std::filesystem::create_directories(m_options.state);
+    m_options.state = std::filesystem::absolute(m_options.state);
+    // For the limits of ContainerSpec. A controller the parent does not
+    // delegate cannot be enabled, and the limits it would enforce are left
+    // out.
+    for (std::string_view controller : {"cpu", "memory"}) {
+        if (lists(m_options.cgroup / "cgroup.controllers", controller) &&
+            !lists(m_options.cgroup / "cgroup.subtree_control", controller))
+        {
+            write_file(m_options.cgroup / "cgroup.subtree_control", "+" + std::string{controller});
+        }
+    }
+    m_cpu = lists(m_options.cgroup / "cgroup.subtree_control", "cpu");
+    m_memory = lists(m_options.cgroup / "cgroup.subtree_control", "memory");
+    m_refiller = std::jthread{[this] (std::stop_token stop) { refill(stop); }};
+}
+
+SandboxPool::~SandboxPool() {
+    m_refiller.request_stop();
+    m_refiller = std::jthread{};
+}
+
+std::size_t SandboxPool::ready() {
+    std::lock_guard lock{m_mutex};
+    return m_ready.size();
+}
+
+std::unique_ptr<Sandbox> SandboxPool::create() {
+    auto sandbox = std::make_unique<Sandbox>();
+    std::string name;
+    {
+        std::lock_guard lock{m_mutex};
+        name = std::to_string(getpid()) + "-" + std::to_string(m_created++);
+    }
+    sandbox->cgroup = m_options.cgroup / name;
+    if (mkdir(sandbox->cgroup.c_str(), 0755) != 0) {
+        sandbox->cgroup.clear();
+        throw_errno("mkdir " + (m_options.cgroup / name).string());
+    }
+    sandbox->mountpoint = m_options.state / name;
+    if (mkdir(sandbox->mountpoint.c_str(), 0700) != 0) {
+        sandbox->mountpoint.clear();
+        throw_errno("mkdir " + (m_options.state / name).string());
+    }
+
+    int cgroup = open(sandbox->cgroup.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cgroup < 0) {
+        throw_errno("open " + sandbox->cgroup.string());
+    }
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) {
+        int saved = errno;
+        close(cgroup);
+        errno = saved;
+        throw_errno("socketpair");
+    }
+    sandbox->socket = sockets[0];
+
+    clone_args args{};
+    args.flags = m_options.namespaces | CLONE_INTO_CGROUP | CLONE_PIDFD;
+    args.pidfd = reinterpret_cast<std::uint64_t>(&sandbox->pidfd);
+    args.exit_signal = SIGCHLD;
+    args.cgroup = static_cast<std::uint64_t>(cgroup);
+    const char* mountpoint = sandbox->mountpoint.c_str();
+    bool new_network = (m_options.namespaces & CLONE_NEWNET) != 0;
+    long pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid == 0) {
+        close(sockets[0]);
+        run_sandbox(sockets[1], mountpoint, new_network);
+    }
+    int saved = errno;
+    close(sockets[1]);
+    close(cgroup);
+    if (pid < 0) {
+        sandbox->pidfd = -1;
+        errno = saved;
+        throw_errno("clone3");
+    }
+    sandbox->pid = static_cast<pid_t>(pid);
+
+    int error = 0;
+    ssize_t length;
+    while ((length = recv(sandbox->socket, &error, sizeof(error), 0)) < 0 && errno == EINTR) {
+    }
+    if (length != sizeof(error) || error != 0) {
+        throw std::system_error(length == sizeof(error) ? error : EPIPE, std::generic_category(), "start sandbox");
+    }
+    return sandbox;
+}
+
+void SandboxPool::refill(std::stop_token stop) {
+    std::unique_lock lock{m_mutex};
+    while (!stop.stop_requested()) {
+        if (m_ready.size() >= m_options.size) {
+            m_changed.wait(lock, stop, [this] { return m_ready.size() < m_options.size; });
+            continue;
+        }
+        lock.unlock();
+        try {
+            std::unique_ptr<Sandbox> sandbox = create();
+            lock.lock();
+            m_ready.push_back(std::move(sandbox));
+        } catch (const std::exception&) {
+            // start() makes its own sandbox meanwhile, and reports why it
+            // cannot.
+            lock.lock();
+            m_changed.wait_for(lock, stop, std::chrono::seconds{1}, [] { return false; });
+        }
+    }
+    // Destroyed outside the lock, as destroying waits for each to exit.
+    std::deque<std::unique_ptr<Sandbox>> ready = std::move(m_ready);
+    lock.unlock();
+}
+
+Container SandboxPool::start(const ContainerSpec& spec) {
+    if (spec.args.empty()) {
+        throw std::invalid_argument("container spec without args");
+    }
+    std::string message = spec.hostname + '\0' + spec.cwd.string() + '\0' + std::to_string(spec.args.size()) + '\0';
+    for (const std::string& string : spec.args) {
+        message += string + '\0';
+    }
+    for (const std::string& string : spec.env) {
+        message += string + '\0';
+    }
+    if (message.size() >= MAX_MESSAGE || 3 + spec.args.size() + spec.env.size() > MAX_STRINGS) {
+        throw std::invalid_argument("container spec too large");
+    }
+
+    std::unique_ptr<Sandbox> sandbox;
+    {
+        std::lock_guard lock{m_mutex};
+        if (!m_ready.empty()) {
+            sandbox = std::move(m_ready.front());
+            m_ready.pop_front();
+        }
+    }
+    // Replaced once this start is done, so that cloning the next sandbox
+    // does not compete with it.
+    struct Refill {
+        std::condition_variable_any& changed;
+        ~Refill() { changed.notify_all(); }
+    } refill{m_changed};
+    if (!sandbox) {
+        sandbox = create();
+    }
+
+    if (spec.memory > 0 && m_memory) {
+        write_file(sandbox->cgroup / "memory.max", std::to_string(spec.memory));
+    }
+    if (spec.cpus > 0 && m_cpu) {
+        constexpr std::int64_t PERIOD = 100000;
+        auto quota = static_cast<std::int64_t>(std::ceil(spec.cpus * PERIOD));
+        write_file(sandbox->cgroup / "cpu.max", std::to_string(quota) + " " + std::to_string(PERIOD));
+    }
+
+    // A copy of the mount, which the sandbox can attach in its own mount
+    // namespace although it was made after the sandbox was.
+    int rootfs = open_tree(AT_FDCWD, spec.rootfs.c_str(), OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+    if (rootfs < 0) {
+        throw_errno("open_tree " + spec.rootfs.string());
+    }
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec part{message.data(), message.size()};
+    msghdr header{};
+    header.msg_iov = &part;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    cmsghdr* rights = CMSG_FIRSTHDR(&header);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(rights), &rootfs, sizeof(rootfs));
+    ssize_t sent = sendmsg(sandbox->socket, &header, MSG_NOSIGNAL);
+    int saved = errno;
+    close(rootfs);
+    if (sent < 0) {
+        errno = saved;
+        throw_errno("start " + spec.args[0]);
+    }
+
+    // Nothing comes back but an error, or the end of the stream once
+    // execve() closed the sandbox's end.
+    int error = 0;
+    ssize_t length;
+    while ((length = recv(sandbox->socket, &error, sizeof(error), 0)) < 0 && errno == EINTR) {
+    }
+    if (length < 0) {
+        throw_errno("start " + spec.args[0]);
+    }
+    if (length == sizeof(error)) {
+        throw std::system_error(error, std::generic_category(), "start " + spec.args[0]);
+    }
+    close(sandbox->socket);
+    sandbox->socket = -1;
+    return Container{std::move(sandbox)};
+}
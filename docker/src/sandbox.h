@@ -0,0 +1,118 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/types.h>
+
+struct SandboxOptions {
+    // The cgroup v2 directory under which each sandbox gets a cgroup of its
+    // own, made when missing.
+    std::filesystem::path cgroup = "/sys/fs/cgroup/my_containerd";
+    // Where each sandbox gets an empty directory to mount the root
+    // filesystem of its container on.
+    std::filesystem::path state = "sandboxes";
+    // How many sandboxes to keep ready. With none, each start makes one.
+    std::size_t size = 4;
+    // The clone flags of the namespaces every sandbox gets.
+    std::uint64_t namespaces = CLONE_NEWPID | CLONE_NEWNET | CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC;
+};
+
+struct ContainerSpec {
+    // Usually what Snapshotter::prepare() returned.
+    std::filesystem::path rootfs;
+    // Run as the container's init. args[0] is the path of the program in
+    // rootfs, which is not looked up in PATH.
+    std::vector<std::string> args;
+    std::vector<std::string> env;
+    std::string hostname;
+    std::filesystem::path cwd = "/";
+    // Limits of the container's cgroup, left unset when 0, or when the pool
+    // has not got the controller that enforces them. cpus may be a
+    // fraction.
+    std::int64_t memory = 0;
+    double cpus = 0;
+};
+
+// Defined in sandbox.cpp.
+struct Sandbox;
+
+// A container started by a SandboxPool. Whatever still runs in it is killed
+// when it is destroyed, and its cgroup removed.
+class Container {
+public:
+    Container(Container&&) noexcept;
+    Container& operator=(Container&&) noexcept;
+    ~Container();
+
+    // In the namespace of the caller, not that of the container.
+    pid_t pid() const;
+
+    // Waits for the container's init to exit, which takes the rest of the
+    // container with it, and returns its status as waitpid() would.
+    int wait();
+
+    void kill(int signal = SIGKILL);
+
+private:
+    friend class SandboxPool;
+    explicit Container(std::unique_ptr<Sandbox> sandbox);
+
+    std::unique_ptr<Sandbox> m_sandbox;
+};
+
+// Starts containers in sandboxes made ahead of time, so that creating the
+// namespaces and cgroup of a container is not part of starting it. Each
+// sandbox is a process cloned straight into its namespaces and its own
+// cgroup, with clone3() and CLONE_INTO_CGROUP. Once started, it waits for
+// a container's root filesystem, pivots into it and runs the container's
+// init. A background thread makes a new sandbox whenever one is taken.
+//
+// Takes root, or CAP_SYS_ADMIN and write access to the cgroup directory.
+class SandboxPool {
+public:
+    explicit SandboxPool(SandboxOptions options = {});
+    // Kills the sandboxes still waiting. Containers already started keep
+    // running.
+    ~SandboxPool();
+
+    SandboxPool(const SandboxPool&) = delete;
+    SandboxPool& operator=(const SandboxPool&) = delete;
+
+    // Returns once spec's init is running. Throws std::system_error, with
+    // the error of execve() when the program could not be run, and
+    // std::invalid_argument for a spec without args or too large to send.
+    Container start(const ContainerSpec& spec);
+
+    // How many sandboxes are waiting.
+    std::size_t ready();
+
+    // Whether the cpu and memory controllers are enabled for the sandboxes,
+    // and so ContainerSpec::cpus and ContainerSpec::memory are enforced.
+    // Only when the parent of SandboxOptions::cgroup delegates them.
+    bool limits_cpu() const { return m_cpu; }
+    bool limits_memory() const { return m_memory; }
+
+private:
+    std::unique_ptr<Sandbox> create();
+    void refill(std::stop_token stop);
+
+    SandboxOptions m_options;
+    std::mutex m_mutex;
+    std::condition_variable_any m_changed;
+    std::deque<std::unique_ptr<Sandbox>> m_ready;
+    std::uint64_t m_created = 0;
+    bool m_cpu = false;
+    bool m_memory = false;
+    // Last, so that it stops before the members it uses go away.
+    std::jthread m_refiller;
+};
@@ -0,0 +1,340 @@
+#include "snapshot.h"
+
+#include <cerrno>
+#include <map>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "posix.h"
+#include "tar.h"
+
+namespace {
+
+// Thrown when overlayfs cannot be mounted here at all, rather than these
+// layers: there is no overlayfs, or no privilege to mount it.
+class OverlayUnavailable : public std::system_error {
+public:
+    using std::system_error::system_error;
+};
+
+[[noreturn]] void throw_overlay_errno(const std::string& what, bool probing) {
+    if (probing && (errno == ENODEV || errno == EPERM)) {
+        throw OverlayUnavailable(errno, std::generic_category(), what);
+    }
+    throw_errno(what);
+}
+
+// For up to a page of options, all that mount(2) takes. probing is for
+// kernels without fsopen, where this mount is the first that tells whether
+// overlayfs is there.
+void mount_overlay_options(const std::vector<std::filesystem::path>& layers, const std::filesystem::path& upper,
+                           const std::filesystem::path& work, const std::filesystem::path& target, bool probing) {
+    std::string options = "lowerdir=";
+    for (auto layer = layers.rbegin(); layer != layers.rend(); ++layer) {
+        options += layer->string();
+        options += layer + 1 == layers.rend() ? "," : ":";
+    }
+    options += "upperdir=" + upper.string() + ",workdir=" + work.string();
+    if (geteuid() != 0) {
+        options += ",userxattr";
+    }
+    if (mount("overlay", target.c_str(), "overlay", 0, options.c_str()) != 0) {
+        throw_overlay_errno("mount overlay at " + target.string(), probing);
+    }
+}
+
+// Passes the layers one at a time, so that an image may have any number
+// of them. Kernels before 6.8 only take them through mount(2).
+void mount_overlay(const std::vector<std::filesystem::path>& layers, const std::filesystem::path& upper,
+                   const std::filesystem::path& work, const std::filesystem::path& target) {
+    Fd context{fsopen("overlay", FSOPEN_CLOEXEC)};
+    if (context.get() < 0) {
+        if (errno == ENOSYS) {
+            mount_overlay_options(layers, upper, work, target, true);
+            return;
+        }
+        throw_overlay_errno("fsopen overlay", true);
+    }
+    auto set = [&] (const char* key, const std::filesystem::path& value) {
+        if (fsconfig(context.get(), FSCONFIG_SET_STRING, key, value.c_str(), 0) != 0) {
+            throw_errno(std::string{"overlay "} + key + " " + value.string());
+        }
+    };
+
+    // Topmost first, which is how overlayfs lists them.
+    for (auto layer = layers.rbegin(); layer != layers.rend(); ++layer) {
+        if (fsconfig(context.get(), FSCONFIG_SET_STRING, "lowerdir+", layer->c_str(), 0) != 0) {
+            if (errno == EINVAL && layer == layers.rbegin()) {
+                mount_overlay_options(layers, upper, work, target, false);
+                return;
+            }
+            throw_errno("overlay lowerdir+ " + layer->string());
+        }
+    }
+    set("upperdir", upper);
+    set("workdir", work);
+    // Unprivileged, overlayfs keeps its own xattrs in the user namespace,
+    // as the tar extractor does for opaque directories.
+    if (geteuid() != 0 && fsconfig(context.get(), FSCONFIG_SET_FLAG, "userxattr", nullptr, 0) != 0) {
+        throw_errno("overlay userxattr");
+    }
+    if (fsconfig(context.get(), FSCONFIG_CMD_CREATE, nullptr, nullptr, 0) != 0) {
+        throw_errno("create overlay for " + target.string());
+    }
+    Fd mounted{fsmount(context.get(), FSMOUNT_CLOEXEC, 0)};
+    if (mounted.get() < 0) {
+        throw_errno("fsmount overlay");
+    }
+    if (move_mount(mounted.get(), "", AT_FDCWD, target.c_str(), MOVE_MOUNT_F_EMPTY_PATH) != 0) {
+        throw_errno("mount overlay at " + target.string());
+    }
+}
+
+bool is_whiteout(const struct stat& status) {
+    return S_ISCHR(status.st_mode) && status.st_rdev == makedev(0, 0);
+}
+
+bool is_opaque(const std::filesystem::path& directory) {
+    for (const char* name : {OVERLAY_OPAQUE_XATTR, USER_OVERLAY_OPAQUE_XATTR}) {
+        char value = 0;
+        if (lgetxattr(directory.c_str(), name, &value, 1) == 1 && value == 'y') {
+            return true;
+        }
+    }
+    return false;
+}
+
+void copy_metadata(const std::filesystem::path& path, const struct stat& status) {
+    // chown clears the setuid and setgid bits, so it goes first.
+    if (geteuid() == 0 && lchown(path.c_str(), status.st_uid, status.st_gid) != 0) {
+        throw_errno("chown " + path.string());
+    }
+    // Symlinks have no mode of their own.
+    if (!S_ISLNK(status.st_mode) && chmod(path.c_str(), status.st_mode & 07777) != 0) {
+        throw_errno("chmod " + path.string());
+    }
+    timespec times[2] = {status.st_atim, status.st_mtim};
+    utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+}
+
+// Reflinks source to target, or failing that and when hard_link is set,
+// hard links it. Otherwise, and for a layer on another filesystem, such as
+// a LazyMount, its bytes are copied.
+void copy_file(const std::filesystem::path& source, const std::filesystem::path& target, const struct stat& status,
+               bool hard_link) {
+    Fd in{open(source.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)};
+    if (in.get() < 0) {
+        throw_errno("open " + source.string());
+    }
+    {
+        Fd out{open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)};
+        if (out.get() < 0) {
+            throw_errno("create " + target.string());
+        }
+        if (ioctl(out.get(), FICLONE, in.get()) == 0) {
+            copy_metadata(target, status);
+            return;
+        }
+    }
+    unlink(target.c_str());
+    if (hard_link) {
+        if (link(source.c_str(), target.c_str()) == 0) {
+            return;
+        }
+        if (errno != EXDEV) {
+            throw_errno("link " + target.string());
+        }
+    }
+
+    Fd out{open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)};
+    if (out.get() < 0) {
+        throw_errno("create " + target.string());
+    }
+    for (off_t left = status.st_size; left > 0; ) {
+        ssize_t copied = sendfile(out.get(), in.get(), nullptr, static_cast<size_t>(left));
+        if (copied < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_errno("copy " + source.string());
+        }
+        if (copied == 0) {
+            break;
+        }
+        left -= copied;
+    }
+    copy_metadata(target, status);
+}
+
+// Applies one layer to the tree at root, whose directories get their
+// modes and times later, in directories, so that read-only ones can still
+// be filled by the layers above.
+void copy_layer(const std::filesystem::path& layer, const std::filesystem::path& root,
+                std::map<std::filesystem::path, struct stat>& directories, bool hard_link) {
+    auto clear = [] (const std::filesystem::path& directory) {
+        for (const auto& child : std::filesystem::directory_iterator{directory}) {
+            std::filesystem::remove_all(child.path());
+        }
+    };
+    if (is_opaque(layer)) {
+        clear(root);
+    }
+
+    // Hard links inside the layer stay hard links in the tree.
+    std::map<std::pair<dev_t, ino_t>, std::filesystem::path> links;
+    // Parents come before what is in them, so every directory of target
+    // below root has been made a real one when its entries get there. Not
+    // even a symlink left by a lower layer leads out of root.
+    for (const auto& entry : std::filesystem::recursive_directory_iterator{layer}) {
+        const std::filesystem::path& source = entry.path();
+        std::filesystem::path target = root / source.lexically_relative(layer);
+        struct stat status;
+        if (lstat(source.c_str(), &status) != 0) {
+            throw_errno("stat " + source.string());
+        }
+        struct stat existing;
+        bool exists = lstat(target.c_str(), &existing) == 0;
+
+        if (S_ISDIR(status.st_mode)) {
+            if (exists && !S_ISDIR(existing.st_mode)) {
+                std::filesystem::remove(target);
+                exists = false;
+            }
+            if (!exists) {
+                if (mkdir(target.c_str(), 0700) != 0) {
+                    throw_errno("mkdir " + target.string());
+                }
+            } else if (is_opaque(source)) {
+                clear(target);
+            }
+            directories.insert_or_assign(target, status);
+            continue;
+        }
+
+        if (exists) {
+            std::filesystem::remove_all(target);
+        }
+        if (is_whiteout(status)) {
+            continue;
+        }
+        if (S_ISREG(status.st_mode)) {
+            if (status.st_nlink > 1) {
+                auto [link, inserted] = links.try_emplace({status.st_dev, status.st_ino}, target);
+                if (!inserted) {
+                    if (::link(link->second.c_str(), target.c_str()) != 0) {
+                        throw_errno("link " + target.string());
+                    }
+                    continue;
+                }
+            }
+            copy_file(source, target, status, hard_link);
+        } else if (S_ISLNK(status.st_mode)) {
+            std::filesystem::create_symlink(std::filesystem::read_symlink(source), target);
+            copy_metadata(target, status);
+        } else {
+            if (mknod(target.c_str(), status.st_mode, status.st_rdev) != 0) {
+                // Unprivileged, device nodes cannot be made and are left out.
+                if (errno == EPERM && geteuid() != 0) {
+                    continue;
+                }
+                throw_errno("mknod " + target.string());
+            }
+            copy_metadata(target, status);
+        }
+    }
+}
+
+} // namespace
+
+Snapshotter::Snapshotter(std::filesystem::path root, SnapshotMethod method)
+    : m_root{std::filesystem::absolute(root)},
+      m_method{method}
+{
+}
+
+std::filesystem::path Snapshotter::container_path(std::string_view id) const {
+    if (id.empty() || id == "." || id == ".." || id.find('/') != std::string_view::npos) {
+        throw std::invalid_argument("invalid container id: " + std::string{id});
+    }
+    return m_root / id;
+}
+
+std::filesystem::path Snapshotter::prepare(std::string_view id, const std::vector<std::filesystem::path>& layers) {
+    StageTimer timer{Stage::snapshot};
+    std::filesystem::path container = container_path(id);
+    std::filesystem::create_directories(m_root);
+    if (!std::filesystem::create_directory(container)) {
+        throw std::system_error(std::make_error_code(std::errc::file_exists), "container " + std::string{id});
+    }
+
+    std::filesystem::path rootfs = container / "rootfs";
+    try {
+        std::filesystem::create_directory(rootfs);
+        if (m_method == SnapshotMethod::overlay) {
+            std::filesystem::path upper = container / "upper";
+            std::filesystem::path work = container / "work";
+            std::filesystem::create_directory(upper);
+            std::filesystem::create_directory(work);
+            std::vector<std::filesystem::path> lower;
+            for (const std::filesystem::path& layer : layers) {
+                lower.push_back(std::filesystem::absolute(layer));
+            }
+            try {
+                mount_overlay(lower, upper, work, rootfs);
+                timer.stop(0, 1);
+                return rootfs;
+            } catch (const OverlayUnavailable&) {
+                m_method = SnapshotMethod::copy;
+                std::filesystem::remove(upper);
+                std::filesystem::remove(work);
+            }
+        }
+
+        std::map<std::filesystem::path, struct stat> directories;
+        for (const std::filesystem::path& layer : layers) {
+            copy_layer(layer, rootfs, directories, m_method == SnapshotMethod::link);
+        }
+        for (const auto& [directory, status] : directories) {
+            // Unless a whiteout above deleted it, or a file took its place.
+            struct stat current;
+            if (lstat(directory.c_str(), &current) == 0 && S_ISDIR(current.st_mode)) {
+                copy_metadata(directory, status);
+            }
+        }
+        timer.stop(0, 1);
+        return rootfs;
+    } catch (...) {
+        std::error_code ignored;
+        std::filesystem::remove_all(container, ignored);
+        throw;
+    }
+}
+
+void Snapshotter::remove(std::string_view id) {
+    std::filesystem::path container = container_path(id);
+    std::filesystem::path rootfs = container / "rootfs";
+    struct stat parent;
+    struct stat mounted;
+    if (lstat(container.c_str(), &parent) != 0) {
+        return;
+    }
+    // Mounted when it is on another device than the directory holding it.
+    // Once detached, only the empty directory beneath is left to delete.
+    if (lstat(rootfs.c_str(), &mounted) == 0 && mounted.st_dev != parent.st_dev &&
+        umount2(rootfs.c_str(), MNT_DETACH | UMOUNT_NOFOLLOW) != 0)
+    {
+        throw_errno("umount " + rootfs.string());
+    }
+    std::filesystem::remove_all(container);
+}
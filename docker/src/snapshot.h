@@ -0,0 +1,54 @@
+#pragma once
+
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+enum class SnapshotMethod {
+    // An overlayfs mount of the layers, with the container's writes going
+    // to a directory of its own. Preparing a container costs a mount, no
+    // matter how many files the layers hold.
+    overlay,
+    // A tree per container, whose files are reflinks of those in the
+    // layers or, where the filesystem has none, copies of them.
+    copy,
+    // As copy, but with hard links in place of the copies. Only for
+    // containers that replace files rather than write to them in place,
+    // since a hard linked file shares its inode with the layer.
+    link,
+};
+
+// Stacks unpacked layers, such as the snapshots a pull leaves behind and
+// the mounts of LazyMount, into the root filesystems of containers. Layers
+// are only read, so every container of an image shares one copy of each.
+// Whiteouts in the layers must be in overlayfs form, as Whiteouts::overlay
+// extracts them.
+//
+// Each container gets a directory under root named after its id, holding
+// its root filesystem in "rootfs" and, with overlayfs, its writes in
+// "upper".
+class Snapshotter {
+public:
+    // Starts out with method. With SnapshotMethod::overlay, falls back to
+    // SnapshotMethod::copy for good the first time overlayfs turns out to be
+    // missing or not permitted; any other failure to mount is thrown.
+    explicit Snapshotter(std::filesystem::path root, SnapshotMethod method = SnapshotMethod::overlay);
+
+    // Makes the root filesystem of container id out of layers, lowest
+    // first, and returns where it is. Throws std::system_error, with
+    // std::errc::file_exists when the container is already there, and
+    // std::invalid_argument for an id that is not a plain file name.
+    std::filesystem::path prepare(std::string_view id, const std::vector<std::filesystem::path>& layers);
+
+    // Unmounts the root filesystem of container id and deletes it with its
+    // writes. Does nothing when there is no such container.
+    void remove(std::string_view id);
+
+    SnapshotMethod method() const { return m_method; }
+
+private:
+    std::filesystem::path container_path(std::string_view id) const;
+
+    std::filesystem::path m_root;
+    SnapshotMethod m_method;
+};
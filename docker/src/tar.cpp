@@ -0,0 +1,500 @@
+#include "tar.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "posix.h"
+
+namespace {
+
+// Long names and pax records are a few hundred bytes. Anything bigger is
+// not an image layer.
+constexpr std::size_t MAX_METADATA = 1024 * 1024;
+
+constexpr std::string_view WHITEOUT_PREFIX = ".wh.";
+constexpr std::string_view OPAQUE_WHITEOUT = ".wh..wh..opq";
+
+int open_in_root(int root_fd, const std::string& path, std::uint64_t flags) {
+    open_how how{};
+    how.flags = flags | O_CLOEXEC;
+    // Absolute symlinks and ".." stop at the root, as they would once the
+    // directory is a container's root filesystem.
+    how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+    return static_cast<int>(syscall(SYS_openat2, root_fd, path.c_str(), &how, sizeof(how)));
+}
+
+// Drops empty and "." components and a leading "/", so that "./usr/bin/"
+// becomes "usr/bin". Rejects "..".
+std::string normalize(std::string_view path) {
+    std::string_view original = path;
+    std::string out;
+    while (!path.empty()) {
+        size_t slash = path.find('/');
+        std::string_view component = path.substr(0, slash);
+        path.remove_prefix(slash == std::string_view::npos ? path.size() : slash + 1);
+        if (component.empty() || component == ".") {
+            continue;
+        }
+        if (component == "..") {
+            throw TarError("tar entry escapes the root: " + std::string{original});
+        }
+        if (!out.empty()) {
+            out += '/';
+        }
+        out += component;
+    }
+    return out;
+}
+
+std::string_view field(const std::array<char, 512>& block, size_t offset, size_t length) {
+    std::string_view value{block.data() + offset, length};
+    return value.substr(0, value.find('\0'));
+}
+
+std::uint64_t number(const std::array<char, 512>& block, size_t offset, size_t length) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(block.data() + offset);
+    // GNU tar stores values too big for octal in base 256, flagged by the
+    // top bit of the first byte.
+    if (bytes[0] & 0x80) {
+        if (bytes[0] & 0x40) {
+            throw TarError("negative number in tar header");
+        }
+        std::uint64_t value = bytes[0] & 0x3f;
+        for (size_t i = 1; i < length; i++) {
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+
+    std::string_view text{block.data() + offset, length};
+    size_t start = text.find_first_not_of(std::string_view{" \0", 2});
+    if (start == std::string_view::npos) {
+        return 0;
+    }
+    text.remove_prefix(start);
+    std::uint64_t value = 0;
+    auto [ptr, error] = std::from_chars(text.data(), text.data() + text.size(), value, 8);
+    if (error != std::errc{}) {
+        throw TarError("malformed number in tar header");
+    }
+    return value;
+}
+
+} // namespace
+
+TarExtractor::TarExtractor(const std::filesystem::path& directory, Whiteouts whiteouts)
+    : m_root_fd{open(directory.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC)},
+      m_set_owner{geteuid() == 0},
+      m_whiteouts{whiteouts}
+{
+    if (m_root_fd < 0) {
+        throw_errno("open " + directory.string());
+    }
+}
+
+TarExtractor::~TarExtractor() {
+    if (m_file_fd >= 0) {
+        close(m_file_fd);
+    }
+    close(m_root_fd);
+}
+
+void TarExtractor::feed(std::string_view data) {
+    while (!data.empty()) {
+        switch (m_state) {
+        case State::header: {
+            size_t length = std::min(m_block.size() - m_block_fill, data.size());
+            std::memcpy(m_block.data() + m_block_fill, data.data(), length);
+            m_block_fill += length;
+            data.remove_prefix(length);
+            if (m_block_fill == m_block.size()) {
+                m_block_fill = 0;
+                parse_header();
+            }
+            break;
+        }
+        case State::data: {
+            size_t length = static_cast<size_t>(std::min<std::uint64_t>(m_remaining, data.size()));
+            std::string_view chunk = data.substr(0, length);
+            if (m_collect) {
+                if (m_collected.size() + length > MAX_METADATA) {
+                    throw TarError("tar metadata entry too large");
+                }
+                m_collected.append(chunk);
+            } else if (m_file_fd >= 0) {
+                write_all(m_file_fd, chunk);
+            }
+            m_remaining -= length;
+            data.remove_prefix(length);
+            if (m_remaining == 0) {
+                end_entry();
+            }
+            break;
+        }
+        case State::padding: {
+            size_t length = std::min(m_padding, data.size());
+            m_padding -= length;
+            data.remove_prefix(length);
+            if (m_padding == 0) {
+                m_state = State::header;
+            }
+            break;
+        }
+        case State::end:
+            // The rest of the archive is zero blocks.
+            return;
+        }
+    }
+}
+
+void TarExtractor::finish() {
+    if (m_state == State::data || m_state == State::padding || m_block_fill != 0) {
+        throw TarError("tar archive truncated");
+    }
+
+    for (auto it = m_directories.rbegin(); it != m_directories.rend(); ++it) {
+        // A later entry may have replaced the directory, which is then left
+        // alone.
+        Fd fd{open_in_root(m_root_fd, it->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)};
+        if (fd.get() < 0) {
+            continue;
+        }
+        if (m_set_owner && fchown(fd.get(), it->uid, it->gid) != 0) {
+            throw_errno("fchown " + it->path);
+        }
+        if (fchmod(fd.get(), it->mode) != 0) {
+            throw_errno("fchmod " + it->path);
+        }
+        timespec times[2] = {{it->mtime, 0}, {it->mtime, 0}};
+        futimens(fd.get(), times);
+    }
+    m_directories.clear();
+}
+
+void TarExtractor::parse_header() {
+    if (std::all_of(m_block.begin(), m_block.end(), [] (char c) { return c == 0; })) {
+        m_state = State::end;
+        return;
+    }
+
+    // The checksum treats its own field as spaces. Some old tars summed
+    // signed chars, so either sum is accepted.
+    std::uint64_t unsigned_sum = 0;
+    std::int64_t signed_sum = 0;
+    for (size_t i = 0; i < m_block.size(); i++) {
+        char c = (i >= 148 && i < 156) ? ' ' : m_block[i];
+        unsigned_sum += static_cast<unsigned char>(c);
+        signed_sum += static_cast<signed char>(c);
+    }
+    std::uint64_t checksum = number(m_block, 148, 8);
+    if (checksum != unsigned_sum && static_cast<std::int64_t>(checksum) != signed_sum) {
+        throw TarError("bad tar header checksum");
+    }
+
+    Entry entry;
+    entry.type = m_block[156];
+    entry.path = field(m_block, 0, 100);
+    if (field(m_block, 257, 5) == "ustar") {
+        std::string_view prefix = field(m_block, 345, 155);
+        if (!prefix.empty()) {
+            entry.path = std::string{prefix} + "/" + entry.path;
+        }
+    }
+    entry.link = field(m_block, 157, 100);
+    entry.mode = static_cast<mode_t>(number(m_block, 100, 8) & 07777);
+    entry.uid = static_cast<uid_t>(number(m_block, 108, 8));
+    entry.gid = static_cast<gid_t>(number(m_block, 116, 8));
+    entry.size = number(m_block, 124, 12);
+    entry.mtime = static_cast<std::int64_t>(number(m_block, 136, 12));
+    entry.major = static_cast<unsigned>(number(m_block, 329, 8));
+    entry.minor = static_cast<unsigned>(number(m_block, 337, 8));
+
+    bool metadata = entry.type == 'L' || entry.type == 'K' || entry.type == 'x' || entry.type == 'g';
+    if (!metadata) {
+        if (!m_next_path.empty()) {
+            entry.path = std::move(m_next_path);
+        }
+        if (!m_next_link.empty()) {
+            entry.link = std::move(m_next_link);
+        }
+        entry.size = m_next_size.value_or(entry.size);
+        entry.mtime = m_next_mtime.value_or(entry.mtime);
+        entry.uid = m_next_uid.value_or(entry.uid);
+        entry.gid = m_next_gid.value_or(entry.gid);
+        m_next_path.clear();
+        m_next_link.clear();
+        m_next_size.reset();
+        m_next_mtime.reset();
+        m_next_uid.reset();
+        m_next_gid.reset();
+    }
+
+    m_entry = std::move(entry);
+    begin_entry();
+}
+
+void TarExtractor::begin_entry() {
+    m_remaining = m_entry.size;
+    m_padding = static_cast<size_t>((512 - m_entry.size % 512) % 512);
+    m_collect = false;
+
+    switch (m_entry.type) {
+    case 'L':
+    case 'K':
+    case 'x':
+    case 'g':
+        m_collect = true;
+        m_collected.clear();
+        break;
+    default:
+        create_entry();
+        break;
+    }
+
+    if (m_remaining == 0) {
+        end_entry();
+    } else {
+        m_state = State::data;
+    }
+}
+
+void TarExtractor::create_entry() {
+    std::string path = normalize(m_entry.path);
+    if (path.empty()) {
+        // The root directory itself, whose mode the caller decides.
+        return;
+    }
+    std::string name;
+    Fd parent{open_parent(path, name)};
+    const char* leaf = name.c_str();
+    if (m_whiteouts == Whiteouts::overlay && name.starts_with(WHITEOUT_PREFIX) &&
+        create_whiteout(parent.get(), path, name))
+    {
+        return;
+    }
+
+    switch (m_entry.type) {
+    case '0':
+    case '\0':
+    case '7': {
+        unlinkat(parent.get(), leaf, 0);
+        m_file_fd = openat(parent.get(), leaf, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (m_file_fd < 0) {
+            throw_errno("create " + path);
+        }
+        break;
+    }
+    case '1': {
+        std::string target_name;
+        Fd target_parent{open_parent(normalize(m_entry.link), target_name)};
+        unlinkat(parent.get(), leaf, 0);
+        if (linkat(target_parent.get(), target_name.c_str(), parent.get(), leaf, 0) != 0) {
+            throw_errno("link " + path);
+        }
+        break;
+    }
+    case '2':
+        unlinkat(parent.get(), leaf, 0);
+        if (symlinkat(m_entry.link.c_str(), parent.get(), leaf) != 0) {
+            throw_errno("symlink " + path);
+        }
+        set_metadata(parent.get(), leaf, AT_SYMLINK_NOFOLLOW);
+        break;
+    case '3':
+    case '4':
+    case '6': {
+        mode_t type = m_entry.type == '3' ? S_IFCHR : m_entry.type == '4' ? S_IFBLK : S_IFIFO;
+        unlinkat(parent.get(), leaf, 0);
+        if (mknodat(parent.get(), leaf, type | m_entry.mode, makedev(m_entry.major, m_entry.minor)) != 0) {
+            // Unprivileged, device nodes cannot be made and are left out.
+            if (errno == EPERM && !m_set_owner) {
+                break;
+            }
+            throw_errno("mknod " + path);
+        }
+        set_metadata(parent.get(), leaf, 0);
+        break;
+    }
+    case '5': {
+        if (mkdirat(parent.get(), leaf, 0700) != 0) {
+            struct stat status;
+            if (errno != EEXIST || fstatat(parent.get(), leaf, &status, AT_SYMLINK_NOFOLLOW) != 0) {
+                throw_errno("mkdir " + path);
+            }
+            if (!S_ISDIR(status.st_mode)) {
+                unlinkat(parent.get(), leaf, 0);
+                if (mkdirat(parent.get(), leaf, 0700) != 0) {
+                    throw_errno("mkdir " + path);
+                }
+            }
+        }
+        m_directories.push_back({path, m_entry.mode, m_entry.uid, m_entry.gid, m_entry.mtime});
+        break;
+    }
+    default:
+        // Sparse files, volume labels and the like do not appear in image
+        // layers. Their data is skipped.
+        break;
+    }
+}
+
+bool TarExtractor::create_whiteout(int parent, const std::string& path, const std::string& name) {
+    if (name == OPAQUE_WHITEOUT) {
+        // The directory may only be listed later, which keeps it as it is.
+        std::string directory = path.substr(0, path.size() - name.size());
+        Fd fd{open_in_root(m_root_fd, directory.empty() ? "." : directory, O_RDONLY | O_DIRECTORY)};
+        if (fd.get() < 0) {
+            throw_errno("open " + directory);
+        }
+        const char* xattr = m_set_owner ? OVERLAY_OPAQUE_XATTR : USER_OVERLAY_OPAQUE_XATTR;
+        if (fsetxattr(fd.get(), xattr, "y", 1, 0) != 0) {
+            throw_errno("setxattr " + path);
+        }
+        return true;
+    }
+
+    std::string deleted = name.substr(WHITEOUT_PREFIX.size());
+    if (deleted.empty() || deleted == "." || deleted == "..") {
+        return false;
+    }
+    // Unprivileged, this takes Linux 5.8 or later.
+    unlinkat(parent, deleted.c_str(), 0);
+    if (mknodat(parent, deleted.c_str(), S_IFCHR, makedev(0, 0)) != 0) {
+        throw_errno("mknod " + path);
+    }
+    return true;
+}
+
+void TarExtractor::end_entry() {
+    if (m_collect) {
+        std::string_view data = m_collected;
+        switch (m_entry.type) {
+        case 'L':
+            m_next_path = data.substr(0, data.find('\0'));
+            break;
+        case 'K':
+            m_next_link = data.substr(0, data.find('\0'));
+            break;
+        case 'x':
+            apply_pax(data);
+            break;
+        default:
+            break;
+        }
+        m_collect = false;
+    } else if (m_file_fd >= 0) {
+        Fd file{m_file_fd};
+        m_file_fd = -1;
+        // chown clears the setuid and setgid bits, so it goes first.
+        if (m_set_owner && fchown(file.get(), m_entry.uid, m_entry.gid) != 0) {
+            throw_errno("fchown " + m_entry.path);
+        }
+        if (fchmod(file.get(), m_entry.mode) != 0) {
+            throw_errno("fchmod " + m_entry.path);
+        }
+        timespec times[2] = {{m_entry.mtime, 0}, {m_entry.mtime, 0}};
+        futimens(file.get(), times);
+    }
+    m_state = m_padding != 0 ? State::padding : State::header;
+}
+
+void TarExtractor::apply_pax(std::string_view records) {
+    // Each record is "<length> <key>=<value>\n", length counting itself.
+    while (!records.empty()) {
+        size_t length = 0;
+        auto [ptr, error] = std::from_chars(records.data(), records.data() + records.size(), length);
+        if (error != std::errc{} || length == 0 || length > records.size()) {
+            throw TarError("malformed pax record");
+        }
+        std::string_view record = records.substr(0, length);
+        records.remove_prefix(length);
+
+        size_t space = record.find(' ');
+        size_t equals = record.find('=');
+        if (space == std::string_view::npos || equals == std::string_view::npos || equals < space ||
+            record.back() != '\n')
+        {
+            throw TarError("malformed pax record");
+        }
+        std::string_view key = record.substr(space + 1, equals - space - 1);
+        std::string_view value = record.substr(equals + 1, record.size() - equals - 2);
+
+        auto integer = [&value] {
+            std::int64_t result = 0;
+            // mtime may carry a fraction, which is dropped.
+            auto [end, parsed] = std::from_chars(value.data(), value.data() + value.size(), result);
+            if (parsed != std::errc{}) {
+                throw TarError("malformed pax value");
+            }
+            return result;
+        };
+        if (key == "path") {
+            m_next_path = value;
+        } else if (key == "linkpath") {
+            m_next_link = value;
+        } else if (key == "size") {
+            m_next_size = static_cast<std::uint64_t>(integer());
+        } else if (key == "mtime") {
+            m_next_mtime = integer();
+        } else if (key == "uid") {
+            m_next_uid = static_cast<uid_t>(integer());
+        } else if (key == "gid") {
+            m_next_gid = static_cast<gid_t>(integer());
+        }
+    }
+}
+
+int TarExtractor::open_parent(const std::string& path, std::string& name) const {
+    size_t slash = path.rfind('/');
+    std::string parent = slash == std::string::npos ? "." : path.substr(0, slash);
+    name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+    int fd = open_in_root(m_root_fd, parent, O_PATH | O_DIRECTORY);
+    if (fd >= 0 || errno != ENOENT) {
+        if (fd < 0) {
+            throw_errno("open " + parent);
+        }
+        return fd;
+    }
+
+    // Archives usually list a directory before what is in it, but need not.
+    // Missing parents are made like mkdir -p would.
+    for (size_t end = parent.find('/'); ; end = parent.find('/', end + 1)) {
+        std::string ancestor_name;
+        Fd ancestor{open_parent(parent.substr(0, end), ancestor_name)};
+        if (mkdirat(ancestor.get(), ancestor_name.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw_errno("mkdir " + parent.substr(0, end));
+        }
+        if (end == std::string::npos) {
+            break;
+        }
+    }
+    fd = open_in_root(m_root_fd, parent, O_PATH | O_DIRECTORY);
+    if (fd < 0) {
+        throw_errno("open " + parent);
+    }
+    return fd;
+}
+
+void TarExtractor::set_metadata(int fd, const char* name, int flags) const {
+    if (m_set_owner && fchownat(fd, name, m_entry.uid, m_entry.gid, flags) != 0) {
+        throw_errno("fchownat " + m_entry.path);
+    }
+    // Symlinks have no mode of their own.
+    if (!(flags & AT_SYMLINK_NOFOLLOW) && fchmodat(fd, name, m_entry.mode, 0) != 0) {
+        throw_errno("fchmodat " + m_entry.path);
+    }
+    timespec times[2] = {{m_entry.mtime, 0}, {m_entry.mtime, 0}};
+    utimensat(fd, name, times, flags);
+}
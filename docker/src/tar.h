@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "pch.h"
+
+class TarError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// What becomes of the whiteouts of OCI layers, the files named ".wh.<name>"
+// that delete <name> from the layers below, and ".wh..wh..opq", which hides
+// everything below in its directory.
+enum class Whiteouts {
+    // Extracted as they are.
+    keep,
+    // Turned into what overlayfs reads: a 0/0 character device in place of
+    // <name>, and an opaque directory marked by OVERLAY_OPAQUE_XATTR, or by
+    // USER_OVERLAY_OPAQUE_XATTR when not running as root.
+    overlay,
+};
+
+constexpr const char* OVERLAY_OPAQUE_XATTR = "trusted.overlay.opaque";
+constexpr const char* USER_OVERLAY_OPAQUE_XATTR = "user.overlay.opaque";
+
+// Unpacks a tar stream, fed in pieces of any size, into a directory. Reads
+// ustar with GNU long names and pax headers, which covers what image
+// builders emit. Every path is resolved inside the directory, so neither
+// ".." nor a symlink in the archive can make it write outside.
+class TarExtractor {
+public:
+    // directory must exist.
+    explicit TarExtractor(const std::filesystem::path& directory, Whiteouts whiteouts = Whiteouts::keep);
+    ~TarExtractor();
+
+    TarExtractor(const TarExtractor&) = delete;
+    TarExtractor& operator=(const TarExtractor&) = delete;
+
+    void feed(std::string_view data);
+
+    // Throws TarError when the archive stopped in the middle of an entry.
+    // Directory modes and times are applied here, last, so that directories
+    // the archive marks read-only can still be filled.
+    void finish();
+
+private:
+    enum class State { header, data, padding, end };
+
+    struct Entry {
+        char type = 0;
+        std::string path;
+        std::string link;
+        std::uint64_t size = 0;
+        mode_t mode = 0;
+        uid_t uid = 0;
+        gid_t gid = 0;
+        std::int64_t mtime = 0;
+        unsigned major = 0;
+        unsigned minor = 0;
+    };
+
+    struct Directory {
+        std::string path;
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+        std::int64_t mtime;
+    };
+
+    void parse_header();
+    void begin_entry();
+    void create_entry();
+    void end_entry();
+    void apply_pax(std::string_view records);
+    // Extracts the entry, whose name starts ".wh.", as an overlayfs
+    // whiteout. Returns false when it names nothing to delete.
+    bool create_whiteout(int parent, const std::string& path, const std::string& name);
+
+    // Opens the directory holding path, resolved inside the root, and sets
+    // name to the last component.
+    int open_parent(const std::string& path, std::string& name) const;
+    void set_metadata(int fd, const char* name, int flags) const;
+
+    int m_root_fd;
+    bool m_set_owner;
+    Whiteouts m_whiteouts;
+    State m_state = State::header;
+
+    std::array<char, 512> m_block;
+    std::size_t m_block_fill = 0;
+    std::uint64_t m_remaining = 0;
+    std::size_t m_padding = 0;
+
+    Entry m_entry;
+    // Set by GNU long name and pax entries, for the entry after them.
+    std::string m_next_path;
+    std::string m_next_link;
+    std::optional<std::uint64_t> m_next_size;
+    std::optional<std::int64_t> m_next_mtime;
+    std::optional<uid_t> m_next_uid;
+    std::optional<gid_t> m_next_gid;
+
+    // The data of a long name or pax entry is gathered here, and that of a
+    // regular file written to m_file_fd.
+    bool m_collect = false;
+    std::string m_collected;
+    int m_file_fd = -1;
+
+    std::vector<Directory> m_directories;
+};
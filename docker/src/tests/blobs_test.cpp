@@ -0,0 +1,170 @@
+#include "blobs.h"
+#include "test.h"
+
+namespace {
+
+std::string blob_contents() {
+    std::string contents;
+    for (int i = 0; contents.size() < 300000; i++) {
+        contents += std::to_string(i) + "\n";
+    }
+    return contents;
+}
+
+auto size_of(std::string_view contents) {
+    return static_cast<std::int64_t>(contents.size());
+}
+
+std::filesystem::path partial_path(const BlobStore& store, std::string_view digest) {
+    std::filesystem::path partial = store.root() / "tmp" / store.path(digest).filename();
+    partial += ".partial";
+    return partial;
+}
+
+} // namespace
+
+TEST(blobs_commit_verified_content) {
+    TempDir directory;
+    BlobStore store{directory.path()};
+    std::string contents = blob_contents();
+    std::string digest = sha256_digest(contents);
+    CHECK(!store.contains(digest));
+
+    BlobStore::Writer writer = store.begin(digest, size_of(contents));
+    CHECK(writer.partial_size() == 0);
+    writer.write(std::string_view{contents}.substr(0, 1000));
+    writer.write(std::string_view{contents}.substr(1000));
+    std::filesystem::path path = writer.commit();
+    CHECK(store.contains(digest));
+    CHECK(path == store.path(digest));
+    CHECK(read_file(path) == contents);
+    CHECK_THROWS(std::logic_error, writer.commit());
+}
+
+TEST(blobs_reject_malformed_digests) {
+    TempDir directory;
+    BlobStore store{directory.path()};
+    for (std::string_view digest : {"sha256:../../etc/passwd", "sha256:", "sha256:ABCDEF", "SHA256:abc", "abc",
+                                    "sha256/abc:def", ":abc"}) {
+        CHECK_THROWS(std::invalid_argument, store.path(digest));
+    }
+}
+
+TEST(blobs_resume_a_partial_write) {
+    TempDir directory;
+    BlobStore store{directory.path()};
+    std::string contents = blob_contents();
+    std::string digest = sha256_digest(contents);
+    std::size_t half = contents.size() / 2;
+    {
+        BlobStore::Writer writer = store.begin(digest, size_of(contents));
+        writer.write(std::string_view{contents}.substr(0, half));
+    }
+    CHECK(!store.contains(digest));
+
+    BlobStore::Writer writer = store.begin(digest, size_of(contents));
+    CHECK(writer.partial_size() == static_cast<std::int64_t>(half));
+    CHECK(writer.offset() == 0);
+    std::string absorbed;
+    BodySink sink = [&absorbed] (std::string_view chunk) { absorbed += chunk; };
+    writer.absorb(writer.partial_size(), &sink);
+    CHECK(absorbed == std::string_view{contents}.substr(0, half));
+    CHECK(writer.offset() == static_cast<std::int64_t>(half));
+    writer.write(std::string_view{contents}.substr(half));
+    writer.commit();
+    CHECK(read_file(store.path(digest)) == contents);
+    CHECK(!std::filesystem::exists(partial_path(store, digest)));
+}
+
+TEST(blobs_reject_a_corrupt_partial_write) {
+    TempDir directory;
+    BlobStore store{directory.path()};
+    std::string contents = blob_contents();
+    std::string digest = sha256_digest(contents);
+    std::size_t half = contents.size() / 2;
+    {
+        BlobStore::Writer writer = store.begin(digest, size_of(contents));
+        std::string corrupt = contents.substr(0, half);
+        corrupt[10] ^= 1;
+        writer.write(corrupt);
+    }
+
+    {
+        BlobStore::Writer writer = store.begin(digest, size_of(contents));
+        writer.absorb(writer.partial_size());
+        writer.write(std::string_view{contents}.substr(half));
+        CHECK_THROWS(DigestError, writer.commit());
+    }
+    CHECK(!store.contains(digest));
+    // Discarded, so that the next writer starts from scratch.
+    CHECK(!std::filesystem::exists(partial_path(store, digest)));
+    BlobStore::Writer writer = store.begin(digest, size_of(contents));
+    CHECK(writer.partial_size() == 0);
+}
+
+TEST(blobs_drop_partial_writes_longer_than_the_blob) {
+    TempDir directory;
+    BlobStore store{directory.path()};
+    std::string contents = blob_contents();
+    std::string digest = sha256_digest(contents);
+    std::filesystem::create_directories(store.root() / "tmp");
+    write_file(partial_path(store, digest), contents + "more");
+
+    BlobStore::Writer writer = store.begin(digest, size_of(contents));
+    CHECK(writer.partial_size() == 0);
+    writer.write(contents);
+    writer.commit();
+    CHECK(read_file(store.path(digest)) == contents);
+}
+
+TEST(blobs_reject_a_partial_write_shorter_than_claimed) {
+    TempDir directory;
+    BlobStore store{directory.path()};
+    std::string contents = blob_contents();
+    std::string digest = sha256_digest(contents);
+    {
+        BlobStore::Writer writer = store.begin(digest, size_of(contents));
+        writer.write(std::string_view{contents}.substr(0, 100));
+    }
+    BlobStore::Writer writer = store.begin(digest, size_of(contents));
+    CHECK_THROWS(DigestError, writer.absorb(200));
+}
+
+TEST(blobs_restart_writes_past_their_size) {
+    TempDir directory;
+    BlobStore store{directory.path()};
+    std::string contents = blob_contents();
+    std::string digest = sha256_digest(contents);
+
+    BlobStore::Writer writer = store.begin(digest, size_of(contents));
+    CHECK_THROWS(DigestError, writer.write(contents + "x"));
+    CHECK(writer.offset() == 0);
+    writer.write(contents);
+    writer.commit();
+    CHECK(read_file(store.path(digest)) == contents);
+}
+
+TEST(blobs_give_a_second_writer_a_private_file) {
+    TempDir directory;
+    BlobStore store{directory.path()};
+    std::string contents = blob_contents();
+    std::string digest = sha256_digest(contents);
+    std::size_t half = contents.size() / 2;
+
+    BlobStore::Writer first = store.begin(digest, size_of(contents));
+    first.write(std::string_view{contents}.substr(0, half));
+    {
+        BlobStore::Writer second = store.begin(digest, size_of(contents));
+        CHECK(second.partial_size() == 0);
+        second.write(std::string_view{contents}.substr(0, 10));
+    }
+    // The second writer's file went away with it, and the first's stayed.
+    std::size_t files = 0;
+    for ([[maybe_unused]] const auto& entry : std::filesystem::directory_iterator{store.root() / "tmp"}) {
+        files++;
+    }
+    CHECK(files == 1);
+    first.write(std::string_view{contents}.substr(half));
+    first.commit();
+    CHECK(read_file(store.path(digest)) == contents);
+}
@@ -0,0 +1,143 @@
+#include <cstdio>
+
+#include "digest.h"
+#include "estargz.h"
+#include "test.h"
+
+namespace {
+
+// A footer whose extra field carries hex as the TOC offset.
+std::string footer(std::string_view hex) {
+    std::string block{"\x1f\x8b\x08\x04\0\0\0\0\0\xff\x1a\0SG\x16\0", 16};
+    block += hex;
+    block += "STARGZ";
+    // An empty stored block, and the gzip trailer of nothing.
+    block += std::string_view{"\x01\0\0\xff\xff", 5};
+    block += std::string(8, '\0');
+    return block;
+}
+
+// The TOC's gzip member, holding json as stargz.index.json.
+std::string toc_member(std::string_view json) {
+    std::string tar(512, '\0');
+    tar.replace(0, 17, "stargz.index.json");
+    char size[12];
+    std::snprintf(size, sizeof(size), "%011zo", json.size());
+    tar.replace(124, 11, size);
+    tar += json;
+    tar.resize((tar.size() + 511) / 512 * 512 + 1024, '\0');
+    return gzip(tar);
+}
+
+Toc parse(std::string_view entries, std::int64_t toc_offset = 1000) {
+    return parse_estargz_toc(toc_member("{\"version\":1,\"entries\":[" + std::string{entries} + "]}"), toc_offset,
+                             {});
+}
+
+} // namespace
+
+TEST(estargz_footer_gives_the_toc_offset) {
+    CHECK(footer("0000000000001234").size() == ESTARGZ_FOOTER_SIZE);
+    CHECK(parse_estargz_footer(footer("0000000000001234")) == 0x1234);
+    CHECK(parse_estargz_footer(footer("7fffffffffffffff")) == 0x7fffffffffffffff);
+}
+
+TEST(estargz_footer_rejects_malformed_footers) {
+    std::string valid = footer("0000000000001234");
+    CHECK_THROWS(EstargzError, parse_estargz_footer(valid.substr(1)));
+    CHECK_THROWS(EstargzError, parse_estargz_footer(valid + '\0'));
+    CHECK_THROWS(EstargzError, parse_estargz_footer("\x1f\x8c" + valid.substr(2)));
+    std::string other_field = valid;
+    other_field[12] = 'X';
+    CHECK_THROWS(EstargzError, parse_estargz_footer(other_field));
+    std::string long_field = valid;
+    long_field[10] = 27;
+    CHECK_THROWS(EstargzError, parse_estargz_footer(long_field));
+    std::string no_magic = valid;
+    no_magic[37] = 'Y';
+    CHECK_THROWS(EstargzError, parse_estargz_footer(no_magic));
+    CHECK_THROWS(EstargzError, parse_estargz_footer(footer("000000000000ABCD")));
+    CHECK_THROWS(EstargzError, parse_estargz_footer(footer("-000000000001234")));
+    // Offsets past what an int64_t holds.
+    CHECK_THROWS(EstargzError, parse_estargz_footer(footer("8000000000000000")));
+    CHECK_THROWS(EstargzError, parse_estargz_footer(footer("ffffffffffffffff")));
+}
+
+TEST(estargz_toc_bounds_each_chunk_by_the_next_member) {
+    std::string json = R"({"version":1,"entries":[
+        {"name":"./etc/","type":"dir","mode":493},
+        {"name":".prefetch.landmark","type":"reg","size":1,"offset":100,"digest":"sha256:l"},
+        {"name":"etc/a","type":"reg","size":10,"offset":200,"digest":"sha256:a","modtime":"2024-01-02T03:04:05Z"},
+        {"name":"etc/big","type":"reg","size":20,"offset":300,"chunkSize":12,"chunkDigest":"sha256:b1"},
+        {"name":"etc/big","type":"chunk","offset":400,"chunkOffset":12,"chunkDigest":"sha256:b2"},
+        {"name":"etc/link","type":"hardlink","linkName":"./etc/a"}]})";
+    Toc toc = parse_estargz_toc(toc_member(json), 500, sha256_digest(json));
+    CHECK(toc.entries.size() == 4);
+    CHECK(toc.prefetch == 1);
+    CHECK(toc.entries[0].name == "etc" && toc.entries[0].mode == 0755 && toc.entries[0].chunks.empty());
+
+    const TocEntry& a = toc.entries[1];
+    CHECK(a.name == "etc/a" && a.mtime == 1704164645);
+    CHECK(a.chunks.size() == 1);
+    CHECK(a.chunks[0].begin == 200 && a.chunks[0].end == 300 && a.chunks[0].size == 10);
+    CHECK(a.chunks[0].digest == "sha256:a");
+
+    const TocEntry& big = toc.entries[2];
+    CHECK(big.chunks.size() == 2);
+    CHECK(big.chunks[0].offset == 0 && big.chunks[0].size == 12);
+    CHECK(big.chunks[0].begin == 300 && big.chunks[0].end == 400);
+    CHECK(big.chunks[1].offset == 12 && big.chunks[1].size == 8);
+    CHECK(big.chunks[1].begin == 400 && big.chunks[1].end == 500);
+
+    CHECK(toc.entries[3].link_name == "etc/a");
+}
+
+TEST(estargz_toc_checks_its_digest) {
+    std::string json = R"({"version":1,"entries":[{"name":"a","type":"reg","size":1,"offset":1,"digest":"sha256:a"}]})";
+    CHECK(parse_estargz_toc(toc_member(json), 10, sha256_digest(json)).entries.size() == 1);
+    CHECK_THROWS(DigestError, parse_estargz_toc(toc_member(json), 10, sha256_digest(json + ' ')));
+}
+
+TEST(estargz_toc_rejects_hostile_entries) {
+    CHECK(parse(R"({"name":"a","type":"reg","size":10,"offset":200,"digest":"sha256:a"})").entries.size() == 1);
+    // Numbers no integer holds.
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":10,"offset":1e300,"digest":"sha256:a"})"));
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":1e19,"offset":200,"digest":"sha256:a"})"));
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"dir","mode":-1e300})"));
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":-10,"offset":200,"digest":"sha256:a"})"));
+    // Members before the first tar header, or past the TOC.
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":10,"digest":"sha256:a"})"));
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":10,"offset":-5,"digest":"sha256:a"})"));
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":10,"offset":1000,"digest":"sha256:a"})"));
+    // Chunks outside their file, including by overflowing.
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":10,"offset":200,"chunkOffset":5,
+                                         "chunkSize":10,"chunkDigest":"sha256:a"})"));
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":10,"offset":200,"chunkOffset":-5,
+                                         "chunkSize":10,"chunkDigest":"sha256:a"})"));
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":10,"offset":200,"chunkOffset":11,
+                                         "chunkDigest":"sha256:a"})"));
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":10,"offset":200,
+                                         "chunkOffset":9.2e18,"chunkSize":9.2e18,"chunkDigest":"sha256:a"})"));
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":10,"offset":200,"chunkSize":4,
+                                         "chunkDigest":"sha256:a"},
+                                        {"name":"a","type":"chunk","offset":300,"chunkOffset":4,"chunkSize":-1,
+                                         "chunkDigest":"sha256:b"})"));
+    // A chunk without its file, and one without a digest.
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"chunk","offset":200,"chunkDigest":"sha256:a"})"));
+    CHECK_THROWS(EstargzError, parse(R"({"name":"a","type":"reg","size":10,"offset":200})"));
+}
+
+TEST(estargz_toc_rejects_malformed_members) {
+    CHECK_THROWS(EstargzError, parse_estargz_toc("not gzip at all", 10, {}));
+    std::string member = toc_member(R"({"version":1,"entries":[]})");
+    CHECK(parse_estargz_toc(member, 10, {}).entries.empty());
+    CHECK_THROWS(EstargzError, parse_estargz_toc(member.substr(0, member.size() / 2), 10, {}));
+
+    std::string tar(512, '\0');
+    tar.replace(0, 10, "other.json");
+    CHECK_THROWS(EstargzError, parse_estargz_toc(gzip(tar + std::string(1024, '\0')), 10, {}));
+    // A size running past the end of the member.
+    tar.replace(0, 17, "stargz.index.json");
+    tar.replace(124, 11, "77777777777");
+    CHECK_THROWS(EstargzError, parse_estargz_toc(gzip(tar + std::string(1024, '\0')), 10, {}));
+}
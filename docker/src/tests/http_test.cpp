@@ -0,0 +1,150 @@
+#include <atomic>
+#include <thread>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "pull.h"
+#include "test.h"
+#include "token.h"
+
+namespace {
+
+const std::string TOKEN(800, 'j');
+const std::string DIGEST = sha256_digest("manifest");
+const std::string BODY(1000, 'b');
+
+// An HTTP/1.1 server on a loopback port, for one connection at a time,
+// kept alive. Answers HEADs of manifests with DIGEST, /token with TOKEN,
+// and anything else with BODY.
+class LocalServer {
+public:
+    LocalServer() {
+        m_listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (m_listener < 0 || bind(m_listener, reinterpret_cast<sockaddr*>(&address), length) != 0 ||
+            listen(m_listener, 8) != 0 || getsockname(m_listener, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "listen");
+        }
+        m_url = "http://127.0.0.1:" + std::to_string(ntohs(address.sin_port));
+        m_thread = std::jthread{[this] (std::stop_token stop) { serve(stop); }};
+    }
+
+    ~LocalServer() {
+        m_thread.request_stop();
+        m_thread.join();
+        close(m_listener);
+    }
+
+    const std::string& url() const { return m_url; }
+
+private:
+    // Waits for fd to be readable, unless asked to stop.
+    static bool wait(int fd, const std::stop_token& stop) {
+        while (!stop.stop_requested()) {
+            pollfd readable{fd, POLLIN, 0};
+            if (poll(&readable, 1, 50) > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void serve(std::stop_token stop) {
+        while (wait(m_listener, stop)) {
+            int connection = accept4(m_listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (connection < 0) {
+                continue;
+            }
+            std::string request;
+            char buffer[4096];
+            while (wait(connection, stop)) {
+                ssize_t got = read(connection, buffer, sizeof(buffer));
+                if (got <= 0) {
+                    break;
+                }
+                request.append(buffer, static_cast<std::size_t>(got));
+                for (std::size_t end; (end = request.find("\r\n\r\n")) != std::string::npos; ) {
+                    answer(connection, request.substr(0, end));
+                    request.erase(0, end + 4);
+                }
+            }
+            close(connection);
+        }
+    }
+
+    static void answer(int connection, std::string_view request) {
+        std::string_view method = request.substr(0, request.find(' '));
+        std::string_view path = request.substr(method.size() + 1);
+        path = path.substr(0, path.find(' '));
+        std::string response = "HTTP/1.1 200 OK\r\n";
+        std::string body;
+        if (path.starts_with("/token")) {
+            body = "{\"token\":\"" + TOKEN + "\",\"expires_in\":300}";
+        } else if (method == "HEAD") {
+            response += "Docker-Content-Digest: " + DIGEST + "\r\n";
+        } else {
+            body = BODY;
+        }
+        response += "Content-Length: " + std::to_string(method == "HEAD" ? 100 : body.size()) + "\r\n\r\n";
+        if (method != "HEAD") {
+            response += body;
+        }
+        for (std::string_view rest = response; !rest.empty(); ) {
+            ssize_t written = write(connection, rest.data(), rest.size());
+            if (written <= 0) {
+                return;
+            }
+            rest.remove_prefix(static_cast<std::size_t>(written));
+        }
+    }
+
+    int m_listener;
+    std::string m_url;
+    std::jthread m_thread;
+};
+
+} // namespace
+
+TEST(prepared_requests_do_not_allocate) {
+    LocalServer server;
+    CurlPool pool;
+    HttpRequest request{server.url() + "/v2/blob", {{"Authorization", "Bearer " + TOKEN}, {"Accept", "*/*"}}};
+    HttpResponse response;
+    // The first requests size the buffers that the others reuse.
+    for (int i = 0; i < 3; i++) {
+        pool.perform(request, response);
+    }
+    std::size_t before = allocations();
+    for (int i = 0; i < 100; i++) {
+        pool.perform(request, response);
+    }
+    CHECK(allocations() == before);
+    CHECK(response.status == 200);
+    CHECK(response.body == BODY);
+}
+
+TEST(manifest_checks_do_not_allocate) {
+    LocalServer server;
+    CurlPool pool;
+    TokenCache tokens{pool, {}, AuthChallenge{server.url() + "/token", ""}};
+    PullOptions options;
+    options.registry = server.url();
+    ManifestCheck check{pool, tokens, "test", "latest", options};
+    for (int i = 0; i < 3; i++) {
+        check.digest();
+    }
+    std::size_t before = allocations();
+    for (int i = 0; i < 100; i++) {
+        check.digest();
+    }
+    CHECK(allocations() == before);
+    CHECK(check.digest() == DIGEST);
+}
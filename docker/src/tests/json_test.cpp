@@ -0,0 +1,52 @@
+#include "json.h"
+#include "test.h"
+
+TEST(json_parses_documents) {
+    JsonValue document = parse_json(R"( {"a": [1, -2.5e3, 0, -0.25E-1], "b": {"c": "d\u00e9\ud83d\ude00\n"},
+                                        "e": true, "f": false, "g": null} )");
+    const JsonValue::Array& a = document["a"].as_array();
+    CHECK(a.size() == 4);
+    CHECK(a[0].as_number() == 1);
+    CHECK(a[1].as_number() == -2500);
+    CHECK(a[2].as_number() == 0);
+    CHECK(a[3].as_number() == -0.025);
+    CHECK(document["b"]["c"].as_string() == "d\xc3\xa9\xf0\x9f\x98\x80\n");
+    CHECK(document["e"].as_bool());
+    CHECK(!document["f"].as_bool());
+    CHECK(document["g"].is_null());
+    CHECK(document["missing"].is_null());
+    CHECK(document.find("missing") == nullptr);
+    CHECK_THROWS(JsonError, document["a"].as_string());
+}
+
+TEST(json_rejects_malformed_numbers) {
+    for (std::string_view text : {"01", "-01", "00", "1.", ".5", "-", "+1", "1e", "1e+", "-inf", "nan", "inf",
+                                  "0x10", "1.e5", "--1"}) {
+        CHECK_THROWS(JsonError, parse_json(text));
+    }
+    CHECK(parse_json("0").as_number() == 0);
+    CHECK(parse_json("-0.5").as_number() == -0.5);
+    CHECK(parse_json("10").as_number() == 10);
+    CHECK(parse_json("1E2").as_number() == 100);
+}
+
+TEST(json_rejects_control_characters_in_strings) {
+    CHECK_THROWS(JsonError, parse_json("\"a\nb\""));
+    CHECK_THROWS(JsonError, parse_json("\"a\tb\""));
+    CHECK_THROWS(JsonError, parse_json(std::string_view{"\"a\0b\"", 5}));
+    CHECK_THROWS(JsonError, parse_json("{\"a\x1f\": 1}"));
+    // Escaped, they are fine, and so is DEL.
+    CHECK(parse_json(R"("a\nb\t")").as_string() == "a\nb\t");
+    CHECK(parse_json("\"\x7f\"").as_string() == "\x7f");
+}
+
+TEST(json_rejects_malformed_documents) {
+    for (std::string_view text : {"", " ", "{", "[1,]", "[1 2]", "{\"a\" 1}", "{\"a\":1,}", "{a:1}", "\"abc",
+                                  "\"\\x\"", "\"\\u12\"", "\"\\ud800\"", "\"\\udc00\"", "tru", "nul", "[] []",
+                                  "{} x", "'a'"}) {
+        CHECK_THROWS(JsonError, parse_json(text));
+    }
+    std::string deep(1000, '[');
+    deep += std::string(1000, ']');
+    CHECK_THROWS(JsonError, parse_json(deep));
+}
@@ -0,0 +1,112 @@
+#include <atomic>
+#include <thread>
+
+#include "queue.h"
+#include "test.h"
+
+TEST(queue_pops_in_order) {
+    BoundedQueue<int> queue{4};
+    CHECK(queue.push(1));
+    CHECK(queue.push(2));
+    CHECK(queue.pop() == 1);
+    CHECK(queue.pop() == 2);
+    queue.close();
+    CHECK(!queue.pop());
+    CHECK(!queue.push(3));
+}
+
+TEST(queue_drains_after_close) {
+    BoundedQueue<int> queue{4};
+    queue.push(1);
+    queue.push(2);
+    queue.close();
+    CHECK(queue.pop() == 1);
+    CHECK(queue.pop() == 2);
+    CHECK(!queue.pop());
+}
+
+TEST(queue_blocks_a_full_push_until_a_pop) {
+    BoundedQueue<int> queue{1};
+    queue.push(1);
+    std::atomic<bool> pushed = false;
+    std::jthread producer{[&] {
+        queue.push(2);
+        pushed = true;
+    }};
+    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+    CHECK(!pushed);
+    CHECK(queue.pop() == 1);
+    CHECK(queue.pop() == 2);
+    producer.join();
+    CHECK(pushed);
+}
+
+TEST(queue_ready_notifies_once_there_is_room) {
+    BoundedQueue<int> queue{2};
+    int notified = 0;
+    CHECK(queue.ready([&notified] { notified++; }));
+    queue.push(1);
+    queue.push(2);
+    CHECK(!queue.ready([&notified] { notified++; }));
+    CHECK(notified == 0);
+    CHECK(queue.pop() == 1);
+    CHECK(notified == 1);
+    // Called once, not again on the next pop.
+    CHECK(queue.pop() == 2);
+    CHECK(notified == 1);
+    CHECK(queue.ready([&notified] { notified++; }));
+}
+
+TEST(queue_ready_notifies_from_another_thread) {
+    BoundedQueue<int> queue{1};
+    queue.push(1);
+    std::mutex mutex;
+    std::condition_variable woken;
+    bool notified = false;
+    CHECK(!queue.ready([&] {
+        std::lock_guard lock{mutex};
+        notified = true;
+        woken.notify_one();
+    }));
+    std::jthread consumer{[&queue] { queue.pop(); }};
+    std::unique_lock lock{mutex};
+    CHECK(woken.wait_for(lock, std::chrono::seconds{5}, [&notified] { return notified; }));
+    CHECK(queue.ready({}));
+}
+
+TEST(queue_close_and_cancel_wake_a_paused_producer) {
+    for (bool cancel : {false, true}) {
+        BoundedQueue<int> queue{1};
+        queue.push(1);
+        int notified = 0;
+        CHECK(!queue.ready([&notified] { notified++; }));
+        if (cancel) {
+            queue.cancel();
+        } else {
+            queue.close();
+        }
+        CHECK(notified == 1);
+        // A closed queue takes nothing more, so it no longer holds anyone up.
+        CHECK(queue.ready({}));
+        CHECK(!queue.push(2));
+        // Cancelling drops what was queued, closing keeps it.
+        CHECK(queue.pop().has_value() == !cancel);
+    }
+}
+
+TEST(queue_cancel_wakes_blocked_ends) {
+    BoundedQueue<int> full{1};
+    full.push(1);
+    BoundedQueue<int> empty{1};
+    std::atomic<bool> pushed = true;
+    std::atomic<bool> popped = true;
+    std::jthread producer{[&] { pushed = full.push(2); }};
+    std::jthread consumer{[&] { popped = empty.pop().has_value(); }};
+    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+    full.cancel();
+    empty.cancel();
+    producer.join();
+    consumer.join();
+    CHECK(!pushed);
+    CHECK(!popped);
+}
@@ -0,0 +1,253 @@
+#include <cstdio>
+#include <system_error>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "layer.h"
+#include "tar.h"
+#include "test.h"
+
+namespace {
+
+// A ustar header, with its checksum.
+std::string header(std::string_view name, char type, std::size_t size = 0, std::string_view link = {},
+                   unsigned mode = 0644) {
+    std::string block(512, '\0');
+    auto field = [&block] (std::size_t offset, std::string_view value) { block.replace(offset, value.size(), value); };
+    auto octal = [&field] (std::size_t offset, std::size_t width, unsigned long long value) {
+        char digits[32];
+        std::snprintf(digits, sizeof(digits), "%0*llo", static_cast<int>(width - 1), value);
+        field(offset, digits);
+    };
+    field(0, name);
+    octal(100, 8, mode);
+    octal(108, 8, 0);
+    octal(116, 8, 0);
+    octal(124, 12, size);
+    octal(136, 12, 1700000000);
+    block[156] = type;
+    field(157, link);
+    field(257, std::string_view{"ustar\0" "00", 8});
+
+    field(148, "        ");
+    unsigned sum = 0;
+    for (char c : block) {
+        sum += static_cast<unsigned char>(c);
+    }
+    char checksum[8];
+    std::snprintf(checksum, sizeof(checksum), "%06o", sum);
+    field(148, std::string_view{checksum, 7});
+    return block;
+}
+
+std::string file(std::string_view name, std::string_view contents) {
+    std::string entry = header(name, '0', contents.size());
+    entry += contents;
+    entry.resize((entry.size() + 511) / 512 * 512, '\0');
+    return entry;
+}
+
+std::string directory(std::string_view name) {
+    return header(name, '5', 0, {}, 0755);
+}
+
+std::string end_of_archive() {
+    return std::string(1024, '\0');
+}
+
+// Feeds archive in pieces of size bytes, which split headers and data
+// wherever they fall.
+void extract(const std::filesystem::path& root, std::string_view archive, Whiteouts whiteouts = Whiteouts::keep,
+             std::size_t size = 7) {
+    TarExtractor extractor{root, whiteouts};
+    for (std::size_t i = 0; i < archive.size(); i += size) {
+        extractor.feed(archive.substr(i, size));
+    }
+    extractor.finish();
+}
+
+#ifdef HAVE_ZSTD
+std::string zstd(std::string_view data) {
+    std::string out(ZSTD_compressBound(data.size()), '\0');
+    std::size_t size = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), 3);
+    if (ZSTD_isError(size)) {
+        throw std::runtime_error("ZSTD_compress failed");
+    }
+    out.resize(size);
+    return out;
+}
+#endif
+
+void unpack(const std::filesystem::path& root, std::string_view layer, Compression compression = Compression::gzip) {
+    LayerUnpacker unpacker{root, compression};
+    for (std::size_t i = 0; i < layer.size(); i += 1000) {
+        unpacker.write(layer.substr(i, 1000));
+    }
+    unpacker.finish();
+}
+
+} // namespace
+
+TEST(tar_extracts_entries_fed_in_pieces) {
+    std::string contents(3000, 'x');
+    std::string archive = directory("./etc/") + file("etc/hosts", "127.0.0.1 localhost\n") + file("big", contents) +
+        header("etc/link", '2', 0, "hosts") + header("hard", '1', 0, "big") + file("a/b/c", "implied parents") +
+        end_of_archive();
+    for (std::size_t size : {1, 7, 512, 100000}) {
+        TempDir root;
+        extract(root.path(), archive, Whiteouts::keep, size);
+        CHECK(read_file(root.path() / "etc/hosts") == "127.0.0.1 localhost\n");
+        CHECK(read_file(root.path() / "big") == contents);
+        CHECK(std::filesystem::read_symlink(root.path() / "etc/link") == "hosts");
+        CHECK(std::filesystem::equivalent(root.path() / "hard", root.path() / "big"));
+        CHECK(read_file(root.path() / "a/b/c") == "implied parents");
+    }
+}
+
+TEST(tar_rejects_dot_dot) {
+    for (std::string archive : {file("../escaped", "x"), file("a/../../escaped", "x"),
+                                file("a", "x") + header("b", '1', 0, "../escaped")}) {
+        TempDir temporary;
+        std::filesystem::path root = temporary.path() / "root";
+        std::filesystem::create_directory(root);
+        CHECK_THROWS(TarError, extract(root, archive + end_of_archive()));
+        CHECK(!std::filesystem::exists(temporary.path() / "escaped"));
+    }
+}
+
+TEST(tar_resolves_symlinks_inside_the_root) {
+    TempDir temporary;
+    std::filesystem::path root = temporary.path() / "root";
+    std::filesystem::path outside = temporary.path() / "outside";
+    std::filesystem::create_directory(root);
+    std::filesystem::create_directory(outside);
+
+    // An absolute symlink to a directory outside, which the archive also
+    // has, one climbing out with "..", and one written through by a hard
+    // link.
+    std::string archive = directory(outside.relative_path().string() + "/") +
+        header("absolute", '2', 0, outside.string()) + file("absolute/file", "a") +
+        header("up", '2', 0, "../../../..") + file("up/file", "b") + directory("up/dir") +
+        file("target", "c") + header("absolute/hard", '1', 0, "target") + end_of_archive();
+    extract(root, archive);
+
+    CHECK(std::filesystem::is_empty(outside));
+    CHECK(std::filesystem::read_symlink(root / "absolute") == outside);
+    CHECK(read_file(root / outside.relative_path() / "file") == "a");
+    CHECK(read_file(root / "file") == "b");
+    CHECK(std::filesystem::is_directory(root / "dir"));
+    CHECK(std::filesystem::equivalent(root / outside.relative_path() / "hard", root / "target"));
+
+    // Where the root has no such directory, nothing is written at all.
+    TempDir other;
+    CHECK_THROWS(std::system_error, extract(other.path(), header("absolute", '2', 0, outside.string()) +
+                                                          file("absolute/file", "a") + end_of_archive()));
+    CHECK(std::filesystem::is_empty(outside));
+}
+
+TEST(tar_turns_whiteouts_into_overlayfs_ones) {
+    TempDir root;
+    std::string archive = directory("d/") + file("d/.wh..wh..opq", "") + file("d/kept", "k") +
+        file(".wh.gone", "") + end_of_archive();
+    extract(root.path(), archive, Whiteouts::overlay);
+
+    struct stat status;
+    CHECK(lstat((root.path() / "gone").c_str(), &status) == 0);
+    CHECK(S_ISCHR(status.st_mode) && status.st_rdev == makedev(0, 0));
+    CHECK(!std::filesystem::exists(root.path() / ".wh.gone"));
+    CHECK(!std::filesystem::exists(root.path() / "d/.wh..wh..opq"));
+    CHECK(read_file(root.path() / "d/kept") == "k");
+
+    const char* xattr = geteuid() == 0 ? OVERLAY_OPAQUE_XATTR : USER_OVERLAY_OPAQUE_XATTR;
+    char value = 0;
+    CHECK(lgetxattr((root.path() / "d").c_str(), xattr, &value, 1) == 1 && value == 'y');
+}
+
+TEST(tar_keeps_whiteouts_as_files) {
+    TempDir root;
+    std::string archive = directory("d/") + file("d/.wh..wh..opq", "") + file(".wh.gone", "") + end_of_archive();
+    extract(root.path(), archive, Whiteouts::keep);
+    CHECK(std::filesystem::is_regular_file(root.path() / ".wh.gone"));
+    CHECK(std::filesystem::is_regular_file(root.path() / "d/.wh..wh..opq"));
+    CHECK(!std::filesystem::exists(root.path() / "gone"));
+}
+
+TEST(tar_rejects_truncated_archives) {
+    std::string archive = file("a", std::string(1000, 'a')) + end_of_archive();
+    // Within the data, within the padding after it, and within a header.
+    for (std::size_t length : {std::size_t{700}, std::size_t{1520}, std::size_t{300}}) {
+        TempDir root;
+        CHECK_THROWS(TarError, extract(root.path(), std::string_view{archive}.substr(0, length)));
+    }
+
+    std::string corrupt = file("a", "x") + end_of_archive();
+    corrupt[0] = 'b';
+    TempDir root;
+    CHECK_THROWS(TarError, extract(root.path(), corrupt));
+}
+
+TEST(layer_unpacks_gzip_streams) {
+    std::string layer = gzip(file("etc/os-release", "ID=test\n") + end_of_archive());
+    TempDir root;
+    unpack(root.path(), layer);
+    CHECK(read_file(root.path() / "etc/os-release") == "ID=test\n");
+}
+
+TEST(layer_rejects_truncated_and_corrupt_gzip_streams) {
+    std::string layer = gzip(file("big", std::string(200000, 'z')) + file("random", sha256_digest("x")) +
+                             end_of_archive());
+    {
+        TempDir root;
+        CHECK_THROWS(std::runtime_error, unpack(root.path(), std::string_view{layer}.substr(0, layer.size() / 2)));
+    }
+    {
+        // Without the trailer, which holds the CRC and length.
+        TempDir root;
+        CHECK_THROWS(std::runtime_error, unpack(root.path(), std::string_view{layer}.substr(0, layer.size() - 4)));
+    }
+    {
+        std::string corrupt = layer;
+        corrupt[corrupt.size() / 2] ^= 0x55;
+        TempDir root;
+        CHECK_THROWS(std::runtime_error, unpack(root.path(), corrupt));
+    }
+}
+
+#ifdef HAVE_ZSTD
+TEST(layer_unpacks_zstd_streams) {
+    std::string contents(300000, 'z');
+    std::string archive = file("etc/os-release", "ID=test\n") + file("big", contents) + end_of_archive();
+    // Two frames back to back, as a multi-frame layer would have them.
+    std::size_t middle = archive.size() / 2 / 512 * 512;
+    std::string layer = zstd(std::string_view{archive}.substr(0, middle)) +
+        zstd(std::string_view{archive}.substr(middle));
+    {
+        TempDir root;
+        unpack(root.path(), layer, Compression::zstd);
+        CHECK(read_file(root.path() / "etc/os-release") == "ID=test\n");
+        CHECK(read_file(root.path() / "big") == contents);
+    }
+    {
+        TempDir root;
+        CHECK_THROWS(std::runtime_error,
+                     unpack(root.path(), std::string_view{layer}.substr(0, layer.size() - 10), Compression::zstd));
+    }
+    {
+        std::string corrupt = layer;
+        corrupt[4] ^= 0xff;
+        TempDir root;
+        CHECK_THROWS(std::runtime_error, unpack(root.path(), corrupt, Compression::zstd));
+    }
+}
+#else
+TEST(layer_rejects_zstd_without_libzstd) {
+    TempDir root;
+    CHECK_THROWS(std::runtime_error, unpack(root.path(), "\x28\xb5\x2f\xfd", Compression::zstd));
+}
+#endif
@@ -0,0 +1,146 @@
+#include "test.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <system_error>
+
+#include <openssl/evp.h>
+#include <zlib.h>
+
+namespace {
+
+thread_local std::size_t thread_allocations = 0;
+
+} // namespace
+
+// Replaced for allocations(). Aligned allocations keep the library's own,
+// which nothing under test asks for.
+void* operator new(std::size_t size) {
+    thread_allocations++;
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+std::size_t allocations() {
+    return thread_allocations;
+}
+
+std::vector<TestCase>& test_cases() {
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+void fail_test(const char* file, int line, const std::string& what) {
+    throw TestFailure(std::string{file} + ":" + std::to_string(line) + ": " + what + " failed");
+}
+
+TempDir::TempDir() {
+    std::string pattern = (std::filesystem::temp_directory_path() / "my_containerd_tests.XXXXXX").string();
+    if (mkdtemp(pattern.data()) == nullptr) {
+        throw std::system_error(errno, std::generic_category(), "mkdtemp " + pattern);
+    }
+    m_path = pattern;
+}
+
+TempDir::~TempDir() {
+    std::error_code ignored;
+    std::filesystem::remove_all(m_path, ignored);
+}
+
+std::string read_file(const std::filesystem::path& path) {
+    std::ifstream file{path, std::ios::binary};
+    if (!file) {
+        throw std::runtime_error("cannot open " + path.string());
+    }
+    return {std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+}
+
+void write_file(const std::filesystem::path& path, std::string_view contents) {
+    std::ofstream file{path, std::ios::binary | std::ios::trunc};
+    file.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+    if (!file.flush()) {
+        throw std::runtime_error("cannot write " + path.string());
+    }
+}
+
+std::string sha256_digest(std::string_view data) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    if (EVP_Digest(data.data(), data.size(), hash, &length, EVP_sha256(), nullptr) != 1) {
+        throw std::runtime_error("EVP_Digest failed");
+    }
+    static constexpr char HEX[] = "0123456789abcdef";
+    std::string digest = "sha256:";
+    for (unsigned int i = 0; i < length; i++) {
+        digest += HEX[hash[i] >> 4];
+        digest += HEX[hash[i] & 0xf];
+    }
+    return digest;
+}
+
+std::string gzip(std::string_view data) {
+    z_stream stream{};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("deflateInit2 failed");
+    }
+    std::string out(deflateBound(&stream, data.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef*>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    int result = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END) {
+        throw std::runtime_error("deflate failed");
+    }
+    return out;
+}
+
+// Runs every test, or those named on the command line, and exits non-zero
+// when any of them failed.
+int main(int argc, char** argv) {
+    std::vector<std::string_view> wanted(argv + 1, argv + argc);
+    int ran = 0;
+    int failed = 0;
+    for (const TestCase& test : test_cases()) {
+        if (!wanted.empty() && std::find(wanted.begin(), wanted.end(), test.name) == wanted.end()) {
+            continue;
+        }
+        ran++;
+        try {
+            test.run();
+            std::cout << "ok   " << test.name << std::endl;
+        } catch (const std::exception& error) {
+            std::cout << "FAIL " << test.name << ": " << error.what() << std::endl;
+            failed++;
+        }
+    }
+    std::cout << ran - failed << " of " << ran << " tests passed" << std::endl;
+    return failed > 0 || ran == 0 ? 1 : 0;
+}
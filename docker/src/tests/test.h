@@ -0,0 +1,83 @@
+#pragma once
+
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pch.h"
+
+// A minimal test runner, so that the tests need nothing the build does not
+// already have. TEST(name) defines a test, and CHECK and CHECK_THROWS fail
+// it by throwing TestFailure.
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+std::vector<TestCase>& test_cases();
+
+struct TestRegistration {
+    TestRegistration(const char* name, void (*run)()) { test_cases().push_back({name, run}); }
+};
+
+#define TEST(name) \
+    static void name(); \
+    static const TestRegistration name##_registration{#name, name}; \
+    static void name()
+
+class TestFailure : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+[[noreturn]] void fail_test(const char* file, int line, const std::string& what);
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fail_test(__FILE__, __LINE__, "CHECK(" #condition ")"); \
+        } \
+    } while (false)
+
+#define CHECK_THROWS(type, expression) \
+    do { \
+        bool thrown = false; \
+        try { \
+            expression; \
+        } catch (const type&) { \
+            thrown = true; \
+        } \
+        if (!thrown) { \
+            fail_test(__FILE__, __LINE__, "CHECK_THROWS(" #type ", " #expression ")"); \
+        } \
+    } while (false)
+
+// A fresh directory, removed with everything in it at the end of a test.
+class TempDir {
+public:
+    TempDir();
+    ~TempDir();
+
+    TempDir(const TempDir&) = delete;
+    TempDir& operator=(const TempDir&) = delete;
+
+    const std::filesystem::path& path() const { return m_path; }
+
+private:
+    std::filesystem::path m_path;
+};
+
+std::string read_file(const std::filesystem::path& path);
+void write_file(const std::filesystem::path& path, std::string_view contents);
+
+// "sha256:<hex>" of data.
+std::string sha256_digest(std::string_view data);
+
+// data as a single gzip member.
+std::string gzip(std::string_view data);
+
+// How often operator new has been called on this thread, so that a test can
+// check what a stretch of code allocates.
+std::size_t allocations();
@@ -0,0 +1,49 @@
+#include "test.h"
+#include "token.h"
+
+namespace {
+
+// The challenge as "[realm] [service]", or "none".
+std::string challenge(std::string_view header) {
+    std::optional<AuthChallenge> parsed = parse_challenge(header);
+    return parsed ? "[" + parsed->realm + "] [" + parsed->service + "]" : "none";
+}
+
+} // namespace
+
+TEST(challenge_parses_quoted_values) {
+    CHECK(challenge(R"(Bearer realm="https://auth.docker.io/token",service="registry.docker.io")") ==
+          "[https://auth.docker.io/token] [registry.docker.io]");
+    CHECK(challenge(R"(Bearer realm="https://a/token",service="registry",scope="repository:a/b:pull,push")") ==
+          "[https://a/token] [registry]");
+    // Escapes, and commas or equals signs inside quotes.
+    CHECK(challenge(R"(Bearer realm="https://a/t?x=1,y=2",service="a \"quoted\" \\ name")") ==
+          R"([https://a/t?x=1,y=2] [a "quoted" \ name])");
+}
+
+TEST(challenge_parses_unquoted_values_and_spacing) {
+    CHECK(challenge("Bearer realm=https://a/token,service=registry") == "[https://a/token] [registry]");
+    CHECK(challenge("  bearer   Realm = \"https://a/token\" ,\tSERVICE=registry , scope=x") ==
+          "[https://a/token] [registry]");
+    // The service is optional.
+    CHECK(challenge(R"(BEARER realm="https://a/token")") == "[https://a/token] []");
+}
+
+TEST(challenge_rejects_other_schemes) {
+    CHECK(challenge(R"(Basic realm="registry")") == "none");
+    CHECK(challenge(R"(Bearerx realm="https://a/token")") == "none");
+    CHECK(challenge("Bearer") == "none");
+    CHECK(challenge("") == "none");
+}
+
+TEST(challenge_rejects_a_missing_realm) {
+    CHECK(challenge(R"(Bearer service="registry")") == "none");
+    CHECK(challenge(R"(Bearer realm="",service="registry")") == "none");
+    CHECK(challenge("Bearer realm") == "none");
+}
+
+TEST(challenge_rejects_an_unterminated_quote) {
+    CHECK(challenge(R"(Bearer realm="https://a/token)") == "none");
+    CHECK(challenge(R"(Bearer realm="https://a/token",service="registry)") == "none");
+    CHECK(challenge(R"(Bearer realm="https://a/token\")") == "none");
+}
@@ -0,0 +1,386 @@
+#include "token.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "posix.h"
+
+namespace {
+
+// For a query parameter, of which only unreserved characters go as is.
+std::string escape_query(std::string_view value) {
+    static constexpr char HEX[] = "0123456789ABCDEF";
+    std::string escaped;
+    for (unsigned char c : value) {
+        if (std::isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            escaped += static_cast<char>(c);
+        } else {
+            escaped += '%';
+            escaped += HEX[c >> 4];
+            escaped += HEX[c & 0xf];
+        }
+    }
+    return escaped;
+}
+
+} // namespace
+
+std::optional<AuthChallenge> parse_challenge(std::string_view header) {
+    auto skip_spaces = [&header] {
+        while (!header.empty() && (header.front() == ' ' || header.front() == '\t')) {
+            header.remove_prefix(1);
+        }
+    };
+    auto lower = [] (std::string_view text) {
+        std::string lowered{text};
+        for (char& c : lowered) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        return lowered;
+    };
+
+    skip_spaces();
+    std::size_t end = header.find(' ');
+    if (end == std::string_view::npos || lower(header.substr(0, end)) != "bearer") {
+        return std::nullopt;
+    }
+    header.remove_prefix(end);
+
+    // Parameters are name=value or name="value", with backslash escapes
+    // in the quoted form, separated by commas.
+    AuthChallenge challenge;
+    while (true) {
+        skip_spaces();
+        std::size_t equals = header.find('=');
+        if (equals == std::string_view::npos) {
+            break;
+        }
+        std::string name = lower(header.substr(0, equals));
+        while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) {
+            name.pop_back();
+        }
+        header.remove_prefix(equals + 1);
+        skip_spaces();
+
+        std::string value;
+        if (!header.empty() && header.front() == '"') {
+            header.remove_prefix(1);
+            bool closed = false;
+            while (!header.empty()) {
+                char c = header.front();
+                header.remove_prefix(1);
+                if (c == '"') {
+                    closed = true;
+                    break;
+                }
+                if (c == '\\' && !header.empty()) {
+                    c = header.front();
+                    header.remove_prefix(1);
+                }
+                value += c;
+            }
+            if (!closed) {
+                return std::nullopt;
+            }
+        } else {
+            std::size_t comma = header.find(',');
+            value = header.substr(0, comma);
+            while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+                value.pop_back();
+            }
+            header.remove_prefix(comma == std::string_view::npos ? header.size() : comma);
+        }
+        if (name == "realm") {
+            challenge.realm = std::move(value);
+        } else if (name == "service") {
+            challenge.service = std::move(value);
+        }
+
+        skip_spaces();
+        if (header.empty() || header.front() != ',') {
+            break;
+        }
+        header.remove_prefix(1);
+    }
+    if (challenge.realm.empty()) {
+        return std::nullopt;
+    }
+    return challenge;
+}
+
+AuthChallenge discover_auth(CurlPool& pool, std::string_view registry) {
+    HttpResponse response = pool.get(std::string{registry} + "/v2/");
+    if (response.status == 200) {
+        return {};
+    }
+    if (response.status == 401) {
+        auto header = response.headers.find("www-authenticate");
+        if (header != response.headers.end()) {
+            if (std::optional<AuthChallenge> challenge = parse_challenge(header->second)) {
+                return *challenge;
+            }
+        }
+        throw RegistryError("registry asks for an authentication other than a bearer token");
+    }
+    throw RegistryError("registry check failed: HTTP " + std::to_string(response.status));
+}
+
+TokenCache::TokenCache(CurlPool& pool, std::filesystem::path cache_file, AuthChallenge auth)
+    : m_pool{pool},
+      m_cache_file{std::move(cache_file)},
+      m_auth{std::move(auth)},
+      m_cache_key{escape_query(m_auth.realm) + "," + escape_query(m_auth.service)}
+{
+    load();
+    m_refresher = std::jthread{[this] (std::stop_token stop) { refresh_loop(stop); }};
+}
+
+std::string TokenCache::get(const std::string& scope) {
+    std::string token;
+    std::uint64_t generation = 0;
+    get(scope, token, generation);
+    return token;
+}
+
+bool TokenCache::get(const std::string& scope, std::string& token, std::uint64_t& generation) {
+    if (m_auth.realm.empty()) {
+        return false;
+    }
+    std::unique_lock lock{m_mutex};
+    Entry& entry = m_entries[scope];
+    entry.used = true;
+    if (entry.token && Clock::now() + MIN_REMAINING < entry.token->expires_at) {
+        if (entry.token->generation == generation) {
+            return false;
+        }
+        token = entry.token->value;
+        generation = entry.token->generation;
+        return true;
+    }
+    Token fetched = fetch_shared(lock, scope);
+    if (fetched.generation == generation) {
+        return false;
+    }
+    token = std::move(fetched.value);
+    generation = fetched.generation;
+    return true;
+}
+
+void TokenCache::invalidate(const std::string& scope, const std::string& token) {
+    std::lock_guard lock{m_mutex};
+    auto entry = m_entries.find(scope);
+    if (entry != m_entries.end() && entry->second.token && entry->second.token->value == token) {
+        entry->second.token.reset();
+    }
+}
+
+TokenCache::Token TokenCache::fetch(const std::string& scope) {
+    // Timed from before the request, so that the token is never thought to
+    // live longer than it does.
+    Clock::time_point issued_at = Clock::now();
+    std::string url = m_auth.realm;
+    url += url.find('?') == std::string::npos ? '?' : '&';
+    if (!m_auth.service.empty()) {
+        url += "service=" + escape_query(m_auth.service) + "&";
+    }
+    url += "scope=" + escape_query(scope);
+    HttpResponse response = m_pool.get(url);
+    if (response.status != 200) {
+        throw RegistryError("token request for " + scope + " failed: HTTP " + std::to_string(response.status));
+    }
+
+    JsonValue document = parse_json(response.body);
+    Token token;
+    const JsonValue* value = document.find("token");
+    if (value == nullptr) {
+        value = document.find("access_token");
+    }
+    if (value == nullptr) {
+        throw RegistryError("token response for " + scope + " has no token");
+    }
+    token.value = value->as_string();
+    token.issued_at = issued_at;
+
+    std::chrono::seconds lifetime = DEFAULT_LIFETIME;
+    if (const JsonValue* expires_in = document.find("expires_in")) {
+        // Clamped before the conversion, which a huge value would overflow.
+        double seconds = std::clamp(expires_in->as_number(), 0.0, static_cast<double>(MAX_LIFETIME.count()));
+        lifetime = std::chrono::seconds{static_cast<long long>(seconds)};
+    }
+    token.expires_at = issued_at + lifetime;
+    return token;
+}
+
+TokenCache::Token TokenCache::fetch_shared(std::unique_lock<std::mutex>& lock, const std::string& scope) {
+    // Entries are never erased, and references into an unordered_map
+    // survive rehashing, so entry stays valid while the lock is dropped.
+    Entry& entry = m_entries[scope];
+    if (entry.pending.valid()) {
+        std::shared_future<Token> pending = entry.pending;
+        lock.unlock();
+        pending.wait();
+        lock.lock();
+        return pending.get();
+    }
+
+    std::promise<Token> promise;
+    entry.pending = promise.get_future().share();
+    lock.unlock();
+
+    Token token;
+    try {
+        token = fetch(scope);
+    } catch (...) {
+        lock.lock();
+        entry.pending = {};
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+
+    lock.lock();
+    std::uint64_t generation = ++m_generation;
+    token.generation = generation;
+    entry.token = token;
+    entry.pending = {};
+    promise.set_value(token);
+    m_wake.notify_all();
+    if (!m_cache_file.empty()) {
+        std::string contents = cache_contents();
+        lock.unlock();
+        save(generation, contents);
+        lock.lock();
+    }
+    return token;
+}
+
+void TokenCache::refresh_loop(std::stop_token stop) {
+    std::unique_lock lock{m_mutex};
+    while (!stop.stop_requested()) {
+        Clock::time_point now = Clock::now();
+        Clock::time_point next = Clock::time_point::max();
+        std::vector<std::string> due;
+        for (const auto& [scope, entry] : m_entries) {
+            if (!entry.token || !entry.used || entry.pending.valid()) {
+                continue;
+            }
+            if (entry.token->refresh_at() <= now) {
+                due.push_back(scope);
+            } else {
+                next = std::min(next, entry.token->refresh_at());
+            }
+        }
+
+        for (const std::string& scope : due) {
+            m_entries[scope].used = false;
+            try {
+                fetch_shared(lock, scope);
+            } catch (...) {
+                // Keep the old token while it lasts. Once it has expired,
+                // get() fetches and reports the failure itself.
+            }
+            if (stop.stop_requested()) {
+                return;
+            }
+        }
+        if (!due.empty()) {
+            continue;
+        }
+
+        std::uint64_t generation = m_generation;
+        auto changed = [this, generation] { return m_generation != generation; };
+        if (next == Clock::time_point::max()) {
+            m_wake.wait(lock, stop, changed);
+        } else {
+            m_wake.wait_until(lock, stop, next, changed);
+        }
+    }
+}
+
+void TokenCache::load() {
+    if (m_cache_file.empty()) {
+        return;
+    }
+    // One token per line: the realm and service it is from, scope, issue
+    // and expiry times in seconds since the epoch, and the token, none of
+    // which contain spaces.
+    std::ifstream file{m_cache_file};
+    std::string line;
+    Clock::time_point now = Clock::now();
+    while (std::getline(file, line)) {
+        std::istringstream fields{line};
+        std::string key;
+        std::string scope;
+        long long issued_at = 0;
+        long long expires_at = 0;
+        Token token;
+        if (!(fields >> key >> scope >> issued_at >> expires_at >> token.value)) {
+            continue;
+        }
+        token.issued_at = Clock::time_point{std::chrono::seconds{issued_at}};
+        token.expires_at = Clock::time_point{std::chrono::seconds{expires_at}};
+        if (token.expires_at <= now + MIN_REMAINING) {
+            continue;
+        }
+        if (key != m_cache_key) {
+            m_other_lines.push_back(line);
+        } else {
+            token.generation = ++m_generation;
+            m_entries[scope].token = std::move(token);
+        }
+    }
+}
+
+std::string TokenCache::cache_contents() const {
+    std::string contents;
+    for (const std::string& line : m_other_lines) {
+        contents += line + '\n';
+    }
+    for (const auto& [scope, entry] : m_entries) {
+        if (!entry.token) {
+            continue;
+        }
+        auto seconds = [] (Clock::time_point time) {
+            return std::to_string(
+                std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count());
+        };
+        contents += m_cache_key + ' ' + scope + ' ' + seconds(entry.token->issued_at) + ' ' +
+            seconds(entry.token->expires_at) + ' ' + entry.token->value + '\n';
+    }
+    return contents;
+}
+
+void TokenCache::save(std::uint64_t generation, const std::string& contents) {
+    std::lock_guard lock{m_save_mutex};
+    if (generation <= m_saved_generation) {
+        return;
+    }
+    m_saved_generation = generation;
+
+    // The cache only saves round trips, so failing to write it is not an
+    // error. A new file, made with a name of its own next to the old one
+    // and readable only by its owner from the start, is synced and renamed
+    // over it, so that other processes never read it half written, and
+    // never each other's.
+    std::string temporary = m_cache_file.string() + ".XXXXXX";
+    int fd = mkostemp(temporary.data(), O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    bool written = false;
+    try {
+        write_all(fd, contents);
+        written = fsync(fd) == 0;
+    } catch (const std::system_error&) {
+    }
+    written = close(fd) == 0 && written;
+    if (!written || rename(temporary.c_str(), m_cache_file.c_str()) != 0) {
+        unlink(temporary.c_str());
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <future>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "http.h"
+#include "registry.h"
+
+// Where a registry sends clients for tokens, as its 401 responses name it
+// in their WWW-Authenticate header. An empty realm is for a registry that
+// asks for no token, such as a local one.
+struct AuthChallenge {
+    std::string realm;
+    std::string service;
+};
+
+// Parses a challenge such as
+// `Bearer realm="https://auth.docker.io/token",service="registry.docker.io"`.
+// Returns std::nullopt for one of another scheme, or without a realm.
+std::optional<AuthChallenge> parse_challenge(std::string_view header);
+
+// Asks the base endpoint of registry, /v2/, for its challenge. Throws
+// RegistryError when it answers neither 200 nor 401 with a Bearer
+// challenge.
+AuthChallenge discover_auth(CurlPool& pool, std::string_view registry);
+
+// Bearer tokens for the registry, one per scope. A token is fetched once
+// and reused until shortly before it expires, and callers asking for the
+// same scope at once share a single fetch. A background thread renews the
+// tokens of scopes still in use before they expire, so that a pull rarely
+// waits on the auth server.
+class TokenCache {
+public:
+    // With a cache file, tokens outlive the process. The file holds
+    // credentials and is only readable by its owner. Tokens come from the
+    // realm of auth, for its service, and are all empty when it has no
+    // realm.
+    explicit TokenCache(CurlPool& pool, std::filesystem::path cache_file = {},
+                        AuthChallenge auth = {std::string{AUTH_URL}, std::string{AUTH_SERVICE}});
+
+    TokenCache(const TokenCache&) = delete;
+    TokenCache& operator=(const TokenCache&) = delete;
+
+    // Returns a token valid for at least MIN_REMAINING, such as for scope
+    // "repository:library/nginx:pull". Throws when the fetch fails.
+    std::string get(const std::string& scope);
+
+    // As get(), for a caller that keeps the token it got last, along with
+    // its generation, which starts out 0. Copies the token into token only
+    // when it is another than that one, and then returns true, so that a
+    // caller asking often costs no allocation until a renewal.
+    bool get(const std::string& scope, std::string& token, std::uint64_t& generation);
+
+    // Drops token, which the registry refused, so that the next get() for
+    // scope fetches a new one. Does nothing when the cache has already
+    // moved on to another token.
+    void invalidate(const std::string& scope, const std::string& token);
+
+    static constexpr std::chrono::seconds MIN_REMAINING{10};
+    // Used when the auth server omits expires_in, as the token spec allows.
+    static constexpr std::chrono::seconds DEFAULT_LIFETIME{60};
+    // Longer lifetimes an auth server claims are cut down to this.
+    static constexpr std::chrono::seconds MAX_LIFETIME{24 * 60 * 60};
+
+private:
+    using Clock = std::chrono::system_clock;
+
+    struct Token {
+        std::string value;
+        Clock::time_point issued_at;
+        Clock::time_point expires_at;
+        // Unique to this token, from m_generation.
+        std::uint64_t generation = 0;
+
+        // Three quarters into its lifetime.
+        Clock::time_point refresh_at() const { return issued_at + (expires_at - issued_at) * 3 / 4; }
+    };
+
+    struct Entry {
+        std::optional<Token> token;
+        std::shared_future<Token> pending;
+        // Whether the scope was asked for since its token was last renewed.
+        // Only those are renewed, so that scopes nobody pulls from anymore
+        // lapse.
+        bool used = false;
+    };
+
+    Token fetch(const std::string& scope);
+    // Expects lock to be held, and holds it again on return.
+    Token fetch_shared(std::unique_lock<std::mutex>& lock, const std::string& scope);
+    void refresh_loop(std::stop_token stop);
+
+    void load();
+    // Expects m_mutex to be held.
+    std::string cache_contents() const;
+    // Called without m_mutex, so that no get() waits on the disk. Contents
+    // older than what has already been saved are dropped.
+    void save(std::uint64_t generation, const std::string& contents);
+
+    CurlPool& m_pool;
+    std::filesystem::path m_cache_file;
+    AuthChallenge m_auth;
+    // Marks the lines of the cache file that belong to m_auth, since other
+    // registries may share the file.
+    std::string m_cache_key;
+    // The lines for other registries, which are written back as they were.
+    std::vector<std::string> m_other_lines;
+    std::mutex m_mutex;
+    std::condition_variable_any m_wake;
+    std::unordered_map<std::string, Entry> m_entries;
+    // Bumped whenever a token is stored, to wake the refresher.
+    std::uint64_t m_generation = 0;
+    std::mutex m_save_mutex;
+    std::uint64_t m_saved_generation = 0;
+    // Last, so that it stops before the members it uses go away.
+    std::jthread m_refresher;
+};
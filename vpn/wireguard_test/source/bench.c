@@ -0,0 +1,561 @@
+// SPDX-License-Identifier: LGPL-2.1+
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+/* Prints one JSON object per line for every benchmark run, so that results
+ * can be compared across builds. Allocations are counted by wrapping the
+ * allocator, and netlink traffic by wrapping the socket calls the library
+ * makes. The device benchmarks need the wireguard module and CAP_NET_ADMIN,
+ * and report themselves as skipped otherwise. */
+
+#define _GNU_SOURCE
+#include "wireguard.h"
+#include <errno.h>
+#include <getopt.h>
+#include <linux/netlink.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct counters {
+	unsigned long allocs, syscalls, msgs_sent, msgs_recv, bytes_sent, bytes_recv;
+};
+
+static struct counters counters;
+
+#define COUNT(field, n) __atomic_fetch_add(&counters.field, (n), __ATOMIC_RELAXED)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+	COUNT(allocs, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	COUNT(allocs, 1);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	COUNT(allocs, 1);
+	return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	COUNT(allocs, 1);
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	COUNT(allocs, 1);
+	*ptr = __libc_memalign(alignment, size);
+	return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+static void count_msgs(const void *buf, ssize_t len, bool sent)
+{
+	const struct nlmsghdr *nlh = buf;
+	int remaining = len;
+
+	if (len <= 0)
+		return;
+	for (; NLMSG_OK(nlh, remaining); nlh = NLMSG_NEXT(nlh, remaining))
+		sent ? COUNT(msgs_sent, 1) : COUNT(msgs_recv, 1);
+	sent ? COUNT(bytes_sent, len) : COUNT(bytes_recv, len);
+}
+
+int socket(int domain, int type, int protocol)
+{
+	COUNT(syscalls, 1);
+	return syscall(SYS_socket, domain, type, protocol);
+}
+
+int bind(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	COUNT(syscalls, 1);
+	return syscall(SYS_bind, fd, addr, addrlen);
+}
+
+int setsockopt(int fd, int level, int optname, const void *optval, socklen_t optlen)
+{
+	COUNT(syscalls, 1);
+	return syscall(SYS_setsockopt, fd, level, optname, optval, optlen);
+}
+
+int getsockname(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	COUNT(syscalls, 1);
+	return syscall(SYS_getsockname, fd, addr, addrlen);
+}
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addrlen)
+{
+	ssize_t ret = syscall(SYS_sendto, fd, buf, len, flags, addr, addrlen);
+
+	COUNT(syscalls, 1);
+	count_msgs(buf, ret, true);
+	return ret;
+}
+
+int sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int ret = syscall(SYS_sendmmsg, fd, msgvec, vlen, flags), i;
+
+	COUNT(syscalls, 1);
+	for (i = 0; i < ret; ++i)
+		count_msgs(msgvec[i].msg_hdr.msg_iov[0].iov_base, msgvec[i].msg_len, true);
+	return ret;
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+	ssize_t ret = syscall(SYS_recvfrom, fd, buf, len, flags, NULL, NULL);
+
+	COUNT(syscalls, 1);
+	count_msgs(buf, ret, false);
+	return ret;
+}
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	ssize_t ret = syscall(SYS_recvmsg, fd, msg, flags);
+
+	COUNT(syscalls, 1);
+	if (!(flags & MSG_PEEK))
+		count_msgs(msg->msg_iov[0].iov_base, ret, false);
+	return ret;
+}
+
+int recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout)
+{
+	int ret = syscall(SYS_recvmmsg, fd, msgvec, vlen, flags, timeout), i;
+
+	COUNT(syscalls, 1);
+	for (i = 0; i < ret; ++i)
+		count_msgs(msgvec[i].msg_hdr.msg_iov[0].iov_base, msgvec[i].msg_len, false);
+	return ret;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct result {
+	const char *name;
+	size_t peers, iterations, items;
+	uint64_t total_ns, min_ns;
+	struct counters start;
+	int error;
+};
+
+static void result_start(struct result *result, const char *name, size_t peers, size_t items)
+{
+	memset(result, 0, sizeof(*result));
+	result->name = name;
+	result->peers = peers;
+	result->items = items;
+	result->min_ns = UINT64_MAX;
+	result->start = counters;
+}
+
+static void result_add(struct result *result, uint64_t start_ns, int ret)
+{
+	uint64_t ns = now_ns() - start_ns;
+
+	result->total_ns += ns;
+	if (ns < result->min_ns)
+		result->min_ns = ns;
+	++result->iterations;
+	if (ret < 0 && !result->error)
+		result->error = ret;
+}
+
+static void result_print(const struct result *result)
+{
+	double n = result->iterations;
+
+	printf("{\"benchmark\":\"%s\"", result->name);
+	if (result->peers)
+		printf(",\"peers\":%zu", result->peers);
+	printf(",\"iterations\":%zu,\"items_per_op\":%zu,\"ns_per_op\":%.0f,\"min_ns\":%llu,\"ns_per_item\":%.1f",
+	       result->iterations, result->items, result->total_ns / n, (unsigned long long)result->min_ns, result->total_ns / n / result->items);
+	printf(",\"allocs_per_op\":%.1f,\"syscalls_per_op\":%.1f,\"netlink_msgs_sent_per_op\":%.1f,\"netlink_msgs_recv_per_op\":%.1f,\"netlink_bytes_sent_per_op\":%.0f,\"netlink_bytes_recv_per_op\":%.0f",
+	       (counters.allocs - result->start.allocs) / n, (counters.syscalls - result->start.syscalls) / n,
+	       (counters.msgs_sent - result->start.msgs_sent) / n, (counters.msgs_recv - result->start.msgs_recv) / n,
+	       (counters.bytes_sent - result->start.bytes_sent) / n, (counters.bytes_recv - result->start.bytes_recv) / n);
+	if (result->error)
+		printf(",\"error\":\"%s\"", strerror(-result->error));
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void print_skipped(const char *name, size_t peers, int error)
+{
+	printf("{\"benchmark\":\"%s\",\"peers\":%zu,\"skipped\":\"%s\"}\n", name, peers, strerror(-error));
+	fflush(stdout);
+}
+
+/* Runs stmt, which sets ret, until both min_iterations and min_ns are
+ * reached. */
+#define BENCH(result, min_iterations, min_ns, stmt) do { \
+		uint64_t __deadline = now_ns() + (min_ns); \
+		while ((result)->iterations < (min_iterations) || now_ns() < __deadline) { \
+			uint64_t __start = now_ns(); \
+			int ret = 0; \
+			stmt; \
+			result_add((result), __start, ret); \
+		} \
+	} while (0)
+
+#define NUM_KEYS 4096
+
+static void bench_keys(void)
+{
+	static wg_key private_keys[NUM_KEYS], public_keys[NUM_KEYS], decoded[NUM_KEYS];
+	static wg_key_b64_string encoded[NUM_KEYS];
+	struct result result;
+	size_t i;
+
+	result_start(&result, "generate_private_keys", 0, NUM_KEYS);
+	BENCH(&result, 10, 100000000, wg_generate_private_keys(private_keys, NUM_KEYS));
+	result_print(&result);
+
+	result_start(&result, "generate_public_key", 0, 1);
+	i = 0;
+	BENCH(&result, 100, 200000000, wg_generate_public_key(public_keys[i % NUM_KEYS], private_keys[i % NUM_KEYS]); ++i);
+	result_print(&result);
+
+	result_start(&result, "generate_public_keys", 0, NUM_KEYS);
+	BENCH(&result, 2, 200000000, wg_generate_public_keys(public_keys, private_keys, NUM_KEYS));
+	result_print(&result);
+
+	result_start(&result, "key_to_base64", 0, NUM_KEYS);
+	BENCH(&result, 10, 100000000, for (i = 0; i < NUM_KEYS; ++i) wg_key_to_base64(encoded[i], public_keys[i]));
+	result_print(&result);
+
+	result_start(&result, "key_from_base64", 0, NUM_KEYS);
+	BENCH(&result, 10, 100000000, for (i = 0; i < NUM_KEYS; ++i) ret |= wg_key_from_base64(decoded[i], encoded[i]));
+	result_print(&result);
+
+	result_start(&result, "keys_to_base64", 0, NUM_KEYS);
+	BENCH(&result, 10, 100000000, wg_keys_to_base64(encoded, public_keys, NUM_KEYS));
+	result_print(&result);
+
+	result_start(&result, "keys_from_base64", 0, NUM_KEYS);
+	BENCH(&result, 10, 100000000, ret = wg_keys_from_base64(decoded, encoded, NUM_KEYS));
+	result_print(&result);
+}
+
+/* A device with num_peers peers, each with an endpoint and one IPv4 and one
+ * IPv6 allowed IP. The peers and allowed IPs live in two arrays. */
+struct synthetic {
+	wg_device device;
+	wg_peer *peers;
+	wg_allowedip *allowedips;
+};
+
+static int synthetic_new(struct synthetic *synth, const char *name, size_t num_peers)
+{
+	wg_key private_keys[64];
+	size_t i, j;
+
+	memset(synth, 0, sizeof(*synth));
+	synth->peers = calloc(num_peers, sizeof(*synth->peers));
+	synth->allowedips = calloc(num_peers * 2, sizeof(*synth->allowedips));
+	if (!synth->peers || !synth->allowedips)
+		return -ENOMEM;
+
+	strncpy(synth->device.name, name, sizeof(synth->device.name) - 1);
+	synth->device.flags = WGDEVICE_HAS_PRIVATE_KEY | WGDEVICE_REPLACE_PEERS;
+	wg_generate_private_key(synth->device.private_key);
+	for (i = 0; i < num_peers; i += j) {
+		wg_generate_private_keys(private_keys, 64);
+		for (j = 0; j < 64 && i + j < num_peers; ++j)
+			wg_generate_public_key(synth->peers[i + j].public_key, private_keys[j]);
+	}
+	for (i = 0; i < num_peers; ++i) {
+		wg_peer *peer = &synth->peers[i];
+		wg_allowedip *allowedip4 = &synth->allowedips[i * 2], *allowedip6 = allowedip4 + 1;
+
+		peer->flags = WGPEER_HAS_PUBLIC_KEY | WGPEER_REPLACE_ALLOWEDIPS | WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL;
+		peer->persistent_keepalive_interval = 25;
+		peer->endpoint.addr4.sin_family = AF_INET;
+		peer->endpoint.addr4.sin_addr.s_addr = htonl(0xc6120000 | (i & 0xffff));
+		peer->endpoint.addr4.sin_port = htons(51820);
+
+		allowedip4->family = AF_INET;
+		allowedip4->ip4.s_addr = htonl(0x0a000000 | i);
+		allowedip4->cidr = 32;
+		allowedip6->family = AF_INET6;
+		allowedip6->ip6.s6_addr[0] = 0xfd;
+		allowedip6->ip6.s6_addr[13] = i >> 16;
+		allowedip6->ip6.s6_addr[14] = i >> 8;
+		allowedip6->ip6.s6_addr[15] = i;
+		allowedip6->cidr = 128;
+		allowedip4->next_allowedip = allowedip6;
+		peer->first_allowedip = allowedip4;
+		peer->last_allowedip = allowedip6;
+
+		if (i)
+			synth->peers[i - 1].next_peer = peer;
+	}
+	if (num_peers) {
+		synth->device.first_peer = &synth->peers[0];
+		synth->device.last_peer = &synth->peers[num_peers - 1];
+	}
+	return 0;
+}
+
+static void synthetic_free(struct synthetic *synth)
+{
+	free(synth->peers);
+	free(synth->allowedips);
+}
+
+static void bench_index(size_t num_peers)
+{
+	struct synthetic synth;
+	wg_allowedips_index *index = NULL;
+	struct in_addr *addrs;
+	wg_peer **peers;
+	struct result result;
+	size_t i, num_addrs = 1 << 16;
+
+	addrs = calloc(num_addrs, sizeof(*addrs));
+	peers = calloc(num_addrs, sizeof(*peers));
+	if (!addrs || !peers || synthetic_new(&synth, "", num_peers) < 0) {
+		print_skipped("allowedips_index_new", num_peers, -ENOMEM);
+		free(addrs);
+		free(peers);
+		return;
+	}
+	for (i = 0; i < num_addrs; ++i)
+		addrs[i].s_addr = htonl(0x0a000000 | ((i * 2654435761U) % (num_peers * 2)));
+
+	result_start(&result, "allowedips_index_new", num_peers, num_peers);
+	BENCH(&result, 3, 100000000, wg_allowedips_index_free(index); ret = wg_allowedips_index_new(&index, &synth.device));
+	result_print(&result);
+
+	if (index) {
+		result_start(&result, "allowedips_lookup4", num_peers, num_addrs);
+		BENCH(&result, 10, 100000000, for (i = 0; i < num_addrs; ++i) peers[i] = wg_allowedips_lookup4(index, &addrs[i]));
+		result_print(&result);
+
+		result_start(&result, "allowedips_lookup4_batch", num_peers, num_addrs);
+		BENCH(&result, 10, 100000000, wg_allowedips_lookup4_batch(index, addrs, peers, num_addrs));
+		result_print(&result);
+	}
+
+	wg_allowedips_index_free(index);
+	synthetic_free(&synth);
+	free(addrs);
+	free(peers);
+}
+
+static int stats_count;
+
+static int count_peer_view(const wg_peer_view *peer, void *data)
+{
+	(void)data;
+	stats_count += !peer->continued;
+	return 0;
+}
+
+static void bench_device(const char *name, size_t num_peers)
+{
+	size_t iterations = num_peers >= 50000 ? 3 : num_peers >= 10000 ? 5 : 20;
+	struct synthetic synth, changed;
+	wg_flat_device flat = { 0 };
+	wg_peer_stats *stats = NULL;
+	wg_session *session = NULL;
+	wg_arena *arena = NULL;
+	wg_device *device, view_device;
+	struct result result;
+	size_t num_stats, i;
+	int ret;
+
+	ret = wg_add_device(name);
+	if (ret < 0) {
+		print_skipped("device", num_peers, ret);
+		return;
+	}
+	if (synthetic_new(&synth, name, num_peers) < 0 || wg_session_open(&session) < 0 || wg_arena_new(&arena) < 0 ||
+	    !(stats = calloc(num_peers ?: 1, sizeof(*stats)))) {
+		print_skipped("device", num_peers, -ENOMEM);
+		goto out;
+	}
+
+	result_start(&result, "set_device", num_peers, num_peers);
+	BENCH(&result, iterations, 0, ret = wg_set_device(&synth.device));
+	result_print(&result);
+
+	result_start(&result, "session_set_device", num_peers, num_peers);
+	BENCH(&result, iterations, 0, ret = wg_session_set_device(session, &synth.device));
+	result_print(&result);
+
+	result_start(&result, "session_set_device_pipelined", num_peers, num_peers);
+	BENCH(&result, iterations, 0, ret = wg_session_set_device_pipelined(session, &synth.device));
+	result_print(&result);
+
+	result_start(&result, "get_device", num_peers, num_peers);
+	BENCH(&result, iterations, 0, ret = wg_get_device(&device, name); wg_free_device(device));
+	result_print(&result);
+
+	result_start(&result, "session_get_device", num_peers, num_peers);
+	BENCH(&result, iterations, 0, ret = wg_session_get_device(session, &device, name); wg_free_device(device));
+	result_print(&result);
+
+	result_start(&result, "session_get_device_arena", num_peers, num_peers);
+	BENCH(&result, iterations, 0, wg_arena_reset(arena); ret = wg_session_get_device_arena(session, arena, &device, name));
+	result_print(&result);
+
+	result_start(&result, "session_get_flat_device", num_peers, num_peers);
+	BENCH(&result, iterations, 0, ret = wg_session_get_flat_device(session, &flat, name));
+	result_print(&result);
+
+	result_start(&result, "session_get_compact_device", num_peers, num_peers);
+	BENCH(&result, iterations, 0, ret = wg_session_get_compact_device(session, &flat, name));
+	result_print(&result);
+
+	result_start(&result, "session_get_device_stats", num_peers, num_peers);
+	BENCH(&result, iterations, 0, num_stats = num_peers; ret = wg_session_get_device_stats(session, name, stats, &num_stats));
+	result_print(&result);
+
+	result_start(&result, "session_walk_device", num_peers, num_peers);
+	BENCH(&result, iterations, 0, stats_count = 0; ret = wg_session_walk_device(session, &view_device, name, count_peer_view, NULL));
+	result_print(&result);
+
+	/* The same configuration with every hundredth peer moved to another
+	 * endpoint, applied back and forth. It shares the allowed IPs. */
+	changed = synth;
+	changed.peers = calloc(num_peers ?: 1, sizeof(*changed.peers));
+	if (!changed.peers)
+		goto out;
+	memcpy(changed.peers, synth.peers, num_peers * sizeof(*changed.peers));
+	for (i = 0; i < num_peers; ++i) {
+		if (i)
+			changed.peers[i - 1].next_peer = &changed.peers[i];
+		if (!(i % 100))
+			changed.peers[i].endpoint.addr4.sin_port = htons(51821);
+	}
+	if (num_peers) {
+		changed.device.first_peer = &changed.peers[0];
+		changed.device.last_peer = &changed.peers[num_peers - 1];
+	}
+	result_start(&result, "session_apply_diff", num_peers, (num_peers + 99) / 100);
+	i = 0;
+	BENCH(&result, iterations, 0,
+	      ret = i++ % 2 ? wg_session_apply_diff(session, &changed.device, &synth.device)
+			    : wg_session_apply_diff(session, &synth.device, &changed.device));
+	result_print(&result);
+	free(changed.peers);
+
+out:
+	wg_free_flat_device(&flat);
+	wg_arena_free(arena);
+	wg_session_close(session);
+	synthetic_free(&synth);
+	free(stats);
+	wg_del_device(name);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-i INTERFACE] [-p PEERS[,PEERS...]] [-s]\n", prog);
+	fprintf(stderr, "  -i INTERFACE  name of the scratch interface (default wgbench0)\n");
+	fprintf(stderr, "  -p PEERS      peer counts for the device benchmarks (default 1000,10000,50000)\n");
+	fprintf(stderr, "  -s            skip the key and index benchmarks\n");
+}
+
+/* Whether text is a comma-separated list of peer counts, each a positive
+ * decimal number. Zero would leave the index benchmark nothing to divide by. */
+static bool valid_counts(const char *text)
+{
+	unsigned long value;
+	char *end;
+
+	for (;;) {
+		if (*text < '0' || *text > '9')
+			return false;
+		errno = 0;
+		value = strtoul(text, &end, 10);
+		if (errno || !value || value > SIZE_MAX / 2)
+			return false;
+		if (*end == '\0')
+			return true;
+		if (*end != ',')
+			return false;
+		text = end + 1;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = "wgbench0", *peer_counts = "1000,10000,50000";
+	bool skip_local = false;
+	char *counts, *count, *saveptr;
+	size_t num_peers;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:p:sh")) != -1) {
+		switch (opt) {
+		case 'i':
+			name = optarg;
+			break;
+		case 'p':
+			if (!valid_counts(optarg)) {
+				fprintf(stderr, "%s: invalid peer counts '%s'\n", argv[0], optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			peer_counts = optarg;
+			break;
+		case 's':
+			skip_local = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!skip_local)
+		bench_keys();
+	counts = strdup(peer_counts);
+	if (!counts) {
+		perror("strdup");
+		return 1;
+	}
+	for (count = strtok_r(counts, ",", &saveptr); count; count = strtok_r(NULL, ",", &saveptr)) {
+		num_peers = strtoul(count, NULL, 10);
+		if (!skip_local)
+			bench_index(num_peers);
+		bench_device(name, num_peers);
+	}
+	free(counts);
+	return 0;
+}
@@ -10,35 +10,32 @@
 
 void list_devices(void)
 {
-	char *device_names, *device_name;
-	size_t len;
+	wg_pool *pool;
+	wg_device **devices;
+	size_t num_devices, i;
 
-	device_names = wg_list_device_names();
-	if (!device_names) {
-		perror("Unable to get device names");
+	if (wg_pool_open(&pool, 0) < 0) {
+		perror("Unable to start worker pool");
 		exit(1);
 	}
-	wg_for_each_device_name(device_names, device_name, len) {
-		wg_device *device;
+	if (wg_get_devices(pool, &devices, &num_devices) < 0)
+		perror("Unable to get devices");
+	for (i = 0; i < num_devices; ++i) {
+		wg_device *device = devices[i];
 		wg_peer *peer;
 		wg_key_b64_string key;
 
-		if (wg_get_device(&device, device_name) < 0) {
-			perror("Unable to get device");
-			continue;
-		}
 		if (device->flags & WGDEVICE_HAS_PUBLIC_KEY) {
 			wg_key_to_base64(key, device->public_key);
-			printf("%s has public key %s\n", device_name, key);
+			printf("%s has public key %s\n", device->name, key);
 		} else
-			printf("%s has no public key\n", device_name);
+			printf("%s has no public key\n", device->name);
 		wg_for_each_peer(device, peer) {
 			wg_key_to_base64(key, peer->public_key);
 			printf(" - peer %s\n", key);
 		}
-		wg_free_device(device);
 	}
-	free(device_names);
+	wg_pool_close(pool);
 }
 
 int main(int argc, char *argv[])
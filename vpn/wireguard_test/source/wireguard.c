@@ -16,11 +16,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
 
 #include "wireguard.h"
 
@@ -81,6 +89,9 @@ enum wgallowedip_attribute {
 /* libmnl mini library: */
 
 #define MNL_SOCKET_AUTOPID 0
+#define MNL_SOCKET_DUMP_SIZE 32768
+#define MNL_RECV_BATCH 8
+#define MNL_SEND_BATCH 16
 #define MNL_ALIGNTO 4
 #define MNL_ALIGN(len) (((len)+MNL_ALIGNTO-1) & ~(MNL_ALIGNTO-1))
 #define MNL_NLMSG_HDRLEN MNL_ALIGN(sizeof(struct nlmsghdr))
@@ -128,15 +139,18 @@ typedef int (*mnl_cb_t)(const struct nlmsghdr *nlh, void *data);
 #define MNL_ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
 #endif
 
+/* Called from every thread of a wg_pool, hence the atomics. */
 static size_t mnl_ideal_socket_buffer_size(void)
 {
-	static size_t size = 0;
+	static size_t cached = 0;
+	size_t size = __atomic_load_n(&cached, __ATOMIC_RELAXED);
 
 	if (size)
 		return size;
 	size = (size_t)sysconf(_SC_PAGESIZE);
 	if (size > 8192)
 		size = 8192;
+	__atomic_store_n(&cached, size, __ATOMIC_RELAXED);
 	return size;
 }
 
@@ -616,6 +630,46 @@ static ssize_t mnl_socket_sendto(const struct mnl_socket *nl, const void *buf,
 		      (struct sockaddr *) &snl, sizeof(snl));
 }
 
+/* Sends each of the vlen messages as its own datagram, with as few system
+ * calls as the kernel allows. Returns 0, or -1 with errno set. */
+static int mnl_socket_sendmmsg(const struct mnl_socket *nl, struct nlmsghdr **nlhs,
+			       unsigned int vlen)
+{
+	static struct sockaddr_nl snl = {
+		.nl_family = AF_NETLINK
+	};
+	struct iovec iov[MNL_SEND_BATCH];
+	struct mmsghdr msgs[MNL_SEND_BATCH];
+	unsigned int i, sent = 0;
+	int ret;
+
+	if (vlen > MNL_SEND_BATCH) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(msgs, 0, sizeof(msgs[0]) * vlen);
+	for (i = 0; i < vlen; ++i) {
+		iov[i].iov_base = nlhs[i];
+		iov[i].iov_len = nlhs[i]->nlmsg_len;
+		msgs[i].msg_hdr.msg_name = &snl;
+		msgs[i].msg_hdr.msg_namelen = sizeof(snl);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (sent < vlen) {
+		ret = sendmmsg(nl->fd, msgs + sent, vlen - sent, 0);
+		if (ret == -1 && errno == ENOSYS) {
+			if (mnl_socket_sendto(nl, nlhs[sent], nlhs[sent]->nlmsg_len) == -1)
+				return -1;
+			ret = 1;
+		}
+		if (ret == -1)
+			return -1;
+		sent += ret;
+	}
+	return 0;
+}
+
 static ssize_t mnl_socket_recvfrom(const struct mnl_socket *nl, void *buf,
 				   size_t bufsiz)
 {
@@ -649,6 +703,61 @@ static ssize_t mnl_socket_recvfrom(const struct mnl_socket *nl, void *buf,
 	return ret;
 }
 
+/* Receives up to vlen datagrams with a single system call. Datagram i is
+ * stored at buf + i * bufsiz and its length in lens[i]. Returns the number of
+ * datagrams received, or -1 with errno set. */
+static int mnl_socket_recvmmsg(const struct mnl_socket *nl, void *buf, size_t bufsiz,
+			       unsigned int *lens, unsigned int vlen)
+{
+	struct sockaddr_nl addr[MNL_RECV_BATCH];
+	struct iovec iov[MNL_RECV_BATCH];
+	struct mmsghdr msgs[MNL_RECV_BATCH];
+	unsigned int i;
+	ssize_t len;
+	int ret;
+
+	if (vlen > MNL_RECV_BATCH)
+		vlen = MNL_RECV_BATCH;
+	memset(msgs, 0, sizeof(msgs[0]) * vlen);
+	for (i = 0; i < vlen; ++i) {
+		iov[i].iov_base = (char *)buf + i * bufsiz;
+		iov[i].iov_len = bufsiz;
+		msgs[i].msg_hdr.msg_name = &addr[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_nl);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	ret = recvmmsg(nl->fd, msgs, vlen, MSG_WAITFORONE, NULL);
+	if (ret == -1 && errno == ENOSYS) {
+		len = mnl_socket_recvfrom(nl, buf, bufsiz);
+		if (len == -1)
+			return -1;
+		lens[0] = len;
+		return 1;
+	}
+	if (ret == -1)
+		return ret;
+
+	for (i = 0; i < (unsigned int)ret; ++i) {
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			errno = ENOSPC;
+			return -1;
+		}
+		if (msgs[i].msg_hdr.msg_namelen != sizeof(struct sockaddr_nl)) {
+			errno = EINVAL;
+			return -1;
+		}
+		lens[i] = msgs[i].msg_len;
+	}
+	return ret;
+}
+
+/* Returns the size of the next queued datagram without consuming it. */
+static ssize_t mnl_socket_recv_size(const struct mnl_socket *nl)
+{
+	return recv(nl->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+}
+
 static int mnl_socket_close(struct mnl_socket *nl)
 {
 	int ret = close(nl->fd);
@@ -658,27 +767,38 @@ static int mnl_socket_close(struct mnl_socket *nl)
 
 /* mnlg mini library: */
 
+#define MNLG_MAX_MCAST_GROUPS 8
+
+/* Replies are received MNL_RECV_BATCH datagrams at a time, into slots of
+ * rx_bufsiz bytes each. The kernel sizes dump datagrams after the largest
+ * receive buffer it has been offered, up to MNL_SOCKET_DUMP_SIZE, so slots of
+ * that size let each datagram carry as many peers as possible. */
 struct mnlg_socket {
 	struct mnl_socket *nl;
 	char *buf;
+	char *rx_buf;
+	size_t rx_bufsiz;
+	bool dump;
 	uint16_t id;
 	uint8_t version;
 	unsigned int seq;
 	unsigned int portid;
+	uint32_t mcast_groups[MNLG_MAX_MCAST_GROUPS];
+	unsigned int num_mcast_groups;
 };
 
-static struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
-					   uint16_t flags, uint16_t id,
-					   uint8_t version)
+static struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, char *buf,
+					   uint8_t cmd, uint16_t flags,
+					   uint16_t id, uint8_t version)
 {
 	struct nlmsghdr *nlh;
 	struct genlmsghdr *genl;
 
-	nlh = mnl_nlmsg_put_header(nlg->buf);
+	nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type	= id;
 	nlh->nlmsg_flags = flags;
-	nlg->seq = time(NULL);
-	nlh->nlmsg_seq = nlg->seq;
+	nlh->nlmsg_seq = ++nlg->seq;
+	nlg->dump = flags & NLM_F_DUMP;
 
 	genl = mnl_nlmsg_put_extra_header(nlh, sizeof(struct genlmsghdr));
 	genl->cmd = cmd;
@@ -690,7 +810,16 @@ static struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 static struct nlmsghdr *mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 					 uint16_t flags)
 {
-	return __mnlg_msg_prepare(nlg, cmd, flags, nlg->id, nlg->version);
+	return __mnlg_msg_prepare(nlg, nlg->buf, cmd, flags, nlg->id, nlg->version);
+}
+
+/* Like mnlg_msg_prepare(), but builds the message in a caller supplied buffer
+ * of at least mnl_ideal_socket_buffer_size() bytes, so several can be queued
+ * up before sending. */
+static struct nlmsghdr *mnlg_msg_prepare_buf(struct mnlg_socket *nlg, char *buf,
+					     uint8_t cmd, uint16_t flags)
+{
+	return __mnlg_msg_prepare(nlg, buf, cmd, flags, nlg->id, nlg->version);
 }
 
 static int mnlg_socket_send(struct mnlg_socket *nlg, const struct nlmsghdr *nlh)
@@ -746,17 +875,53 @@ static const mnl_cb_t mnlg_cb_array[] = {
 	[NLMSG_OVERRUN]	= mnlg_cb_noop,
 };
 
+static int mnlg_socket_grow_rx(struct mnlg_socket *nlg, size_t bufsiz)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	int rcvbuf;
+	char *rx_buf;
+
+	bufsiz = (bufsiz + page - 1) & ~(page - 1);
+	rx_buf = malloc(bufsiz * MNL_RECV_BATCH);
+	if (!rx_buf)
+		return -1;
+	free(nlg->rx_buf);
+	nlg->rx_buf = rx_buf;
+	nlg->rx_bufsiz = bufsiz;
+
+	/* Leave room to queue a whole batch. Raising the limit past rmem_max
+	 * needs CAP_NET_ADMIN, so settle for what we can get otherwise. */
+	rcvbuf = bufsiz * MNL_RECV_BATCH;
+	if (setsockopt(nlg->nl->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+		setsockopt(nlg->nl->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	return 0;
+}
+
 static int mnlg_socket_recv_run(struct mnlg_socket *nlg, mnl_cb_t data_cb, void *data)
 {
-	int err;
+	unsigned int lens[MNL_RECV_BATCH];
+	int err = MNL_CB_OK, i, n;
+	ssize_t size;
+
+	/* The first datagram of a dump was built before we had a say in its
+	 * size, so peek at it and make room if needed. */
+	if (nlg->dump) {
+		size = mnl_socket_recv_size(nlg->nl);
+		if (size < 0)
+			return -1;
+		if ((size_t)size > nlg->rx_bufsiz && mnlg_socket_grow_rx(nlg, size) < 0)
+			return -1;
+	}
 
 	do {
-		err = mnl_socket_recvfrom(nlg->nl, nlg->buf,
-					  mnl_ideal_socket_buffer_size());
-		if (err <= 0)
-			break;
-		err = mnl_cb_run2(nlg->buf, err, nlg->seq, nlg->portid,
-				  data_cb, data, mnlg_cb_array, MNL_ARRAY_SIZE(mnlg_cb_array));
+		n = mnl_socket_recvmmsg(nlg->nl, nlg->rx_buf, nlg->rx_bufsiz,
+					lens, MNL_RECV_BATCH);
+		if (n <= 0)
+			return n;
+		for (i = 0; i < n && err > 0; ++i)
+			err = mnl_cb_run2(nlg->rx_buf + i * nlg->rx_bufsiz, lens[i],
+					  nlg->seq, nlg->portid, data_cb, data,
+					  mnlg_cb_array, MNL_ARRAY_SIZE(mnlg_cb_array));
 	} while (err > 0);
 
 	return err;
@@ -779,13 +944,25 @@ static int get_family_id_attr_cb(const struct nlattr *attr, void *data)
 
 static int get_family_id_cb(const struct nlmsghdr *nlh, void *data)
 {
-	uint16_t *p_id = data;
+	struct mnlg_socket *nlg = data;
 	struct nlattr *tb[CTRL_ATTR_MAX + 1] = { 0 };
+	struct nlattr *group, *attr;
 
 	mnl_attr_parse(nlh, sizeof(struct genlmsghdr), get_family_id_attr_cb, tb);
 	if (!tb[CTRL_ATTR_FAMILY_ID])
 		return MNL_CB_ERROR;
-	*p_id = mnl_attr_get_u16(tb[CTRL_ATTR_FAMILY_ID]);
+	nlg->id = mnl_attr_get_u16(tb[CTRL_ATTR_FAMILY_ID]);
+
+	if (!tb[CTRL_ATTR_MCAST_GROUPS])
+		return MNL_CB_OK;
+	mnl_attr_for_each_nested(group, tb[CTRL_ATTR_MCAST_GROUPS]) {
+		mnl_attr_for_each_nested(attr, group) {
+			if (mnl_attr_get_type(attr) != CTRL_ATTR_MCAST_GRP_ID || mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+				continue;
+			if (nlg->num_mcast_groups < MNLG_MAX_MCAST_GROUPS)
+				nlg->mcast_groups[nlg->num_mcast_groups++] = mnl_attr_get_u32(attr);
+		}
+	}
 	return MNL_CB_OK;
 }
 
@@ -793,12 +970,15 @@ static struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t ver
 {
 	struct mnlg_socket *nlg;
 	struct nlmsghdr *nlh;
-	int err;
+	int err, one;
 
 	nlg = malloc(sizeof(*nlg));
 	if (!nlg)
 		return NULL;
 	nlg->id = 0;
+	nlg->num_mcast_groups = 0;
+	nlg->rx_buf = NULL;
+	nlg->rx_bufsiz = 0;
 
 	err = -ENOMEM;
 	nlg->buf = malloc(mnl_ideal_socket_buffer_size());
@@ -816,9 +996,25 @@ static struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t ver
 		goto err_mnl_socket_bind;
 	}
 
+	/* Keep ACKs small by not having the request echoed back in them, and
+	 * ask for extended ACKs. Older kernels reject both; that's harmless. */
+	one = 1;
+#ifdef NETLINK_CAP_ACK
+	setsockopt(nlg->nl->fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+#endif
+#ifdef NETLINK_EXT_ACK
+	setsockopt(nlg->nl->fd, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one));
+#endif
+
+	if (mnlg_socket_grow_rx(nlg, MNL_SOCKET_DUMP_SIZE) < 0) {
+		err = -errno;
+		goto err_mnlg_socket_grow_rx;
+	}
+
 	nlg->portid = mnl_socket_get_portid(nlg->nl);
+	nlg->seq = time(NULL);
 
-	nlh = __mnlg_msg_prepare(nlg, CTRL_CMD_GETFAMILY,
+	nlh = __mnlg_msg_prepare(nlg, nlg->buf, CTRL_CMD_GETFAMILY,
 				 NLM_F_REQUEST | NLM_F_ACK, GENL_ID_CTRL, 1);
 	mnl_attr_put_strz(nlh, CTRL_ATTR_FAMILY_NAME, family_name);
 
@@ -828,7 +1024,7 @@ static struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t ver
 	}
 
 	errno = 0;
-	if (mnlg_socket_recv_run(nlg, get_family_id_cb, &nlg->id) < 0) {
+	if (mnlg_socket_recv_run(nlg, get_family_id_cb, nlg) < 0) {
 		errno = errno == ENOENT ? EPROTONOSUPPORT : errno;
 		err = errno ? -errno : -ENOSYS;
 		goto err_mnlg_socket_recv_run;
@@ -840,6 +1036,8 @@ static struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t ver
 
 err_mnlg_socket_recv_run:
 err_mnlg_socket_send:
+	free(nlg->rx_buf);
+err_mnlg_socket_grow_rx:
 err_mnl_socket_bind:
 	mnl_socket_close(nlg->nl);
 err_mnl_socket_open:
@@ -853,12 +1051,74 @@ err_buf_alloc:
 static void mnlg_socket_close(struct mnlg_socket *nlg)
 {
 	mnl_socket_close(nlg->nl);
+	free(nlg->rx_buf);
 	free(nlg->buf);
 	free(nlg);
 }
 
 /* wireguard-specific parts: */
 
+/* Both sockets are opened on first use and then kept for the lifetime of the
+ * session, so that the generic netlink family lookup and the binds happen once
+ * rather than on every call. Whenever a request fails, the socket it used is
+ * dropped, since it may still hold the unread remainder of that exchange, and
+ * the next call opens a fresh one. */
+struct wg_session {
+	struct mnlg_socket *nlg;
+	struct mnl_socket *rtnl;
+	char *rtnl_buffer;
+	unsigned int rtnl_seq;
+};
+
+static struct mnlg_socket *session_genl(wg_session *session)
+{
+	if (!session->nlg)
+		session->nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	return session->nlg;
+}
+
+static void session_genl_reset(wg_session *session)
+{
+	if (session->nlg)
+		mnlg_socket_close(session->nlg);
+	session->nlg = NULL;
+}
+
+static struct mnl_socket *session_rtnl(wg_session *session)
+{
+	int err;
+
+	if (session->rtnl)
+		return session->rtnl;
+
+	if (!session->rtnl_buffer) {
+		session->rtnl_buffer = calloc(mnl_ideal_socket_buffer_size(), 1);
+		if (!session->rtnl_buffer)
+			return NULL;
+	}
+
+	session->rtnl = mnl_socket_open(NETLINK_ROUTE);
+	if (!session->rtnl)
+		return NULL;
+
+	if (mnl_socket_bind(session->rtnl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		err = errno;
+		mnl_socket_close(session->rtnl);
+		session->rtnl = NULL;
+		errno = err;
+		return NULL;
+	}
+	session->rtnl_seq = time(NULL);
+	return session->rtnl;
+}
+
+static void session_rtnl_reset(wg_session *session)
+{
+	if (session->rtnl)
+		mnl_socket_close(session->rtnl);
+	session->rtnl = NULL;
+}
+
 struct string_list {
 	char *buffer;
 	size_t len;
@@ -890,6 +1150,93 @@ static int string_list_add(struct string_list *list, const char *str)
 	return 0;
 }
 
+/* Arena chunks are handed out in increasing size. Once an arena has been
+ * reset, it holds a single chunk as large as everything it handed out before,
+ * so that fetching a device of the same size again needs no allocation. */
+#define WG_ARENA_MIN_CHUNK 16384
+#define WG_ARENA_ALIGN 16
+
+struct wg_arena_chunk {
+	struct wg_arena_chunk *next;
+	size_t size, used;
+	char data[];
+};
+
+struct wg_arena {
+	struct wg_arena_chunk *chunk;
+	size_t capacity;
+};
+
+static void *wg_arena_alloc(wg_arena *arena, size_t size)
+{
+	struct wg_arena_chunk *chunk = arena->chunk;
+	size_t offset, chunk_size;
+
+	size = (size + WG_ARENA_ALIGN - 1) & ~(size_t)(WG_ARENA_ALIGN - 1);
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk_size = chunk ? chunk->size * 2 : WG_ARENA_MIN_CHUNK;
+		if (chunk_size < size)
+			chunk_size = size;
+		/* Leave room to align the first allocation of the chunk. */
+		chunk_size += WG_ARENA_ALIGN;
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+		chunk->size = chunk_size;
+		chunk->used = -(uintptr_t)chunk->data & (WG_ARENA_ALIGN - 1);
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
+		arena->capacity += chunk_size;
+	}
+	offset = chunk->used;
+	chunk->used += size;
+	memset(chunk->data + offset, 0, size);
+	return chunk->data + offset;
+}
+
+static void wg_arena_release(wg_arena *arena)
+{
+	struct wg_arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunk; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunk = NULL;
+	arena->capacity = 0;
+}
+
+int wg_arena_new(wg_arena **arena)
+{
+	*arena = calloc(1, sizeof(**arena));
+	if (!*arena)
+		return -errno;
+	return 0;
+}
+
+void wg_arena_reset(wg_arena *arena)
+{
+	size_t capacity = arena->capacity;
+
+	if (arena->chunk && !arena->chunk->next) {
+		arena->chunk->used = -(uintptr_t)arena->chunk->data & (WG_ARENA_ALIGN - 1);
+		return;
+	}
+	wg_arena_release(arena);
+	if (capacity)
+		wg_arena_alloc(arena, capacity);
+	if (arena->chunk)
+		arena->chunk->used = -(uintptr_t)arena->chunk->data & (WG_ARENA_ALIGN - 1);
+}
+
+void wg_arena_free(wg_arena *arena)
+{
+	if (!arena)
+		return;
+	wg_arena_release(arena);
+	free(arena);
+}
+
 struct interface {
 	const char *name;
 	bool is_wireguard;
@@ -933,10 +1280,10 @@ static int read_devices_cb(const struct nlmsghdr *nlh, void *data)
 	return MNL_CB_OK;
 }
 
-static int fetch_device_names(struct string_list *list)
+static int fetch_device_names(wg_session *session, struct string_list *list)
 {
-	struct mnl_socket *nl = NULL;
-	char *rtnl_buffer = NULL;
+	struct mnl_socket *nl;
+	char *rtnl_buffer;
 	size_t message_len;
 	unsigned int portid, seq;
 	ssize_t len;
@@ -944,23 +1291,12 @@ static int fetch_device_names(struct string_list *list)
 	struct nlmsghdr *nlh;
 	struct ifinfomsg *ifm;
 
-	ret = -ENOMEM;
-	rtnl_buffer = calloc(mnl_ideal_socket_buffer_size(), 1);
-	if (!rtnl_buffer)
-		goto cleanup;
-
-	nl = mnl_socket_open(NETLINK_ROUTE);
-	if (!nl) {
-		ret = -errno;
-		goto cleanup;
-	}
-
-	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
-		ret = -errno;
-		goto cleanup;
-	}
+	nl = session_rtnl(session);
+	if (!nl)
+		return -errno;
+	rtnl_buffer = session->rtnl_buffer;
 
-	seq = time(NULL);
+	seq = ++session->rtnl_seq;
 	portid = mnl_socket_get_portid(nl);
 	nlh = mnl_nlmsg_put_header(rtnl_buffer);
 	nlh->nlmsg_type = RTM_GETLINK;
@@ -990,21 +1326,22 @@ another:
 			ret = -errno;
 			goto cleanup;
 		}
+		/* The rest of the interrupted dump is still queued on the socket. */
+		session_rtnl_reset(session);
 	}
 	if (len == MNL_CB_OK + 1)
 		goto another;
 	ret = 0;
 
 cleanup:
-	free(rtnl_buffer);
-	if (nl)
-		mnl_socket_close(nl);
+	if (ret)
+		session_rtnl_reset(session);
 	return ret;
 }
 
-static int add_del_iface(const char *ifname, bool add)
+static int add_del_iface(wg_session *session, const char *ifname, bool add)
 {
-	struct mnl_socket *nl = NULL;
+	struct mnl_socket *nl;
 	char *rtnl_buffer;
 	ssize_t len;
 	int ret;
@@ -1012,27 +1349,15 @@ static int add_del_iface(const char *ifname, bool add)
 	struct ifinfomsg *ifm;
 	struct nlattr *nest;
 
-	rtnl_buffer = calloc(mnl_ideal_socket_buffer_size(), 1);
-	if (!rtnl_buffer) {
-		ret = -ENOMEM;
-		goto cleanup;
-	}
-
-	nl = mnl_socket_open(NETLINK_ROUTE);
-	if (!nl) {
-		ret = -errno;
-		goto cleanup;
-	}
-
-	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
-		ret = -errno;
-		goto cleanup;
-	}
+	nl = session_rtnl(session);
+	if (!nl)
+		return -errno;
+	rtnl_buffer = session->rtnl_buffer;
 
 	nlh = mnl_nlmsg_put_header(rtnl_buffer);
 	nlh->nlmsg_type = add ? RTM_NEWLINK : RTM_DELLINK;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | (add ? NLM_F_CREATE | NLM_F_EXCL : 0);
-	nlh->nlmsg_seq = time(NULL);
+	nlh->nlmsg_seq = ++session->rtnl_seq;
 	ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
 	mnl_attr_put_strz(nlh, IFLA_IFNAME, ifname);
@@ -1055,27 +1380,20 @@ static int add_del_iface(const char *ifname, bool add)
 	ret = 0;
 
 cleanup:
-	free(rtnl_buffer);
-	if (nl)
-		mnl_socket_close(nl);
+	if (ret)
+		session_rtnl_reset(session);
 	return ret;
 }
 
-int wg_set_device(wg_device *dev)
+/* Fills nlh with as much of dev as fits, starting at *peer_p and *allowedip_p,
+ * which are both NULL for the first chunk, and advances them past what was
+ * added. Once *peer_p is left NULL the whole device has been serialized. */
+static void put_set_device_chunk(struct nlmsghdr *nlh, wg_device *dev, wg_peer **peer_p, wg_allowedip **allowedip_p)
 {
-	int ret = 0;
-	wg_peer *peer = NULL;
-	wg_allowedip *allowedip = NULL;
+	wg_peer *peer = *peer_p;
+	wg_allowedip *allowedip = *allowedip_p;
 	struct nlattr *peers_nest, *peer_nest, *allowedips_nest, *allowedip_nest;
-	struct nlmsghdr *nlh;
-	struct mnlg_socket *nlg;
-
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
-	if (!nlg)
-		return -errno;
 
-again:
-	nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
 	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, dev->name);
 
 	if (!peer) {
@@ -1093,7 +1411,7 @@ again:
 			mnl_attr_put_u32(nlh, WGDEVICE_A_FLAGS, flags);
 	}
 	if (!dev->first_peer)
-		goto send;
+		goto out;
 	peers_nest = peer_nest = allowedips_nest = allowedip_nest = NULL;
 	peers_nest = mnl_attr_nest_start(nlh, WGDEVICE_A_PEERS);
 	for (peer = peer ? peer : dev->first_peer; peer; peer = peer->next_peer) {
@@ -1162,7 +1480,7 @@ again:
 	}
 	mnl_attr_nest_end(nlh, peers_nest);
 	peers_nest = NULL;
-	goto send;
+	goto out;
 toobig_allowedips:
 	if (allowedip_nest)
 		mnl_attr_nest_cancel(nlh, allowedip_nest);
@@ -1170,13 +1488,32 @@ toobig_allowedips:
 		mnl_attr_nest_end(nlh, allowedips_nest);
 	mnl_attr_nest_end(nlh, peer_nest);
 	mnl_attr_nest_end(nlh, peers_nest);
-	goto send;
+	goto out;
 toobig_peers:
 	if (peer_nest)
 		mnl_attr_nest_cancel(nlh, peer_nest);
 	mnl_attr_nest_end(nlh, peers_nest);
-	goto send;
-send:
+	goto out;
+out:
+	*peer_p = peer;
+	*allowedip_p = allowedip;
+}
+
+int wg_session_set_device(wg_session *session, wg_device *dev)
+{
+	int ret = 0;
+	wg_peer *peer = NULL;
+	wg_allowedip *allowedip = NULL;
+	struct nlmsghdr *nlh;
+	struct mnlg_socket *nlg;
+
+	nlg = session_genl(session);
+	if (!nlg)
+		return -errno;
+
+again:
+	nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
+	put_set_device_chunk(nlh, dev, &peer, &allowedip);
 	if (mnlg_socket_send(nlg, nlh) < 0) {
 		ret = -errno;
 		goto out;
@@ -1190,7 +1527,119 @@ send:
 		goto again;
 
 out:
-	mnlg_socket_close(nlg);
+	if (ret)
+		session_genl_reset(session);
+	errno = -ret;
+	return ret;
+}
+
+struct set_pipeline {
+	unsigned int first_seq;
+	unsigned int num_chunks;
+	unsigned int acked;
+	int error;
+};
+
+static int set_pipeline_cb_error(const struct nlmsghdr *nlh, void *data)
+{
+	const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+	struct set_pipeline *pipeline = data;
+
+	if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(struct nlmsgerr))) {
+		errno = EBADMSG;
+		return MNL_CB_ERROR;
+	}
+	if (nlh->nlmsg_seq - pipeline->first_seq >= pipeline->num_chunks) {
+		errno = EPROTO;
+		return MNL_CB_ERROR;
+	}
+	++pipeline->acked;
+	if (err->error && !pipeline->error)
+		pipeline->error = err->error < 0 ? -err->error : err->error;
+	return MNL_CB_OK;
+}
+
+static const mnl_cb_t set_pipeline_cb_array[] = {
+	[NLMSG_NOOP]	= mnlg_cb_noop,
+	[NLMSG_ERROR]	= set_pipeline_cb_error,
+	[NLMSG_DONE]	= mnlg_cb_noop,
+	[NLMSG_OVERRUN]	= mnlg_cb_noop,
+};
+
+/* Collects one ACK for every chunk of the pipeline, in whatever order and
+ * grouping the kernel queued them. */
+static int set_pipeline_recv_acks(struct mnlg_socket *nlg, struct set_pipeline *pipeline)
+{
+	unsigned int lens[MNL_RECV_BATCH];
+	int i, n;
+
+	while (pipeline->acked < pipeline->num_chunks) {
+		n = mnl_socket_recvmmsg(nlg->nl, nlg->rx_buf, nlg->rx_bufsiz,
+					lens, MNL_RECV_BATCH);
+		if (n < 0)
+			return -1;
+		for (i = 0; i < n; ++i) {
+			if (mnl_cb_run2(nlg->rx_buf + i * nlg->rx_bufsiz, lens[i], 0,
+					nlg->portid, NULL, pipeline, set_pipeline_cb_array,
+					MNL_ARRAY_SIZE(set_pipeline_cb_array)) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Like wg_session_set_device(), but instead of waiting for each chunk to be
+ * acknowledged before building the next one, up to MNL_SEND_BATCH
+ * chunks are sent with a single system call and their ACKs collected
+ * afterwards. As every chunk in a window is applied even when an earlier
+ * one fails, an error may leave more of dev configured than it would with
+ * wg_session_set_device(). */
+int wg_session_set_device_pipelined(wg_session *session, wg_device *dev)
+{
+	struct nlmsghdr *msgs[MNL_SEND_BATCH];
+	struct set_pipeline pipeline;
+	size_t bufsiz = mnl_ideal_socket_buffer_size();
+	wg_peer *peer = NULL;
+	wg_allowedip *allowedip = NULL;
+	struct mnlg_socket *nlg;
+	bool first = true;
+	char *bufs;
+	int ret = 0;
+
+	nlg = session_genl(session);
+	if (!nlg)
+		return -errno;
+	bufs = malloc(bufsiz * MNL_SEND_BATCH);
+	if (!bufs)
+		return -errno;
+
+	while (first || peer) {
+		memset(&pipeline, 0, sizeof(pipeline));
+		pipeline.first_seq = nlg->seq + 1;
+		while (pipeline.num_chunks < MNL_SEND_BATCH && (first || peer)) {
+			msgs[pipeline.num_chunks] = mnlg_msg_prepare_buf(nlg, bufs + pipeline.num_chunks * bufsiz,
+									 WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
+			put_set_device_chunk(msgs[pipeline.num_chunks++], dev, &peer, &allowedip);
+			first = false;
+		}
+		if (mnl_socket_sendmmsg(nlg->nl, msgs, pipeline.num_chunks) < 0) {
+			ret = -errno;
+			goto out;
+		}
+		if (set_pipeline_recv_acks(nlg, &pipeline) < 0) {
+			ret = errno ? -errno : -EINVAL;
+			goto out;
+		}
+		if (pipeline.error) {
+			ret = -pipeline.error;
+			goto out;
+		}
+	}
+
+out:
+	free(bufs);
+	if (ret)
+		session_genl_reset(session);
 	errno = -ret;
 	return ret;
 }
@@ -1221,10 +1670,40 @@ static int parse_allowedip(const struct nlattr *attr, void *data)
 	return MNL_CB_OK;
 }
 
+/* Threaded through the device parsing callbacks. Without an arena, every node
+ * is allocated separately and wg_free_device() releases them. */
+struct device_ctx {
+	mnl_attr_cb_t parse_peers;
+	wg_device *device;
+	wg_peer *peer;
+	wg_arena *arena;
+	wg_flat_device *flat;
+	bool compact;
+	wg_peer_stats *stats;
+	size_t num_stats, max_stats;
+	wg_key last_public_key;
+	wg_peer_view_cb view_cb;
+	void *view_data;
+	size_t num_views;
+};
+
+static void *device_ctx_alloc(struct device_ctx *ctx, size_t size)
+{
+	void *ptr;
+
+	if (!ctx->arena)
+		return calloc(1, size);
+	ptr = wg_arena_alloc(ctx->arena, size);
+	if (!ptr)
+		errno = ENOMEM;
+	return ptr;
+}
+
 static int parse_allowedips(const struct nlattr *attr, void *data)
 {
-	wg_peer *peer = data;
-	wg_allowedip *new_allowedip = calloc(1, sizeof(wg_allowedip));
+	struct device_ctx *ctx = data;
+	wg_peer *peer = ctx->peer;
+	wg_allowedip *new_allowedip = device_ctx_alloc(ctx, sizeof(wg_allowedip));
 	int ret;
 
 	if (!new_allowedip)
@@ -1245,38 +1724,162 @@ static int parse_allowedips(const struct nlattr *attr, void *data)
 	return MNL_CB_OK;
 }
 
-bool wg_key_is_zero(const wg_key key)
+static int array_reserve(void **array, size_t *cap, size_t num, size_t size, size_t min_cap)
 {
-	volatile uint8_t acc = 0;
-	unsigned int i;
+	size_t new_cap = *cap ? *cap * 2 : min_cap;
+	void *ptr;
 
-	for (i = 0; i < sizeof(wg_key); ++i) {
-		acc |= key[i];
-		__asm__ ("" : "=r" (acc) : "0" (acc));
-	}
-	return 1 & ((acc - 1) >> 8);
+	if (num < *cap)
+		return 0;
+	if (!(ptr = realloc(*array, new_cap * size)))
+		return -1;
+	*array = ptr;
+	*cap = new_cap;
+	return 0;
 }
 
-static int parse_peer(const struct nlattr *attr, void *data)
+static int flat_device_reserve_peer(wg_flat_device *dev)
 {
-	wg_peer *peer = data;
+	size_t cap = dev->peers_cap ? dev->peers_cap * 2 : 64;
+	void *ptr;
 
-	switch (mnl_attr_get_type(attr)) {
-	case WGPEER_A_UNSPEC:
-		break;
-	case WGPEER_A_PUBLIC_KEY:
-		if (mnl_attr_get_payload_len(attr) == sizeof(peer->public_key)) {
-			memcpy(peer->public_key, mnl_attr_get_payload(attr), sizeof(peer->public_key));
-			peer->flags |= WGPEER_HAS_PUBLIC_KEY;
-		}
-		break;
-	case WGPEER_A_PRESHARED_KEY:
-		if (mnl_attr_get_payload_len(attr) == sizeof(peer->preshared_key)) {
-			memcpy(peer->preshared_key, mnl_attr_get_payload(attr), sizeof(peer->preshared_key));
-			if (!wg_key_is_zero(peer->preshared_key))
-				peer->flags |= WGPEER_HAS_PRESHARED_KEY;
-		}
-		break;
+	if (dev->num_peers < dev->peers_cap)
+		return 0;
+	if (!(ptr = realloc(dev->peers, cap * sizeof(*dev->peers))))
+		return -1;
+	dev->peers = ptr;
+	if (!(ptr = realloc(dev->rx_bytes, cap * sizeof(*dev->rx_bytes))))
+		return -1;
+	dev->rx_bytes = ptr;
+	if (!(ptr = realloc(dev->tx_bytes, cap * sizeof(*dev->tx_bytes))))
+		return -1;
+	dev->tx_bytes = ptr;
+	if (!(ptr = realloc(dev->last_handshake_time, cap * sizeof(*dev->last_handshake_time))))
+		return -1;
+	dev->last_handshake_time = ptr;
+	dev->peers_cap = cap;
+	return 0;
+}
+
+static int flat_device_reserve_allowedip(wg_flat_device *dev)
+{
+	return array_reserve((void **)&dev->allowedips, &dev->allowedips_cap, dev->num_allowedips, sizeof(*dev->allowedips), 256);
+}
+
+static int parse_flat_allowedips(const struct nlattr *attr, void *data)
+{
+	struct device_ctx *ctx = data;
+	wg_flat_device *dev = ctx->flat;
+	wg_allowedip *allowedip;
+	int ret;
+
+	if (flat_device_reserve_allowedip(dev) < 0)
+		return MNL_CB_ERROR;
+	allowedip = &dev->allowedips[dev->num_allowedips];
+	memset(allowedip, 0, sizeof(*allowedip));
+	ret = mnl_attr_parse_nested(attr, parse_allowedip, allowedip);
+	if (ret != MNL_CB_OK)
+		return ret;
+	if (!((allowedip->family == AF_INET && allowedip->cidr <= 32) || (allowedip->family == AF_INET6 && allowedip->cidr <= 128))) {
+		errno = EAFNOSUPPORT;
+		return MNL_CB_ERROR;
+	}
+	++dev->num_allowedips;
+	return MNL_CB_OK;
+}
+
+static const uint8_t zero_addr[16];
+
+/* Reads one allowed IP without copying its address out of the buffer. */
+static int parse_allowedip_view(const struct nlattr *attr, wg_allowedip_view *allowedip)
+{
+	const struct nlattr *ip_attr;
+	const void *addr = NULL;
+	uint16_t addr_len = 0;
+
+	allowedip->family = 0;
+	allowedip->cidr = 0;
+	mnl_attr_for_each_nested(ip_attr, attr) {
+		switch (mnl_attr_get_type(ip_attr)) {
+		case WGALLOWEDIP_A_FAMILY:
+			if (!mnl_attr_validate(ip_attr, MNL_TYPE_U16))
+				allowedip->family = mnl_attr_get_u16(ip_attr);
+			break;
+		case WGALLOWEDIP_A_IPADDR:
+			addr = mnl_attr_get_payload(ip_attr);
+			addr_len = mnl_attr_get_payload_len(ip_attr);
+			break;
+		case WGALLOWEDIP_A_CIDR_MASK:
+			if (!mnl_attr_validate(ip_attr, MNL_TYPE_U8))
+				allowedip->cidr = mnl_attr_get_u8(ip_attr);
+			break;
+		}
+	}
+	if (!((allowedip->family == AF_INET && allowedip->cidr <= 32) || (allowedip->family == AF_INET6 && allowedip->cidr <= 128))) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+	allowedip->addr = addr_len == (allowedip->family == AF_INET ? 4 : 16) ? addr : zero_addr;
+	return 0;
+}
+
+/* Each allowed IP is decoded from the attributes straight into the packed
+ * array of its family. */
+static int parse_compact_allowedips(const struct nlattr *attr, void *data)
+{
+	struct device_ctx *ctx = data;
+	wg_flat_device *dev = ctx->flat;
+	wg_allowedip_view allowedip;
+
+	if (parse_allowedip_view(attr, &allowedip) < 0)
+		return MNL_CB_ERROR;
+	if (allowedip.family == AF_INET) {
+		if (array_reserve((void **)&dev->prefixes4, &dev->prefixes4_cap, dev->num_prefixes4, sizeof(*dev->prefixes4), 1024) < 0)
+			return MNL_CB_ERROR;
+		memcpy(dev->prefixes4[dev->num_prefixes4].addr, allowedip.addr, 4);
+		dev->prefixes4[dev->num_prefixes4++].cidr = allowedip.cidr;
+	} else {
+		if (array_reserve((void **)&dev->prefixes6, &dev->prefixes6_cap, dev->num_prefixes6, sizeof(*dev->prefixes6), 256) < 0)
+			return MNL_CB_ERROR;
+		memcpy(dev->prefixes6[dev->num_prefixes6].addr, allowedip.addr, 16);
+		dev->prefixes6[dev->num_prefixes6++].cidr = allowedip.cidr;
+	}
+	return MNL_CB_OK;
+}
+
+bool wg_key_is_zero(const wg_key key)
+{
+	volatile uint8_t acc = 0;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(wg_key); ++i) {
+		acc |= key[i];
+		__asm__ ("" : "=r" (acc) : "0" (acc));
+	}
+	return 1 & ((acc - 1) >> 8);
+}
+
+static int parse_peer(const struct nlattr *attr, void *data)
+{
+	struct device_ctx *ctx = data;
+	wg_peer *peer = ctx->peer;
+
+	switch (mnl_attr_get_type(attr)) {
+	case WGPEER_A_UNSPEC:
+		break;
+	case WGPEER_A_PUBLIC_KEY:
+		if (mnl_attr_get_payload_len(attr) == sizeof(peer->public_key)) {
+			memcpy(peer->public_key, mnl_attr_get_payload(attr), sizeof(peer->public_key));
+			peer->flags |= WGPEER_HAS_PUBLIC_KEY;
+		}
+		break;
+	case WGPEER_A_PRESHARED_KEY:
+		if (mnl_attr_get_payload_len(attr) == sizeof(peer->preshared_key)) {
+			memcpy(peer->preshared_key, mnl_attr_get_payload(attr), sizeof(peer->preshared_key));
+			if (!wg_key_is_zero(peer->preshared_key))
+				peer->flags |= WGPEER_HAS_PRESHARED_KEY;
+		}
+		break;
 	case WGPEER_A_ENDPOINT: {
 		struct sockaddr *addr;
 
@@ -1306,16 +1909,83 @@ static int parse_peer(const struct nlattr *attr, void *data)
 			peer->tx_bytes = mnl_attr_get_u64(attr);
 		break;
 	case WGPEER_A_ALLOWEDIPS:
-		return mnl_attr_parse_nested(attr, parse_allowedips, peer);
+		if (ctx->compact)
+			return mnl_attr_parse_nested(attr, parse_compact_allowedips, ctx);
+		return mnl_attr_parse_nested(attr, ctx->flat ? parse_flat_allowedips : parse_allowedips, ctx);
 	}
 
 	return MNL_CB_OK;
 }
 
+/* Open addressing table of the peers of a device, keyed by public key. It is
+ * kept at most half full. */
+struct wg_peer_index {
+	size_t mask, count;
+	wg_peer *slots[];
+};
+
+static size_t peer_index_hash(const wg_key key)
+{
+	uint64_t words[4];
+
+	memcpy(words, key, sizeof(words));
+	return (words[0] ^ words[1] ^ words[2] ^ words[3]) * 0x9e3779b97f4a7c15ULL >> 32;
+}
+
+static wg_peer **peer_index_slot(struct wg_peer_index *index, const wg_key key)
+{
+	size_t i = peer_index_hash(key) & index->mask;
+
+	while (index->slots[i] && memcmp(index->slots[i]->public_key, key, sizeof(wg_key)))
+		i = (i + 1) & index->mask;
+	return &index->slots[i];
+}
+
+static wg_peer *peer_index_find(struct wg_peer_index *index, const wg_key key)
+{
+	return index ? *peer_index_slot(index, key) : NULL;
+}
+
+static int peer_index_insert(struct device_ctx *ctx, wg_peer *peer)
+{
+	struct wg_peer_index *index = ctx->device->peer_index, *new_index;
+	wg_peer **slot;
+	size_t size, i;
+
+	if (!index || (index->count + 1) * 2 > index->mask + 1) {
+		size = index ? (index->mask + 1) * 2 : 64;
+		new_index = device_ctx_alloc(ctx, sizeof(*new_index) + size * sizeof(wg_peer *));
+		if (!new_index)
+			return -1;
+		new_index->mask = size - 1;
+		if (index) {
+			for (i = 0; i <= index->mask; ++i) {
+				if (index->slots[i])
+					*peer_index_slot(new_index, index->slots[i]->public_key) = index->slots[i];
+			}
+			new_index->count = index->count;
+			if (!ctx->arena)
+				free(index);
+		}
+		ctx->device->peer_index = index = new_index;
+	}
+	slot = peer_index_slot(index, peer->public_key);
+	if (!*slot)
+		++index->count;
+	*slot = peer;
+	return 0;
+}
+
+/* A peer with more allowed IPs than fit in one message is continued in the
+ * next one, carrying only its public key and the remaining allowed IPs. Those
+ * continuations are folded into the first occurrence of the peer as they
+ * arrive, wherever they are in the dump. */
 static int parse_peers(const struct nlattr *attr, void *data)
 {
-	wg_device *device = data;
-	wg_peer *new_peer = calloc(1, sizeof(wg_peer));
+	struct device_ctx *ctx = data;
+	wg_device *device = ctx->device;
+	wg_peer *new_peer = device_ctx_alloc(ctx, sizeof(wg_peer));
+	wg_peer *prev_last_peer = device->last_peer, *peer;
 	int ret;
 
 	if (!new_peer)
@@ -1326,19 +1996,254 @@ static int parse_peers(const struct nlattr *attr, void *data)
 		device->last_peer->next_peer = new_peer;
 		device->last_peer = new_peer;
 	}
-	ret = mnl_attr_parse_nested(attr, parse_peer, new_peer);
+	ctx->peer = new_peer;
+	ret = mnl_attr_parse_nested(attr, parse_peer, ctx);
 	if (!ret)
 		return ret;
 	if (!(new_peer->flags & WGPEER_HAS_PUBLIC_KEY)) {
 		errno = ENXIO;
 		return MNL_CB_ERROR;
 	}
+
+	peer = peer_index_find(device->peer_index, new_peer->public_key);
+	if (!peer)
+		return peer_index_insert(ctx, new_peer) < 0 ? MNL_CB_ERROR : MNL_CB_OK;
+
+	if (!peer->first_allowedip)
+		peer->first_allowedip = new_peer->first_allowedip;
+	else
+		peer->last_allowedip->next_allowedip = new_peer->first_allowedip;
+	if (new_peer->first_allowedip)
+		peer->last_allowedip = new_peer->last_allowedip;
+	device->last_peer = prev_last_peer;
+	prev_last_peer->next_peer = NULL;
+	if (!ctx->arena)
+		free(new_peer);
+	return MNL_CB_OK;
+}
+
+wg_peer *wg_device_find_peer(const wg_device *dev, const wg_key public_key)
+{
+	wg_peer *peer;
+
+	if (dev->peer_index)
+		return peer_index_find(dev->peer_index, public_key);
+	wg_for_each_peer(dev, peer) {
+		if (!memcmp(peer->public_key, public_key, sizeof(wg_key)))
+			return peer;
+	}
+	return NULL;
+}
+
+/* Peers are parsed into a scratch wg_peer and then scattered into the flat
+ * arrays, while their allowed IPs are appended to dev->allowedips directly. */
+static int parse_flat_peers(const struct nlattr *attr, void *data)
+{
+	struct device_ctx *ctx = data;
+	wg_flat_device *dev = ctx->flat;
+	size_t first_allowedip = dev->num_allowedips, i;
+	size_t first_prefix4 = dev->num_prefixes4, first_prefix6 = dev->num_prefixes6;
+	wg_flat_peer *flat_peer;
+	wg_peer peer = { 0 };
+	int ret;
+
+	ctx->peer = &peer;
+	ret = mnl_attr_parse_nested(attr, parse_peer, ctx);
+	ctx->peer = NULL;
+	if (ret != MNL_CB_OK)
+		return ret;
+	if (!(peer.flags & WGPEER_HAS_PUBLIC_KEY)) {
+		errno = ENXIO;
+		return MNL_CB_ERROR;
+	}
+
+	/* A peer whose allowed IPs did not fit in one message is continued at
+	 * the start of the next one, so its allowed IPs are still contiguous. */
+	if (dev->num_peers && !memcmp(dev->peers[dev->num_peers - 1].public_key, peer.public_key, sizeof(wg_key))) {
+		flat_peer = &dev->peers[dev->num_peers - 1];
+		flat_peer->num_allowedips += dev->num_allowedips - first_allowedip;
+		flat_peer->num_prefixes4 += dev->num_prefixes4 - first_prefix4;
+		flat_peer->num_prefixes6 += dev->num_prefixes6 - first_prefix6;
+		return MNL_CB_OK;
+	}
+
+	if (flat_device_reserve_peer(dev) < 0)
+		return MNL_CB_ERROR;
+	i = dev->num_peers++;
+	flat_peer = &dev->peers[i];
+	flat_peer->flags = peer.flags;
+	memcpy(flat_peer->public_key, peer.public_key, sizeof(flat_peer->public_key));
+	memcpy(flat_peer->preshared_key, peer.preshared_key, sizeof(flat_peer->preshared_key));
+	flat_peer->endpoint = peer.endpoint;
+	flat_peer->persistent_keepalive_interval = peer.persistent_keepalive_interval;
+	flat_peer->first_allowedip = first_allowedip;
+	flat_peer->num_allowedips = dev->num_allowedips - first_allowedip;
+	flat_peer->first_prefix4 = first_prefix4;
+	flat_peer->num_prefixes4 = dev->num_prefixes4 - first_prefix4;
+	flat_peer->first_prefix6 = first_prefix6;
+	flat_peer->num_prefixes6 = dev->num_prefixes6 - first_prefix6;
+	dev->rx_bytes[i] = peer.rx_bytes;
+	dev->tx_bytes[i] = peer.tx_bytes;
+	dev->last_handshake_time[i] = peer.last_handshake_time;
+	return MNL_CB_OK;
+}
+
+/* Only the attributes reported in wg_peer_stats are looked at; allowed IPs
+ * are skipped over without being parsed. Entries past max_stats are counted
+ * but not stored. */
+static int parse_stats_peers(const struct nlattr *attr, void *data)
+{
+	struct device_ctx *ctx = data;
+	const struct nlattr *peer_attr;
+	wg_peer_stats stats = { 0 };
+	bool has_public_key = false;
+
+	mnl_attr_for_each_nested(peer_attr, attr) {
+		switch (mnl_attr_get_type(peer_attr)) {
+		case WGPEER_A_PUBLIC_KEY:
+			if (mnl_attr_get_payload_len(peer_attr) == sizeof(stats.public_key)) {
+				memcpy(stats.public_key, mnl_attr_get_payload(peer_attr), sizeof(stats.public_key));
+				has_public_key = true;
+			}
+			break;
+		case WGPEER_A_ENDPOINT: {
+			struct sockaddr *addr;
+
+			if (mnl_attr_get_payload_len(peer_attr) < sizeof(*addr))
+				break;
+			addr = mnl_attr_get_payload(peer_attr);
+			if (addr->sa_family == AF_INET && mnl_attr_get_payload_len(peer_attr) == sizeof(stats.endpoint.addr4))
+				memcpy(&stats.endpoint.addr4, addr, sizeof(stats.endpoint.addr4));
+			else if (addr->sa_family == AF_INET6 && mnl_attr_get_payload_len(peer_attr) == sizeof(stats.endpoint.addr6))
+				memcpy(&stats.endpoint.addr6, addr, sizeof(stats.endpoint.addr6));
+			break;
+		}
+		case WGPEER_A_LAST_HANDSHAKE_TIME:
+			if (mnl_attr_get_payload_len(peer_attr) == sizeof(stats.last_handshake_time))
+				memcpy(&stats.last_handshake_time, mnl_attr_get_payload(peer_attr), sizeof(stats.last_handshake_time));
+			break;
+		case WGPEER_A_RX_BYTES:
+			if (!mnl_attr_validate(peer_attr, MNL_TYPE_U64))
+				stats.rx_bytes = mnl_attr_get_u64(peer_attr);
+			break;
+		case WGPEER_A_TX_BYTES:
+			if (!mnl_attr_validate(peer_attr, MNL_TYPE_U64))
+				stats.tx_bytes = mnl_attr_get_u64(peer_attr);
+			break;
+		}
+	}
+	if (!has_public_key) {
+		errno = ENXIO;
+		return MNL_CB_ERROR;
+	}
+
+	/* The continuation of a peer split across messages only carries more
+	 * allowed IPs. */
+	if (ctx->num_stats && !memcmp(ctx->last_public_key, stats.public_key, sizeof(wg_key)))
+		return MNL_CB_OK;
+	memcpy(ctx->last_public_key, stats.public_key, sizeof(wg_key));
+
+	if (ctx->num_stats < ctx->max_stats)
+		ctx->stats[ctx->num_stats] = stats;
+	++ctx->num_stats;
+	return MNL_CB_OK;
+}
+
+/* Nothing is copied but the scalars; the keys, endpoint and allowed IPs of
+ * the view point into the message being parsed. */
+static int parse_view_peers(const struct nlattr *attr, void *data)
+{
+	struct device_ctx *ctx = data;
+	const struct nlattr *peer_attr, *ip_attr;
+	wg_allowedip_view allowedip;
+	wg_peer_view peer = { 0 };
+	int ret;
+
+	mnl_attr_for_each_nested(peer_attr, attr) {
+		switch (mnl_attr_get_type(peer_attr)) {
+		case WGPEER_A_PUBLIC_KEY:
+			if (mnl_attr_get_payload_len(peer_attr) == sizeof(wg_key)) {
+				peer.public_key = mnl_attr_get_payload(peer_attr);
+				peer.flags |= WGPEER_HAS_PUBLIC_KEY;
+			}
+			break;
+		case WGPEER_A_PRESHARED_KEY:
+			if (mnl_attr_get_payload_len(peer_attr) == sizeof(wg_key) && !wg_key_is_zero(mnl_attr_get_payload(peer_attr))) {
+				peer.preshared_key = mnl_attr_get_payload(peer_attr);
+				peer.flags |= WGPEER_HAS_PRESHARED_KEY;
+			}
+			break;
+		case WGPEER_A_ENDPOINT: {
+			struct sockaddr *addr;
+
+			if (mnl_attr_get_payload_len(peer_attr) < sizeof(*addr))
+				break;
+			addr = mnl_attr_get_payload(peer_attr);
+			if ((addr->sa_family == AF_INET && mnl_attr_get_payload_len(peer_attr) == sizeof(struct sockaddr_in)) ||
+			    (addr->sa_family == AF_INET6 && mnl_attr_get_payload_len(peer_attr) == sizeof(struct sockaddr_in6)))
+				peer.endpoint = addr;
+			break;
+		}
+		case WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL:
+			if (!mnl_attr_validate(peer_attr, MNL_TYPE_U16))
+				peer.persistent_keepalive_interval = mnl_attr_get_u16(peer_attr);
+			break;
+		case WGPEER_A_LAST_HANDSHAKE_TIME:
+			if (mnl_attr_get_payload_len(peer_attr) == sizeof(peer.last_handshake_time))
+				memcpy(&peer.last_handshake_time, mnl_attr_get_payload(peer_attr), sizeof(peer.last_handshake_time));
+			break;
+		case WGPEER_A_RX_BYTES:
+			if (!mnl_attr_validate(peer_attr, MNL_TYPE_U64))
+				peer.rx_bytes = mnl_attr_get_u64(peer_attr);
+			break;
+		case WGPEER_A_TX_BYTES:
+			if (!mnl_attr_validate(peer_attr, MNL_TYPE_U64))
+				peer.tx_bytes = mnl_attr_get_u64(peer_attr);
+			break;
+		case WGPEER_A_ALLOWEDIPS:
+			mnl_attr_for_each_nested(ip_attr, peer_attr) {
+				if (parse_allowedip_view(ip_attr, &allowedip) < 0)
+					return MNL_CB_ERROR;
+			}
+			peer.allowedips = peer_attr;
+			break;
+		}
+	}
+	if (!peer.public_key) {
+		errno = ENXIO;
+		return MNL_CB_ERROR;
+	}
+
+	peer.continued = ctx->num_views++ && !memcmp(ctx->last_public_key, peer.public_key, sizeof(wg_key));
+	memcpy(ctx->last_public_key, peer.public_key, sizeof(wg_key));
+
+	ret = ctx->view_cb(&peer, ctx->view_data);
+	if (ret < 0) {
+		errno = -ret;
+		return MNL_CB_ERROR;
+	}
 	return MNL_CB_OK;
 }
 
+bool wg_peer_view_next_allowedip(const wg_peer_view *peer, wg_allowedip_view *allowedip)
+{
+	const struct nlattr *nest = peer->allowedips, *attr;
+	const char *end;
+
+	if (!nest)
+		return false;
+	attr = allowedip->next ?: mnl_attr_get_payload(nest);
+	end = (const char *)mnl_attr_get_payload(nest) + mnl_attr_get_payload_len(nest);
+	if (!mnl_attr_ok(attr, end - (const char *)attr))
+		return false;
+	allowedip->next = mnl_attr_next(attr);
+	return !parse_allowedip_view(attr, allowedip);
+}
+
 static int parse_device(const struct nlattr *attr, void *data)
 {
-	wg_device *device = data;
+	struct device_ctx *ctx = data;
+	wg_device *device = ctx->device;
 
 	switch (mnl_attr_get_type(attr)) {
 	case WGDEVICE_A_UNSPEC:
@@ -1374,7 +2279,7 @@ static int parse_device(const struct nlattr *attr, void *data)
 			device->fwmark = mnl_attr_get_u32(attr);
 		break;
 	case WGDEVICE_A_PEERS:
-		return mnl_attr_parse_nested(attr, parse_peers, device);
+		return mnl_attr_parse_nested(attr, ctx->parse_peers, ctx);
 	}
 
 	return MNL_CB_OK;
@@ -1385,45 +2290,17 @@ static int read_device_cb(const struct nlmsghdr *nlh, void *data)
 	return mnl_attr_parse(nlh, sizeof(struct genlmsghdr), parse_device, data);
 }
 
-static void coalesce_peers(wg_device *device)
-{
-	wg_peer *old_next_peer, *peer = device->first_peer;
-
-	while (peer && peer->next_peer) {
-		if (memcmp(peer->public_key, peer->next_peer->public_key, sizeof(wg_key))) {
-			peer = peer->next_peer;
-			continue;
-		}
-		if (!peer->first_allowedip) {
-			peer->first_allowedip = peer->next_peer->first_allowedip;
-			peer->last_allowedip = peer->next_peer->last_allowedip;
-		} else {
-			peer->last_allowedip->next_allowedip = peer->next_peer->first_allowedip;
-			peer->last_allowedip = peer->next_peer->last_allowedip;
-		}
-		old_next_peer = peer->next_peer;
-		peer->next_peer = old_next_peer->next_peer;
-		free(old_next_peer);
-	}
-}
-
-int wg_get_device(wg_device **device, const char *device_name)
+/* Sends a WG_CMD_GET_DEVICE dump request and feeds the replies to the parsing
+ * callbacks with ctx. */
+static int dump_device(wg_session *session, const char *device_name, struct device_ctx *ctx)
 {
 	int ret = 0;
 	struct nlmsghdr *nlh;
 	struct mnlg_socket *nlg;
 
-try_again:
-	*device = calloc(1, sizeof(wg_device));
-	if (!*device)
-		return -errno;
-
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
-	if (!nlg) {
-		wg_free_device(*device);
-		*device = NULL;
+	nlg = session_genl(session);
+	if (!nlg)
 		return -errno;
-	}
 
 	nlh = mnlg_msg_prepare(nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
 	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
@@ -1432,30 +2309,146 @@ try_again:
 		goto out;
 	}
 	errno = 0;
-	if (mnlg_socket_recv_run(nlg, read_device_cb, *device) < 0) {
+	if (mnlg_socket_recv_run(nlg, read_device_cb, ctx) < 0)
 		ret = errno ? -errno : -EINVAL;
-		goto out;
-	}
-	coalesce_peers(*device);
 
 out:
-	if (nlg)
-		mnlg_socket_close(nlg);
+	if (ret)
+		session_genl_reset(session);
+	return ret;
+}
+
+static int get_device(wg_session *session, wg_arena *arena, wg_device **device, const char *device_name)
+{
+	int ret;
+	struct device_ctx ctx = { .parse_peers = parse_peers, .arena = arena };
+
+try_again:
+	*device = device_ctx_alloc(&ctx, sizeof(wg_device));
+	if (!*device)
+		return -errno;
+	ctx.device = *device;
+
+	ret = dump_device(session, device_name, &ctx);
 	if (ret) {
-		wg_free_device(*device);
+		if (!arena)
+			wg_free_device(*device);
 		if (ret == -EINTR)
 			goto try_again;
 		*device = NULL;
 	}
+
+	errno = -ret;
+	return ret;
+}
+
+int wg_session_get_device(wg_session *session, wg_device **device, const char *device_name)
+{
+	return get_device(session, NULL, device, device_name);
+}
+
+int wg_session_get_device_arena(wg_session *session, wg_arena *arena, wg_device **device, const char *device_name)
+{
+	return get_device(session, arena, device, device_name);
+}
+
+static int get_flat_device(wg_session *session, wg_flat_device *dev, const char *device_name, bool compact)
+{
+	int ret;
+	wg_device device;
+	struct device_ctx ctx = { .parse_peers = parse_flat_peers, .device = &device, .flat = dev, .compact = compact };
+
+	do {
+		memset(&device, 0, sizeof(device));
+		dev->num_peers = dev->num_allowedips = dev->num_prefixes4 = dev->num_prefixes6 = 0;
+		ret = dump_device(session, device_name, &ctx);
+	} while (ret == -EINTR);
+
+	if (!ret) {
+		memcpy(dev->name, device.name, sizeof(dev->name));
+		dev->ifindex = device.ifindex;
+		dev->flags = device.flags;
+		memcpy(dev->public_key, device.public_key, sizeof(dev->public_key));
+		memcpy(dev->private_key, device.private_key, sizeof(dev->private_key));
+		dev->fwmark = device.fwmark;
+		dev->listen_port = device.listen_port;
+	}
+	errno = -ret;
+	return ret;
+}
+
+int wg_session_get_flat_device(wg_session *session, wg_flat_device *dev, const char *device_name)
+{
+	return get_flat_device(session, dev, device_name, false);
+}
+
+/* A /32 then takes five bytes rather than a wg_allowedip. */
+int wg_session_get_compact_device(wg_session *session, wg_flat_device *dev, const char *device_name)
+{
+	return get_flat_device(session, dev, device_name, true);
+}
+
+int wg_session_walk_device(wg_session *session, wg_device *dev, const char *device_name, wg_peer_view_cb cb, void *data)
+{
+	int ret;
+	struct device_ctx ctx = {
+		.parse_peers = parse_view_peers,
+		.device = dev,
+		.view_cb = cb,
+		.view_data = data
+	};
+
+	memset(dev, 0, sizeof(*dev));
+	ret = dump_device(session, device_name, &ctx);
+	errno = -ret;
+	return ret;
+}
+
+int wg_session_get_device_stats(wg_session *session, const char *device_name, wg_peer_stats *stats, size_t *num_stats)
+{
+	int ret;
+	wg_device device;
+	struct device_ctx ctx = {
+		.parse_peers = parse_stats_peers,
+		.device = &device,
+		.stats = stats,
+		.max_stats = *num_stats
+	};
+
+	do {
+		memset(&device, 0, sizeof(device));
+		ctx.num_stats = 0;
+		ret = dump_device(session, device_name, &ctx);
+	} while (ret == -EINTR);
+
+	if (!ret) {
+		if (ctx.num_stats > ctx.max_stats)
+			ret = -ENOSPC;
+		*num_stats = ctx.num_stats;
+	}
 	errno = -ret;
 	return ret;
 }
 
+void wg_free_flat_device(wg_flat_device *dev)
+{
+	if (!dev)
+		return;
+	free(dev->peers);
+	free(dev->allowedips);
+	free(dev->prefixes4);
+	free(dev->prefixes6);
+	free(dev->rx_bytes);
+	free(dev->tx_bytes);
+	free(dev->last_handshake_time);
+	memset(dev, 0, sizeof(*dev));
+}
+
 /* first\0second\0third\0forth\0last\0\0 */
-char *wg_list_device_names(void)
+char *wg_session_list_device_names(wg_session *session)
 {
 	struct string_list list = { 0 };
-	int ret = fetch_device_names(&list);
+	int ret = fetch_device_names(session, &list);
 
 	errno = -ret;
 	if (errno) {
@@ -1465,29 +2458,1523 @@ char *wg_list_device_names(void)
 	return list.buffer ?: strdup("\0");
 }
 
-int wg_add_device(const char *device_name)
+int wg_session_add_device(wg_session *session, const char *device_name)
 {
-	return add_del_iface(device_name, true);
+	return add_del_iface(session, device_name, true);
 }
 
-int wg_del_device(const char *device_name)
+int wg_session_del_device(wg_session *session, const char *device_name)
+{
+	return add_del_iface(session, device_name, false);
+}
+
+int wg_session_open(wg_session **session)
+{
+	*session = calloc(1, sizeof(**session));
+	if (!*session)
+		return -errno;
+	return 0;
+}
+
+void wg_session_close(wg_session *session)
+{
+	if (!session)
+		return;
+	session_genl_reset(session);
+	session_rtnl_reset(session);
+	free(session->rtnl_buffer);
+	free(session);
+}
+
+int wg_set_device(wg_device *dev)
+{
+	wg_session *session;
+	int ret;
+
+	ret = wg_session_open(&session);
+	if (ret)
+		return ret;
+	ret = wg_session_set_device(session, dev);
+	wg_session_close(session);
+	errno = -ret;
+	return ret;
+}
+
+int wg_set_device_pipelined(wg_device *dev)
+{
+	wg_session *session;
+	int ret;
+
+	ret = wg_session_open(&session);
+	if (ret)
+		return ret;
+	ret = wg_session_set_device_pipelined(session, dev);
+	wg_session_close(session);
+	errno = -ret;
+	return ret;
+}
+
+int wg_get_device(wg_device **device, const char *device_name)
+{
+	wg_session *session;
+	int ret;
+
+	*device = NULL;
+	ret = wg_session_open(&session);
+	if (ret)
+		return ret;
+	ret = wg_session_get_device(session, device, device_name);
+	wg_session_close(session);
+	errno = -ret;
+	return ret;
+}
+
+/* first\0second\0third\0forth\0last\0\0 */
+char *wg_list_device_names(void)
+{
+	wg_session *session;
+	char *names;
+	int ret;
+
+	ret = wg_session_open(&session);
+	if (ret)
+		return NULL;
+	names = wg_session_list_device_names(session);
+	ret = names ? 0 : errno;
+	wg_session_close(session);
+	errno = ret;
+	return names;
+}
+
+/* Link notifications tell us about wireguard interfaces coming and going,
+ * and, on kernels whose wireguard family exposes multicast groups, the
+ * family's own notifications about configuration changes are passed on too.
+ * Both sockets are non-blocking and registered with one epoll instance, whose
+ * fd is what callers wait on. */
+struct wg_events {
+	int epoll_fd;
+	struct mnl_socket *rtnl;
+	char *rtnl_buf;
+	struct mnlg_socket *nlg;
+	bool genl_resolved;
+};
+
+struct events_ctx {
+	wg_events *events;
+	wg_event_cb cb;
+	void *data;
+	int count;
+};
+
+static void events_deliver(struct events_ctx *ctx, const wg_event *event)
+{
+	ctx->cb(event, ctx->data);
+	++ctx->count;
+}
+
+/* The wireguard module is only loaded once the first interface is created,
+ * so this is retried on every addition until the family resolves. */
+static void events_subscribe_genl(wg_events *events)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct mnlg_socket *nlg;
+	unsigned int i;
+
+	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	if (!nlg)
+		return;
+	events->genl_resolved = true;
+	if (!nlg->num_mcast_groups)
+		goto err;
+	for (i = 0; i < nlg->num_mcast_groups; ++i) {
+		if (setsockopt(nlg->nl->fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &nlg->mcast_groups[i], sizeof(nlg->mcast_groups[i])) < 0)
+			goto err;
+	}
+	if (fcntl(nlg->nl->fd, F_SETFL, O_NONBLOCK) < 0)
+		goto err;
+	if (epoll_ctl(events->epoll_fd, EPOLL_CTL_ADD, nlg->nl->fd, &ev) < 0)
+		goto err;
+	events->nlg = nlg;
+	return;
+
+err:
+	mnlg_socket_close(nlg);
+}
+
+static int link_event_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct events_ctx *ctx = data;
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	struct interface interface = { 0 };
+	wg_event event = { 0 };
+
+	if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK)
+		return MNL_CB_OK;
+	if (mnl_attr_parse(nlh, sizeof(*ifm), parse_infomsg, &interface) != MNL_CB_OK) {
+		errno = EBADMSG;
+		return MNL_CB_ERROR;
+	}
+	if (!interface.is_wireguard)
+		return MNL_CB_OK;
+
+	event.ifindex = ifm->ifi_index;
+	if (interface.name)
+		strncpy(event.name, interface.name, sizeof(event.name) - 1);
+	/* Registration is announced with every bit marked as changed. */
+	if (nlh->nlmsg_type == RTM_DELLINK)
+		event.type = WG_EVENT_DEVICE_REMOVED;
+	else if (ifm->ifi_change == ~0U)
+		event.type = WG_EVENT_DEVICE_ADDED;
+	else
+		event.type = WG_EVENT_DEVICE_CHANGED;
+	if (event.type == WG_EVENT_DEVICE_ADDED && !ctx->events->genl_resolved)
+		events_subscribe_genl(ctx->events);
+	events_deliver(ctx, &event);
+	return MNL_CB_OK;
+}
+
+static int genl_event_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct events_ctx *ctx = data;
+	wg_event event = { .type = WG_EVENT_CONFIG_CHANGED };
+	const struct nlattr *attr;
+
+	if (nlh->nlmsg_type != ctx->events->nlg->id)
+		return MNL_CB_OK;
+	mnl_attr_for_each(attr, nlh, sizeof(struct genlmsghdr)) {
+		if (mnl_attr_get_type(attr) == WGDEVICE_A_IFINDEX && !mnl_attr_validate(attr, MNL_TYPE_U32))
+			event.ifindex = mnl_attr_get_u32(attr);
+		else if (mnl_attr_get_type(attr) == WGDEVICE_A_IFNAME && !mnl_attr_validate(attr, MNL_TYPE_STRING))
+			strncpy(event.name, mnl_attr_get_str(attr), sizeof(event.name) - 1);
+	}
+	events_deliver(ctx, &event);
+	return MNL_CB_OK;
+}
+
+/* Drains everything queued on nl. A receive queue overrun means some
+ * notifications were dropped, which is reported as WG_EVENT_OVERRUN. */
+static int events_drain(struct events_ctx *ctx, const struct mnl_socket *nl, char *buf, size_t bufsiz, mnl_cb_t cb)
+{
+	static const wg_event overrun = { .type = WG_EVENT_OVERRUN };
+	unsigned int lens[MNL_RECV_BATCH];
+	int i, n;
+
+	for (;;) {
+		n = mnl_socket_recvmmsg(nl, buf, bufsiz, lens, MNL_RECV_BATCH);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n < 0 && errno == ENOBUFS) {
+			events_deliver(ctx, &overrun);
+			continue;
+		}
+		if (n < 0)
+			return -errno;
+		for (i = 0; i < n; ++i) {
+			if (mnl_cb_run(buf + i * bufsiz, lens[i], 0, 0, cb, ctx) < 0)
+				return -errno;
+		}
+	}
+}
+
+int wg_events_open(wg_events **events)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	wg_events *e;
+	int ret, rcvbuf;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return -errno;
+	e->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (e->epoll_fd < 0) {
+		ret = -errno;
+		goto err_epoll;
+	}
+	e->rtnl_buf = malloc(MNL_SOCKET_DUMP_SIZE * MNL_RECV_BATCH);
+	if (!e->rtnl_buf) {
+		ret = -errno;
+		goto err_buf;
+	}
+	e->rtnl = __mnl_socket_open(NETLINK_ROUTE, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (!e->rtnl) {
+		ret = -errno;
+		goto err_rtnl;
+	}
+	if (mnl_socket_bind(e->rtnl, RTMGRP_LINK, MNL_SOCKET_AUTOPID) < 0) {
+		ret = -errno;
+		goto err_bind;
+	}
+	/* Bursts of interface churn should not overrun the queue. */
+	rcvbuf = MNL_SOCKET_DUMP_SIZE * MNL_RECV_BATCH;
+	if (setsockopt(e->rtnl->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+		setsockopt(e->rtnl->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->rtnl->fd, &ev) < 0) {
+		ret = -errno;
+		goto err_bind;
+	}
+	events_subscribe_genl(e);
+
+	*events = e;
+	return 0;
+
+err_bind:
+	mnl_socket_close(e->rtnl);
+err_rtnl:
+	free(e->rtnl_buf);
+err_buf:
+	close(e->epoll_fd);
+err_epoll:
+	free(e);
+	errno = -ret;
+	return ret;
+}
+
+void wg_events_close(wg_events *events)
+{
+	if (!events)
+		return;
+	if (events->nlg)
+		mnlg_socket_close(events->nlg);
+	mnl_socket_close(events->rtnl);
+	free(events->rtnl_buf);
+	close(events->epoll_fd);
+	free(events);
+}
+
+int wg_events_fd(const wg_events *events)
+{
+	return events->epoll_fd;
+}
+
+/* Calls cb for every event queued so far, without blocking, and returns how
+ * many there were, or a negative errno. */
+int wg_events_process(wg_events *events, wg_event_cb cb, void *data)
+{
+	struct events_ctx ctx = { .events = events, .cb = cb, .data = data };
+	int ret;
+
+	ret = events_drain(&ctx, events->rtnl, events->rtnl_buf, MNL_SOCKET_DUMP_SIZE, link_event_cb);
+	if (!ret && events->nlg)
+		ret = events_drain(&ctx, events->nlg->nl, events->nlg->rx_buf, events->nlg->rx_bufsiz, genl_event_cb);
+	if (ret) {
+		errno = -ret;
+		return ret;
+	}
+	return ctx.count;
+}
+
+/* Requests are queued and run one at a time, since the kernel refuses to
+ * start a dump on a socket that is still in the middle of another. Sends
+ * complete immediately, as netlink hands them straight to the kernel, so the
+ * only waiting is for replies, which wg_async_process() reads without blocking
+ * whenever wg_async_fd() is readable. */
+enum async_op {
+	ASYNC_GET_DEVICE,
+	ASYNC_SET_DEVICE
+};
+
+struct async_req {
+	struct async_req *next;
+	enum async_op op;
+	char device_name[IFNAMSIZ];
+	wg_device *dev;
+	wg_peer *peer;
+	wg_allowedip *allowedip;
+	struct device_ctx ctx;
+	bool retry;
+	wg_async_cb cb;
+	void *data;
+};
+
+struct wg_async {
+	struct mnlg_socket *nlg;
+	struct async_req *head, *tail;
+	size_t pending;
+	/* Requests completed so far, which wg_async_process() counts its own
+	 * by, since callbacks may submit more. */
+	size_t completed;
+	/* A request has been sent and its replies are not all read yet. If the
+	 * request already failed, head no longer points to it and discard is
+	 * set, so that the rest of its replies are dropped rather than taken for
+	 * those of the next request. */
+	bool in_flight;
+	bool discard;
+	unsigned int in_flight_seq;
+};
+
+int wg_async_open(wg_async **async)
+{
+	wg_async *a;
+	int ret;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return -errno;
+	a->nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	if (!a->nlg) {
+		ret = -errno;
+		free(a);
+		errno = -ret;
+		return ret;
+	}
+	if (fcntl(a->nlg->nl->fd, F_SETFL, O_NONBLOCK) < 0) {
+		ret = -errno;
+		mnlg_socket_close(a->nlg);
+		free(a);
+		errno = -ret;
+		return ret;
+	}
+	*async = a;
+	return 0;
+}
+
+int wg_async_fd(const wg_async *async)
+{
+	return async->nlg->nl->fd;
+}
+
+size_t wg_async_pending(const wg_async *async)
+{
+	return async->pending;
+}
+
+static int async_submit(wg_async *async, enum async_op op, const char *device_name, wg_device *dev, wg_async_cb cb, void *data)
+{
+	struct async_req *req;
+
+	if (strlen(device_name) >= IFNAMSIZ) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return -errno;
+	req->op = op;
+	strcpy(req->device_name, device_name);
+	req->dev = dev;
+	req->cb = cb;
+	req->data = data;
+
+	if (async->tail)
+		async->tail->next = req;
+	else
+		async->head = req;
+	async->tail = req;
+	++async->pending;
+	return 0;
+}
+
+/* On completion cb is passed the newly allocated device, to be released with
+ * wg_free_device(), or NULL and a negative errno. */
+int wg_async_get_device(wg_async *async, const char *device_name, wg_async_cb cb, void *data)
+{
+	return async_submit(async, ASYNC_GET_DEVICE, device_name, NULL, cb, data);
+}
+
+/* dev must stay valid until cb is called with it. */
+int wg_async_set_device(wg_async *async, wg_device *dev, wg_async_cb cb, void *data)
+{
+	return async_submit(async, ASYNC_SET_DEVICE, dev->name, dev, cb, data);
+}
+
+static void async_complete(wg_async *async, struct async_req *req, int ret)
+{
+	wg_device *dev = req->dev;
+
+	if (async->head == req) {
+		async->head = req->next;
+		if (!async->head)
+			async->tail = NULL;
+	}
+	--async->pending;
+	++async->completed;
+	if (ret && req->op == ASYNC_GET_DEVICE) {
+		wg_free_device(dev);
+		dev = NULL;
+	}
+	req->cb(async, ret, dev, req->data);
+	free(req);
+}
+
+/* Sends the next message of the request at the head of the queue. */
+static int async_send(wg_async *async)
+{
+	struct mnlg_socket *nlg = async->nlg;
+	struct async_req *req = async->head;
+	struct nlmsghdr *nlh;
+
+	if (req->op == ASYNC_GET_DEVICE) {
+		req->dev = calloc(1, sizeof(wg_device));
+		if (!req->dev)
+			return -errno;
+		memset(&req->ctx, 0, sizeof(req->ctx));
+		req->ctx.parse_peers = parse_peers;
+		req->ctx.device = req->dev;
+		nlh = mnlg_msg_prepare(nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
+		mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, req->device_name);
+	} else {
+		nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
+		put_set_device_chunk(nlh, req->dev, &req->peer, &req->allowedip);
+	}
+	if (mnlg_socket_send(nlg, nlh) < 0)
+		return -errno;
+	async->in_flight = true;
+	async->discard = false;
+	async->in_flight_seq = nlh->nlmsg_seq;
+	return 0;
+}
+
+/* Whether buf holds the end of the exchange, be it a dump or a single ACK. */
+static bool async_exchange_done(const void *buf, size_t len)
+{
+	const struct nlmsghdr *nlh = buf;
+	int remaining = len;
+
+	for (; mnl_nlmsg_ok(nlh, remaining); nlh = mnl_nlmsg_next(nlh, &remaining)) {
+		if (nlh->nlmsg_type == NLMSG_DONE || nlh->nlmsg_type == NLMSG_ERROR)
+			return true;
+	}
+	return false;
+}
+
+static void async_handle(wg_async *async, const void *buf, size_t len)
+{
+	struct mnlg_socket *nlg = async->nlg;
+	struct async_req *req = async->head;
+	const struct nlmsghdr *nlh = buf;
+	bool done;
+	int ret;
+
+	if (len < sizeof(*nlh) || nlh->nlmsg_seq != async->in_flight_seq)
+		return;
+	done = async_exchange_done(buf, len);
+	if (done)
+		async->in_flight = false;
+	if (async->discard) {
+		if (done)
+			async->discard = false;
+		return;
+	}
+	if (!req || req->retry)
+		return;
+
+	errno = 0;
+	ret = mnl_cb_run2(buf, len, async->in_flight_seq, nlg->portid,
+			  req->op == ASYNC_GET_DEVICE ? read_device_cb : NULL, &req->ctx,
+			  mnlg_cb_array, MNL_ARRAY_SIZE(mnlg_cb_array));
+	if (ret < 0 && errno == EINTR && req->op == ASYNC_GET_DEVICE) {
+		/* As in wg_get_device(), an interrupted dump is rerun, once what
+		 * is left of this one has been read. */
+		wg_free_device(req->dev);
+		req->dev = NULL;
+		req->retry = true;
+	} else if (ret < 0) {
+		/* What is left of this exchange must not reach the next request. */
+		async->discard = !done;
+		async_complete(async, req, errno ? -errno : -EINVAL);
+	} else if (done && !(req->op == ASYNC_SET_DEVICE && req->peer)) {
+		async_complete(async, req, 0);
+	}
+}
+
+/* Advances all requests as far as they can go without blocking, calling
+ * back for each one that completes. Returns the number of completions, or a
+ * negative errno if the socket itself failed. */
+int wg_async_process(wg_async *async)
+{
+	struct mnlg_socket *nlg = async->nlg;
+	unsigned int lens[MNL_RECV_BATCH];
+	size_t completed = async->completed;
+	int i, n, ret;
+
+	for (;;) {
+		while (!async->in_flight && async->head) {
+			async->head->retry = false;
+			ret = async_send(async);
+			if (ret)
+				async_complete(async, async->head, ret);
+		}
+		if (!async->in_flight)
+			break;
+
+		/* The slots are already as large as the kernel ever makes a dump
+		 * datagram, so unlike mnlg_socket_recv_run() there is no need to
+		 * peek first. */
+		n = mnl_socket_recvmmsg(nlg->nl, nlg->rx_buf, nlg->rx_bufsiz, lens, MNL_RECV_BATCH);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n < 0) {
+			ret = -errno;
+			async->in_flight = false;
+			if (async->head)
+				async_complete(async, async->head, ret);
+			errno = -ret;
+			return ret;
+		}
+		for (i = 0; i < n; ++i)
+			async_handle(async, nlg->rx_buf + i * nlg->rx_bufsiz, lens[i]);
+	}
+	return async->completed - completed;
+}
+
+/* Pending requests are completed with -ECANCELED. */
+void wg_async_close(wg_async *async)
+{
+	if (!async)
+		return;
+	while (async->head)
+		async_complete(async, async->head, -ECANCELED);
+	mnlg_socket_close(async->nlg);
+	free(async);
+}
+
+#define WG_POOL_MAX_THREADS 16
+
+struct pool_worker {
+	wg_pool *pool;
+	pthread_t thread;
+	wg_session *session;
+	wg_arena *arena;
+};
+
+/* Each call to wg_get_devices() bumps the generation, which wakes the
+ * workers. They then claim names by atomically incrementing next, fetching
+ * each device into their own arena, which they reset at the start of every
+ * generation, and the last one to run out of names signals done_cond. */
+struct wg_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond, done_cond;
+	struct pool_worker *workers;
+	unsigned int num_workers;
+	unsigned int busy;
+	unsigned long generation;
+	bool stopping;
+
+	wg_session *session;
+	const char **names;
+	wg_device **devices;
+	int *errors;
+	size_t num_names, max_names;
+	size_t next;
+};
+
+static void *pool_worker_main(void *arg)
+{
+	struct pool_worker *worker = arg;
+	wg_pool *pool = worker->pool;
+	unsigned long generation = 0;
+	size_t i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stopping && pool->generation == generation)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->stopping)
+			break;
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		wg_arena_reset(worker->arena);
+		while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->num_names)
+			pool->errors[i] = wg_session_get_device_arena(worker->session, worker->arena, &pool->devices[i], pool->names[i]);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->busy)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void pool_stop(wg_pool *pool, unsigned int num_started)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < num_started; ++i)
+		pthread_join(pool->workers[i].thread, NULL);
+	for (i = 0; i < pool->num_workers; ++i) {
+		wg_session_close(pool->workers[i].session);
+		wg_arena_free(pool->workers[i].arena);
+	}
+}
+
+/* num_threads of 0 picks one per online CPU, up to WG_POOL_MAX_THREADS. */
+int wg_pool_open(wg_pool **pool, unsigned int num_threads)
+{
+	wg_pool *p;
+	unsigned int i;
+	long cpus;
+	int ret;
+
+	if (!num_threads) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = cpus > 0 ? cpus : 1;
+	}
+	if (num_threads > WG_POOL_MAX_THREADS)
+		num_threads = WG_POOL_MAX_THREADS;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return -errno;
+	p->workers = calloc(num_threads, sizeof(*p->workers));
+	if (!p->workers) {
+		ret = -errno;
+		goto err_workers;
+	}
+	ret = wg_session_open(&p->session);
+	if (ret)
+		goto err_session;
+	p->num_workers = num_threads;
+	for (i = 0; i < num_threads; ++i) {
+		p->workers[i].pool = p;
+		ret = wg_session_open(&p->workers[i].session);
+		if (!ret)
+			ret = wg_arena_new(&p->workers[i].arena);
+		if (ret)
+			goto err_worker;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work_cond, NULL);
+	pthread_cond_init(&p->done_cond, NULL);
+	for (i = 0; i < num_threads; ++i) {
+		ret = -pthread_create(&p->workers[i].thread, NULL, pool_worker_main, &p->workers[i]);
+		if (ret) {
+			pool_stop(p, i);
+			pthread_cond_destroy(&p->done_cond);
+			pthread_cond_destroy(&p->work_cond);
+			pthread_mutex_destroy(&p->lock);
+			goto err_thread;
+		}
+	}
+
+	*pool = p;
+	return 0;
+
+err_worker:
+	for (i = 0; i < num_threads; ++i) {
+		wg_session_close(p->workers[i].session);
+		wg_arena_free(p->workers[i].arena);
+	}
+err_thread:
+	wg_session_close(p->session);
+err_session:
+	free(p->workers);
+err_workers:
+	free(p);
+	errno = -ret;
+	return ret;
+}
+
+void wg_pool_close(wg_pool *pool)
+{
+	if (!pool)
+		return;
+	pool_stop(pool, pool->num_workers);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	wg_session_close(pool->session);
+	free(pool->names);
+	free(pool->devices);
+	free(pool->errors);
+	free(pool->workers);
+	free(pool);
+}
+
+static int pool_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int pool_reserve(wg_pool *pool, size_t num_names)
+{
+	const char **names;
+	wg_device **devices;
+	int *errors;
+
+	if (num_names <= pool->max_names)
+		return 0;
+	names = realloc(pool->names, num_names * sizeof(*names));
+	if (!names)
+		return -errno;
+	pool->names = names;
+	devices = realloc(pool->devices, num_names * sizeof(*devices));
+	if (!devices)
+		return -errno;
+	pool->devices = devices;
+	errors = realloc(pool->errors, num_names * sizeof(*errors));
+	if (!errors)
+		return -errno;
+	pool->errors = errors;
+	pool->max_names = num_names;
+	return 0;
+}
+
+/* Fetches every wireguard device, spread over the pool's threads, and
+ * returns them sorted by name. Devices that disappear while this runs are
+ * left out. If any other fetch fails, its error is returned, along with
+ * whatever devices did succeed. The devices and the array holding them
+ * belong to the pool and stay valid until the next call. */
+int wg_get_devices(wg_pool *pool, wg_device ***devices, size_t *num_devices)
+{
+	char *device_names, *device_name;
+	size_t len, i, j;
+	int ret = 0;
+
+	*devices = NULL;
+	*num_devices = 0;
+	/* Every arena is reset below, so nothing from the last call survives. */
+	pool->num_names = 0;
+
+	device_names = wg_session_list_device_names(pool->session);
+	if (!device_names)
+		return -errno;
+	i = 0;
+	wg_for_each_device_name(device_names, device_name, len)
+		++i;
+	ret = pool_reserve(pool, i);
+	if (ret)
+		goto out;
+	i = 0;
+	wg_for_each_device_name(device_names, device_name, len)
+		pool->names[i++] = device_name;
+	qsort(pool->names, i, sizeof(*pool->names), pool_name_cmp);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->num_names = i;
+	pool->next = 0;
+	pool->busy = pool->num_workers;
+	++pool->generation;
+	pthread_cond_broadcast(&pool->work_cond);
+	while (pool->busy)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0, j = 0; i < pool->num_names; ++i) {
+		if (!pool->errors[i])
+			pool->devices[j++] = pool->devices[i];
+		else if (pool->errors[i] != -ENODEV && !ret)
+			ret = pool->errors[i];
+	}
+	*devices = pool->devices;
+	*num_devices = j;
+
+out:
+	free(device_names);
+	errno = -ret;
+	return ret;
+}
+
+int wg_add_device(const char *device_name)
+{
+	wg_session *session;
+	int ret;
+
+	ret = wg_session_open(&session);
+	if (ret)
+		return ret;
+	ret = wg_session_add_device(session, device_name);
+	wg_session_close(session);
+	errno = -ret;
+	return ret;
+}
+
+int wg_del_device(const char *device_name)
+{
+	wg_session *session;
+	int ret;
+
+	ret = wg_session_open(&session);
+	if (ret)
+		return ret;
+	ret = wg_session_del_device(session, device_name);
+	wg_session_close(session);
+	errno = -ret;
+	return ret;
+}
+
+void wg_free_device(wg_device *dev)
+{
+	wg_peer *peer, *np;
+	wg_allowedip *allowedip, *na;
+
+	if (!dev)
+		return;
+	for (peer = dev->first_peer, np = peer ? peer->next_peer : NULL; peer; peer = np, np = peer ? peer->next_peer : NULL) {
+		for (allowedip = peer->first_allowedip, na = allowedip ? allowedip->next_allowedip : NULL; allowedip; allowedip = na, na = allowedip ? allowedip->next_allowedip : NULL)
+			free(allowedip);
+		free(peer);
+	}
+	free(dev->peer_index);
+	free(dev);
+}
+
+/* Allowed IPs are compared in the form the kernel reports them in, with the
+ * bits past the prefix length masked off. */
+struct allowedip_key {
+	uint8_t family;
+	uint8_t cidr;
+	uint8_t addr[16];
+};
+
+static void allowedip_key(struct allowedip_key *key, const wg_allowedip *allowedip)
+{
+	unsigned int i;
+
+	memset(key, 0, sizeof(*key));
+	key->family = allowedip->family;
+	key->cidr = allowedip->cidr;
+	if (allowedip->family == AF_INET)
+		memcpy(key->addr, &allowedip->ip4, sizeof(allowedip->ip4));
+	else if (allowedip->family == AF_INET6)
+		memcpy(key->addr, &allowedip->ip6, sizeof(allowedip->ip6));
+	for (i = 0; i < sizeof(key->addr); ++i) {
+		if (key->cidr <= i * 8)
+			key->addr[i] = 0;
+		else if (key->cidr < (i + 1) * 8)
+			key->addr[i] &= 0xff00 >> (key->cidr - i * 8);
+	}
+}
+
+static int allowedip_key_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct allowedip_key));
+}
+
+/* Returns 1 if the two peers have different sets of allowed IPs, 0 if they
+ * have the same ones, in whatever order, or -1 with errno set. */
+static int allowedips_differ(const wg_peer *old_peer, const wg_peer *new_peer)
+{
+	const wg_allowedip *a, *b;
+	struct allowedip_key key_a, key_b, *keys;
+	size_t len = 0, i;
+	int ret;
+
+	for (a = old_peer->first_allowedip, b = new_peer->first_allowedip; a && b; a = a->next_allowedip, b = b->next_allowedip)
+		++len;
+	if (a || b)
+		return 1;
+
+	for (a = old_peer->first_allowedip, b = new_peer->first_allowedip; a; a = a->next_allowedip, b = b->next_allowedip) {
+		allowedip_key(&key_a, a);
+		allowedip_key(&key_b, b);
+		if (memcmp(&key_a, &key_b, sizeof(key_a)))
+			break;
+	}
+	if (!a)
+		return 0;
+
+	keys = calloc(len * 2, sizeof(*keys));
+	if (!keys)
+		return -1;
+	i = 0;
+	wg_for_each_allowedip(old_peer, a)
+		allowedip_key(&keys[i++], a);
+	wg_for_each_allowedip(new_peer, b)
+		allowedip_key(&keys[i++], b);
+	qsort(keys, len, sizeof(*keys), allowedip_key_cmp);
+	qsort(keys + len, len, sizeof(*keys), allowedip_key_cmp);
+	ret = !!memcmp(keys, keys + len, len * sizeof(*keys));
+	free(keys);
+	return ret;
+}
+
+static bool endpoints_differ(const wg_endpoint *old_endpoint, const wg_endpoint *new_endpoint)
+{
+	if (old_endpoint->addr.sa_family != new_endpoint->addr.sa_family)
+		return true;
+	if (new_endpoint->addr.sa_family == AF_INET)
+		return old_endpoint->addr4.sin_port != new_endpoint->addr4.sin_port ||
+		       old_endpoint->addr4.sin_addr.s_addr != new_endpoint->addr4.sin_addr.s_addr;
+	if (new_endpoint->addr.sa_family == AF_INET6)
+		return old_endpoint->addr6.sin6_port != new_endpoint->addr6.sin6_port ||
+		       old_endpoint->addr6.sin6_scope_id != new_endpoint->addr6.sin6_scope_id ||
+		       memcmp(&old_endpoint->addr6.sin6_addr, &new_endpoint->addr6.sin6_addr, sizeof(struct in6_addr));
+	return false;
+}
+
+/* Fills in change with only the parts of new_peer that differ from old_peer.
+ * Returns 1 if there are any, 0 if not, or -1 with errno set. */
+static int diff_peer(wg_peer *change, const wg_peer *old_peer, const wg_peer *new_peer)
+{
+	wg_key old_preshared_key = { 0 }, new_preshared_key = { 0 };
+	uint16_t new_keepalive;
+	bool changed = false;
+	int ret;
+
+	memset(change, 0, sizeof(*change));
+	memcpy(change->public_key, new_peer->public_key, sizeof(change->public_key));
+
+	if (old_peer->flags & WGPEER_HAS_PRESHARED_KEY)
+		memcpy(old_preshared_key, old_peer->preshared_key, sizeof(old_preshared_key));
+	if (new_peer->flags & WGPEER_HAS_PRESHARED_KEY)
+		memcpy(new_preshared_key, new_peer->preshared_key, sizeof(new_preshared_key));
+	if (memcmp(old_preshared_key, new_preshared_key, sizeof(wg_key))) {
+		memcpy(change->preshared_key, new_preshared_key, sizeof(change->preshared_key));
+		change->flags |= WGPEER_HAS_PRESHARED_KEY;
+		changed = true;
+	}
+
+	/* Endpoints cannot be unset, and the kernel roams them on its own, so
+	 * one is only pushed when new_peer asks for a specific one. */
+	if (new_peer->endpoint.addr.sa_family && endpoints_differ(&old_peer->endpoint, &new_peer->endpoint)) {
+		change->endpoint = new_peer->endpoint;
+		changed = true;
+	}
+
+	new_keepalive = new_peer->flags & WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL ? new_peer->persistent_keepalive_interval : 0;
+	if (new_keepalive != old_peer->persistent_keepalive_interval) {
+		change->persistent_keepalive_interval = new_keepalive;
+		change->flags |= WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL;
+		changed = true;
+	}
+
+	ret = allowedips_differ(old_peer, new_peer);
+	if (ret < 0)
+		return ret;
+	if (ret) {
+		change->first_allowedip = new_peer->first_allowedip;
+		change->last_allowedip = new_peer->last_allowedip;
+		change->flags |= WGPEER_REPLACE_ALLOWEDIPS;
+		changed = true;
+	}
+
+	if (!changed)
+		return 0;
+	change->flags |= WGPEER_HAS_PUBLIC_KEY;
+	return 1;
+}
+
+static int build_peer_index(wg_device *lookup, const wg_device *dev)
+{
+	struct device_ctx ctx = { .device = lookup };
+	wg_peer *peer;
+
+	wg_for_each_peer(dev, peer) {
+		if (peer_index_insert(&ctx, peer) < 0)
+			return -errno;
+	}
+	return 0;
+}
+
+/* new_dev is the complete desired configuration and old_dev what the kernel
+ * currently has, as returned by wg_get_device(). Only the peers that are
+ * added, removed or changed are sent, and of those only the changed parts. */
+int wg_session_apply_diff(wg_session *session, const wg_device *old_dev, const wg_device *new_dev)
+{
+	wg_device diff = { 0 }, old_lookup = { 0 }, new_lookup = { 0 };
+	struct wg_peer_index *old_index = old_dev->peer_index;
+	wg_peer *peer, *old_peer, *changes;
+	size_t num_changes = 0, max_changes = 0, i;
+	int ret = 0;
+
+	wg_for_each_peer(old_dev, peer)
+		++max_changes;
+	wg_for_each_peer(new_dev, peer)
+		++max_changes;
+	changes = calloc(max_changes ?: 1, sizeof(*changes));
+	if (!changes)
+		return -errno;
+
+	if (!old_index) {
+		ret = build_peer_index(&old_lookup, old_dev);
+		if (ret)
+			goto out;
+		old_index = old_lookup.peer_index;
+	}
+	ret = build_peer_index(&new_lookup, new_dev);
+	if (ret)
+		goto out;
+
+	wg_for_each_peer(new_dev, peer) {
+		old_peer = peer_index_find(old_index, peer->public_key);
+		if (peer->flags & WGPEER_REMOVE_ME) {
+			if (!old_peer)
+				continue;
+			memcpy(changes[num_changes].public_key, peer->public_key, sizeof(wg_key));
+			changes[num_changes++].flags = WGPEER_HAS_PUBLIC_KEY | WGPEER_REMOVE_ME;
+		} else if (!old_peer) {
+			changes[num_changes] = *peer;
+			changes[num_changes++].flags |= WGPEER_HAS_PUBLIC_KEY | WGPEER_REPLACE_ALLOWEDIPS;
+		} else {
+			ret = diff_peer(&changes[num_changes], old_peer, peer);
+			if (ret < 0) {
+				ret = -errno;
+				goto out;
+			}
+			num_changes += ret;
+			ret = 0;
+		}
+	}
+	wg_for_each_peer(old_dev, old_peer) {
+		if (peer_index_find(new_lookup.peer_index, old_peer->public_key))
+			continue;
+		memcpy(changes[num_changes].public_key, old_peer->public_key, sizeof(wg_key));
+		changes[num_changes++].flags = WGPEER_HAS_PUBLIC_KEY | WGPEER_REMOVE_ME;
+	}
+
+	memcpy(diff.name, new_dev->name, sizeof(diff.name));
+	if ((new_dev->flags & WGDEVICE_HAS_PRIVATE_KEY) &&
+	    (!(old_dev->flags & WGDEVICE_HAS_PRIVATE_KEY) || memcmp(old_dev->private_key, new_dev->private_key, sizeof(wg_key)))) {
+		memcpy(diff.private_key, new_dev->private_key, sizeof(diff.private_key));
+		diff.flags |= WGDEVICE_HAS_PRIVATE_KEY;
+	}
+	if ((new_dev->flags & WGDEVICE_HAS_LISTEN_PORT) && new_dev->listen_port != old_dev->listen_port) {
+		diff.listen_port = new_dev->listen_port;
+		diff.flags |= WGDEVICE_HAS_LISTEN_PORT;
+	}
+	if ((new_dev->flags & WGDEVICE_HAS_FWMARK) && new_dev->fwmark != old_dev->fwmark) {
+		diff.fwmark = new_dev->fwmark;
+		diff.flags |= WGDEVICE_HAS_FWMARK;
+	}
+	if (!diff.flags && !num_changes)
+		goto out;
+
+	for (i = 0; i < num_changes; ++i)
+		changes[i].next_peer = i + 1 < num_changes ? &changes[i + 1] : NULL;
+	if (num_changes) {
+		diff.first_peer = &changes[0];
+		diff.last_peer = &changes[num_changes - 1];
+	}
+	ret = wg_session_set_device(session, &diff);
+
+out:
+	free(old_lookup.peer_index);
+	free(new_lookup.peer_index);
+	free(changes);
+	errno = -ret;
+	return ret;
+}
+
+int wg_apply_diff(const wg_device *old_dev, const wg_device *new_dev)
+{
+	wg_session *session;
+	int ret;
+
+	ret = wg_session_open(&session);
+	if (ret)
+		return ret;
+	ret = wg_session_apply_diff(session, old_dev, new_dev);
+	wg_session_close(session);
+	errno = -ret;
+	return ret;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define WG_X86_SIMD
+static bool have_popcnt(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("popcnt");
+}
+
+static bool have_ssse3(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+static bool have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* The allowed IPs index is a poptrie: the top 16 bits of an address select
+ * an entry of a direct table, and each further 6 bits a slot of a node. Of
+ * the 64 slots of a node, those set in vector lead to children, which are
+ * contiguous in nodes, and the others to leaves, of which runs of the same
+ * value are stored once, starting where leafvec is set. A leaf is the index
+ * of a peer in peers, where 0 is no peer. Longer prefixes are pushed down
+ * into the slots they cover, so a lookup never backtracks. */
+#define LPM_DIRECT_BITS 16
+#define LPM_STRIDE 6
+#define LPM_LEAF (1U << 31)
+#define LPM_BATCH 8
+
+struct lpm_node {
+	uint64_t vector, leafvec;
+	uint32_t base0, base1;
+};
+
+struct lpm_trie {
+	uint32_t *direct;
+	struct lpm_node *nodes;
+	uint32_t *leaves;
+	size_t num_nodes, nodes_cap, num_leaves, leaves_cap;
+};
+
+struct wg_allowedips_index {
+	struct lpm_trie trie4, trie6;
+	wg_peer **peers;
+};
+
+struct lpm_prefix {
+	uint64_t key[2];
+	uint8_t cidr;
+	uint32_t leaf;
+};
+
+static inline __attribute__((always_inline)) unsigned int lpm_bits(const uint64_t key[2], unsigned int off, unsigned int len)
+{
+	uint64_t word;
+
+	if (off >= 128)
+		word = 0;
+	else if (off >= 64)
+		word = key[1] << (off - 64);
+	else
+		word = key[0] << off | (off ? key[1] >> (64 - off) : 0);
+	return word >> (64 - len);
+}
+
+static void lpm_key4(uint64_t key[2], const struct in_addr *addr)
+{
+	key[0] = (uint64_t)ntohl(addr->s_addr) << 32;
+	key[1] = 0;
+}
+
+static void lpm_key6(uint64_t key[2], const struct in6_addr *addr)
+{
+	unsigned int i;
+
+	key[0] = key[1] = 0;
+	for (i = 0; i < 8; ++i) {
+		key[0] = key[0] << 8 | addr->s6_addr[i];
+		key[1] = key[1] << 8 | addr->s6_addr[i + 8];
+	}
+}
+
+static int lpm_prefix_cmp(const void *a, const void *b)
+{
+	const struct lpm_prefix *x = a, *y = b;
+
+	if (x->key[0] != y->key[0])
+		return x->key[0] < y->key[0] ? -1 : 1;
+	if (x->key[1] != y->key[1])
+		return x->key[1] < y->key[1] ? -1 : 1;
+	if (x->cidr != y->cidr)
+		return x->cidr - y->cidr;
+	return x->leaf < y->leaf ? -1 : x->leaf > y->leaf;
+}
+
+/* Prefixes are sorted by address, length and then peer, so that, as when
+ * setting a device, the last peer with a given allowed IP gets it. Those
+ * ending within this level come before the prefixes they contain and are
+ * overridden by them, and the longer ones of a slot are contiguous. leaf,
+ * child_lo and child_hi have 1 << stride entries. */
+static void lpm_classify(const struct lpm_prefix *prefixes, size_t lo, size_t hi, unsigned int off, unsigned int stride,
+			 uint32_t def, uint32_t *leaf, size_t *child_lo, size_t *child_hi)
+{
+	size_t i, j, slot, n, slots = (size_t)1 << stride;
+
+	for (i = 0; i < slots; ++i) {
+		leaf[i] = def;
+		child_hi[i] = 0;
+	}
+	for (i = lo; i < hi; ++i) {
+		slot = lpm_bits(prefixes[i].key, off, stride);
+		if (prefixes[i].cidr <= off + stride) {
+			n = (size_t)1 << (off + stride - prefixes[i].cidr);
+			for (j = slot; j < slot + n; ++j)
+				leaf[j] = prefixes[i].leaf;
+		} else {
+			if (!child_hi[slot])
+				child_lo[slot] = i;
+			child_hi[slot] = i + 1;
+		}
+	}
+}
+
+static int lpm_build_node(struct lpm_trie *trie, const struct lpm_prefix *prefixes, size_t lo, size_t hi, unsigned int off, uint32_t def, size_t index)
+{
+	uint32_t leaf[1 << LPM_STRIDE];
+	size_t child_lo[1 << LPM_STRIDE], child_hi[1 << LPM_STRIDE];
+	struct lpm_node node = { 0 };
+	unsigned int i, num_children = 0;
+	bool have_leaf = false;
+	uint32_t last_leaf = 0;
+
+	lpm_classify(prefixes, lo, hi, off, LPM_STRIDE, def, leaf, child_lo, child_hi);
+	node.base0 = trie->num_leaves;
+	for (i = 0; i < 1 << LPM_STRIDE; ++i) {
+		if (child_hi[i]) {
+			node.vector |= 1ULL << i;
+			++num_children;
+			continue;
+		}
+		if (have_leaf && leaf[i] == last_leaf)
+			continue;
+		if (array_reserve((void **)&trie->leaves, &trie->leaves_cap, trie->num_leaves, sizeof(*trie->leaves), 256) < 0)
+			return -1;
+		trie->leaves[trie->num_leaves++] = last_leaf = leaf[i];
+		node.leafvec |= 1ULL << i;
+		have_leaf = true;
+	}
+	while (trie->num_nodes + num_children > trie->nodes_cap) {
+		if (array_reserve((void **)&trie->nodes, &trie->nodes_cap, trie->nodes_cap, sizeof(*trie->nodes), 256) < 0)
+			return -1;
+	}
+	node.base1 = trie->num_nodes;
+	trie->num_nodes += num_children;
+	trie->nodes[index] = node;
+
+	for (i = 0, num_children = 0; i < 1 << LPM_STRIDE; ++i) {
+		if (child_hi[i] && lpm_build_node(trie, prefixes, child_lo[i], child_hi[i], off + LPM_STRIDE, leaf[i], node.base1 + num_children++) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int lpm_build(struct lpm_trie *trie, const struct lpm_prefix *prefixes, size_t num_prefixes)
+{
+	const size_t slots = (size_t)1 << LPM_DIRECT_BITS;
+	size_t *child_lo = NULL, *child_hi = NULL, i;
+	uint32_t *leaf = NULL;
+	int ret = -1;
+
+	trie->direct = calloc(slots, sizeof(*trie->direct));
+	leaf = calloc(slots, sizeof(*leaf));
+	child_lo = calloc(slots, sizeof(*child_lo));
+	child_hi = calloc(slots, sizeof(*child_hi));
+	if (!trie->direct || !leaf || !child_lo || !child_hi)
+		goto out;
+
+	lpm_classify(prefixes, 0, num_prefixes, 0, LPM_DIRECT_BITS, 0, leaf, child_lo, child_hi);
+	for (i = 0; i < slots; ++i) {
+		if (!child_hi[i]) {
+			trie->direct[i] = LPM_LEAF | leaf[i];
+			continue;
+		}
+		if (array_reserve((void **)&trie->nodes, &trie->nodes_cap, trie->num_nodes, sizeof(*trie->nodes), 256) < 0)
+			goto out;
+		trie->direct[i] = trie->num_nodes++;
+		if (lpm_build_node(trie, prefixes, child_lo[i], child_hi[i], LPM_DIRECT_BITS, leaf[i], trie->direct[i]) < 0)
+			goto out;
+	}
+	ret = 0;
+
+out:
+	free(leaf);
+	free(child_lo);
+	free(child_hi);
+	return ret;
+}
+
+static void lpm_free(struct lpm_trie *trie)
+{
+	free(trie->direct);
+	free(trie->nodes);
+	free(trie->leaves);
+}
+
+/* Looks up LPM_BATCH addresses at once, one level of all of them per step,
+ * so that their cache misses overlap. */
+static inline __attribute__((always_inline)) void lpm_lookup_batch(const struct lpm_trie *trie, const uint64_t (*keys)[2], uint32_t *leaves, size_t count)
+{
+	unsigned int off = LPM_DIRECT_BITS, idx;
+	uint32_t entry[LPM_BATCH];
+	const struct lpm_node *node;
+	uint64_t mask;
+	size_t i, pending = 0;
+
+	for (i = 0; i < count; ++i) {
+		entry[i] = trie->direct[keys[i][0] >> (64 - LPM_DIRECT_BITS)];
+		if (entry[i] & LPM_LEAF)
+			leaves[i] = entry[i] & ~LPM_LEAF;
+		else {
+			__builtin_prefetch(&trie->nodes[entry[i]]);
+			++pending;
+		}
+	}
+	for (; pending; off += LPM_STRIDE) {
+		for (i = 0; i < count; ++i) {
+			if (entry[i] & LPM_LEAF)
+				continue;
+			node = &trie->nodes[entry[i]];
+			idx = lpm_bits(keys[i], off, LPM_STRIDE);
+			mask = (2ULL << idx) - 1;
+			if (node->vector & (1ULL << idx)) {
+				entry[i] = node->base1 + __builtin_popcountll(node->vector & mask) - 1;
+				__builtin_prefetch(&trie->nodes[entry[i]]);
+			} else {
+				leaves[i] = trie->leaves[node->base0 + __builtin_popcountll(node->leafvec & mask) - 1];
+				entry[i] = LPM_LEAF;
+				--pending;
+			}
+		}
+	}
+}
+
+static void lpm_lookup_batch_generic(const struct lpm_trie *trie, const uint64_t (*keys)[2], uint32_t *leaves, size_t count)
+{
+	lpm_lookup_batch(trie, keys, leaves, count);
+}
+
+#ifdef WG_X86_SIMD
+static __attribute__((target("popcnt"))) void lpm_lookup_batch_popcnt(const struct lpm_trie *trie, const uint64_t (*keys)[2], uint32_t *leaves, size_t count)
+{
+	lpm_lookup_batch(trie, keys, leaves, count);
+}
+#endif
+
+typedef void (*lpm_lookup_fn)(const struct lpm_trie *trie, const uint64_t (*keys)[2], uint32_t *leaves, size_t count);
+
+static lpm_lookup_fn lpm_lookup_impl(void)
+{
+#ifdef WG_X86_SIMD
+	if (have_popcnt())
+		return lpm_lookup_batch_popcnt;
+#endif
+	return lpm_lookup_batch_generic;
+}
+
+int wg_allowedips_index_new(wg_allowedips_index **index, const wg_device *dev)
+{
+	struct lpm_prefix *prefixes4 = NULL, *prefixes6 = NULL, *prefix;
+	size_t num_peers = 0, num4 = 0, num6 = 0, i4 = 0, i6 = 0;
+	wg_allowedip *allowedip;
+	wg_peer *peer;
+	int ret = -ENOMEM;
+
+	*index = NULL;
+	wg_for_each_peer(dev, peer) {
+		++num_peers;
+		wg_for_each_allowedip(peer, allowedip) {
+			if (allowedip->family == AF_INET && allowedip->cidr <= 32)
+				++num4;
+			else if (allowedip->family == AF_INET6 && allowedip->cidr <= 128)
+				++num6;
+			else {
+				ret = -EINVAL;
+				goto err;
+			}
+		}
+	}
+	if (num_peers >= LPM_LEAF) {
+		ret = -E2BIG;
+		goto err;
+	}
+
+	*index = calloc(1, sizeof(**index));
+	if (!*index)
+		goto err;
+	(*index)->peers = calloc(num_peers + 1, sizeof(*(*index)->peers));
+	prefixes4 = malloc((num4 ?: 1) * sizeof(*prefixes4));
+	prefixes6 = malloc((num6 ?: 1) * sizeof(*prefixes6));
+	if (!(*index)->peers || !prefixes4 || !prefixes6)
+		goto err;
+
+	num_peers = 0;
+	wg_for_each_peer(dev, peer) {
+		(*index)->peers[++num_peers] = peer;
+		wg_for_each_allowedip(peer, allowedip) {
+			if (allowedip->family == AF_INET) {
+				prefix = &prefixes4[i4++];
+				lpm_key4(prefix->key, &allowedip->ip4);
+			} else {
+				prefix = &prefixes6[i6++];
+				lpm_key6(prefix->key, &allowedip->ip6);
+			}
+			prefix->cidr = allowedip->cidr;
+			prefix->leaf = num_peers;
+			if (prefix->cidr < 64) {
+				prefix->key[0] &= prefix->cidr ? ~0ULL << (64 - prefix->cidr) : 0;
+				prefix->key[1] = 0;
+			} else if (prefix->cidr < 128)
+				prefix->key[1] &= prefix->cidr > 64 ? ~0ULL << (128 - prefix->cidr) : 0;
+		}
+	}
+	qsort(prefixes4, num4, sizeof(*prefixes4), lpm_prefix_cmp);
+	qsort(prefixes6, num6, sizeof(*prefixes6), lpm_prefix_cmp);
+	if (lpm_build(&(*index)->trie4, prefixes4, num4) < 0 || lpm_build(&(*index)->trie6, prefixes6, num6) < 0)
+		goto err;
+	free(prefixes4);
+	free(prefixes6);
+	return 0;
+
+err:
+	free(prefixes4);
+	free(prefixes6);
+	wg_allowedips_index_free(*index);
+	*index = NULL;
+	errno = -ret;
+	return ret;
+}
+
+void wg_allowedips_index_free(wg_allowedips_index *index)
+{
+	if (!index)
+		return;
+	lpm_free(&index->trie4);
+	lpm_free(&index->trie6);
+	free(index->peers);
+	free(index);
+}
+
+wg_peer *wg_allowedips_lookup4(const wg_allowedips_index *index, const struct in_addr *addr)
+{
+	uint64_t key[1][2];
+	uint32_t leaf;
+
+	lpm_key4(key[0], addr);
+	lpm_lookup_impl()(&index->trie4, (const uint64_t (*)[2])key, &leaf, 1);
+	return index->peers[leaf];
+}
+
+wg_peer *wg_allowedips_lookup6(const wg_allowedips_index *index, const struct in6_addr *addr)
+{
+	uint64_t key[1][2];
+	uint32_t leaf;
+
+	lpm_key6(key[0], addr);
+	lpm_lookup_impl()(&index->trie6, (const uint64_t (*)[2])key, &leaf, 1);
+	return index->peers[leaf];
+}
+
+void wg_allowedips_lookup4_batch(const wg_allowedips_index *index, const struct in_addr *addrs, wg_peer **peers, size_t count)
+{
+	lpm_lookup_fn lookup = lpm_lookup_impl();
+	uint64_t keys[LPM_BATCH][2];
+	uint32_t leaves[LPM_BATCH];
+	size_t i, j, n;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i < LPM_BATCH ? count - i : LPM_BATCH;
+		for (j = 0; j < n; ++j)
+			lpm_key4(keys[j], &addrs[i + j]);
+		lookup(&index->trie4, (const uint64_t (*)[2])keys, leaves, n);
+		for (j = 0; j < n; ++j)
+			peers[i + j] = index->peers[leaves[j]];
+	}
+}
+
+void wg_allowedips_lookup6_batch(const wg_allowedips_index *index, const struct in6_addr *addrs, wg_peer **peers, size_t count)
 {
-	return add_del_iface(device_name, false);
+	lpm_lookup_fn lookup = lpm_lookup_impl();
+	uint64_t keys[LPM_BATCH][2];
+	uint32_t leaves[LPM_BATCH];
+	size_t i, j, n;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i < LPM_BATCH ? count - i : LPM_BATCH;
+		for (j = 0; j < n; ++j)
+			lpm_key6(keys[j], &addrs[i + j]);
+		lookup(&index->trie6, (const uint64_t (*)[2])keys, leaves, n);
+		for (j = 0; j < n; ++j)
+			peers[i + j] = index->peers[leaves[j]];
+	}
 }
 
-void wg_free_device(wg_device *dev)
+static __attribute__((noinline)) void memzero_explicit(void *s, size_t count)
 {
-	wg_peer *peer, *np;
-	wg_allowedip *allowedip, *na;
-
-	if (!dev)
-		return;
-	for (peer = dev->first_peer, np = peer ? peer->next_peer : NULL; peer; peer = np, np = peer ? peer->next_peer : NULL) {
-		for (allowedip = peer->first_allowedip, na = allowedip ? allowedip->next_allowedip : NULL; allowedip; allowedip = na, na = allowedip ? allowedip->next_allowedip : NULL)
-			free(allowedip);
-		free(peer);
-	}
-	free(dev);
+	memset(s, 0, count);
+	__asm__ __volatile__("": :"r"(s) :"memory");
 }
 
 static void encode_base64(char dest[static 4], const uint8_t src[static 3])
@@ -1558,13 +4045,710 @@ out:
 	return -errno;
 }
 
-typedef int64_t fe[16];
+#ifdef WG_X86_SIMD
+/* The bulk codecs below follow Wojciech Muła's pshufb method: a key is
+ * two 12-byte chunks and an 8-byte tail, each turned into 16 characters with
+ * only shuffles and arithmetic, so they are as constant time as the scalar
+ * code. For decoding, validity is accumulated rather than acted upon. */
+#define B64_SSSE3 __attribute__((target("ssse3")))
+#define B64_AVX2 __attribute__((target("avx2")))
 
-static __attribute__((noinline)) void memzero_explicit(void *s, size_t count)
+static B64_SSSE3 inline __m128i encode_base64_ssse3(__m128i in)
 {
-	memset(s, 0, count);
-	__asm__ __volatile__("": :"r"(s) :"memory");
+	__m128i t0, t1, t2, t3, indices, reduced;
+
+	in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	indices = _mm_or_si128(t1, t3);
+
+	reduced = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	reduced = _mm_or_si128(reduced, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+	return _mm_add_epi8(indices, _mm_shuffle_epi8(_mm_setr_epi8(71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 65, 0, 0), reduced));
+}
+
+/* Returns the 12 decoded bytes, and sets *invalid to non-zero if any of the
+ * 16 characters is outside the alphabet. */
+static B64_SSSE3 inline __m128i decode_base64_ssse3(__m128i in, __m128i *invalid)
+{
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	__m128i hi, lo, roll, merged;
+
+	hi = _mm_and_si128(_mm_srli_epi32(in, 4), mask);
+	lo = _mm_and_si128(in, mask);
+	*invalid = _mm_or_si128(*invalid, _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi)));
+	roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')), hi));
+	in = _mm_add_epi8(in, roll);
+
+	merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+	merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+static B64_SSSE3 void keys_to_base64_ssse3(wg_key_b64_string *base64, const wg_key *keys, size_t count)
+{
+	uint8_t out[48];
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		_mm_storeu_si128((__m128i *)&out[0], encode_base64_ssse3(_mm_loadu_si128((const __m128i *)&keys[i][0])));
+		_mm_storeu_si128((__m128i *)&out[16], encode_base64_ssse3(_mm_loadu_si128((const __m128i *)&keys[i][12])));
+		_mm_storeu_si128((__m128i *)&out[32], encode_base64_ssse3(_mm_loadl_epi64((const __m128i *)&keys[i][24])));
+		memcpy(base64[i], out, 43);
+		base64[i][43] = '=';
+		base64[i][44] = '\0';
+	}
+}
+
+/* Besides the alphabet, a key string must be exactly 43 characters and an
+ * '=', and the unused low bits of its last character must be zero. */
+static B64_SSSE3 int keys_from_base64_ssse3(wg_key *keys, const wg_key_b64_string *base64, size_t count)
+{
+	__m128i invalid = _mm_setzero_si128(), tail;
+	uint8_t out[48], ret = 0;
+	char last[16];
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		memcpy(last, &base64[i][32], 11);
+		memset(&last[11], 'A', 5);
+		_mm_storeu_si128((__m128i *)&out[0], decode_base64_ssse3(_mm_loadu_si128((const __m128i *)&base64[i][0]), &invalid));
+		_mm_storeu_si128((__m128i *)&out[12], decode_base64_ssse3(_mm_loadu_si128((const __m128i *)&base64[i][16]), &invalid));
+		tail = decode_base64_ssse3(_mm_loadu_si128((const __m128i *)last), &invalid);
+		_mm_storeu_si128((__m128i *)&out[24], tail);
+		ret |= out[32] | (base64[i][43] ^ '=') | base64[i][44];
+		memcpy(keys[i], out, sizeof(wg_key));
+	}
+	ret |= _mm_movemask_epi8(_mm_cmpeq_epi8(invalid, _mm_setzero_si128())) != 0xffff;
+	memzero_explicit(out, sizeof(out));
+	errno = EINVAL & ~((ret - 1) >> 8);
+	return -errno;
+}
+
+static B64_AVX2 inline __m256i encode_base64_avx2(__m256i in)
+{
+	__m256i t0, t1, t2, t3, indices, reduced;
+
+	in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+						       1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+	t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+	t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	indices = _mm256_or_si256(t1, t3);
+
+	reduced = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+	reduced = _mm256_or_si256(reduced, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+	return _mm256_add_epi8(indices, _mm256_shuffle_epi8(_mm256_setr_epi8(71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 65, 0, 0,
+									      71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 65, 0, 0), reduced));
+}
+
+static B64_AVX2 inline __m256i decode_base64_avx2(__m256i in, __m256i *invalid)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+						0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+						0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+						  0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	__m256i hi, lo, roll, merged;
+
+	hi = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask);
+	lo = _mm256_and_si256(in, mask);
+	*invalid = _mm256_or_si256(*invalid, _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo), _mm256_shuffle_epi8(lut_hi, hi)));
+	roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')), hi));
+	in = _mm256_add_epi8(in, roll);
+
+	merged = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+	merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+	return _mm256_shuffle_epi8(merged, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+							    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+/* The two 12-byte chunks of a key go through one 256-bit register, one per
+ * 128-bit lane, and the tail through the 128-bit kernel. */
+static B64_AVX2 void keys_to_base64_avx2(wg_key_b64_string *base64, const wg_key *keys, size_t count)
+{
+	uint8_t out[48];
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		_mm256_storeu_si256((__m256i *)&out[0], encode_base64_avx2(_mm256_loadu2_m128i((const __m128i *)&keys[i][12], (const __m128i *)&keys[i][0])));
+		_mm_storeu_si128((__m128i *)&out[32], encode_base64_ssse3(_mm_loadl_epi64((const __m128i *)&keys[i][24])));
+		memcpy(base64[i], out, 43);
+		base64[i][43] = '=';
+		base64[i][44] = '\0';
+	}
+}
+
+static B64_AVX2 int keys_from_base64_avx2(wg_key *keys, const wg_key_b64_string *base64, size_t count)
+{
+	__m256i invalid = _mm256_setzero_si256(), head;
+	__m128i invalid_tail = _mm_setzero_si128();
+	uint8_t out[48], ret = 0;
+	char last[16];
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		memcpy(last, &base64[i][32], 11);
+		memset(&last[11], 'A', 5);
+		head = decode_base64_avx2(_mm256_loadu_si256((const __m256i *)&base64[i][0]), &invalid);
+		_mm_storeu_si128((__m128i *)&out[0], _mm256_castsi256_si128(head));
+		_mm_storeu_si128((__m128i *)&out[12], _mm256_extracti128_si256(head, 1));
+		_mm_storeu_si128((__m128i *)&out[24], decode_base64_ssse3(_mm_loadu_si128((const __m128i *)last), &invalid_tail));
+		ret |= out[32] | (base64[i][43] ^ '=') | base64[i][44];
+		memcpy(keys[i], out, sizeof(wg_key));
+	}
+	ret |= !_mm256_testz_si256(invalid, invalid) | !_mm_testz_si128(invalid_tail, invalid_tail);
+	memzero_explicit(out, sizeof(out));
+	errno = EINVAL & ~((ret - 1) >> 8);
+	return -errno;
+}
+#endif
+
+void wg_keys_to_base64(wg_key_b64_string *base64, const wg_key *keys, size_t count)
+{
+	size_t i;
+
+#ifdef WG_X86_SIMD
+	if (have_avx2()) {
+		keys_to_base64_avx2(base64, keys, count);
+		return;
+	}
+	if (have_ssse3()) {
+		keys_to_base64_ssse3(base64, keys, count);
+		return;
+	}
+#endif
+	for (i = 0; i < count; ++i)
+		wg_key_to_base64(base64[i], keys[i]);
+}
+
+/* Returns -EINVAL if any of the strings is not a valid key; which one can
+ * be found with wg_key_from_base64(). */
+int wg_keys_from_base64(wg_key *keys, const wg_key_b64_string *base64, size_t count)
+{
+	size_t i;
+	int ret = 0;
+
+#ifdef WG_X86_SIMD
+	if (have_avx2())
+		return keys_from_base64_avx2(keys, base64, count);
+	if (have_ssse3())
+		return keys_from_base64_ssse3(keys, base64, count);
+#endif
+	for (i = 0; i < count; ++i)
+		ret |= wg_key_from_base64(keys[i], base64[i]);
+	errno = ret ? EINVAL : 0;
+	return ret ? -EINVAL : 0;
+}
+
+static void clamp_key(uint8_t *z)
+{
+	z[31] = (z[31] & 127) | 64;
+	z[0] &= 248;
+}
+
+#ifdef __SIZEOF_INT128__
+/* Field elements are five 51-bit limbs, multiplied with 128-bit products.
+ * Limbs are left unreduced between operations: sums may reach 2^52 and
+ * differences 2^53, which fe51_mul() and fe51_sq() can still take. */
+typedef uint64_t fe51[5];
+typedef unsigned __int128 u128;
+
+#define FE51_MASK ((1ULL << 51) - 1)
+
+static void fe51_add(fe51 o, const fe51 a, const fe51 b)
+{
+	int i;
+
+	for (i = 0; i < 5; ++i)
+		o[i] = a[i] + b[i];
+}
+
+/* Adding 2p first keeps every limb positive. */
+static void fe51_sub(fe51 o, const fe51 a, const fe51 b)
+{
+	int i;
+
+	o[0] = a[0] + 0xfffffffffffdaULL - b[0];
+	for (i = 1; i < 5; ++i)
+		o[i] = a[i] + 0xffffffffffffeULL - b[i];
+}
+
+static inline void fe51_carry_wide(fe51 o, u128 t0, u128 t1, u128 t2, u128 t3, u128 t4)
+{
+	uint64_t c;
+
+	t1 += (uint64_t)(t0 >> 51);
+	t2 += (uint64_t)(t1 >> 51);
+	t3 += (uint64_t)(t2 >> 51);
+	t4 += (uint64_t)(t3 >> 51);
+	c = (uint64_t)(t4 >> 51);
+	o[0] = ((uint64_t)t0 & FE51_MASK) + c * 19;
+	o[1] = ((uint64_t)t1 & FE51_MASK) + (o[0] >> 51);
+	o[0] &= FE51_MASK;
+	o[2] = (uint64_t)t2 & FE51_MASK;
+	o[3] = (uint64_t)t3 & FE51_MASK;
+	o[4] = (uint64_t)t4 & FE51_MASK;
+}
+
+static void fe51_mul(fe51 o, const fe51 a, const fe51 b)
+{
+	uint64_t b1 = 19 * b[1], b2 = 19 * b[2], b3 = 19 * b[3], b4 = 19 * b[4];
+
+	fe51_carry_wide(o,
+		(u128)a[0] * b[0] + (u128)a[1] * b4 + (u128)a[2] * b3 + (u128)a[3] * b2 + (u128)a[4] * b1,
+		(u128)a[0] * b[1] + (u128)a[1] * b[0] + (u128)a[2] * b4 + (u128)a[3] * b3 + (u128)a[4] * b2,
+		(u128)a[0] * b[2] + (u128)a[1] * b[1] + (u128)a[2] * b[0] + (u128)a[3] * b4 + (u128)a[4] * b3,
+		(u128)a[0] * b[3] + (u128)a[1] * b[2] + (u128)a[2] * b[1] + (u128)a[3] * b[0] + (u128)a[4] * b4,
+		(u128)a[0] * b[4] + (u128)a[1] * b[3] + (u128)a[2] * b[2] + (u128)a[3] * b[1] + (u128)a[4] * b[0]);
+}
+
+static void fe51_sq(fe51 o, const fe51 a)
+{
+	uint64_t d0 = 2 * a[0], d1 = 2 * a[1], d2 = 38 * a[2], a3 = 19 * a[3], a4 = 19 * a[4], d4 = 2 * a4;
+
+	fe51_carry_wide(o,
+		(u128)a[0] * a[0] + (u128)d4 * a[1] + (u128)d2 * a[3],
+		(u128)d0 * a[1] + (u128)d4 * a[2] + (u128)a3 * a[3],
+		(u128)d0 * a[2] + (u128)a[1] * a[1] + (u128)d4 * a[3],
+		(u128)d0 * a[3] + (u128)d1 * a[2] + (u128)a4 * a[4],
+		(u128)d0 * a[4] + (u128)d1 * a[3] + (u128)a[2] * a[2]);
+}
+
+static void fe51_sq_times(fe51 o, const fe51 a, int n)
+{
+	fe51_sq(o, a);
+	while (--n)
+		fe51_sq(o, o);
+}
+
+static void fe51_mul_small(fe51 o, const fe51 a, uint32_t b)
+{
+	fe51_carry_wide(o, (u128)a[0] * b, (u128)a[1] * b, (u128)a[2] * b, (u128)a[3] * b, (u128)a[4] * b);
+}
+
+static void fe51_cswap(fe51 a, fe51 b, uint64_t bit)
+{
+	uint64_t t, mask = 0 - bit;
+	int i;
+
+	for (i = 0; i < 5; ++i) {
+		t = mask & (a[i] ^ b[i]);
+		a[i] ^= t;
+		b[i] ^= t;
+	}
+}
+
+/* z^(p - 2), with the usual chain of 254 squarings and 11 multiplications. */
+static void fe51_invert(fe51 o, const fe51 z)
+{
+	fe51 z2, z9, z11, z2_5_0, z2_10_0, z2_20_0, z2_50_0, z2_100_0, t;
+
+	fe51_sq(z2, z);
+	fe51_sq_times(t, z2, 2);
+	fe51_mul(z9, t, z);
+	fe51_mul(z11, z9, z2);
+	fe51_sq(t, z11);
+	fe51_mul(z2_5_0, t, z9);
+	fe51_sq_times(t, z2_5_0, 5);
+	fe51_mul(z2_10_0, t, z2_5_0);
+	fe51_sq_times(t, z2_10_0, 10);
+	fe51_mul(z2_20_0, t, z2_10_0);
+	fe51_sq_times(t, z2_20_0, 20);
+	fe51_mul(t, t, z2_20_0);
+	fe51_sq_times(t, t, 10);
+	fe51_mul(z2_50_0, t, z2_10_0);
+	fe51_sq_times(t, z2_50_0, 50);
+	fe51_mul(z2_100_0, t, z2_50_0);
+	fe51_sq_times(t, z2_100_0, 100);
+	fe51_mul(t, t, z2_100_0);
+	fe51_sq_times(t, t, 50);
+	fe51_mul(t, t, z2_50_0);
+	fe51_sq_times(t, t, 5);
+	fe51_mul(o, t, z11);
+
+	memzero_explicit(z2, sizeof(z2));
+	memzero_explicit(z9, sizeof(z9));
+	memzero_explicit(z11, sizeof(z11));
+	memzero_explicit(z2_5_0, sizeof(z2_5_0));
+	memzero_explicit(z2_10_0, sizeof(z2_10_0));
+	memzero_explicit(z2_20_0, sizeof(z2_20_0));
+	memzero_explicit(z2_50_0, sizeof(z2_50_0));
+	memzero_explicit(z2_100_0, sizeof(z2_100_0));
+	memzero_explicit(t, sizeof(t));
+}
+
+static void fe51_tobytes(uint8_t o[32], const fe51 a)
+{
+	uint64_t t[5], q, w;
+	int i, j;
+
+	memcpy(t, a, sizeof(t));
+	for (j = 0; j < 2; ++j) {
+		for (i = 0; i < 4; ++i) {
+			t[i + 1] += t[i] >> 51;
+			t[i] &= FE51_MASK;
+		}
+		t[0] += 19 * (t[4] >> 51);
+		t[4] &= FE51_MASK;
+	}
+
+	/* Now t < 2^255 + 19, so subtracting p once, if t >= p, reduces it. */
+	q = (t[0] + 19) >> 51;
+	for (i = 1; i < 5; ++i)
+		q = (t[i] + q) >> 51;
+	t[0] += 19 * q;
+	for (i = 0; i < 4; ++i) {
+		t[i + 1] += t[i] >> 51;
+		t[i] &= FE51_MASK;
+	}
+	t[4] &= FE51_MASK;
+
+	for (i = 0; i < 4; ++i) {
+		w = (t[i] >> (13 * i)) | (t[i + 1] << (51 - 13 * i));
+		for (j = 0; j < 8; ++j)
+			o[i * 8 + j] = w >> (8 * j);
+	}
+
+	memzero_explicit(t, sizeof(t));
+	memzero_explicit(&w, sizeof(w));
+}
+
+void wg_generate_public_key(wg_key public_key, const wg_key private_key)
+{
+	fe51 x2 = { 1 }, z2 = { 0 }, x3 = { 9 }, z3 = { 1 }, a, b, c, d, e, aa, bb;
+	uint64_t bit, swap = 0;
+	uint8_t k[32];
+	int i;
+
+	memcpy(k, private_key, sizeof(k));
+	clamp_key(k);
+
+	for (i = 254; i >= 0; --i) {
+		bit = (k[i >> 3] >> (i & 7)) & 1;
+		swap ^= bit;
+		fe51_cswap(x2, x3, swap);
+		fe51_cswap(z2, z3, swap);
+		swap = bit;
+
+		fe51_add(a, x2, z2);
+		fe51_sub(b, x2, z2);
+		fe51_add(c, x3, z3);
+		fe51_sub(d, x3, z3);
+		fe51_sq(aa, a);
+		fe51_sq(bb, b);
+		fe51_mul(d, d, a);
+		fe51_mul(c, c, b);
+		fe51_sub(e, aa, bb);
+		fe51_add(x3, d, c);
+		fe51_sq(x3, x3);
+		fe51_sub(z3, d, c);
+		fe51_sq(z3, z3);
+		fe51_mul_small(z3, z3, 9);
+		fe51_mul(x2, aa, bb);
+		fe51_mul_small(z2, e, 121665);
+		fe51_add(z2, z2, aa);
+		fe51_mul(z2, z2, e);
+	}
+	fe51_cswap(x2, x3, swap);
+	fe51_cswap(z2, z3, swap);
+
+	fe51_invert(z2, z2);
+	fe51_mul(x2, x2, z2);
+	fe51_tobytes(public_key, x2);
+
+	memzero_explicit(&bit, sizeof(bit));
+	memzero_explicit(&swap, sizeof(swap));
+	memzero_explicit(k, sizeof(k));
+	memzero_explicit(x2, sizeof(x2));
+	memzero_explicit(z2, sizeof(z2));
+	memzero_explicit(x3, sizeof(x3));
+	memzero_explicit(z3, sizeof(z3));
+	memzero_explicit(a, sizeof(a));
+	memzero_explicit(b, sizeof(b));
+	memzero_explicit(c, sizeof(c));
+	memzero_explicit(d, sizeof(d));
+	memzero_explicit(e, sizeof(e));
+	memzero_explicit(aa, sizeof(aa));
+	memzero_explicit(bb, sizeof(bb));
+}
+
+#ifdef WG_X86_SIMD
+#define CURVE25519_AVX2
+/* Four keys at once, one per 64-bit lane. AVX2 only multiplies 32-bit
+ * halves, so here elements are ten limbs of alternately 26 and 25 bits;
+ * two of them make up exactly one limb of fe51, which is how the results
+ * are handed back to fe51_tobytes(). Every operation carries its result,
+ * so that limbs stay below 2^27 and 19 times a limb still fits 32 bits. */
+typedef struct {
+	__m256i l[10];
+} fe4;
+
+#define FE4_AVX2 __attribute__((target("avx2")))
+
+static FE4_AVX2 inline void fe4_carry_step(fe4 *h, int i)
+{
+	const __m256i mask = _mm256_set1_epi64x(i & 1 ? (1 << 25) - 1 : (1 << 26) - 1);
+	__m256i c = _mm256_srli_epi64(h->l[i], i & 1 ? 25 : 26);
+
+	h->l[i] = _mm256_and_si256(h->l[i], mask);
+	h->l[i + 1] = _mm256_add_epi64(h->l[i + 1], c);
+}
+
+/* Two interleaved carry chains, as in ref10, to shorten the dependency. */
+static FE4_AVX2 inline void fe4_carry(fe4 *h)
+{
+	__m256i c;
+
+	fe4_carry_step(h, 0);
+	fe4_carry_step(h, 4);
+	fe4_carry_step(h, 1);
+	fe4_carry_step(h, 5);
+	fe4_carry_step(h, 2);
+	fe4_carry_step(h, 6);
+	fe4_carry_step(h, 3);
+	fe4_carry_step(h, 7);
+	fe4_carry_step(h, 4);
+	fe4_carry_step(h, 8);
+	c = _mm256_srli_epi64(h->l[9], 25);
+	h->l[9] = _mm256_and_si256(h->l[9], _mm256_set1_epi64x((1 << 25) - 1));
+	/* c * 19 = c * 16 + c * 2 + c, as c may be wider than 32 bits. */
+	h->l[0] = _mm256_add_epi64(h->l[0], _mm256_add_epi64(_mm256_add_epi64(_mm256_slli_epi64(c, 4), _mm256_slli_epi64(c, 1)), c));
+	fe4_carry_step(h, 0);
+}
+
+static FE4_AVX2 inline void fe4_add(fe4 *h, const fe4 *f, const fe4 *g)
+{
+	int i;
+
+#pragma GCC unroll 10
+	for (i = 0; i < 10; ++i)
+		h->l[i] = _mm256_add_epi64(f->l[i], g->l[i]);
+	fe4_carry(h);
+}
+
+static FE4_AVX2 inline void fe4_sub(fe4 *h, const fe4 *f, const fe4 *g)
+{
+	const __m256i two_p0 = _mm256_set1_epi64x(0x7ffffda), two_p_even = _mm256_set1_epi64x(0x7fffffe), two_p_odd = _mm256_set1_epi64x(0x3fffffe);
+	int i;
+
+#pragma GCC unroll 10
+	for (i = 0; i < 10; ++i)
+		h->l[i] = _mm256_sub_epi64(_mm256_add_epi64(f->l[i], i == 0 ? two_p0 : i & 1 ? two_p_odd : two_p_even), g->l[i]);
+	fe4_carry(h);
+}
+
+static FE4_AVX2 inline void fe4_mul(fe4 *h, const fe4 *f, const fe4 *g)
+{
+	const __m256i nineteen = _mm256_set1_epi64x(19);
+	__m256i f2[10], g19[10], t[10];
+	int i, j;
+
+#pragma GCC unroll 10
+	for (i = 0; i < 10; ++i) {
+		f2[i] = i & 1 ? _mm256_add_epi64(f->l[i], f->l[i]) : f->l[i];
+		g19[i] = _mm256_mul_epu32(g->l[i], nineteen);
+		t[i] = _mm256_setzero_si256();
+	}
+#pragma GCC unroll 10
+	for (i = 0; i < 10; ++i) {
+#pragma GCC unroll 10
+		for (j = 0; j < 10; ++j)
+			t[(i + j) % 10] = _mm256_add_epi64(t[(i + j) % 10],
+				_mm256_mul_epu32(i & j & 1 ? f2[i] : f->l[i], i + j >= 10 ? g19[j] : g->l[j]));
+	}
+#pragma GCC unroll 10
+	for (i = 0; i < 10; ++i)
+		h->l[i] = t[i];
+	fe4_carry(h);
+}
+
+/* As fe4_mul(h, f, f), but each cross product is computed once and doubled,
+ * which takes 55 multiplications instead of 100. */
+static FE4_AVX2 inline void fe4_sq(fe4 *h, const fe4 *f)
+{
+	const __m256i nineteen = _mm256_set1_epi64x(19);
+	__m256i f2[10], f4[10], f19[10], t[10];
+	int i, j;
+
+#pragma GCC unroll 10
+	for (i = 0; i < 10; ++i) {
+		f2[i] = _mm256_add_epi64(f->l[i], f->l[i]);
+		f4[i] = _mm256_add_epi64(f2[i], f2[i]);
+		f19[i] = _mm256_mul_epu32(f->l[i], nineteen);
+		t[i] = _mm256_setzero_si256();
+	}
+#pragma GCC unroll 10
+	for (i = 0; i < 10; ++i) {
+#pragma GCC unroll 10
+		for (j = i; j < 10; ++j)
+			t[(i + j) % 10] = _mm256_add_epi64(t[(i + j) % 10],
+				_mm256_mul_epu32(i == j ? (i & 1 ? f2[i] : f->l[i]) : (i & j & 1 ? f4[i] : f2[i]),
+						 i + j >= 10 ? f19[j] : f->l[j]));
+	}
+#pragma GCC unroll 10
+	for (i = 0; i < 10; ++i)
+		h->l[i] = t[i];
+	fe4_carry(h);
+}
+
+static FE4_AVX2 inline void fe4_sq_times(fe4 *h, const fe4 *f, int n)
+{
+	fe4_sq(h, f);
+	while (--n)
+		fe4_sq(h, h);
+}
+
+static FE4_AVX2 inline void fe4_mul_small(fe4 *h, const fe4 *f, uint32_t b)
+{
+	const __m256i k = _mm256_set1_epi64x(b);
+	int i;
+
+#pragma GCC unroll 10
+	for (i = 0; i < 10; ++i)
+		h->l[i] = _mm256_mul_epu32(f->l[i], k);
+	fe4_carry(h);
+}
+
+static FE4_AVX2 inline void fe4_cswap(fe4 *f, fe4 *g, __m256i mask)
+{
+	__m256i t;
+	int i;
+
+#pragma GCC unroll 10
+	for (i = 0; i < 10; ++i) {
+		t = _mm256_and_si256(mask, _mm256_xor_si256(f->l[i], g->l[i]));
+		f->l[i] = _mm256_xor_si256(f->l[i], t);
+		g->l[i] = _mm256_xor_si256(g->l[i], t);
+	}
+}
+
+static FE4_AVX2 void fe4_invert(fe4 *o, const fe4 *z)
+{
+	fe4 z2, z9, z11, z2_5_0, z2_10_0, z2_20_0, z2_50_0, z2_100_0, t;
+
+	fe4_sq(&z2, z);
+	fe4_sq_times(&t, &z2, 2);
+	fe4_mul(&z9, &t, z);
+	fe4_mul(&z11, &z9, &z2);
+	fe4_sq(&t, &z11);
+	fe4_mul(&z2_5_0, &t, &z9);
+	fe4_sq_times(&t, &z2_5_0, 5);
+	fe4_mul(&z2_10_0, &t, &z2_5_0);
+	fe4_sq_times(&t, &z2_10_0, 10);
+	fe4_mul(&z2_20_0, &t, &z2_10_0);
+	fe4_sq_times(&t, &z2_20_0, 20);
+	fe4_mul(&t, &t, &z2_20_0);
+	fe4_sq_times(&t, &t, 10);
+	fe4_mul(&z2_50_0, &t, &z2_10_0);
+	fe4_sq_times(&t, &z2_50_0, 50);
+	fe4_mul(&z2_100_0, &t, &z2_50_0);
+	fe4_sq_times(&t, &z2_100_0, 100);
+	fe4_mul(&t, &t, &z2_100_0);
+	fe4_sq_times(&t, &t, 50);
+	fe4_mul(&t, &t, &z2_50_0);
+	fe4_sq_times(&t, &t, 5);
+	fe4_mul(o, &t, &z11);
+
+	memzero_explicit(&z2, sizeof(z2));
+	memzero_explicit(&z9, sizeof(z9));
+	memzero_explicit(&z11, sizeof(z11));
+	memzero_explicit(&z2_5_0, sizeof(z2_5_0));
+	memzero_explicit(&z2_10_0, sizeof(z2_10_0));
+	memzero_explicit(&z2_20_0, sizeof(z2_20_0));
+	memzero_explicit(&z2_50_0, sizeof(z2_50_0));
+	memzero_explicit(&z2_100_0, sizeof(z2_100_0));
+	memzero_explicit(&t, sizeof(t));
+}
+
+static FE4_AVX2 void generate_public_keys_avx2(wg_key public_keys[4], const wg_key private_keys[4])
+{
+	fe4 x2 = { 0 }, z2 = { 0 }, x3 = { 0 }, z3 = { 0 }, a, b, c, d, e, aa, bb;
+	uint64_t lanes[10][4];
+	__m256i bit, swap = _mm256_setzero_si256();
+	uint8_t k[4][32];
+	fe51 x;
+	int i, j;
+
+	for (j = 0; j < 4; ++j) {
+		memcpy(k[j], private_keys[j], sizeof(k[j]));
+		clamp_key(k[j]);
+	}
+	x2.l[0] = _mm256_set1_epi64x(1);
+	x3.l[0] = _mm256_set1_epi64x(9);
+	z3.l[0] = _mm256_set1_epi64x(1);
+
+	for (i = 254; i >= 0; --i) {
+		bit = _mm256_set_epi64x((k[3][i >> 3] >> (i & 7)) & 1, (k[2][i >> 3] >> (i & 7)) & 1,
+					(k[1][i >> 3] >> (i & 7)) & 1, (k[0][i >> 3] >> (i & 7)) & 1);
+		swap = _mm256_xor_si256(swap, bit);
+		swap = _mm256_sub_epi64(_mm256_setzero_si256(), swap);
+		fe4_cswap(&x2, &x3, swap);
+		fe4_cswap(&z2, &z3, swap);
+		swap = bit;
+
+		fe4_add(&a, &x2, &z2);
+		fe4_sub(&b, &x2, &z2);
+		fe4_add(&c, &x3, &z3);
+		fe4_sub(&d, &x3, &z3);
+		fe4_sq(&aa, &a);
+		fe4_sq(&bb, &b);
+		fe4_mul(&d, &d, &a);
+		fe4_mul(&c, &c, &b);
+		fe4_sub(&e, &aa, &bb);
+		fe4_add(&x3, &d, &c);
+		fe4_sq(&x3, &x3);
+		fe4_sub(&z3, &d, &c);
+		fe4_sq(&z3, &z3);
+		fe4_mul_small(&z3, &z3, 9);
+		fe4_mul(&x2, &aa, &bb);
+		fe4_mul_small(&z2, &e, 121665);
+		fe4_add(&z2, &z2, &aa);
+		fe4_mul(&z2, &z2, &e);
+	}
+	swap = _mm256_sub_epi64(_mm256_setzero_si256(), swap);
+	fe4_cswap(&x2, &x3, swap);
+	fe4_cswap(&z2, &z3, swap);
+
+	fe4_invert(&z2, &z2);
+	fe4_mul(&x2, &x2, &z2);
+	for (i = 0; i < 10; ++i)
+		_mm256_storeu_si256((__m256i *)lanes[i], x2.l[i]);
+	for (j = 0; j < 4; ++j) {
+		for (i = 0; i < 5; ++i)
+			x[i] = lanes[2 * i][j] + (lanes[2 * i + 1][j] << 26);
+		fe51_tobytes(public_keys[j], x);
+	}
+
+	memzero_explicit(&bit, sizeof(bit));
+	memzero_explicit(&swap, sizeof(swap));
+	memzero_explicit(k, sizeof(k));
+	memzero_explicit(lanes, sizeof(lanes));
+	memzero_explicit(x, sizeof(x));
+	memzero_explicit(&x2, sizeof(x2));
+	memzero_explicit(&z2, sizeof(z2));
+	memzero_explicit(&x3, sizeof(x3));
+	memzero_explicit(&z3, sizeof(z3));
+	memzero_explicit(&a, sizeof(a));
+	memzero_explicit(&b, sizeof(b));
+	memzero_explicit(&c, sizeof(c));
+	memzero_explicit(&d, sizeof(d));
+	memzero_explicit(&e, sizeof(e));
+	memzero_explicit(&aa, sizeof(aa));
+	memzero_explicit(&bb, sizeof(bb));
 }
+#endif
+
+#else
+typedef int64_t fe[16];
 
 static void carry(fe o)
 {
@@ -1672,12 +4856,6 @@ static void invert(fe o, const fe i)
 	memzero_explicit(c, sizeof(c));
 }
 
-static void clamp_key(uint8_t *z)
-{
-	z[31] = (z[31] & 127) | 64;
-	z[0] &= 248;
-}
-
 void wg_generate_public_key(wg_key public_key, const wg_key private_key)
 {
 	int i, r;
@@ -1725,31 +4903,83 @@ void wg_generate_public_key(wg_key public_key, const wg_key private_key)
 	memzero_explicit(e, sizeof(e));
 	memzero_explicit(f, sizeof(f));
 }
+#endif
 
-void wg_generate_private_key(wg_key private_key)
+/* Derives count public keys at once, four at a time with AVX2 where the CPU
+ * has it. */
+void wg_generate_public_keys(wg_key *public_keys, const wg_key *private_keys, size_t count)
 {
-	wg_generate_preshared_key(private_key);
-	clamp_key(private_key);
+	size_t i = 0;
+
+#ifdef CURVE25519_AVX2
+	if (count >= 4 && have_avx2()) {
+		for (; i + 4 <= count; i += 4)
+			generate_public_keys_avx2(&public_keys[i], &private_keys[i]);
+	}
+#endif
+	for (; i < count; ++i)
+		wg_generate_public_key(public_keys[i], private_keys[i]);
 }
 
-void wg_generate_preshared_key(wg_key preshared_key)
+/* Fills out with len random bytes, in as few system calls as possible. */
+static void get_random_bytes(uint8_t *out, size_t len)
 {
-	ssize_t ret;
-	size_t i;
+	ssize_t ret = 0;
+	size_t i = 0;
 	int fd;
-#if defined(__OpenBSD__) || (defined(__APPLE__) && MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_12) || (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25)))
-	if (!getentropy(preshared_key, sizeof(wg_key)))
+#if defined(__NR_getrandom) && defined(__linux__)
+	/* getrandom() hands out up to 32 MiB at once, but may return short
+	 * reads of larger requests if a signal arrives. */
+	for (; i < len; i += ret) {
+		ret = syscall(__NR_getrandom, out + i, len - i, 0);
+		if (ret <= 0 && errno != EINTR)
+			break;
+		if (ret < 0)
+			ret = 0;
+	}
+	if (i == len)
 		return;
 #endif
-#if defined(__NR_getrandom) && defined(__linux__)
-	if (syscall(__NR_getrandom, preshared_key, sizeof(wg_key), 0) == sizeof(wg_key))
+#if defined(__OpenBSD__) || (defined(__APPLE__) && MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_12) || (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25)))
+	/* getentropy() is limited to 256 bytes per call. */
+	for (; i < len; i += ret) {
+		ret = len - i < 256 ? len - i : 256;
+		if (getentropy(out + i, ret))
+			break;
+	}
+	if (i == len)
 		return;
 #endif
 	fd = open("/dev/urandom", O_RDONLY);
 	assert(fd >= 0);
-	for (i = 0; i < sizeof(wg_key); i += ret) {
-		ret = read(fd, preshared_key + i, sizeof(wg_key) - i);
+	for (; i < len; i += ret) {
+		ret = read(fd, out + i, len - i);
 		assert(ret > 0);
 	}
 	close(fd);
 }
+
+void wg_generate_private_key(wg_key private_key)
+{
+	wg_generate_preshared_key(private_key);
+	clamp_key(private_key);
+}
+
+void wg_generate_preshared_key(wg_key preshared_key)
+{
+	get_random_bytes(preshared_key, sizeof(wg_key));
+}
+
+void wg_generate_private_keys(wg_key *private_keys, size_t count)
+{
+	size_t i;
+
+	wg_generate_preshared_keys(private_keys, count);
+	for (i = 0; i < count; ++i)
+		clamp_key(private_keys[i]);
+}
+
+void wg_generate_preshared_keys(wg_key *preshared_keys, size_t count)
+{
+	get_random_bytes((uint8_t *)preshared_keys, count * sizeof(wg_key));
+}
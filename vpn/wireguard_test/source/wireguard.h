@@ -83,23 +83,225 @@ typedef struct wg_device {
 	uint16_t listen_port;
 
 	struct wg_peer *first_peer, *last_peer;
+
+	/* Set on devices returned by wg_get_device() and friends. */
+	struct wg_peer_index *peer_index;
 } wg_device;
 
+typedef struct wg_flat_peer {
+	enum wg_peer_flags flags;
+
+	wg_key public_key;
+	wg_key preshared_key;
+
+	wg_endpoint endpoint;
+
+	uint16_t persistent_keepalive_interval;
+
+	uint32_t first_allowedip, num_allowedips;
+	uint32_t first_prefix4, num_prefixes4;
+	uint32_t first_prefix6, num_prefixes6;
+} wg_flat_peer;
+
+/* Allowed IPs as stored by wg_session_get_compact_device(), with the address
+ * in network order. */
+typedef struct wg_prefix4 {
+	uint8_t addr[4];
+	uint8_t cidr;
+} wg_prefix4;
+
+typedef struct wg_prefix6 {
+	uint8_t addr[16];
+	uint8_t cidr;
+} wg_prefix6;
+
+/* The same information as wg_device, but in contiguous arrays: peer i owns
+ * allowedips[peers[i].first_allowedip] onwards, and its traffic statistics are
+ * rx_bytes[i], tx_bytes[i] and last_handshake_time[i]. A zeroed wg_flat_device
+ * may be passed to wg_session_get_flat_device(), and passing the same one
+ * again reuses its arrays. wg_session_get_compact_device() fills prefixes4 and
+ * prefixes6 instead of allowedips, split by family in the same way. */
+typedef struct wg_flat_device {
+	char name[IFNAMSIZ];
+	uint32_t ifindex;
+
+	enum wg_device_flags flags;
+
+	wg_key public_key;
+	wg_key private_key;
+
+	uint32_t fwmark;
+	uint16_t listen_port;
+
+	size_t num_peers, num_allowedips;
+	wg_flat_peer *peers;
+	wg_allowedip *allowedips;
+
+	size_t num_prefixes4, num_prefixes6;
+	wg_prefix4 *prefixes4;
+	wg_prefix6 *prefixes6;
+
+	uint64_t *rx_bytes, *tx_bytes;
+	struct timespec64 *last_handshake_time;
+
+	size_t peers_cap, allowedips_cap, prefixes4_cap, prefixes6_cap;
+} wg_flat_device;
+
+/* Views into the receive buffer, handed to the callback of
+ * wg_session_walk_device() and only valid until it returns. */
+typedef struct wg_allowedip_view {
+	uint16_t family;
+	uint8_t cidr;
+	const uint8_t *addr; /* 4 or 16 bytes, in network order */
+	const void *next;
+} wg_allowedip_view;
+
+typedef struct wg_peer_view {
+	enum wg_peer_flags flags;
+
+	const uint8_t *public_key;
+	const uint8_t *preshared_key; /* NULL unless WGPEER_HAS_PRESHARED_KEY */
+	const struct sockaddr *endpoint; /* NULL if the peer has none */
+
+	struct timespec64 last_handshake_time;
+	uint64_t rx_bytes, tx_bytes;
+	uint16_t persistent_keepalive_interval;
+
+	/* A peer with more allowed IPs than fit in one message is reported again
+	 * right after, with only its public key and the remaining allowed IPs. */
+	bool continued;
+
+	const void *allowedips;
+} wg_peer_view;
+
+typedef int (*wg_peer_view_cb)(const wg_peer_view *peer, void *data);
+
+typedef struct wg_peer_stats {
+	wg_key public_key;
+	wg_endpoint endpoint;
+	struct timespec64 last_handshake_time;
+	uint64_t rx_bytes, tx_bytes;
+} wg_peer_stats;
+
+/* A session keeps its netlink sockets, and the resolved generic netlink
+ * family, open across calls. It must not be used by several threads at once. */
+typedef struct wg_session wg_session;
+
+/* An arena owns every node of the devices fetched into it, which are then
+ * released all at once by wg_arena_reset() rather than by wg_free_device().
+ * The arena keeps its memory across resets, so that polling a device of
+ * steady size does no allocation. */
+typedef struct wg_arena wg_arena;
+
+enum wg_event_type {
+	WG_EVENT_DEVICE_ADDED,
+	WG_EVENT_DEVICE_REMOVED,
+	WG_EVENT_DEVICE_CHANGED, /* link state, such as up or down, or renamed */
+	WG_EVENT_CONFIG_CHANGED, /* only on kernels with wireguard multicast groups */
+	WG_EVENT_OVERRUN /* events were lost; callers should resync */
+};
+
+typedef struct wg_event {
+	enum wg_event_type type;
+	uint32_t ifindex;
+	char name[IFNAMSIZ];
+} wg_event;
+
+typedef void (*wg_event_cb)(const wg_event *event, void *data);
+
+/* Subscribes to notifications about wireguard interfaces. wg_events_fd()
+ * becomes readable when wg_events_process() has events to deliver. */
+typedef struct wg_events wg_events;
+
+/* Runs requests without blocking, for use from an event loop. */
+typedef struct wg_async wg_async;
+typedef void (*wg_async_cb)(wg_async *async, int ret, wg_device *dev, void *data);
+
+/* A longest prefix match index of the allowed IPs of a device, which must
+ * outlive it, as lookups return its peers. Lookups return NULL for addresses
+ * that no peer owns. */
+typedef struct wg_allowedips_index wg_allowedips_index;
+
+/* Worker threads, each with its own session and arena, for fetching many
+ * devices at once. A pool must only be used by one thread at a time. */
+typedef struct wg_pool wg_pool;
+
 #define wg_for_each_device_name(__names, __name, __len) for ((__name) = (__names), (__len) = 0; ((__len) = strlen(__name)); (__name) += (__len) + 1)
 #define wg_for_each_peer(__dev, __peer) for ((__peer) = (__dev)->first_peer; (__peer); (__peer) = (__peer)->next_peer)
 #define wg_for_each_allowedip(__peer, __allowedip) for ((__allowedip) = (__peer)->first_allowedip; (__allowedip); (__allowedip) = (__allowedip)->next_allowedip)
 
 int wg_set_device(wg_device *dev);
+int wg_set_device_pipelined(wg_device *dev);
 int wg_get_device(wg_device **dev, const char *device_name);
 int wg_add_device(const char *device_name);
 int wg_del_device(const char *device_name);
 void wg_free_device(wg_device *dev);
+wg_peer *wg_device_find_peer(const wg_device *dev, const wg_key public_key);
+int wg_apply_diff(const wg_device *old_dev, const wg_device *new_dev);
 char *wg_list_device_names(void); /* first\0second\0third\0forth\0last\0\0 */
 void wg_key_to_base64(wg_key_b64_string base64, const wg_key key);
 int wg_key_from_base64(wg_key key, const wg_key_b64_string base64);
+void wg_keys_to_base64(wg_key_b64_string *base64, const wg_key *keys, size_t count);
+int wg_keys_from_base64(wg_key *keys, const wg_key_b64_string *base64, size_t count);
 bool wg_key_is_zero(const wg_key key);
 void wg_generate_public_key(wg_key public_key, const wg_key private_key);
+void wg_generate_public_keys(wg_key *public_keys, const wg_key *private_keys, size_t count);
 void wg_generate_private_key(wg_key private_key);
 void wg_generate_preshared_key(wg_key preshared_key);
+void wg_generate_private_keys(wg_key *private_keys, size_t count);
+void wg_generate_preshared_keys(wg_key *preshared_keys, size_t count);
+
+int wg_session_open(wg_session **session);
+void wg_session_close(wg_session *session);
+int wg_session_set_device(wg_session *session, wg_device *dev);
+int wg_session_set_device_pipelined(wg_session *session, wg_device *dev);
+int wg_session_get_device(wg_session *session, wg_device **dev, const char *device_name);
+int wg_session_add_device(wg_session *session, const char *device_name);
+int wg_session_del_device(wg_session *session, const char *device_name);
+char *wg_session_list_device_names(wg_session *session);
+int wg_session_apply_diff(wg_session *session, const wg_device *old_dev, const wg_device *new_dev);
+
+int wg_arena_new(wg_arena **arena);
+void wg_arena_reset(wg_arena *arena);
+void wg_arena_free(wg_arena *arena);
+int wg_session_get_device_arena(wg_session *session, wg_arena *arena, wg_device **dev, const char *device_name);
+int wg_session_get_flat_device(wg_session *session, wg_flat_device *dev, const char *device_name);
+int wg_session_get_compact_device(wg_session *session, wg_flat_device *dev, const char *device_name);
+void wg_free_flat_device(wg_flat_device *dev);
+/* Fills dev, whose peers are left empty, and calls cb for every peer. A
+ * negative return from cb stops the walk and is returned. Since the callbacks
+ * cannot be taken back, an interrupted dump is not retried but fails with
+ * -EINTR. *allowedip must be zeroed before the first call to
+ * wg_peer_view_next_allowedip(). */
+int wg_session_walk_device(wg_session *session, wg_device *dev, const char *device_name, wg_peer_view_cb cb, void *data);
+bool wg_peer_view_next_allowedip(const wg_peer_view *peer, wg_allowedip_view *allowedip);
+/* On entry *num_stats is the capacity of stats, on return the number of peers.
+ * If there are more peers than fit, -ENOSPC is returned and stats holds
+ * as many of them as fit, in dump order. */
+int wg_session_get_device_stats(wg_session *session, const char *device_name, wg_peer_stats *stats, size_t *num_stats);
+
+int wg_events_open(wg_events **events);
+void wg_events_close(wg_events *events);
+int wg_events_fd(const wg_events *events);
+int wg_events_process(wg_events *events, wg_event_cb cb, void *data);
+
+int wg_async_open(wg_async **async);
+void wg_async_close(wg_async *async);
+int wg_async_fd(const wg_async *async);
+size_t wg_async_pending(const wg_async *async);
+int wg_async_get_device(wg_async *async, const char *device_name, wg_async_cb cb, void *data);
+int wg_async_set_device(wg_async *async, wg_device *dev, wg_async_cb cb, void *data);
+int wg_async_process(wg_async *async);
+
+int wg_allowedips_index_new(wg_allowedips_index **index, const wg_device *dev);
+void wg_allowedips_index_free(wg_allowedips_index *index);
+wg_peer *wg_allowedips_lookup4(const wg_allowedips_index *index, const struct in_addr *addr);
+wg_peer *wg_allowedips_lookup6(const wg_allowedips_index *index, const struct in6_addr *addr);
+void wg_allowedips_lookup4_batch(const wg_allowedips_index *index, const struct in_addr *addrs, wg_peer **peers, size_t count);
+void wg_allowedips_lookup6_batch(const wg_allowedips_index *index, const struct in6_addr *addrs, wg_peer **peers, size_t count);
+
+int wg_pool_open(wg_pool **pool, unsigned int num_threads);
+void wg_pool_close(wg_pool *pool);
+int wg_get_devices(wg_pool *pool, wg_device ***devices, size_t *num_devices);
 
 #endif